@@ -80,29 +80,81 @@ double CAddrInfo::GetChance(int64_t nNow) const
     return fChance;
 }
 
+void CAddrMan::Clear()
+{
+    vInfo.clear();
+    vFreeIds.clear();
+    mapAddr.clear();
+    vRandom.clear();
+    nTried = 0;
+    nNew = 0;
+    for (int b = 0; b < ADDRMAN_TRIED_BUCKET_COUNT; b++)
+        vTriedSize[b] = 0;
+    for (int b = 0; b < ADDRMAN_NEW_BUCKET_COUNT; b++)
+        vNewSize[b] = 0;
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int *pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
+    boost::unordered_map<CNetAddr, int, CAddrManHasher>::iterator it = mapAddr.find(addr);
     if (it == mapAddr.end())
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
-    if (it2 != mapInfo.end())
-        return &(*it2).second;
-    return NULL;
+    return &vInfo[(*it).second];
 }
 
 CAddrInfo* CAddrMan::Create(const CAddress &addr, const CNetAddr &addrSource, int *pnId)
 {
-    int nId = nIdCount++;
-    mapInfo[nId] = CAddrInfo(addr, addrSource);
+    int nId;
+    if (!vFreeIds.empty()) {
+        nId = vFreeIds.back();
+        vFreeIds.pop_back();
+        vInfo[nId] = CAddrInfo(addr, addrSource);
+    } else {
+        nId = vInfo.size();
+        vInfo.push_back(CAddrInfo(addr, addrSource));
+    }
     mapAddr[addr] = nId;
-    mapInfo[nId].nRandomPos = vRandom.size();
+    vInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
     if (pnId)
         *pnId = nId;
-    return &mapInfo[nId];
+    return &vInfo[nId];
+}
+
+void CAddrMan::Delete(int nId)
+{
+    CAddrInfo &info = vInfo[nId];
+    assert(!info.fInTried && info.nRefCount == 0 && info.nRandomPos >= 0);
+
+    SwapRandom(info.nRandomPos, vRandom.size()-1);
+    vRandom.pop_back();
+    mapAddr.erase(info);
+    info.nRandomPos = -1;
+    vFreeIds.push_back(nId);
+    nNew--;
+}
+
+int CAddrMan::FindNew(int nUBucket, int nId) const
+{
+    for (int i = 0; i < vNewSize[nUBucket]; i++)
+        if (vvNew[nUBucket][i] == nId)
+            return i;
+    return -1;
+}
+
+void CAddrMan::InsertNew(int nUBucket, int nId)
+{
+    assert(vNewSize[nUBucket] < ADDRMAN_NEW_BUCKET_SIZE);
+    vvNew[nUBucket][vNewSize[nUBucket]++] = nId;
+}
+
+void CAddrMan::EraseNew(int nUBucket, int nPos)
+{
+    // order within a bucket doesn't matter; fill the hole with the last one
+    assert(nPos >= 0 && nPos < vNewSize[nUBucket]);
+    vvNew[nUBucket][nPos] = vvNew[nUBucket][--vNewSize[nUBucket]];
 }
 
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
@@ -115,11 +167,8 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     int nId1 = vRandom[nRndPos1];
     int nId2 = vRandom[nRndPos2];
 
-    assert(mapInfo.count(nId1) == 1);
-    assert(mapInfo.count(nId2) == 1);
-
-    mapInfo[nId1].nRandomPos = nRndPos2;
-    mapInfo[nId2].nRandomPos = nRndPos1;
+    vInfo[nId1].nRandomPos = nRndPos2;
+    vInfo[nId2].nRandomPos = nRndPos1;
 
     vRandom[nRndPos1] = nId2;
     vRandom[nRndPos2] = nId1;
@@ -127,22 +176,22 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
 
 int CAddrMan::SelectTried(int nKBucket)
 {
-    std::vector<int> &vTried = vvTried[nKBucket];
+    int *vTried = vvTried[nKBucket];
+    int nSize = vTriedSize[nKBucket];
 
     // random shuffle the first few elements (using the entire list)
     // find the least recently tried among them
     int64_t nOldest = -1;
     int nOldestPos = -1;
-    for (unsigned int i = 0; i < ADDRMAN_TRIED_ENTRIES_INSPECT_ON_EVICT && i < vTried.size(); i++)
+    for (int i = 0; i < ADDRMAN_TRIED_ENTRIES_INSPECT_ON_EVICT && i < nSize; i++)
     {
-        int nPos = GetRandInt(vTried.size() - i) + i;
+        int nPos = GetRandInt(nSize - i) + i;
         int nTemp = vTried[nPos];
         vTried[nPos] = vTried[i];
         vTried[i] = nTemp;
-        assert(nOldest == -1 || mapInfo.count(nTemp) == 1);
-        if (nOldest == -1 || mapInfo[nTemp].nLastSuccess < mapInfo[nOldest].nLastSuccess) {
+        if (nOldest == -1 || vInfo[nTemp].nLastSuccess < vInfo[nOldest].nLastSuccess) {
            nOldest = nTemp;
-           nOldestPos = nPos;
+           nOldestPos = i;
         }
     }
 
@@ -151,67 +200,51 @@ int CAddrMan::SelectTried(int nKBucket)
 
 int CAddrMan::ShrinkNew(int nUBucket)
 {
-    assert(nUBucket >= 0 && (unsigned int)nUBucket < vvNew.size());
-    std::set<int> &vNew = vvNew[nUBucket];
+    assert(nUBucket >= 0 && nUBucket < ADDRMAN_NEW_BUCKET_COUNT);
+    int nSize = vNewSize[nUBucket];
 
     // first look for deletable items
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+    for (int i = 0; i < nSize; i++)
     {
-        assert(mapInfo.count(*it));
-        CAddrInfo &info = mapInfo[*it];
+        int nId = vvNew[nUBucket][i];
+        CAddrInfo &info = vInfo[nId];
         if (info.IsTerrible())
         {
+            EraseNew(nUBucket, i);
             if (--info.nRefCount == 0)
-            {
-                SwapRandom(info.nRandomPos, vRandom.size()-1);
-                vRandom.pop_back();
-                mapAddr.erase(info);
-                mapInfo.erase(*it);
-                nNew--;
-            }
-            vNew.erase(it);
+                Delete(nId);
             return 0;
         }
     }
 
     // otherwise, select four randomly, and pick the oldest of those to replace
-    int n[4] = {GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size())};
-    int nI = 0;
-    int nOldest = -1;
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
-    {
-        if (nI == n[0] || nI == n[1] || nI == n[2] || nI == n[3])
-        {
-            assert(nOldest == -1 || mapInfo.count(*it) == 1);
-            if (nOldest == -1 || mapInfo[*it].nTime < mapInfo[nOldest].nTime)
-                nOldest = *it;
-        }
-        nI++;
-    }
-    assert(mapInfo.count(nOldest) == 1);
-    CAddrInfo &info = mapInfo[nOldest];
-    if (--info.nRefCount == 0)
+    int nOldestPos = -1;
+    for (int n = 0; n < 4; n++)
     {
-        SwapRandom(info.nRandomPos, vRandom.size()-1);
-        vRandom.pop_back();
-        mapAddr.erase(info);
-        mapInfo.erase(nOldest);
-        nNew--;
+        int nPos = GetRandInt(nSize);
+        if (nOldestPos == -1 || vInfo[vvNew[nUBucket][nPos]].nTime < vInfo[vvNew[nUBucket][nOldestPos]].nTime)
+            nOldestPos = nPos;
     }
-    vNew.erase(nOldest);
+    int nOldest = vvNew[nUBucket][nOldestPos];
+    EraseNew(nUBucket, nOldestPos);
+    if (--vInfo[nOldest].nRefCount == 0)
+        Delete(nOldest);
 
     return 1;
 }
 
 void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 {
-    assert(vvNew[nOrigin].count(nId) == 1);
+    assert(FindNew(nOrigin, nId) != -1);
 
     // remove the entry from all new buckets
-    for (std::vector<std::set<int> >::iterator it = vvNew.begin(); it != vvNew.end(); it++)
+    for (int b = 0; b < ADDRMAN_NEW_BUCKET_COUNT && info.nRefCount > 0; b++)
     {
-        if ((*it).erase(nId))
+        int nPos = FindNew(b, nId);
+        if (nPos != -1) {
+            EraseNew(b, nPos);
             info.nRefCount--;
+        }
     }
     nNew--;
 
@@ -219,12 +252,11 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 
     // what tried bucket to move the entry to
     int nKBucket = info.GetTriedBucket(nKey);
-    std::vector<int> &vTried = vvTried[nKBucket];
 
     // first check whether there is place to just add it
-    if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
+    if (vTriedSize[nKBucket] < ADDRMAN_TRIED_BUCKET_SIZE)
     {
-        vTried.push_back(nId);
+        vvTried[nKBucket][vTriedSize[nKBucket]++] = nId;
         nTried++;
         info.fInTried = true;
         return;
@@ -232,31 +264,30 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 
     // otherwise, find an item to evict
     int nPos = SelectTried(nKBucket);
+    int nIdOld = vvTried[nKBucket][nPos];
 
     // find which new bucket it belongs to
-    assert(mapInfo.count(vTried[nPos]) == 1);
-    int nUBucket = mapInfo[vTried[nPos]].GetNewBucket(nKey);
-    std::set<int> &vNew = vvNew[nUBucket];
+    CAddrInfo& infoOld = vInfo[nIdOld];
+    int nUBucket = infoOld.GetNewBucket(nKey);
 
     // remove the to-be-replaced tried entry from the tried set
-    CAddrInfo& infoOld = mapInfo[vTried[nPos]];
     infoOld.fInTried = false;
     infoOld.nRefCount = 1;
     // do not update nTried, as we are going to move something else there immediately
 
     // check whether there is place in that one,
-    if (vNew.size() < ADDRMAN_NEW_BUCKET_SIZE)
+    if (vNewSize[nUBucket] < ADDRMAN_NEW_BUCKET_SIZE)
     {
         // if so, move it back there
-        vNew.insert(vTried[nPos]);
+        InsertNew(nUBucket, nIdOld);
     } else {
         // otherwise, move it to the new bucket nId came from (there is certainly place there)
-        vvNew[nOrigin].insert(vTried[nPos]);
+        InsertNew(nOrigin, nIdOld);
     }
     nNew++;
 
-    vTried[nPos] = nId;
-    // we just overwrote an entry in vTried; no need to update nTried
+    vvTried[nKBucket][nPos] = nId;
+    // we just overwrote an entry in vvTried; no need to update nTried
     info.fInTried = true;
     return;
 }
@@ -287,13 +318,12 @@ void CAddrMan::Good_(const CService &addr, int64_t nTime)
         return;
 
     // find a bucket it is in now
-    int nRnd = GetRandInt(vvNew.size());
+    int nRnd = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
     int nUBucket = -1;
-    for (unsigned int n = 0; n < vvNew.size(); n++)
+    for (int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++)
     {
-        int nB = (n+nRnd) % vvNew.size();
-        std::set<int> &vNew = vvNew[nB];
-        if (vNew.count(nId))
+        int nB = (n+nRnd) % ADDRMAN_NEW_BUCKET_COUNT;
+        if (FindNew(nB, nId) != -1)
         {
             nUBucket = nB;
             break;
@@ -356,13 +386,12 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimeP
     }
 
     int nUBucket = pinfo->GetNewBucket(nKey, source);
-    std::set<int> &vNew = vvNew[nUBucket];
-    if (!vNew.count(nId))
+    if (FindNew(nUBucket, nId) == -1)
     {
         pinfo->nRefCount++;
-        if (vNew.size() == ADDRMAN_NEW_BUCKET_SIZE)
+        if (vNewSize[nUBucket] == ADDRMAN_NEW_BUCKET_SIZE)
             ShrinkNew(nUBucket);
-        vvNew[nUBucket].insert(nId);
+        InsertNew(nUBucket, nId);
     }
     return fNew;
 }
@@ -399,12 +428,9 @@ CAddress CAddrMan::Select_(int nUnkBias)
         double fChanceFactor = 1.0;
         while(1)
         {
-            int nKBucket = GetRandInt(vvTried.size());
-            std::vector<int> &vTried = vvTried[nKBucket];
-            if (vTried.size() == 0) continue;
-            int nPos = GetRandInt(vTried.size());
-            assert(mapInfo.count(vTried[nPos]) == 1);
-            CAddrInfo &info = mapInfo[vTried[nPos]];
+            int nKBucket = GetRandInt(ADDRMAN_TRIED_BUCKET_COUNT);
+            if (vTriedSize[nKBucket] == 0) continue;
+            CAddrInfo &info = vInfo[vvTried[nKBucket][GetRandInt(vTriedSize[nKBucket])]];
             if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
                 return info;
             fChanceFactor *= 1.2;
@@ -414,15 +440,9 @@ CAddress CAddrMan::Select_(int nUnkBias)
         double fChanceFactor = 1.0;
         while(1)
         {
-            int nUBucket = GetRandInt(vvNew.size());
-            std::set<int> &vNew = vvNew[nUBucket];
-            if (vNew.size() == 0) continue;
-            int nPos = GetRandInt(vNew.size());
-            std::set<int>::iterator it = vNew.begin();
-            while (nPos--)
-                it++;
-            assert(mapInfo.count(*it) == 1);
-            CAddrInfo &info = mapInfo[*it];
+            int nUBucket = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
+            if (vNewSize[nUBucket] == 0) continue;
+            CAddrInfo &info = vInfo[vvNew[nUBucket][GetRandInt(vNewSize[nUBucket])]];
             if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
                 return info;
             fChanceFactor *= 1.2;
@@ -433,58 +453,63 @@ CAddress CAddrMan::Select_(int nUnkBias)
 #ifdef DEBUG_ADDRMAN
 int CAddrMan::Check_()
 {
-    std::set<int> setTried;
-    std::map<int, int> mapNew;
+    std::vector<int> vTriedRefs(vInfo.size(), 0);
+    std::vector<int> vNewRefs(vInfo.size(), 0);
+    int nTriedFound = 0, nNewFound = 0;
 
     if (vRandom.size() != nTried + nNew) return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    for (int n = 0; n < (int)vInfo.size(); n++)
     {
-        int n = (*it).first;
-        CAddrInfo &info = (*it).second;
+        CAddrInfo &info = vInfo[n];
+        if (info.nRandomPos == -1)
+            continue;
         if (info.fInTried)
         {
-
             if (!info.nLastSuccess) return -1;
             if (info.nRefCount) return -2;
-            setTried.insert(n);
+            nTriedFound++;
         } else {
             if (info.nRefCount < 0 || info.nRefCount > ADDRMAN_NEW_BUCKETS_PER_ADDRESS) return -3;
             if (!info.nRefCount) return -4;
-            mapNew[n] = info.nRefCount;
+            nNewFound++;
         }
-        if (mapAddr[info] != n) return -5;
+        if (!mapAddr.count(info) || mapAddr[info] != n) return -5;
         if (info.nRandomPos<0 || info.nRandomPos>=vRandom.size() || vRandom[info.nRandomPos] != n) return -14;
         if (info.nLastTry < 0) return -6;
         if (info.nLastSuccess < 0) return -8;
     }
 
-    if (setTried.size() != nTried) return -9;
-    if (mapNew.size() != nNew) return -10;
+    if (nTriedFound != nTried) return -9;
+    if (nNewFound != nNew) return -10;
 
-    for (int n=0; n<vvTried.size(); n++)
+    for (int b = 0; b < ADDRMAN_TRIED_BUCKET_COUNT; b++)
     {
-        std::vector<int> &vTried = vvTried[n];
-        for (std::vector<int>::iterator it = vTried.begin(); it != vTried.end(); it++)
+        for (int i = 0; i < vTriedSize[b]; i++)
         {
-            if (!setTried.count(*it)) return -11;
-            setTried.erase(*it);
+            int nId = vvTried[b][i];
+            if (!vInfo[nId].fInTried || vInfo[nId].nRandomPos == -1) return -11;
+            vTriedRefs[nId]++;
         }
     }
 
-    for (int n=0; n<vvNew.size(); n++)
+    for (int b = 0; b < ADDRMAN_NEW_BUCKET_COUNT; b++)
     {
-        std::set<int> &vNew = vvNew[n];
-        for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+        for (int i = 0; i < vNewSize[b]; i++)
         {
-            if (!mapNew.count(*it)) return -12;
-            if (--mapNew[*it] == 0)
-                mapNew.erase(*it);
+            int nId = vvNew[b][i];
+            if (vInfo[nId].fInTried || vInfo[nId].nRandomPos == -1) return -12;
+            vNewRefs[nId]++;
         }
     }
 
-    if (setTried.size()) return -13;
-    if (mapNew.size()) return -15;
+    for (int n = 0; n < (int)vInfo.size(); n++)
+    {
+        if (vInfo[n].nRandomPos == -1)
+            continue;
+        if (vTriedRefs[n] != (vInfo[n].fInTried ? 1 : 0)) return -13;
+        if (vNewRefs[n] != vInfo[n].nRefCount) return -15;
+    }
 
     return 0;
 }
@@ -495,14 +520,14 @@ void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
     int nNodes = ADDRMAN_GETADDR_MAX_PCT*vRandom.size()/100;
     if (nNodes > ADDRMAN_GETADDR_MAX)
         nNodes = ADDRMAN_GETADDR_MAX;
+    vAddr.reserve(nNodes);
 
     // perform a random shuffle over the first nNodes elements of vRandom (selecting from all)
     for (int n = 0; n<nNodes; n++)
     {
         int nRndPos = GetRandInt(vRandom.size() - n) + n;
         SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-        vAddr.push_back(mapInfo[vRandom[n]]);
+        vAddr.push_back(vInfo[vRandom[n]]);
     }
 }
 
@@ -525,3 +550,82 @@ void CAddrMan::Connected_(const CService &addr, int64_t nTime)
     if (nTime - info.nTime > nUpdateInterval)
         info.nTime = nTime;
 }
+
+void CAddrMan::Loaded()
+{
+    // vInfo and vRandom hold every entry read, and the buckets their ids;
+    // the rest is derived here. Entries sharing an address, or not in any
+    // bucket (anymore), are dropped.
+    mapAddr.clear();
+    vFreeIds.clear();
+    std::vector<bool> vDrop(vInfo.size(), false);
+    for (unsigned int n = 0; n < vInfo.size(); n++)
+    {
+        CAddrInfo &info = vInfo[n];
+        info.nRefCount = 0;
+        info.fInTried = false;
+        if (!mapAddr.insert(std::make_pair((CNetAddr)info, (int)n)).second)
+            vDrop[n] = true;
+    }
+
+    for (int b = 0; b < ADDRMAN_TRIED_BUCKET_COUNT; b++)
+    {
+        int nKeep = 0;
+        for (int i = 0; i < vTriedSize[b]; i++)
+        {
+            int nId = vvTried[b][i];
+            if (vDrop[nId] || vInfo[nId].fInTried)
+                continue;
+            vInfo[nId].fInTried = true;
+            vvTried[b][nKeep++] = nId;
+        }
+        vTriedSize[b] = nKeep;
+    }
+
+    for (int b = 0; b < ADDRMAN_NEW_BUCKET_COUNT; b++)
+    {
+        int nKeep = 0;
+        for (int i = 0; i < vNewSize[b]; i++)
+        {
+            int nId = vvNew[b][i];
+            CAddrInfo &info = vInfo[nId];
+            if (vDrop[nId] || info.fInTried || info.nRefCount == ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
+                continue;
+            bool fDup = false;
+            for (int j = 0; j < nKeep && !fDup; j++)
+                fDup = vvNew[b][j] == nId;
+            if (fDup)
+                continue;
+            info.nRefCount++;
+            vvNew[b][nKeep++] = nId;
+        }
+        vNewSize[b] = nKeep;
+    }
+
+    int nLost = 0;
+    nTried = 0;
+    nNew = 0;
+    vRandom.clear();
+    for (unsigned int n = 0; n < vInfo.size(); n++)
+    {
+        CAddrInfo &info = vInfo[n];
+        if (!info.fInTried && info.nRefCount == 0)
+        {
+            if (!vDrop[n])
+                mapAddr.erase(info);
+            info.nRandomPos = -1;
+            vFreeIds.push_back(n);
+            nLost++;
+            continue;
+        }
+        info.nRandomPos = vRandom.size();
+        vRandom.push_back(n);
+        if (info.fInTried)
+            nTried++;
+        else
+            nNew++;
+    }
+
+    if (nLost)
+        LogPrint("addrman", "addrman lost %i entries that were in no bucket\n", nLost);
+}
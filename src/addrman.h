@@ -5,16 +5,17 @@
 #ifndef _BITMARK_ADDRMAN
 #define _BITMARK_ADDRMAN 1
 
+#include "hash.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "sync.h"
 #include "util.h"
 
-#include <map>
-#include <set>
+#include <limits>
 #include <stdint.h>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
 #include <openssl/rand.h>
 
 /** Extended statistics about a CAddress */
@@ -119,6 +120,9 @@ public:
 //      be observable by adversaries.
 //    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
 //      consistency checks for the entire data structure.
+//    * Entries live in a vector indexed by their nId, and the buckets are fixed-size arrays of nIds, so selecting
+//      an address is a couple of array lookups. peers.dat stores the buckets as they are, and loading it doesn't
+//      have to work out every address' buckets again.
 
 // total number of buckets for tried addresses
 #define ADDRMAN_TRIED_BUCKET_COUNT 64
@@ -162,6 +166,25 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+// Salted hash of an address for mapAddr, so nobody can pick addresses that collide in it
+class CAddrManHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CAddrManHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+    size_t operator()(const CNetAddr& addr) const
+    {
+        uint256 val;
+        unsigned char* p = val.begin();
+        for (int n = 0; n < 16; n++)
+            p[n] = addr.GetByte(n);
+        return SipHashUint256(k0, k1, val);
+    }
+};
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
@@ -172,14 +195,13 @@ private:
     // secret key to randomize bucket select with
     std::vector<unsigned char> nKey;
 
-    // last used nId
-    int nIdCount;
-
-    // table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    // table with information about all nIds; entries of deleted nIds have
+    // nRandomPos -1 and are reused through vFreeIds
+    std::vector<CAddrInfo> vInfo;
+    std::vector<int> vFreeIds;
 
     // find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    boost::unordered_map<CNetAddr, int, CAddrManHasher> mapAddr;
 
     // randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -187,17 +209,22 @@ private:
     // number of "tried" entries
     int nTried;
 
-    // list of "tried" buckets
-    std::vector<std::vector<int> > vvTried;
+    // "tried" buckets: the first vTriedSize[n] nIds of vvTried[n] are in use, in no particular order
+    int vvTried[ADDRMAN_TRIED_BUCKET_COUNT][ADDRMAN_TRIED_BUCKET_SIZE];
+    int vTriedSize[ADDRMAN_TRIED_BUCKET_COUNT];
 
     // number of (unique) "new" entries
     int nNew;
 
-    // list of "new" buckets
-    std::vector<std::set<int> > vvNew;
+    // "new" buckets, likewise
+    int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_NEW_BUCKET_SIZE];
+    int vNewSize[ADDRMAN_NEW_BUCKET_COUNT];
 
 protected:
 
+    // Forget everything but the key.
+    void Clear();
+
     // Find an entry.
     CAddrInfo* Find(const CNetAddr& addr, int *pnId = NULL);
 
@@ -205,6 +232,16 @@ protected:
     // nTime and nServices of found node is updated, if necessary.
     CAddrInfo* Create(const CAddress &addr, const CNetAddr &addrSource, int *pnId = NULL);
 
+    // Delete an entry that is in no bucket anymore.
+    void Delete(int nId);
+
+    // Position of nId in a "new" bucket, or -1.
+    int FindNew(int nUBucket, int nId) const;
+
+    // Add nId to a "new" bucket that has room, or take it out of one.
+    void InsertNew(int nUBucket, int nId);
+    void EraseNew(int nUBucket, int nPos);
+
     // Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
@@ -217,7 +254,7 @@ protected:
     int ShrinkNew(int nUBucket);
 
     // Move an entry from the "new" table(s) to the "tried" table
-    // @pre vvUnkown[nOrigin].count(nId) != 0
+    // @pre FindNew(nOrigin, nId) != -1
     void MakeTried(CAddrInfo& info, int nId, int nOrigin);
 
     // Mark an entry "good", possibly moving it from "new" to "tried".
@@ -244,150 +281,136 @@ protected:
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64_t nTime);
 
+    // After the entries and buckets were read: rebuild mapAddr, vRandom,
+    // nRefCount and fInTried, dropping entries that are in no bucket.
+    void Loaded();
+
+    // Read the format of version 0, which had to recompute the buckets.
+    template<typename Stream>
+    void UnserializeV0(Stream& s, int nType, int nVersion);
+
 public:
 
-    IMPLEMENT_SERIALIZE
-    (({
-        // serialized format:
-        // * version byte (currently 0)
-        // * nKey
-        // * nNew
-        // * nTried
-        // * number of "new" buckets
-        // * all nNew addrinfos in vvNew
-        // * all nTried addrinfos in vvTried
-        // * for each bucket:
-        //   * number of elements
-        //   * for each element: index
-        //
-        // Notice that vvTried, mapAddr and vVector are never encoded explicitly;
-        // they are instead reconstructed from the other information.
-        //
-        // vvNew is serialized, but only used if ADDRMAN_UNKOWN_BUCKET_COUNT didn't change,
-        // otherwise it is reconstructed as well.
-        //
-        // This format is more complex, but significantly smaller (at most 1.5 MiB), and supports
-        // changes to the ADDRMAN_ parameters without breaking the on-disk structure.
-        {
-            LOCK(cs);
-            unsigned char nVersion = 0;
-            READWRITE(nVersion);
-            READWRITE(nKey);
-            READWRITE(nNew);
-            READWRITE(nTried);
-
-            CAddrMan *am = const_cast<CAddrMan*>(this);
-            if (fWrite)
-            {
-                int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT;
-                READWRITE(nUBuckets);
-                std::map<int, int> mapUnkIds;
-                int nIds = 0;
-                for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
-                {
-                    if (nIds == nNew) break; // this means nNew was wrong, oh ow
-                    mapUnkIds[(*it).first] = nIds;
-                    CAddrInfo &info = (*it).second;
-                    if (info.nRefCount)
-                    {
-                        READWRITE(info);
-                        nIds++;
-                    }
-                }
-                nIds = 0;
-                for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
-                {
-                    if (nIds == nTried) break; // this means nTried was wrong, oh ow
-                    CAddrInfo &info = (*it).second;
-                    if (info.fInTried)
-                    {
-                        READWRITE(info);
-                        nIds++;
-                    }
-                }
-                for (std::vector<std::set<int> >::iterator it = am->vvNew.begin(); it != am->vvNew.end(); it++)
-                {
-                    const std::set<int> &vNew = (*it);
-                    int nSize = vNew.size();
-                    READWRITE(nSize);
-                    for (std::set<int>::iterator it2 = vNew.begin(); it2 != vNew.end(); it2++)
-                    {
-                        int nIndex = mapUnkIds[*it2];
-                        READWRITE(nIndex);
-                    }
-                }
-            } else {
-                int nUBuckets = 0;
-                READWRITE(nUBuckets);
-                am->nIdCount = 0;
-                am->mapInfo.clear();
-                am->mapAddr.clear();
-                am->vRandom.clear();
-                am->vvTried = std::vector<std::vector<int> >(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0));
-                am->vvNew = std::vector<std::set<int> >(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>());
-                for (int n = 0; n < am->nNew; n++)
-                {
-                    CAddrInfo &info = am->mapInfo[n];
-                    READWRITE(info);
-                    am->mapAddr[info] = n;
-                    info.nRandomPos = vRandom.size();
-                    am->vRandom.push_back(n);
-                    if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT)
-                    {
-                        am->vvNew[info.GetNewBucket(am->nKey)].insert(n);
-                        info.nRefCount++;
-                    }
-                }
-                am->nIdCount = am->nNew;
-                int nLost = 0;
-                for (int n = 0; n < am->nTried; n++)
-                {
-                    CAddrInfo info;
-                    READWRITE(info);
-                    std::vector<int> &vTried = am->vvTried[info.GetTriedBucket(am->nKey)];
-                    if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
-                    {
-                        info.nRandomPos = vRandom.size();
-                        info.fInTried = true;
-                        am->vRandom.push_back(am->nIdCount);
-                        am->mapInfo[am->nIdCount] = info;
-                        am->mapAddr[info] = am->nIdCount;
-                        vTried.push_back(am->nIdCount);
-                        am->nIdCount++;
-                    } else {
-                        nLost++;
-                    }
+    // serialized format:
+    // * version byte (currently 1)
+    // * nKey
+    // * nNew
+    // * nTried
+    // * all nNew + nTried addrinfos, in vRandom order; an entry's index is its position
+    // * number of "tried" buckets, their size, number of "new" buckets, their size
+    // * for each "tried" bucket, then for each "new" bucket:
+    //   * number of elements
+    //   * for each element: index
+    //
+    // mapAddr, fInTried and nRefCount follow from the buckets. If the ADDRMAN_
+    // bucket parameters changed, the buckets are worked out again from the addresses.
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        LOCK(cs);
+        unsigned char nFormat = 1;
+        s << nFormat << nKey << nNew << nTried;
+        for (unsigned int n = 0; n < vRandom.size(); n++)
+            ::Serialize(s, vInfo[vRandom[n]], nType, nVersion);
+
+        int nKBuckets = ADDRMAN_TRIED_BUCKET_COUNT, nKBucketSize = ADDRMAN_TRIED_BUCKET_SIZE;
+        int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT, nUBucketSize = ADDRMAN_NEW_BUCKET_SIZE;
+        s << nKBuckets << nKBucketSize << nUBuckets << nUBucketSize;
+        for (int b = 0; b < ADDRMAN_TRIED_BUCKET_COUNT; b++) {
+            s << vTriedSize[b];
+            for (int i = 0; i < vTriedSize[b]; i++)
+                s << vInfo[vvTried[b][i]].nRandomPos;
+        }
+        for (int b = 0; b < ADDRMAN_NEW_BUCKET_COUNT; b++) {
+            s << vNewSize[b];
+            for (int i = 0; i < vNewSize[b]; i++)
+                s << vInfo[vvNew[b][i]].nRandomPos;
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        LOCK(cs);
+        Clear();
+
+        unsigned char nFormat = 0;
+        s >> nFormat >> nKey;
+        if (nFormat == 0) {
+            UnserializeV0(s, nType, nVersion);
+            return;
+        }
+        if (nFormat != 1)
+            throw std::ios_base::failure("CAddrMan : unknown format");
+
+        int nNewIn = 0, nTriedIn = 0;
+        s >> nNewIn >> nTriedIn;
+        if (nNewIn < 0 || nTriedIn < 0 || nNewIn > ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_NEW_BUCKET_SIZE ||
+            nTriedIn > ADDRMAN_TRIED_BUCKET_COUNT * ADDRMAN_TRIED_BUCKET_SIZE)
+            throw std::ios_base::failure("CAddrMan : bad entry count");
+        int nEntries = nNewIn + nTriedIn;
+        vInfo.resize(nEntries);
+        for (int n = 0; n < nEntries; n++)
+            ::Unserialize(s, vInfo[n], nType, nVersion);
+
+        int nKBuckets = 0, nKBucketSize = 0, nUBuckets = 0, nUBucketSize = 0;
+        s >> nKBuckets >> nKBucketSize >> nUBuckets >> nUBucketSize;
+        if (nKBuckets < 0 || nUBuckets < 0)
+            throw std::ios_base::failure("CAddrMan : bad bucket count");
+        bool fSameBuckets = nKBuckets == ADDRMAN_TRIED_BUCKET_COUNT && nKBucketSize == ADDRMAN_TRIED_BUCKET_SIZE &&
+                            nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && nUBucketSize == ADDRMAN_NEW_BUCKET_SIZE;
+        std::vector<bool> vTriedIn(nEntries, false);
+        for (int b = 0; b < nKBuckets + nUBuckets; b++) {
+            bool fTried = b < nKBuckets;
+            int nSize = 0;
+            s >> nSize;
+            if (nSize < 0 || nSize > (fTried ? nKBucketSize : nUBucketSize))
+                throw std::ios_base::failure("CAddrMan : bad bucket size");
+            for (int i = 0; i < nSize; i++) {
+                int nIndex = 0;
+                s >> nIndex;
+                if (nIndex < 0 || nIndex >= nEntries)
+                    throw std::ios_base::failure("CAddrMan : bad index");
+                if (fTried)
+                    vTriedIn[nIndex] = true;
+                if (!fSameBuckets)
+                    continue;
+                if (fTried)
+                    vvTried[b][vTriedSize[b]++] = nIndex;
+                else
+                    vvNew[b - nKBuckets][vNewSize[b - nKBuckets]++] = nIndex;
+            }
+        }
+
+        if (!fSameBuckets) {
+            // Put the addresses where they go with the current parameters,
+            // as far as there is room
+            for (int n = 0; n < nEntries; n++) {
+                CAddrInfo& info = vInfo[n];
+                if (vTriedIn[n]) {
+                    int nKBucket = info.GetTriedBucket(nKey);
+                    if (vTriedSize[nKBucket] < ADDRMAN_TRIED_BUCKET_SIZE)
+                        vvTried[nKBucket][vTriedSize[nKBucket]++] = n;
+                    else
+                        vTriedIn[n] = false;
                 }
-                am->nTried -= nLost;
-                for (int b = 0; b < nUBuckets; b++)
-                {
-                    std::set<int> &vNew = am->vvNew[b];
-                    int nSize = 0;
-                    READWRITE(nSize);
-                    for (int n = 0; n < nSize; n++)
-                    {
-                        int nIndex = 0;
-                        READWRITE(nIndex);
-                        CAddrInfo &info = am->mapInfo[nIndex];
-                        if (nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
-                        {
-                            info.nRefCount++;
-                            vNew.insert(nIndex);
-                        }
-                    }
+                if (!vTriedIn[n]) {
+                    int nUBucket = info.GetNewBucket(nKey);
+                    if (vNewSize[nUBucket] < ADDRMAN_NEW_BUCKET_SIZE)
+                        vvNew[nUBucket][vNewSize[nUBucket]++] = n;
                 }
             }
         }
-    });)
 
-    CAddrMan() : vRandom(0), vvTried(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0)), vvNew(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>())
+        Loaded();
+    }
+
+    CAddrMan()
     {
-         nKey.resize(32);
-         RAND_bytes(&nKey[0], 32);
+        nKey.resize(32);
+        RAND_bytes(&nKey[0], 32);
 
-         nIdCount = 0;
-         nTried = 0;
-         nNew = 0;
+        Clear();
     }
 
     // Return the number of (unique) addresses in all tables.
@@ -501,4 +524,53 @@ public:
     }
 };
 
+template<typename Stream>
+void CAddrMan::UnserializeV0(Stream& s, int nType, int nVersion)
+{
+    // * nNew
+    // * nTried
+    // * number of "new" buckets
+    // * all nNew addrinfos in vvNew
+    // * all nTried addrinfos in vvTried
+    // * for each "new" bucket: number of elements, then for each the index among the "new" addrinfos
+    int nNewIn = 0, nTriedIn = 0, nUBuckets = 0;
+    s >> nNewIn >> nTriedIn >> nUBuckets;
+    if (nNewIn < 0 || nTriedIn < 0 || nNewIn > ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_NEW_BUCKET_SIZE ||
+        nTriedIn > ADDRMAN_TRIED_BUCKET_COUNT * ADDRMAN_TRIED_BUCKET_SIZE)
+        throw std::ios_base::failure("CAddrMan : bad entry count");
+
+    for (int n = 0; n < nNewIn; n++) {
+        CAddrInfo info;
+        ::Unserialize(s, info, nType, nVersion);
+        vInfo.push_back(info);
+        if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT) {
+            int nUBucket = info.GetNewBucket(nKey);
+            if (vNewSize[nUBucket] < ADDRMAN_NEW_BUCKET_SIZE)
+                vvNew[nUBucket][vNewSize[nUBucket]++] = n;
+        }
+    }
+    for (int n = 0; n < nTriedIn; n++) {
+        CAddrInfo info;
+        ::Unserialize(s, info, nType, nVersion);
+        int nKBucket = info.GetTriedBucket(nKey);
+        if (vTriedSize[nKBucket] < ADDRMAN_TRIED_BUCKET_SIZE) {
+            vvTried[nKBucket][vTriedSize[nKBucket]++] = vInfo.size();
+            vInfo.push_back(info);
+        }
+    }
+    for (int b = 0; b < nUBuckets; b++) {
+        int nSize = 0;
+        s >> nSize;
+        for (int i = 0; i < nSize; i++) {
+            int nIndex = 0;
+            s >> nIndex;
+            if (nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && nIndex >= 0 && nIndex < nNewIn &&
+                vNewSize[b] < ADDRMAN_NEW_BUCKET_SIZE && FindNew(b, nIndex) == -1)
+                vvNew[b][vNewSize[b]++] = nIndex;
+        }
+    }
+
+    Loaded();
+}
+
 #endif
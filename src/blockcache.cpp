@@ -0,0 +1,122 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+using namespace std;
+
+// Fixed per-entry bookkeeping (map node, LRU node, vectors) on top of the block data
+static const size_t BLOCK_CACHE_ENTRY_OVERHEAD = 256;
+
+CBlockCache::CBlockCache(size_t nMaxBytesIn) : nMaxBytes(nMaxBytesIn), nBytes(0), nHits(0), nMisses(0)
+{
+}
+
+void CBlockCache::EraseEntry(map<uint256, CEntry>::iterator it)
+{
+    nBytes -= it->second.nUsage;
+    listLRU.erase(it->second.itLRU);
+    mapEntries.erase(it);
+}
+
+void CBlockCache::Trim(size_t nLimit)
+{
+    while (nBytes > nLimit && !listLRU.empty())
+        EraseEntry(mapEntries.find(listLRU.back()));
+}
+
+map<uint256, CBlockCache::CEntry>::iterator CBlockCache::Lookup(const uint256 &hash)
+{
+    map<uint256, CEntry>::iterator it = mapEntries.find(hash);
+    if (it == mapEntries.end()) {
+        nMisses++;
+        return it;
+    }
+    nHits++;
+    listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+    return it;
+}
+
+void CBlockCache::SetMaxBytes(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    Trim(nMaxBytes);
+}
+
+void CBlockCache::Insert(const uint256 &hash, const CBlock &block)
+{
+    LOCK(cs);
+    if (nMaxBytes == 0 || mapEntries.count(hash))
+        return;
+
+    // The deserialized copy takes roughly as much memory as its serialization.
+    size_t nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    size_t nUsage = 2 * nSize + BLOCK_CACHE_ENTRY_OVERHEAD;
+    if (nUsage > nMaxBytes)
+        return;
+    Trim(nMaxBytes - nUsage);
+
+    listLRU.push_front(hash);
+    CEntry &entry = mapEntries[hash];
+    entry.block = block;
+    entry.ssBlock.reserve(nSize);
+    entry.ssBlock << block;
+    entry.nUsage = nUsage;
+    entry.itLRU = listLRU.begin();
+    nBytes += nUsage;
+}
+
+bool CBlockCache::GetBlock(const uint256 &hash, CBlock &blockOut)
+{
+    LOCK(cs);
+    map<uint256, CEntry>::iterator it = Lookup(hash);
+    if (it == mapEntries.end())
+        return false;
+    blockOut = it->second.block;
+    return true;
+}
+
+bool CBlockCache::GetSerializedBlock(const uint256 &hash, CDataStream &ssOut)
+{
+    LOCK(cs);
+    map<uint256, CEntry>::iterator it = Lookup(hash);
+    if (it == mapEntries.end())
+        return false;
+    const CDataStream &ssBlock = it->second.ssBlock;
+    ssOut.write(&ssBlock[0], ssBlock.size());
+    return true;
+}
+
+bool CBlockCache::Contains(const uint256 &hash) const
+{
+    LOCK(cs);
+    return mapEntries.count(hash) != 0;
+}
+
+void CBlockCache::Erase(const uint256 &hash)
+{
+    LOCK(cs);
+    map<uint256, CEntry>::iterator it = mapEntries.find(hash);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+}
+
+void CBlockCache::Clear()
+{
+    LOCK(cs);
+    mapEntries.clear();
+    listLRU.clear();
+    nBytes = 0;
+}
+
+void CBlockCache::GetStats(CBlockCacheStats &stats) const
+{
+    LOCK(cs);
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    stats.nEntries = mapEntries.size();
+    stats.nBytes = nBytes;
+    stats.nMaxBytes = nMaxBytes;
+}
@@ -0,0 +1,86 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_BLOCKCACHE_H
+#define BITMARK_BLOCKCACHE_H
+
+#include "core.h"
+#include "serialize.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+#include <stdint.h>
+
+/** Default for -blockcache, the memory budget (in MiB) of the recent block cache */
+static const unsigned int DEFAULT_BLOCK_CACHE_SIZE = 16;
+
+struct CBlockCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    size_t nEntries;
+    size_t nBytes;
+    size_t nMaxBytes;
+
+    CBlockCacheStats() : nHits(0), nMisses(0), nEntries(0), nBytes(0), nMaxBytes(0) {}
+};
+
+/** Byte-bounded LRU cache of recently read and recently accepted blocks.
+ *
+ * Each entry keeps both the deserialized CBlock and its network serialization,
+ * so the connect/disconnect path, the wallet and RPC can take a copy of the
+ * block while getdata replies and raw getblock can use the bytes directly.
+ * Blocks are immutable once their hash is known, so entries never go stale;
+ * they are only dropped to stay within the memory budget or when the block
+ * data itself is removed from disk.
+ */
+class CBlockCache
+{
+private:
+    struct CEntry
+    {
+        CBlock block;
+        CDataStream ssBlock;
+        size_t nUsage;
+        std::list<uint256>::iterator itLRU;
+
+        CEntry() : ssBlock(SER_NETWORK, PROTOCOL_VERSION), nUsage(0) {}
+    };
+
+    mutable CCriticalSection cs;
+    std::map<uint256, CEntry> mapEntries;
+    std::list<uint256> listLRU; // most recently used at the front
+    size_t nMaxBytes;
+    size_t nBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    void EraseEntry(std::map<uint256, CEntry>::iterator it);
+    void Trim(size_t nLimit);
+    std::map<uint256, CEntry>::iterator Lookup(const uint256 &hash);
+
+public:
+    CBlockCache(size_t nMaxBytesIn = 0);
+
+    /** Change the memory budget; evicts least recently used entries if needed. 0 disables the cache. */
+    void SetMaxBytes(size_t nMaxBytesIn);
+
+    /** Add a block. Blocks larger than the whole budget are not cached. */
+    void Insert(const uint256 &hash, const CBlock &block);
+
+    /** Copy a cached block into blockOut. Counts a hit or miss. */
+    bool GetBlock(const uint256 &hash, CBlock &blockOut);
+
+    /** Append the network serialization of a cached block to ssOut. Counts a hit or miss. */
+    bool GetSerializedBlock(const uint256 &hash, CDataStream &ssOut);
+
+    bool Contains(const uint256 &hash) const;
+    void Erase(const uint256 &hash);
+    void Clear();
+    void GetStats(CBlockCacheStats &stats) const;
+};
+
+#endif // BITMARK_BLOCKCACHE_H
@@ -0,0 +1,153 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <limits>
+#include <map>
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+    nShortIDKey0(0), nShortIDKey1(0), header(block.GetBlockHeader()), nNonce(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+    FillShortTxIDSelector();
+
+    // The coinbase can't be in anyone's mempool, so it always goes along
+    CPrefilledTransaction prefilled;
+    prefilled.nIndex = 0;
+    prefilled.tx = block.vtx[0];
+    vPrefilledTxn.push_back(prefilled);
+
+    vShortTxIDs.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIDs.push_back(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    // Keyed on the header and a per-announcement nonce, so nobody can grind
+    // transactions whose short ids collide on every link
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nNonce;
+    uint256 hashKey = Hash(ss.begin(), ss.end());
+    nShortIDKey0 = hashKey.GetLow64();
+    nShortIDKey1 = (hashKey >> 64).GetLow64();
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(nShortIDKey0, nShortIDKey1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus CPartialBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.vShortTxIDs.empty() && cmpctblock.vPrefilledTxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_CMPCTBLOCK_TXN)
+        return READ_STATUS_INVALID;
+    if (!header.IsNull() || !vtxAvailable.empty())
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vtxAvailable.assign(cmpctblock.BlockTxCount(), CTransaction());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    // Prefilled indexes are already offset-decoded, so they only need to fit the block
+    for (unsigned int i = 0; i < cmpctblock.vPrefilledTxn.size(); i++) {
+        const CPrefilledTransaction& prefilled = cmpctblock.vPrefilledTxn[i];
+        if (prefilled.tx.IsNull() || prefilled.nIndex >= vtxAvailable.size())
+            return READ_STATUS_INVALID;
+        vtxAvailable[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+    nPrefilled = cmpctblock.vPrefilledTxn.size();
+
+    // Map each short id to its position in the block; the slots not
+    // prefilled are taken up by the short ids in order
+    std::map<uint64_t, uint16_t> mapShortIDs;
+    unsigned int nShortID = 0;
+    for (unsigned int i = 0; i < vtxAvailable.size(); i++) {
+        if (vHave[i])
+            continue;
+        if (nShortID >= cmpctblock.vShortTxIDs.size())
+            return READ_STATUS_INVALID;
+        if (!mapShortIDs.insert(std::make_pair(cmpctblock.vShortTxIDs[nShortID++], (uint16_t)i)).second) {
+            // Two transactions of the block share a short id; we couldn't tell
+            // which is which even if we had both
+            return READ_STATUS_FAILED;
+        }
+    }
+    if (nShortID != cmpctblock.vShortTxIDs.size())
+        return READ_STATUS_INVALID;
+
+    // A short id matching more than one mempool transaction leaves that slot
+    // empty, to be requested like any other missing one
+    std::vector<bool> vCollided(vtxAvailable.size(), false);
+    {
+        LOCK(pool.cs);
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi) {
+            std::map<uint64_t, uint16_t>::const_iterator it = mapShortIDs.find(cmpctblock.GetShortID(mi->first));
+            if (it == mapShortIDs.end())
+                continue;
+            uint16_t nIndex = it->second;
+            if (vCollided[nIndex])
+                continue;
+            if (vHave[nIndex]) {
+                vHave[nIndex] = false;
+                vtxAvailable[nIndex] = CTransaction();
+                vCollided[nIndex] = true;
+                nFromMempool--;
+                continue;
+            }
+            vtxAvailable[nIndex] = mi->second.GetTx();
+            vHave[nIndex] = true;
+            nFromMempool++;
+        }
+    }
+
+    LogPrint("net", "Initialized partial block %s: %u prefilled, %u from mempool, %u missing\n",
+             header.GetHash().ToString(), nPrefilled, nFromMempool, vtxAvailable.size() - nPrefilled - nFromMempool);
+    return READ_STATUS_OK;
+}
+
+bool CPartialBlock::IsTxAvailable(size_t nIndex) const
+{
+    assert(!header.IsNull());
+    assert(nIndex < vHave.size());
+    return vHave[nIndex];
+}
+
+ReadStatus CPartialBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const
+{
+    assert(!header.IsNull());
+    block = header;
+    block.vtx.resize(vtxAvailable.size());
+
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vtxAvailable.size(); i++) {
+        if (vHave[i]) {
+            block.vtx[i] = vtxAvailable[i];
+        } else {
+            if (nMissing >= vtxMissing.size())
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtxMissing[nMissing++];
+        }
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_STATUS_INVALID;
+
+    // A wrong mempool match shows up here; the block itself is checked
+    // properly once it reaches ProcessBlock
+    if (block.BuildMerkleTree() != block.hashMerkleRoot) {
+        LogPrint("net", "Partial block %s didn't match its merkle root, falling back to the full block\n",
+                 header.GetHash().ToString());
+        return READ_STATUS_FAILED;
+    }
+
+    return READ_STATUS_OK;
+}
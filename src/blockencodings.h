@@ -0,0 +1,194 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_BLOCKENCODINGS_H
+#define BITMARK_BLOCKENCODINGS_H
+
+#include "core.h"
+#include "main.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <vector>
+
+class CTxMemPool;
+
+/** Blocks within this many of the tip are served as compact blocks and
+ *  answered with blocktxn; older ones are sent in full. */
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
+
+// Upper bound on transactions per block, for sanity checking counts read off the wire
+static const unsigned int MAX_CMPCTBLOCK_TXN = MAX_BLOCK_SIZE / 60;
+
+enum ReadStatus
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // Invalid object, peer is sending bogus crap
+    READ_STATUS_FAILED,  // Failed to process object, fall back to a full block
+};
+
+// Reads a list of transaction indexes stored as differences from the previous one
+#define READWRITE_DIFF_INDEXES(v, pv) \
+    { \
+        unsigned int nCount = (v).size(); \
+        READWRITE(VARINT(nCount)); \
+        if (fRead) { \
+            if (nCount > MAX_CMPCTBLOCK_TXN) \
+                throw std::ios_base::failure("too many transaction indexes"); \
+            (pv).resize(nCount); \
+        } \
+        for (unsigned int i = 0; i < nCount; i++) { \
+            unsigned int nDelta = fRead ? 0 : (v)[i] - (i ? (v)[i - 1] + 1 : 0); \
+            READWRITE(VARINT(nDelta)); \
+            if (fRead) { \
+                unsigned int nIndex = nDelta + (i ? (pv)[i - 1] + 1 : 0); \
+                if (nIndex > 0xffff || nIndex < nDelta) \
+                    throw std::ios_base::failure("transaction index overflowed 16 bits"); \
+                (pv)[i] = nIndex; \
+            } \
+        } \
+    }
+
+/** A transaction sent along with a compact block, because the receiver
+ *  cannot have it (the coinbase) */
+struct CPrefilledTransaction
+{
+    uint16_t nIndex; // Position in the block
+    CTransaction tx;
+};
+
+/** A block header with the short ids of its transactions: what a peer that
+ *  already has the transactions in its mempool needs to rebuild the block.
+ *  The header is serialized like any other, so it carries the auxpow of
+ *  merge-mined blocks and the Equihash solution. */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t nShortIDKey0, nShortIDKey1;
+
+    void FillShortTxIDSelector() const;
+
+    friend class CPartialBlock;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    CBlockHeader header;
+    uint64_t nNonce;
+    std::vector<uint64_t> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() : nShortIDKey0(0), nShortIDKey1(0), nNonce(0) {}
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return vShortTxIDs.size() + vPrefilledTxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockHeaderAndShortTxIDs* pthis = const_cast<CBlockHeaderAndShortTxIDs*>(this);
+        READWRITE(header);
+        READWRITE(nNonce);
+
+        unsigned int nShortIDs = vShortTxIDs.size();
+        READWRITE(VARINT(nShortIDs));
+        if (fRead) {
+            if (nShortIDs > MAX_CMPCTBLOCK_TXN)
+                throw std::ios_base::failure("too many short ids");
+            pthis->vShortTxIDs.resize(nShortIDs);
+        }
+        for (unsigned int i = 0; i < nShortIDs; i++) {
+            // 6 bytes each, little endian
+            uint32_t nLow = vShortTxIDs[i] & 0xffffffff;
+            uint16_t nHigh = (vShortTxIDs[i] >> 32) & 0xffff;
+            READWRITE(nLow);
+            READWRITE(nHigh);
+            if (fRead)
+                pthis->vShortTxIDs[i] = ((uint64_t)nHigh << 32) | nLow;
+        }
+
+        std::vector<uint16_t> vIndexes;
+        if (!fRead)
+            for (unsigned int i = 0; i < vPrefilledTxn.size(); i++)
+                vIndexes.push_back(vPrefilledTxn[i].nIndex);
+        READWRITE_DIFF_INDEXES(vIndexes, vIndexes);
+        if (fRead)
+            pthis->vPrefilledTxn.resize(vIndexes.size());
+        for (unsigned int i = 0; i < vIndexes.size(); i++) {
+            if (fRead)
+                pthis->vPrefilledTxn[i].nIndex = vIndexes[i];
+            READWRITE(pthis->vPrefilledTxn[i].tx);
+        }
+
+        if (fRead)
+            pthis->FillShortTxIDSelector();
+    )
+};
+
+/** getblocktxn: the transactions of a compact block a peer could not fill in */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<uint16_t> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockTransactionsRequest* pthis = const_cast<CBlockTransactionsRequest*>(this);
+        READWRITE(hashBlock);
+        READWRITE_DIFF_INDEXES(vIndexes, pthis->vIndexes);
+    )
+};
+
+/** blocktxn: the answer to a getblocktxn, in the order they were asked for */
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    CBlockTransactions() {}
+    CBlockTransactions(const CBlockTransactionsRequest& req) : hashBlock(req.hashBlock), vtx(req.vIndexes.size()) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+/** A block being rebuilt from a compact block and the mempool, waiting
+ *  for the transactions that were missing */
+class CPartialBlock
+{
+private:
+    std::vector<CTransaction> vtxAvailable;
+    std::vector<bool> vHave;
+    size_t nPrefilled, nFromMempool;
+
+public:
+    CBlockHeader header;
+
+    CPartialBlock() : nPrefilled(0), nFromMempool(0) {}
+
+    /** Fill in what the compact block and the mempool provide. Returns
+     *  READ_STATUS_FAILED when the short ids can't be matched unambiguously. */
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool);
+
+    bool IsTxAvailable(size_t nIndex) const;
+
+    /** Build the block, taking the missing transactions from vtxMissing in order.
+     *  Fails when the result doesn't match the header's merkle root, which
+     *  happens if a short id matched the wrong mempool transaction. */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const;
+
+    size_t GetPrefilledCount() const { return nPrefilled; }
+    size_t GetMempoolCount() const { return nFromMempool; }
+};
+
+#endif // BITMARK_BLOCKENCODINGS_H
@@ -6,10 +6,14 @@
 #include "bloom.h"
 
 #include "core.h"
+#include "hash.h"
 #include "script.h"
+#include "util.h"
 
+#include <limits>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455
 #define LN2 0.6931471805599453094172321214581765680755001343602552
@@ -32,67 +36,101 @@ nFlags(nFlagsIn)
 {
 }
 
-inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
+// Hashes are worked out four at a time, the width of MurmurHash3Batch's
+// lanes. Most lookups of data that isn't in the filter end after the first
+// couple of hashes, so doing all nHashFuncs in one go would mostly be waste.
+static const unsigned int BLOOM_HASH_BATCH = 4;
+
+static inline void BloomHashes(unsigned int nTweak, unsigned int nFirst, unsigned int nCount, const unsigned char* pKey, size_t nLen, unsigned int* pHashes)
 {
-    // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash) % (vData.size() * 8);
+    unsigned int vSeeds[BLOOM_HASH_BATCH];
+    for (unsigned int i = 0; i < nCount; i++)
+        // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
+        vSeeds[i] = (nFirst + i) * 0xFBA4C795 + nTweak;
+    MurmurHash3Batch(vSeeds, nCount, pKey, nLen, pHashes);
 }
 
-void CBloomFilter::insert(const vector<unsigned char>& vKey)
+// An outpoint the way it is serialized on the network, without a stream
+static inline void OutPointKey(const COutPoint& outpoint, unsigned char* pKey)
+{
+    memcpy(pKey, outpoint.hash.begin(), 32);
+    for (unsigned int i = 0; i < 4; i++)
+        pKey[32 + i] = (outpoint.n >> (8 * i)) & 0xff;
+}
+
+void CBloomFilter::insert(const unsigned char* pKey, size_t nLen)
 {
     if (isFull)
         return;
-    for (unsigned int i = 0; i < nHashFuncs; i++)
+    unsigned int vHashes[BLOOM_HASH_BATCH];
+    for (unsigned int i = 0; i < nHashFuncs; i += BLOOM_HASH_BATCH)
     {
-        unsigned int nIndex = Hash(i, vKey);
-        // Sets bit nIndex of vData
-        vData[nIndex >> 3] |= (1 << (7 & nIndex));
+        unsigned int nCount = min(nHashFuncs - i, BLOOM_HASH_BATCH);
+        BloomHashes(nTweak, i, nCount, pKey, nLen, vHashes);
+        for (unsigned int j = 0; j < nCount; j++)
+        {
+            unsigned int nIndex = vHashes[j] % (vData.size() * 8);
+            // Sets bit nIndex of vData
+            vData[nIndex >> 3] |= (1 << (7 & nIndex));
+        }
     }
     isEmpty = false;
 }
 
+void CBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    insert(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
 void CBloomFilter::insert(const COutPoint& outpoint)
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    insert(data);
+    unsigned char vKey[36];
+    OutPointKey(outpoint, vKey);
+    insert(vKey, sizeof(vKey));
 }
 
 void CBloomFilter::insert(const uint256& hash)
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    insert(data);
+    insert(hash.begin(), hash.size());
 }
 
-bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+bool CBloomFilter::contains(const unsigned char* pKey, size_t nLen) const
 {
     if (isFull)
         return true;
     if (isEmpty)
         return false;
-    for (unsigned int i = 0; i < nHashFuncs; i++)
+    unsigned int vHashes[BLOOM_HASH_BATCH];
+    for (unsigned int i = 0; i < nHashFuncs; i += BLOOM_HASH_BATCH)
     {
-        unsigned int nIndex = Hash(i, vKey);
-        // Checks bit nIndex of vData
-        if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
-            return false;
+        unsigned int nCount = min(nHashFuncs - i, BLOOM_HASH_BATCH);
+        BloomHashes(nTweak, i, nCount, pKey, nLen, vHashes);
+        for (unsigned int j = 0; j < nCount; j++)
+        {
+            unsigned int nIndex = vHashes[j] % (vData.size() * 8);
+            // Checks bit nIndex of vData
+            if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
+                return false;
+        }
     }
     return true;
 }
 
+bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    return contains(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
 bool CBloomFilter::contains(const COutPoint& outpoint) const
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    return contains(data);
+    unsigned char vKey[36];
+    OutPointKey(outpoint, vKey);
+    return contains(vKey, sizeof(vKey));
 }
 
 bool CBloomFilter::contains(const uint256& hash) const
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    return contains(data);
+    return contains(hash.begin(), hash.size());
 }
 
 bool CBloomFilter::IsWithinSizeConstraints() const
@@ -169,6 +207,48 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& ha
     return false;
 }
 
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomBlockElements& elements, unsigned int nTx)
+{
+    // Same matching as for a CTransaction above, on the extracted elements
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+
+    const CBloomBlockElements::Tx& tx = elements.vTx[nTx];
+    const CBloomBlockElements::Tx& txNext = elements.vTx[nTx + 1];
+    bool fFound = contains(tx.hash);
+
+    for (unsigned int i = tx.nFirstOutput; i < txNext.nFirstOutput; i++)
+    {
+        const CBloomBlockElements::Output& output = elements.vOutputs[i];
+        for (unsigned int e = output.nFirstElement; e < output.nEndElement; e++)
+        {
+            if (contains(elements.GetElement(e), elements.vElements[e].nLen))
+            {
+                fFound = true;
+                if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL ||
+                    ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY && output.fPayToPubKey))
+                    insert(COutPoint(tx.hash, i - tx.nFirstOutput));
+                break;
+            }
+        }
+    }
+
+    if (fFound)
+        return true;
+
+    for (unsigned int i = tx.nFirstInput; i < txNext.nFirstInput; i++)
+    {
+        const CBloomBlockElements::Input& input = elements.vInputs[i];
+        for (unsigned int e = input.nFirstElement; e < input.nEndElement; e++)
+            if (contains(elements.GetElement(e), elements.vElements[e].nLen))
+                return true;
+    }
+
+    return false;
+}
+
 void CBloomFilter::UpdateEmptyFull()
 {
     bool full = true;
@@ -181,3 +261,165 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CBloomBlockElements::CBloomBlockElements(const CBlock& block) : hashBlock(block.GetHash())
+{
+    vTx.reserve(block.vtx.size() + 1);
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        Tx entry;
+        entry.hash = tx.GetHash();
+        entry.nFirstOutput = vOutputs.size();
+        entry.nFirstInput = vInputs.size();
+        vTx.push_back(entry);
+
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            Output output;
+            output.nFirstElement = vElements.size();
+            AddPushes(txout.scriptPubKey);
+            output.nEndElement = vElements.size();
+            txnouttype type;
+            vector<vector<unsigned char> > vSolutions;
+            output.fPayToPubKey = Solver(txout.scriptPubKey, type, vSolutions) &&
+                                  (type == TX_PUBKEY || type == TX_MULTISIG);
+            vOutputs.push_back(output);
+        }
+
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            Input input;
+            input.nFirstElement = vElements.size();
+            unsigned char vKey[36];
+            OutPointKey(txin.prevout, vKey);
+            AddElement(vKey, sizeof(vKey));
+            AddPushes(txin.scriptSig);
+            input.nEndElement = vElements.size();
+            vInputs.push_back(input);
+        }
+    }
+
+    Tx end;
+    end.nFirstOutput = vOutputs.size();
+    end.nFirstInput = vInputs.size();
+    vTx.push_back(end);
+}
+
+void CBloomBlockElements::AddElement(const unsigned char* pData, size_t nLen)
+{
+    Element element;
+    element.nOffset = vData.size();
+    element.nLen = nLen;
+    vElements.push_back(element);
+    vData.insert(vData.end(), pData, pData + nLen);
+}
+
+void CBloomBlockElements::AddPushes(const CScript& script)
+{
+    CScript::const_iterator pc = script.begin();
+    vector<unsigned char> data;
+    while (pc < script.end())
+    {
+        opcodetype opcode;
+        if (!script.GetOp(pc, opcode, data))
+            break;
+        if (data.size() != 0)
+            AddElement(&data[0], data.size());
+    }
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate)
+{
+    double logFPRate = log(nFPRate);
+    // The ideal number of hash functions is log(fp rate) / log(0.5)
+    nHashFuncs = max(1, min((int)(logFPRate / log(0.5) + 0.5), (int)MAX_HASH_FUNCS));
+    // Two full generations and the one being filled are kept
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    // Solve fp rate = (1 - exp(-nHashFuncs * nMaxElements / nFilterBits)) ^ nHashFuncs for nFilterBits
+    unsigned int nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFPRate / nHashFuncs)));
+    vData.resize(((nFilterBits + 63) / 64) * 2);
+    reset();
+}
+
+// All nHashFuncs positions come from two MurmurHash3 runs as h1 + i * h2, which
+// does as well as independent hashes (Kirsch and Mitzenmacher) and costs two
+// hashes per lookup however low the fp rate
+static inline void RollingBloomHashes(unsigned int nTweak, const unsigned char* pKey, size_t nLen, unsigned int& h1, unsigned int& h2)
+{
+    h1 = MurmurHash3(nTweak, pKey, nLen);
+    h2 = MurmurHash3(nTweak ^ 0xFBA4C795, pKey, nLen) | 1;
+}
+
+void CRollingBloomFilter::insert(const unsigned char* pKey, size_t nLen)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        // Wipe the positions left over from the last time this generation was used
+        uint64_t nMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        for (unsigned int p = 0; p < vData.size(); p += 2) {
+            uint64_t p1 = vData[p], p2 = vData[p + 1];
+            uint64_t mask = (p1 ^ nMask1) | (p2 ^ nMask2);
+            vData[p] = p1 & mask;
+            vData[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    unsigned int h1, h2;
+    RollingBloomHashes(nTweak, pKey, nLen, h1, h2);
+    for (unsigned int i = 0; i < nHashFuncs; i++) {
+        unsigned int h = h1 + i * h2;
+        int bit = h & 0x3f;
+        unsigned int pos = ((h >> 6) % (vData.size() / 2)) * 2;
+        vData[pos] = (vData[pos] & ~((uint64_t)1 << bit)) | ((uint64_t)(nGeneration & 1) << bit);
+        vData[pos + 1] = (vData[pos + 1] & ~((uint64_t)1 << bit)) | ((uint64_t)(nGeneration >> 1) << bit);
+    }
+}
+
+bool CRollingBloomFilter::contains(const unsigned char* pKey, size_t nLen) const
+{
+    unsigned int h1, h2;
+    RollingBloomHashes(nTweak, pKey, nLen, h1, h2);
+    for (unsigned int i = 0; i < nHashFuncs; i++) {
+        unsigned int h = h1 + i * h2;
+        int bit = h & 0x3f;
+        unsigned int pos = ((h >> 6) % (vData.size() / 2)) * 2;
+        // Set in any generation
+        if (!(((vData[pos] | vData[pos + 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    insert(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    insert(hash.begin(), hash.size());
+}
+
+bool CRollingBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    return contains(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    return contains(hash.begin(), hash.size());
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(vData.begin(), vData.end(), 0);
+}
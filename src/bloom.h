@@ -7,12 +7,16 @@
 #define BITMARK_BLOOM_H
 
 #include "serialize.h"
+#include "uint256.h"
 
+#include <stdint.h>
 #include <vector>
 
+class CBlock;
+class CBloomBlockElements;
 class COutPoint;
+class CScript;
 class CTransaction;
-class uint256;
 
 // 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -50,7 +54,8 @@ private:
     unsigned int nTweak;
     unsigned char nFlags;
 
-    unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    void insert(const unsigned char* pKey, size_t nLen);
+    bool contains(const unsigned char* pKey, size_t nLen) const;
 
 public:
     // Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
@@ -85,9 +90,110 @@ public:
 
     // Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash);
+    // The same for transaction nTx of a block whose data elements were extracted already
+    bool IsRelevantAndUpdate(const CBloomBlockElements& elements, unsigned int nTx);
 
     // Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
 };
 
+/**
+ * The data elements IsRelevantAndUpdate looks at in each transaction of a
+ * block: its hash, the pushes of every scriptPubKey, and the outpoints and
+ * scriptSig pushes of its inputs. Getting them out of the scripts is most of
+ * the work of matching a block, so a block sent filtered to several peers is
+ * only taken apart once. All elements are stored back to back in one buffer.
+ */
+class CBloomBlockElements
+{
+public:
+    struct Element
+    {
+        unsigned int nOffset;
+        unsigned int nLen;
+    };
+
+    struct Output
+    {
+        unsigned int nFirstElement, nEndElement; // the scriptPubKey pushes
+        bool fPayToPubKey; // pay-to-pubkey or multisig, for BLOOM_UPDATE_P2PUBKEY_ONLY
+    };
+
+    struct Input
+    {
+        unsigned int nFirstElement, nEndElement; // the serialized prevout, then the scriptSig pushes
+    };
+
+    struct Tx
+    {
+        uint256 hash;
+        unsigned int nFirstOutput;
+        unsigned int nFirstInput;
+    };
+
+    CBloomBlockElements(const CBlock& block);
+
+    const uint256& GetBlockHash() const { return hashBlock; }
+    unsigned int size() const { return vTx.size() - 1; }
+    const uint256& GetTxHash(unsigned int nTx) const { return vTx[nTx].hash; }
+
+private:
+    uint256 hashBlock;
+    std::vector<unsigned char> vData;
+    std::vector<Element> vElements;
+    std::vector<Output> vOutputs;
+    std::vector<Input> vInputs;
+    // One more than there are transactions, so every range has an end
+    std::vector<Tx> vTx;
+
+    const unsigned char* GetElement(unsigned int nElement) const { return &vData[vElements[nElement].nOffset]; }
+    void AddElement(const unsigned char* pData, size_t nLen);
+    void AddPushes(const CScript& script);
+
+    friend class CBloomFilter;
+};
+
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * It remembers at least the last nElements items inserted (and up to half as
+ * many again), using a fixed amount of memory decided at construction.
+ *
+ * Every position of the filter holds a 2-bit generation number instead of a
+ * single bit, 0 meaning unset. Inserts are tagged with the current generation;
+ * after nElements / 2 of them the filter moves on to the next of three
+ * generations and wipes the positions still tagged with it.
+ *
+ * Unlike CBloomFilter it is only kept locally, so its hash seed is random
+ * and a peer can't aim for false positives.
+ */
+class CRollingBloomFilter
+{
+public:
+    // The false positive rate holds with up to 1.5 * nElements items in the filter
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    // Forget everything, and pick a new hash seed
+    void reset();
+
+    size_t DynamicMemoryUsage() const { return vData.capacity() * sizeof(uint64_t); }
+
+private:
+    unsigned int nEntriesPerGeneration;
+    unsigned int nEntriesThisGeneration;
+    int nGeneration;
+    // Position p is bit (p & 63) of vData[(p >> 6) * 2] (low bit of the
+    // generation) and vData[(p >> 6) * 2 + 1] (high bit)
+    std::vector<uint64_t> vData;
+    unsigned int nTweak;
+    unsigned int nHashFuncs;
+
+    void insert(const unsigned char* pKey, size_t nLen);
+    bool contains(const unsigned char* pKey, size_t nLen) const;
+};
+
 #endif /* BITMARK_BLOOM_H */
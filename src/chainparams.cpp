@@ -58,6 +58,9 @@ public:
 	nEquihashN = 200;
 	nEquihashK = 9;
 	fMineBlocksOnDemand = false;
+	// Set to a recent block at release time (see doc/release-process.md); scripts
+	// below the last checkpoint are skipped anyway, so that block gains nothing
+	hashDefaultAssumeValid = 0;
 
         // Build the genesis block.
         const char* pszTimestamp = "13/July/2014, with memory of the past, we look to the future. TDR";
@@ -168,6 +171,7 @@ public:
 	nEquihashN = 200;
 	nEquihashK = 9;
 	fMineBlocksOnDemand = false;
+	hashDefaultAssumeValid = 0;
 
 	const char* pszTimestamp = "Testing Testnet";
 	CTransaction txNew;
@@ -73,6 +73,8 @@ public:
     unsigned int EquihashN() const { return nEquihashN; }
     unsigned int EquihashK() const { return nEquihashK; }
     bool MineBlocksOnDemand() const { return fMineBlocksOnDemand; }
+    /** Block whose ancestors skip script verification unless -assumevalid overrides it (0 = none) */
+    const uint256& DefaultAssumeValid() const { return hashDefaultAssumeValid; }
 
     // Fork2 in suspension (3/21/21)
     //int64_t GetFork2Height() const { return nForkHeight2; }
@@ -111,6 +113,7 @@ protected:
     unsigned int nEquihashN = 0;
     unsigned int nEquihashK = 0;
     bool fMineBlocksOnDemand = true;
+    uint256 hashDefaultAssumeValid;
  
 };
 
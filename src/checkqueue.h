@@ -6,28 +6,65 @@
 #ifndef CHECKQUEUE_H
 #define CHECKQUEUE_H
 
+#include "util.h"
+
 #include <algorithm>
+#include <atomic>
+#include <assert.h>
+#include <deque>
 #include <vector>
 
-#include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
 
 template<typename T> class CCheckQueueControl;
 
-/** Queue for verifications that have to be performed.
+/** Counters describing how the workers of a CCheckQueue spent their time. */
+struct CCheckQueueStats
+{
+    uint64_t nChecks;       // checks run
+    uint64_t nSteals;       // batches taken from another worker's deque
+    int64_t nStealMicros;   // time spent searching other deques for work
+    int64_t nIdleMicros;    // time spent blocked while checks were still outstanding
+
+    CCheckQueueStats() : nChecks(0), nSteals(0), nStealMicros(0), nIdleMicros(0) {}
+
+    CCheckQueueStats operator-(const CCheckQueueStats &other) const {
+        CCheckQueueStats ret;
+        ret.nChecks = nChecks - other.nChecks;
+        ret.nSteals = nSteals - other.nSteals;
+        ret.nStealMicros = nStealMicros - other.nStealMicros;
+        ret.nIdleMicros = nIdleMicros - other.nIdleMicros;
+        return ret;
+    }
+};
+
+/** Work-stealing pool for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
-  * operator(), returning a bool.
+  * operator(), returning a bool, and a swap().
   *
-  * One thread (the master) is assumed to push batches of verifications
-  * onto the queue, where they are processed by N-1 worker threads. When
-  * the master is done adding work, it temporarily joins the worker pool
-  * as an N'th worker, until all jobs are done.
+  * One thread (the master) pushes batches of verifications, which are dealt
+  * out over per-worker deques. Each worker runs checks from the back of its
+  * own deque and, once that is empty, steals up to half of another deque
+  * from the front. When the master is done adding work, it joins the pool
+  * with a deque of its own until all jobs are done. Only sleeping and waking
+  * go through the shared mutex.
   */
 template<typename T> class CCheckQueue {
 private:
-    // Mutex to protect the inner state
+    struct CWorkerDeque {
+        boost::mutex mutex;
+        std::deque<T> checks;
+    };
+
+    // Slot 0 belongs to the master, the others to worker threads in the order they started
+    boost::scoped_array<CWorkerDeque> vDeques;
+    unsigned int nSlots;
+    std::atomic<unsigned int> nWorkers;
+
+    // Mutex for sleeping and waking up; also protects fQuit
     boost::mutex mutex;
 
     // Worker threads block on this when out of work
@@ -36,119 +73,195 @@ private:
     // Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    // The queue of elements to be processed.
-    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
-    // The number of workers (including the master) that are idle.
-    int nIdle;
+    // Number of verifications sitting in deques (including ones moving between deques)
+    std::atomic<unsigned int> nQueued;
 
-    // The total number of workers (including the master).
-    int nTotal;
+    // Number of verifications that haven't completed yet.
+    std::atomic<unsigned int> nTodo;
 
     // The temporary evaluation result.
-    bool fAllOk;
-
-    // Number of verifications that haven't completed yet.
-    // This includes elements that are not anymore in queue, but still in
-    // worker's own batches.
-    unsigned int nTodo;
+    std::atomic<bool> fAllOk;
 
     // Whether we're shutting down.
     bool fQuit;
 
-    // The maximum number of elements to be processed in one batch
+    // The maximum number of elements taken in one steal
     unsigned int nBatchSize;
 
+    // When nTodo last dropped to zero, to stop the idle clock of sleeping workers
+    std::atomic<int64_t> nDoneMicros;
+
+    std::atomic<uint64_t> nChecks;
+    std::atomic<uint64_t> nSteals;
+    std::atomic<int64_t> nStealMicros;
+    std::atomic<int64_t> nIdleMicros;
+
+    unsigned int GetActiveSlots() const {
+        return std::min(nSlots, nWorkers.load() + 1);
+    }
+
+    // Move up to half of another deque's checks to our own and take one of them.
+    bool Steal(unsigned int nSlot, T &check) {
+        unsigned int nActive = GetActiveSlots();
+        std::vector<T> vStolen;
+        for (unsigned int i = 1; i < nActive && vStolen.empty(); i++) {
+            CWorkerDeque &victim = vDeques[(nSlot + i) % nActive];
+            boost::unique_lock<boost::mutex> lock(victim.mutex);
+            unsigned int nTake = std::min(nBatchSize, (unsigned int)(victim.checks.size() + 1) / 2);
+            vStolen.resize(nTake);
+            for (unsigned int j = 0; j < nTake; j++) {
+                vStolen[j].swap(victim.checks.front());
+                victim.checks.pop_front();
+            }
+        }
+        if (vStolen.empty())
+            return false;
+        check.swap(vStolen.back());
+        vStolen.pop_back();
+        if (!vStolen.empty()) {
+            CWorkerDeque &own = vDeques[nSlot];
+            boost::unique_lock<boost::mutex> lock(own.mutex);
+            for (unsigned int j = 0; j < vStolen.size(); j++) {
+                own.checks.push_back(T());
+                own.checks.back().swap(vStolen[j]);
+            }
+        }
+        nSteals++;
+        return true;
+    }
+
+    // Find the next check to run: our own newest one, or a stolen one.
+    bool Take(unsigned int nSlot, T &check) {
+        {
+            CWorkerDeque &own = vDeques[nSlot];
+            boost::unique_lock<boost::mutex> lock(own.mutex);
+            if (!own.checks.empty()) {
+                check.swap(own.checks.back());
+                own.checks.pop_back();
+                nQueued--;
+                return true;
+            }
+        }
+        if (nQueued == 0)
+            return false;
+        int64_t nStart = GetTimeMicros();
+        bool fFound = Steal(nSlot, check);
+        nStealMicros += GetTimeMicros() - nStart;
+        if (fFound)
+            nQueued--;
+        return fFound;
+    }
+
+    void Run(T &check) {
+        // Once a check failed the rest are only drained
+        if (fAllOk && !check())
+            fAllOk = false;
+        T().swap(check);
+        nChecks++;
+        if (--nTodo == 0) {
+            nDoneMicros = GetTimeMicros();
+            boost::unique_lock<boost::mutex> lock(mutex);
+            condMaster.notify_one();
+        }
+    }
+
     // Internal function that does bulk of the verification work.
-    bool Loop(bool fMaster = false) {
-        boost::condition_variable &cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                     // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                     // queue to the local batch vector instead of copying.
-                     vChecks[i].swap(queue.back());
-                     queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+    bool Loop(unsigned int nSlot, bool fMaster) {
+        T check;
+        while (true) {
+            if (Take(nSlot, check)) {
+                Run(check);
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fMaster) {
+                // Checks stolen by others are in flight; wait for them to finish
+                int64_t nStart = GetTimeMicros();
+                while (nTodo > 0 && nQueued == 0)
+                    condMaster.wait(lock);
+                nIdleMicros += GetTimeMicros() - nStart;
+                if (nTodo > 0)
+                    continue;
+                // return the current status and reset it for new work later
+                bool fRet = fAllOk;
+                fAllOk = true;
+                return fRet;
             }
-            // execute work
-            BOOST_FOREACH(T &check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
-        } while(true);
+            if (nQueued > 0)
+                continue;
+            if (fQuit)
+                return fAllOk;
+            bool fStarved = nTodo > 0;
+            int64_t nStart = GetTimeMicros();
+            while (nQueued == 0 && !fQuit)
+                condWorker.wait(lock);
+            if (fStarved)
+                nIdleMicros += std::max(nStart, std::min(GetTimeMicros(), nDoneMicros.load())) - nStart;
+        }
     }
 
 public:
-    // Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) :
-        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    // Create a new check queue for the master and up to nMaxWorkers worker threads
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkers) :
+        vDeques(new CWorkerDeque[nMaxWorkers + 1]), nSlots(nMaxWorkers + 1), nWorkers(0),
+        nQueued(0), nTodo(0), fAllOk(true), fQuit(false), nBatchSize(nBatchSizeIn),
+        nDoneMicros(0), nChecks(0), nSteals(0), nStealMicros(0), nIdleMicros(0) {}
 
     // Worker thread
     void Thread() {
-        Loop();
+        unsigned int nSlot = ++nWorkers;
+        assert(nSlot < nSlots);
+        Loop(nSlot, false);
     }
 
     // Wait until execution finishes, and return whether all evaluations where succesful.
     bool Wait() {
-        return Loop(true);
+        return Loop(0, true);
     }
 
-    // Add a batch of checks to the queue
+    // Add a batch of checks to the queue, dealt out over the deques of all workers
     void Add(std::vector<T> &vChecks) {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH(T &check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
+        // Count before publishing, so a fast worker can't finish a check that isn't counted yet
         nTodo += vChecks.size();
+        nQueued += vChecks.size();
+        unsigned int nActive = GetActiveSlots();
+        for (unsigned int nSlot = 0; nSlot < nActive; nSlot++) {
+            CWorkerDeque &deque = vDeques[nSlot];
+            boost::unique_lock<boost::mutex> lock(deque.mutex);
+            for (unsigned int i = nSlot; i < vChecks.size(); i += nActive) {
+                deque.checks.push_back(T());
+                deque.checks.back().swap(vChecks[i]);
+            }
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
+    // Make idle worker threads return
+    void Quit() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+        condWorker.notify_all();
+    }
+
+    CCheckQueueStats GetStats() const {
+        CCheckQueueStats stats;
+        stats.nChecks = nChecks;
+        stats.nSteals = nSteals;
+        stats.nStealMicros = nStealMicros;
+        stats.nIdleMicros = nIdleMicros;
+        return stats;
+    }
+
+    bool IsIdle() const {
+        return nTodo == 0 && nQueued == 0 && fAllOk;
+    }
+
     ~CCheckQueue() {
     }
 
@@ -166,11 +279,12 @@ private:
 public:
     CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false) {
         // passed queue is supposed to be unused, or NULL
-        if (pqueue != NULL) {
-            assert(pqueue->nTotal == pqueue->nIdle);
-            assert(pqueue->nTodo == 0);
-            assert(pqueue->fAllOk == true);
-        }
+        if (pqueue != NULL)
+            assert(pqueue->IsIdle());
+    }
+
+    bool IsActive() const {
+        return pqueue != NULL;
     }
 
     bool Wait() {
@@ -182,8 +296,10 @@ public:
     }
 
     void Add(std::vector<T> &vChecks) {
-        if (pqueue != NULL)
+        if (pqueue != NULL) {
             pqueue->Add(vChecks);
+            fDone = false;
+        }
     }
 
     ~CCheckQueueControl() {
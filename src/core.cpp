@@ -80,32 +80,28 @@ void CTxOut::print() const
 
 uint256 CTransaction::GetHash() const
 {
-  return SerializeHash(*this);
-}
-
-uint256 CTransaction::GetCachedHash() const
-{
-  if (hash!=uint256(0)) {
+  if (hash != 0)
     return hash;
-  }
-  else {
-    return SerializeHash(*this);
-  }
+  return ComputeHash();
 }
 
-void CTransaction::UpdateHash() const
+uint256 CTransaction::ComputeHash() const
 {
+  // Parent coinbases of Equihash and Cryptonight auxpow are hashed as raw bytes
   if (this->vector_format) {
     if (this->keccak_hash) {
-      *const_cast<uint256*>(&hash) = KeccakHashCBTX((unsigned char *)&vector_rep[0],(unsigned char *)&vector_rep[vector_rep.size()]);
+      return KeccakHashCBTX((unsigned char *)&vector_rep[0],(unsigned char *)&vector_rep[vector_rep.size()]);
     }
     else {
-      *const_cast<uint256*>(&hash) = Hash((unsigned char *)&vector_rep[0],(unsigned char *)&vector_rep[vector_rep.size()]);
+      return Hash((unsigned char *)&vector_rep[0],(unsigned char *)&vector_rep[vector_rep.size()]);
     }
   }
-  else {
-    *const_cast<uint256*>(&hash) = SerializeHash(*this);
-  }
+  return SerializeHash(*this);
+}
+
+void CTransaction::UpdateHash() const
+{
+  *const_cast<uint256*>(&hash) = ComputeHash();
 }
 
 bool CTransaction::IsNewerThan(const CTransaction& old) const
@@ -198,6 +194,45 @@ void CTransaction::print() const
 // * if e==9, we only know the resulting number is not zero, so output 1 + 10*(n - 1) + 9
 // (this is decodable, as d is in [1-9] and e is in [0-9])
 
+bool CTxInUndoCompressor::DeriveScript(unsigned int nType, const CScript &scriptSigIn, CScript &scriptOut)
+{
+    if (nType != 1 && nType != 2)
+        return false;
+    CScript::const_iterator pc = scriptSigIn.begin();
+    opcodetype opcode;
+    std::vector<unsigned char> vch, vchLast;
+    bool fPush = false;
+    while (pc < scriptSigIn.end()) {
+        if (!scriptSigIn.GetOp(pc, opcode, vch) || opcode > OP_PUSHDATA4)
+            return false;
+        vchLast.swap(vch);
+        fPush = true;
+    }
+    if (!fPush)
+        return false;
+    uint160 hash = Hash160(vchLast);
+    scriptOut.clear();
+    if (nType == 1)
+        scriptOut << OP_DUP << OP_HASH160 << hash << OP_EQUALVERIFY << OP_CHECKSIG;
+    else
+        scriptOut << OP_HASH160 << hash << OP_EQUAL;
+    return true;
+}
+
+unsigned int CTxInUndoCompressor::GetDerivedType() const
+{
+    const CScript &script = undo.txout.scriptPubKey;
+    unsigned int nType = 0;
+    if (script.size() == 25 && script[0] == OP_DUP)
+        nType = 1;
+    else if (script.IsPayToScriptHash())
+        nType = 2;
+    CScript scriptDerived;
+    if (nType && DeriveScript(nType, scriptSig, scriptDerived) && scriptDerived == script)
+        return nType;
+    return 0;
+}
+
 uint64_t CTxOutCompressor::CompressAmount(uint64_t n)
 {
     if (n == 0)
@@ -245,9 +280,17 @@ uint64_t CTxOutCompressor::DecompressAmount(uint64_t x)
 
 uint256 CBlock::BuildMerkleTree() const
 {
-    vMerkleTree.clear();
+    std::vector<uint256> vTxHash;
+    vTxHash.reserve(vtx.size());
     BOOST_FOREACH(const CTransaction& tx, vtx)
-        vMerkleTree.push_back(tx.GetHash());
+        vTxHash.push_back(tx.GetHash());
+    return BuildMerkleTree(vTxHash);
+}
+
+uint256 CBlock::BuildMerkleTree(const std::vector<uint256> &vTxHash) const
+{
+    assert(vTxHash.size() == vtx.size());
+    vMerkleTree = vTxHash;
     int j = 0;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
@@ -384,6 +427,56 @@ bool CBlockIndex::IsSuperMajorityVariant2(int minVersion, bool variant, const CB
   return (nFound >= nRequired);
 }
 
+/** Turn the lowest '1' bit in the binary representation of a number into a '0'. */
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+/** Compute what height to jump back to with the CBlockIndex::pskip pointer. */
+static inline int GetSkipHeight(int height) {
+    if (height < 2)
+        return 0;
+
+    // Determine which height to jump back to. Any number strictly lower than height is acceptable,
+    // but the following expression seems to perform well in simulations (max 110 steps to go back
+    // up to 2**18 blocks).
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int height)
+{
+    if (height > nHeight || height < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > height) {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == height ||
+             (heightSkip > height && !(heightSkipPrev < heightSkip - 2 &&
+                                       heightSkipPrev >= height)))) {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev.
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int height) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(height);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
 int64_t CBlockIndex::GetMedianTime() const
 {
   AssertLockHeld(cs_main);
@@ -194,13 +194,19 @@ public:
 
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
+ *
+ * The txid is computed once when a transaction is deserialized, so one read
+ * from disk or the network must not be modified afterwards; the few callers
+ * that edit one in place call InvalidateHash() first.
  */
 class CTransaction
 {
  private:
+  // txid cached at deserialization, or 0
   uint256 hash;
   void UpdateHash() const;
-  
+  uint256 ComputeHash() const;
+
 public:
     static int64_t nMinTxFee;
     static int64_t nMinRelayTxFee;
@@ -252,7 +258,11 @@ public:
     }
 
     uint256 GetHash() const;
-    uint256 GetCachedHash() const;
+
+    void InvalidateHash()
+    {
+        hash = 0;
+    }
     bool IsNewerThan(const CTransaction& old) const;
 
     // Return sum of txouts.
@@ -469,11 +479,6 @@ public:
    * @return The expected index for the aux hash.
    */
     static int getExpectedIndex(int nNonce, int nChainId, unsigned h);
-
-    inline uint256 GetHash() const
-    {
-      return CTransaction::GetCachedHash();
-    }
 };
 
 /** Nodes collect new transactions into a block, hash them into a hash tree,
@@ -698,6 +703,71 @@ public:
     }
 };
 
+/** Compact undo encoding of a CTxInUndo, given the input that spent it.
+ *
+ *  Pay-to-pubkey-hash and pay-to-script-hash outputs are spent by a
+ *  scriptSig whose last push is the public key or the redeem script, so
+ *  their scriptPubKey can be rebuilt from the block instead of being
+ *  stored. The two low bits of the height code say how:
+ *  0 = script stored, 1 = P2PKH of the last push, 2 = P2SH of the last push.
+ *  Only the amount is stored in the latter two cases.
+ */
+class CTxInUndoCompressor
+{
+private:
+    CTxInUndo &undo;
+    const CScript &scriptSig;
+
+    unsigned int GetDerivedType() const;
+
+public:
+    // Rebuild the scriptPubKey of derived type nType from a spending scriptSig
+    static bool DeriveScript(unsigned int nType, const CScript &scriptSigIn, CScript &scriptOut);
+
+    CTxInUndoCompressor(CTxInUndo &undoIn, const CScript &scriptSigIn) : undo(undoIn), scriptSig(scriptSigIn) { }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        unsigned int nDerived = GetDerivedType();
+        unsigned int nSize = ::GetSerializeSize(VARINT((undo.nHeight*2+(undo.fCoinBase ? 1 : 0))*4+nDerived), nType, nVersion) +
+                             (undo.nHeight > 0 ? ::GetSerializeSize(VARINT(undo.nVersion), nType, nVersion) : 0);
+        if (nDerived)
+            return nSize + ::GetSerializeSize(VARINT(CTxOutCompressor::CompressAmount(undo.txout.nValue)), nType, nVersion);
+        return nSize + ::GetSerializeSize(CTxOutCompressor(REF(undo.txout)), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        unsigned int nDerived = GetDerivedType();
+        ::Serialize(s, VARINT((undo.nHeight*2+(undo.fCoinBase ? 1 : 0))*4+nDerived), nType, nVersion);
+        if (undo.nHeight > 0)
+            ::Serialize(s, VARINT(undo.nVersion), nType, nVersion);
+        if (nDerived)
+            ::Serialize(s, VARINT(CTxOutCompressor::CompressAmount(undo.txout.nValue)), nType, nVersion);
+        else
+            ::Serialize(s, CTxOutCompressor(REF(undo.txout)), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        unsigned int nDerived = nCode & 3;
+        nCode >>= 2;
+        undo.nHeight = nCode / 2;
+        undo.fCoinBase = nCode & 1;
+        if (undo.nHeight > 0)
+            ::Unserialize(s, VARINT(undo.nVersion), nType, nVersion);
+        if (nDerived) {
+            uint64_t nVal = 0;
+            ::Unserialize(s, VARINT(nVal), nType, nVersion);
+            undo.txout.nValue = CTxOutCompressor::DecompressAmount(nVal);
+            if (!DeriveScript(nDerived, scriptSig, undo.txout.scriptPubKey))
+                throw std::ios_base::failure("CTxInUndoCompressor : cannot derive scriptPubKey");
+        } else
+            ::Unserialize(s, REF(CTxOutCompressor(REF(undo.txout))), nType, nVersion);
+    }
+};
+
 /** Undo information for a CTransaction */
 class CTxUndo
 {
@@ -761,6 +831,8 @@ public:
     }
 
     uint256 BuildMerkleTree() const;
+    // Same, from transaction hashes that were already computed
+    uint256 BuildMerkleTree(const std::vector<uint256> &vTxHash) const;
 
     const uint256 &GetTxHash(unsigned int nIndex) const {
         assert(vMerkleTree.size() > 0); // BuildMerkleTree must have been called first
@@ -789,7 +861,9 @@ enum BlockStatus {
 
     BLOCK_FAILED_VALID       =   32, // stage after last reached validness failed
     BLOCK_FAILED_CHILD       =   64, // descends from failed block
-    BLOCK_FAILED_MASK        =   96
+    BLOCK_FAILED_MASK        =   96,
+
+    BLOCK_UNDO_COMPACT       =  128, // undo data is in the CBlockUndoCompressor format
 };
 
 FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly);
@@ -818,6 +892,9 @@ public:
     // pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
+    // pointer to the index of some further predecessor of this block
+    CBlockIndex* pskip;
+
     // pointer to the AuxPoW header, if this block has one
     boost::shared_ptr<CAuxPow> pauxpow;
 
@@ -843,10 +920,11 @@ public:
     uint256 nChainWork;
 
     // Number of transactions in this block.
-    // Note: in a potential headers-first mode, this number cannot be relied upon
+    // Note: 0 while only the header is known
     unsigned int nTx;
 
-    // (memory only) Number of transactions in the chain up to and including this block
+    // (memory only) Number of transactions in the chain up to and including this block.
+    // Only set once this block and all its ancestors have been received, 0 before
     unsigned int nChainTx; // change to 64-bit type when necessary; won't happen before 2030
 
     // Verification status of this block. See enum BlockStatus
@@ -869,6 +947,7 @@ public:
     {
         phashBlock = NULL;
         pprev = NULL;
+        pskip = NULL;
 	pauxpow.reset();
         nHeight = 0;
         nMoneySupply = 0;
@@ -945,7 +1024,8 @@ public:
     CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
-	if (IsAuxpow() && onFork())
+	// The auxpow is kept in the index, so header-only entries have it too
+	if (IsAuxpow() && onFork() && !pauxpow)
 	  {
 	    const CDiskBlockPos pos = GetBlockPos();
 	    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
@@ -1082,6 +1162,36 @@ public:
     static bool IsSuperMajorityVariant2(int minVersion, bool variant, const CBlockIndex* pstart,
 				       unsigned int nRequired, unsigned int nToCheck);
 
+    // Check whether this block index entry is valid up to the passed validity level.
+    bool IsValid(enum BlockStatus nUpTo = BLOCK_VALID_TRANSACTIONS) const
+    {
+        assert(!(nUpTo & ~BLOCK_VALID_MASK)); // Only validity flags allowed.
+        if (nStatus & BLOCK_FAILED_MASK)
+            return false;
+        return ((nStatus & BLOCK_VALID_MASK) >= nUpTo);
+    }
+
+    // Raise the validity level of this block index entry.
+    // Returns true if the validity was changed.
+    bool RaiseValidity(enum BlockStatus nUpTo)
+    {
+        assert(!(nUpTo & ~BLOCK_VALID_MASK)); // Only validity flags allowed.
+        if (nStatus & BLOCK_FAILED_MASK)
+            return false;
+        if ((nStatus & BLOCK_VALID_MASK) < nUpTo) {
+            nStatus = (nStatus & ~BLOCK_VALID_MASK) | nUpTo;
+            return true;
+        }
+        return false;
+    }
+
+    // Build the skiplist pointer for this entry.
+    void BuildSkip();
+
+    // Efficiently find an ancestor of this block.
+    CBlockIndex* GetAncestor(int height);
+    const CBlockIndex* GetAncestor(int height) const;
+
     std::string ToString() const
     {
         return strprintf("CBlockIndex(pprev=%p, nHeight=%d, merkle=%s, hashBlock=%s)",
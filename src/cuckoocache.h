@@ -0,0 +1,179 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_CUCKOOCACHE_H
+#define BITMARK_CUCKOOCACHE_H
+
+#include "uint256.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#include <boost/scoped_array.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Fixed-size set of 256-bit keys, such as salted digests.
+ *
+ * Each key may live in one of eight slots, picked by its own eight 32-bit
+ * words, so keys must be unpredictable to outsiders. A key that finds all its
+ * slots taken displaces another into one of that key's alternative slots,
+ * cuckoo-style; after a bounded number of moves the last displaced key is
+ * dropped. The table is allocated once and never grows.
+ *
+ * Lookups take no lock. Keys are stored as atomic words and every write is
+ * bracketed by a sequence counter, so a reader that overlapped a writer
+ * notices, retries, and eventually reports a miss. Writers are serialized by
+ * a mutex. Erasing only marks a slot as reusable; the key stays findable until
+ * it is overwritten.
+ */
+class CCuckooCache
+{
+private:
+    static const unsigned int KEY_WORDS = 4;
+    static const unsigned int KEY_SLOTS = 8;
+    static const unsigned int MAX_READ_TRIES = 4;
+
+    boost::scoped_array<std::atomic<uint64_t> > pWords; // KEY_WORDS per slot
+    boost::scoped_array<std::atomic<bool> > pCollectable; // slot may be overwritten
+    uint32_t nSlots;
+    unsigned int nMaxDepth;
+
+    // Odd while a writer is moving keys around
+    std::atomic<uint64_t> nSequence;
+    boost::mutex csWrite;
+
+    void GetSlots(const uint64_t *pKey, uint32_t *pSlots) const
+    {
+        uint32_t vWords[KEY_SLOTS];
+        memcpy(vWords, pKey, sizeof(vWords));
+        for (unsigned int i = 0; i < KEY_SLOTS; i++)
+            pSlots[i] = ((uint64_t)vWords[i] * nSlots) >> 32;
+    }
+
+    bool Matches(uint32_t nSlot, const uint64_t *pKey) const
+    {
+        for (unsigned int i = 0; i < KEY_WORDS; i++)
+            if (pWords[nSlot * KEY_WORDS + i].load(std::memory_order_relaxed) != pKey[i])
+                return false;
+        return true;
+    }
+
+    void Load(uint32_t nSlot, uint64_t *pKey) const
+    {
+        for (unsigned int i = 0; i < KEY_WORDS; i++)
+            pKey[i] = pWords[nSlot * KEY_WORDS + i].load(std::memory_order_relaxed);
+    }
+
+    void Store(uint32_t nSlot, const uint64_t *pKey)
+    {
+        for (unsigned int i = 0; i < KEY_WORDS; i++)
+            pWords[nSlot * KEY_WORDS + i].store(pKey[i], std::memory_order_relaxed);
+        pCollectable[nSlot].store(false, std::memory_order_relaxed);
+    }
+
+public:
+    CCuckooCache() : nSlots(0), nMaxDepth(0), nSequence(0) {}
+
+    /** Allocate room for about nBytes of keys, dropping any previous contents.
+     *  Not thread safe. Returns the number of slots. */
+    uint32_t Setup(size_t nBytes)
+    {
+        uint64_t nSlotsNew = nBytes / (32 + sizeof(std::atomic<bool>));
+        nSlots = nSlotsNew > 0xffffffffULL ? 0xffffffffU : (uint32_t)nSlotsNew;
+        pWords.reset(nSlots ? new std::atomic<uint64_t>[(size_t)nSlots * KEY_WORDS] : NULL);
+        pCollectable.reset(nSlots ? new std::atomic<bool>[nSlots] : NULL);
+        for (size_t i = 0; i < (size_t)nSlots * KEY_WORDS; i++)
+            pWords[i].store(0, std::memory_order_relaxed);
+        for (uint32_t i = 0; i < nSlots; i++)
+            pCollectable[i].store(true, std::memory_order_relaxed);
+        // Moves per insert grow with log2 of the table size
+        nMaxDepth = 1;
+        while (nMaxDepth < 32 && (1ULL << nMaxDepth) < nSlots)
+            nMaxDepth++;
+        nSequence.store(0);
+        return nSlots;
+    }
+
+    /** Whether key is in the set. With fErase, a found key's slot becomes reusable.
+     *  A slot that a concurrent writer just refilled may be marked too, which can
+     *  only cost a later miss. */
+    bool Contains(const uint256 &key, bool fErase)
+    {
+        if (nSlots == 0)
+            return false;
+        uint64_t vKey[KEY_WORDS];
+        memcpy(vKey, key.begin(), sizeof(vKey));
+        uint32_t vSlots[KEY_SLOTS];
+        GetSlots(vKey, vSlots);
+
+        for (unsigned int nTry = 0; nTry < MAX_READ_TRIES; nTry++) {
+            uint64_t nSeq = nSequence.load(std::memory_order_acquire);
+            if (nSeq & 1)
+                continue;
+            int nFound = -1;
+            for (unsigned int i = 0; i < KEY_SLOTS && nFound < 0; i++)
+                if (Matches(vSlots[i], vKey))
+                    nFound = vSlots[i];
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (nSequence.load(std::memory_order_relaxed) != nSeq)
+                continue;
+            if (nFound >= 0 && fErase)
+                pCollectable[nFound].store(true, std::memory_order_relaxed);
+            return nFound >= 0;
+        }
+        return false;
+    }
+
+    /** Add key, evicting another key if all slots it could move to are taken. */
+    void Insert(const uint256 &key)
+    {
+        if (nSlots == 0)
+            return;
+        boost::mutex::scoped_lock lock(csWrite);
+        uint64_t vKey[KEY_WORDS];
+        memcpy(vKey, key.begin(), sizeof(vKey));
+        uint32_t vSlots[KEY_SLOTS];
+        GetSlots(vKey, vSlots);
+        for (unsigned int i = 0; i < KEY_SLOTS; i++) {
+            if (Matches(vSlots[i], vKey)) {
+                pCollectable[vSlots[i]].store(false, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        uint64_t nSeq = nSequence.load(std::memory_order_relaxed);
+        nSequence.store(nSeq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        unsigned int nLast = KEY_SLOTS - 1;
+        for (unsigned int nDepth = 0; nDepth < nMaxDepth; nDepth++) {
+            for (unsigned int i = 0; i < KEY_SLOTS; i++) {
+                if (pCollectable[vSlots[i]].load(std::memory_order_relaxed)) {
+                    Store(vSlots[i], vKey);
+                    nSequence.store(nSeq + 2, std::memory_order_release);
+                    return;
+                }
+            }
+            // Swap with the key in the slot after the one we came from, then
+            // find somewhere for the displaced key
+            uint32_t nSlot = vSlots[(nLast + 1) % KEY_SLOTS];
+            uint64_t vDisplaced[KEY_WORDS];
+            Load(nSlot, vDisplaced);
+            Store(nSlot, vKey);
+            memcpy(vKey, vDisplaced, sizeof(vKey));
+            GetSlots(vKey, vSlots);
+            nLast = 0;
+            while (nLast < KEY_SLOTS - 1 && vSlots[nLast] != nSlot)
+                nLast++;
+        }
+        // The last displaced key is dropped
+        nSequence.store(nSeq + 2, std::memory_order_release);
+    }
+
+    uint32_t GetSlotCount() const { return nSlots; }
+};
+
+#endif // BITMARK_CUCKOOCACHE_H
@@ -1,4 +1,5 @@
 #include "hash.h"
+#include "portable_endian.h"
 #include "scrypt.h"
 #include "argon2.h"
 #include "hashx17.h"
@@ -6,6 +7,12 @@
 #include "cryptonight/crypto/hash-ops.h"
 #include "yescrypt/yescrypt.h"
 
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 uint32_t murmur3_32(const uint8_t* key, size_t len, uint32_t seed) {
   uint32_t h = seed;
   if (len > 3) {
@@ -49,18 +56,18 @@ inline uint32_t MROTL32 ( uint32_t x, int8_t r )
     return (x << r) | (x >> (32 - r));
 }
 
-unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash)
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pDataToHash, size_t nLen)
 {
     // The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
     uint32_t h1 = nHashSeed;
     const uint32_t c1 = 0xcc9e2d51;
     const uint32_t c2 = 0x1b873593;
 
-    const int nblocks = vDataToHash.size() / 4;
+    const int nblocks = nLen / 4;
 
     //----------
     // body
-    const uint32_t * blocks = (const uint32_t *)(&vDataToHash[0] + nblocks*4);
+    const uint32_t * blocks = (const uint32_t *)(pDataToHash + nblocks*4);
 
     for(int i = -nblocks; i; i++)
     {
@@ -77,11 +84,11 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
     //----------
     // tail
-    const uint8_t * tail = (const uint8_t*)(&vDataToHash[0] + nblocks*4);
+    const uint8_t * tail = (const uint8_t*)(pDataToHash + nblocks*4);
 
     uint32_t k1 = 0;
 
-    switch(vDataToHash.size() & 3)
+    switch(nLen & 3)
     {
     case 3: k1 ^= tail[2] << 16;
     case 2: k1 ^= tail[1] << 8;
@@ -91,7 +98,7 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
     //----------
     // finalization
-    h1 ^= vDataToHash.size();
+    h1 ^= nLen;
     h1 ^= h1 >> 16;
     h1 *= 0x85ebca6b;
     h1 ^= h1 >> 13;
@@ -101,6 +108,151 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
     return h1;
 }
 
+unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash)
+{
+    return MurmurHash3(nHashSeed, vDataToHash.empty() ? NULL : &vDataToHash[0], vDataToHash.size());
+}
+
+#if defined(__SSE2__)
+static inline __m128i MROTL32x4(__m128i x, int r)
+{
+    return _mm_or_si128(_mm_slli_epi32(x, r), _mm_srli_epi32(x, 32 - r));
+}
+
+// SSE2 has no 32 bit multiply; multiply the even and odd lanes as 64 bit and merge the low halves
+static inline __m128i MMUL32x4(__m128i x, __m128i c)
+{
+    __m128i even = _mm_mul_epu32(x, c);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(x, 32), _mm_srli_epi64(c, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
+
+void MurmurHash3Batch(const unsigned int* pSeeds, unsigned int nSeeds, const unsigned char* pDataToHash, size_t nLen, unsigned int* pHashes)
+{
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+
+    const int nblocks = nLen / 4;
+    const uint32_t * blocks = (const uint32_t *)(pDataToHash + nblocks*4);
+    const uint8_t * tail = (const uint8_t*)(pDataToHash + nblocks*4);
+
+    uint32_t k1tail = 0;
+    switch(nLen & 3)
+    {
+    case 3: k1tail ^= tail[2] << 16;
+    case 2: k1tail ^= tail[1] << 8;
+    case 1: k1tail ^= tail[0];
+            k1tail *= c1; k1tail = MROTL32(k1tail,15); k1tail *= c2;
+    };
+
+    unsigned int n = 0;
+#if defined(__SSE2__)
+    const __m128i m5 = _mm_set1_epi32(0xe6546b64);
+    const __m128i f1 = _mm_set1_epi32(0x85ebca6b);
+    const __m128i f2 = _mm_set1_epi32(0xc2b2ae35);
+    for (; n + 4 <= nSeeds; n += 4)
+    {
+        __m128i h1 = _mm_loadu_si128((const __m128i*)(pSeeds + n));
+        for(int i = -nblocks; i; i++)
+        {
+            uint32_t k1 = blocks[i];
+            k1 *= c1;
+            k1 = MROTL32(k1,15);
+            k1 *= c2;
+
+            h1 = _mm_xor_si128(h1, _mm_set1_epi32(k1));
+            h1 = MROTL32x4(h1, 13);
+            // h1*5+0xe6546b64
+            h1 = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(h1, 2), h1), m5);
+        }
+        h1 = _mm_xor_si128(h1, _mm_set1_epi32(k1tail));
+
+        h1 = _mm_xor_si128(h1, _mm_set1_epi32(nLen));
+        h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 16));
+        h1 = MMUL32x4(h1, f1);
+        h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 13));
+        h1 = MMUL32x4(h1, f2);
+        h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 16));
+        _mm_storeu_si128((__m128i*)(pHashes + n), h1);
+    }
+#endif
+
+    for (; n < nSeeds; n += 4)
+    {
+        unsigned int nLanes = std::min(nSeeds - n, 4U);
+        uint32_t h[4];
+        for (unsigned int j = 0; j < nLanes; j++)
+            h[j] = pSeeds[n + j];
+        for(int i = -nblocks; i; i++)
+        {
+            uint32_t k1 = blocks[i];
+            k1 *= c1;
+            k1 = MROTL32(k1,15);
+            k1 *= c2;
+
+            for (unsigned int j = 0; j < nLanes; j++)
+            {
+                h[j] ^= k1;
+                h[j] = MROTL32(h[j],13);
+                h[j] = h[j]*5+0xe6546b64;
+            }
+        }
+        for (unsigned int j = 0; j < nLanes; j++)
+        {
+            uint32_t h1 = h[j] ^ k1tail;
+            h1 ^= nLen;
+            h1 ^= h1 >> 16;
+            h1 *= 0x85ebca6b;
+            h1 ^= h1 >> 13;
+            h1 *= 0xc2b2ae35;
+            h1 ^= h1 >> 16;
+            pHashes[n + j] = h1;
+        }
+    }
+}
+
+#define SIPROUND do { \
+    v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0; \
+    v0 = (v0 << 32) | (v0 >> 32); \
+    v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2; \
+    v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0; \
+    v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2; \
+    v2 = (v2 << 32) | (v2 >> 32); \
+} while (0)
+
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
+{
+    // SipHash-2-4 of the 32 bytes of val, see https://131002.net/siphash/
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    const unsigned char *p = val.begin();
+    for (int i = 0; i < 4; i++) {
+        uint64_t d;
+        memcpy(&d, p + 8 * i, 8);
+        d = le64toh(d);
+        v3 ^= d;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= d;
+    }
+    v3 ^= ((uint64_t)32) << 56;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= ((uint64_t)32) << 56;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+
 int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len)
 {
     unsigned char key[128];
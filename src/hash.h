@@ -189,8 +189,18 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pDataToHash, size_t nLen);
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** MurmurHash3 of the same data under nSeeds seeds, into pHashes. The block
+ *  mixing doesn't depend on the seed, so it is done once per group of four
+ *  seeds, which are then hashed side by side (in SSE2 registers if available). */
+void MurmurHash3Batch(const unsigned int* pSeeds, unsigned int nSeeds, const unsigned char* pDataToHash, size_t nLen, unsigned int* pHashes);
+
+/** SipHash-2-4 of a 256-bit value with the 128-bit key (k0, k1). Used where
+ *  hashes of peer-supplied data need to be hard to collide on purpose. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 typedef struct
 {
     SHA512_CTX ctxInner;
@@ -104,8 +104,6 @@ bool ShutdownRequested()
     return fRequestShutdown;
 }
 
-static CCoinsViewDB *pcoinsdbview;
-
 void Shutdown()
 {
     LogPrintf("Shutdown : In progress...\n");
@@ -137,6 +135,8 @@ void Shutdown()
         delete pcoinsTip; pcoinsTip = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
+        delete ptxindexdb; ptxindexdb = NULL;
+        delete paddressindexdb; paddressindexdb = NULL;
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -194,7 +194,9 @@ std::string HelpMessage(HelpMessageMode hmm)
     string strUsage = _("Options:") + "\n";
     strUsage += "  -?                     " + _("This help message") + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
+    strUsage += "  -assumevalid=<hex>     " + strprintf(_("If this block is in the chain assume that it and its ancestors are valid and skip their script verification (0 to verify all, default: %s)"), Params().DefaultAssumeValid().GetHex()) + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
+    strUsage += "  -blockcache=<n>        " + strprintf(_("Keep up to <n> megabytes of recently used blocks in memory (0 to disable, default: %u)"), DEFAULT_BLOCK_CACHE_SIZE) + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification of -checkblocks is (0-4, default: 3)") + "\n";
     strUsage += "  -conf=<file>           " + _("Specify configuration file (default: bitmark.conf)") + "\n";
@@ -204,15 +206,20 @@ std::string HelpMessage(HelpMessageMode hmm)
         strUsage += "  -daemon                " + _("Run in the background as a daemon and accept commands") + "\n";
 #endif
     }
+    strUsage += "  -addressindex          " + _("Maintain an index of the transactions and unspent outputs of every address, built in the background (default: 0)") + "\n";
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
+    strUsage += "  -dbcompression         " + strprintf(_("Compress newly written block index and chainstate database tables (default: %u)"), DEFAULT_DB_COMPRESSION) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
-    strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -loadutxosnapshot=<file> " + _("Start from a UTXO set snapshot written by dumptxoutset if the block chain is empty; the history below it is downloaded and checked in the background") + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -prune=<n>             " + strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode disables wallet rescans and is incompatible with -txindex and -addressindex. "
+            "Warning: Reverting this setting requires re-downloading the entire blockchain. "
+            "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024) + "\n";
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: bitmarkd.pid)") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
-    strUsage += "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n";
+    strUsage += "  -txindex               " + _("Maintain a full transaction index, built in the background (default: 0)") + "\n";
 
     strUsage += "\n" + _("Connection options:") + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
@@ -225,8 +232,10 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -dnsseed               " + _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)") + "\n";
     strUsage += "  -forcednsseed          " + _("Always query for peer addresses via DNS lookup (default: 0)") + "\n";
     strUsage += "  -externalip=<ip>       " + _("Specify your own public address") + "\n";
+    strUsage += "  -fastblockrelay        " + strprintf(_("Relay new blocks to peers that asked for compact blocks before checking their scripts (default: %u)"), DEFAULT_FASTBLOCKRELAY) + "\n";
     strUsage += "  -listen                " + _("Accept connections from outside (default: 1 if no -proxy or -connect)") + "\n";
     strUsage += "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n";
+    strUsage += "  -msghandlerthreads=<n> " + strprintf(_("Process peer messages on <n> threads (up to %d, 0 = one per core up to 4, default: %d)"), MAX_MSGHANDLER_THREADS, DEFAULT_MSGHANDLER_THREADS) + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
     strUsage += "  -onion=<ip:port>       " + _("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: -proxy)") + "\n";
@@ -234,6 +243,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -port=<port>           " + _("Listen for connections on <port> (default: 9265 or testnet: 19265)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS proxy") + "\n";
     strUsage += "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n";
+    strUsage += "  -socketevents=<mode>   " + _("Wait for socket readiness with 'epoll' or 'select' (default: epoll where supported)") + "\n";
     strUsage += "  -socks=<n>             " + _("Select SOCKS version for -proxy (4 or 5, default: 5)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
 #ifdef USE_UPNP
@@ -273,7 +283,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -debug=<category>      " + _("Output debugging information (default: 0, supplying <category> is optional)") + "\n";
     strUsage += "                         " + _("If <category> is not supplied, output all debugging information.") + "\n";
     strUsage += "                         " + _("<category> can be:");
-    strUsage +=                                 " addrman, alert, coindb, db, lock, rand, rpc, selectcoins, mempool, net"; // Don't translate these and qt below
+    strUsage +=                                 " addrman, alert, coindb, db, lock, rand, rpc, selectcoins, mempool, net, prune"; // Don't translate these and qt below
     if (hmm == HMM_BITMARK_QT)
         strUsage += ", qt";
     strUsage += ".\n";
@@ -285,8 +295,12 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -logtimestamps         " + _("Prepend debug output with timestamp (default: 1)") + "\n";
     if (GetBoolArg("-help-debug", false))
     {
+        strUsage += "  -limitancestorcount=<n> " + strprintf(_("Do not accept transactions with more than <n> unconfirmed ancestors, themselves included (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+        strUsage += "  -limitancestorsize=<n> " + strprintf(_("Do not accept transactions whose unconfirmed ancestors, themselves included, exceed <n> kilobytes (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+        strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions that would give an unconfirmed transaction more than <n> descendants, itself included (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+        strUsage += "  -limitdescendantsize=<n> " + strprintf(_("Do not accept transactions that would make the descendants of an unconfirmed transaction, itself included, exceed <n> kilobytes (default: %u)"), DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
         strUsage += "  -limitfreerelay=<n>    " + _("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:15)") + "\n";
-        strUsage += "  -maxsigcachesize=<n>   " + _("Limit size of signature cache to <n> entries (default: 50000)") + "\n";
+        strUsage += "  -sigcachesize=<n>      " + strprintf(_("Limit size of signature cache to <n> MiB (default: %d, maximum: %d)"), DEFAULT_SIG_CACHE_SIZE, MAX_SIG_CACHE_SIZE) + "\n";
     }
     strUsage += "  -mintxfee=<amt>        " + _("Fees smaller than this are considered zero fee (for transaction creation) (default:") + " " + FormatMoney(CTransaction::nMinTxFee) + ")" + "\n";
     strUsage += "  -minrelaytxfee=<amt>   " + _("Fees smaller than this are considered zero fee (for relaying) (default:") + " " + FormatMoney(CTransaction::nMinRelayTxFee) + ")" + "\n";
@@ -517,10 +531,38 @@ bool AppInit2(boost::thread_group& threadGroup)
             LogPrintf("AppInit2 : parameter interaction: -zapwallettxes=1 -> setting -rescan=1\n");
     }
 
+    // -prune drops the block data needed to serve the full chain and to build a transaction index
+    if (GetArg("-prune", 0)) {
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("Prune mode is incompatible with -txindex."));
+        if (GetBoolArg("-addressindex", false))
+            return InitError(_("Prune mode is incompatible with -addressindex."));
+#ifdef ENABLE_WALLET
+        if (GetBoolArg("-rescan", false))
+            return InitError(_("Rescans are not possible in pruned mode. You will need to use -reindex which will download the whole blockchain again."));
+#endif
+    }
+
+    // A snapshot has no history to build the indexes from, and -reindex would replace it
+    if (mapArgs.count("-loadutxosnapshot")) {
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("-loadutxosnapshot is incompatible with -txindex."));
+        if (GetBoolArg("-addressindex", false))
+            return InitError(_("-loadutxosnapshot is incompatible with -addressindex."));
+        if (GetBoolArg("-reindex", false))
+            return InitError(_("-loadutxosnapshot is incompatible with -reindex."));
+    }
+
+    std::string strSocketEvents = GetArg("-socketevents", "epoll");
+    if (!InitSocketEvents(strSocketEvents))
+        return InitError(strprintf(_("Unknown -socketevents mode: '%s'"), strSocketEvents));
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    if (SocketEventsUseSelect())
+        nMaxConnections = std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS));
+    nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -539,10 +581,43 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (GetBoolArg("-debugnet", false))
         InitWarning(_("Warning: Deprecated argument -debugnet ignored, use -debug=net"));
 
+    // -maxsigcachesize (deprecated) counted cache entries; map it onto -sigcachesize, which is in MiB
+    if (mapArgs.count("-maxsigcachesize")) {
+        int64_t nEntries = std::max((int64_t)0, GetArg("-maxsigcachesize", 0));
+        int64_t nMiB = nEntries ? std::min(nEntries / ((1 << 20) / (32 + 1)) + 1, MAX_SIG_CACHE_SIZE) : 0; // 33 bytes per slot
+        if (SoftSetArg("-sigcachesize", strprintf("%d", nMiB)))
+            InitWarning(strprintf(_("Warning: Deprecated argument -maxsigcachesize=<entries> translated to -sigcachesize=%d (MiB)"), nMiB));
+        else
+            InitWarning(_("Warning: Deprecated argument -maxsigcachesize ignored, -sigcachesize takes precedence"));
+    }
+    if (GetArg("-sigcachesize", DEFAULT_SIG_CACHE_SIZE) > MAX_SIG_CACHE_SIZE)
+        InitWarning(strprintf(_("Warning: -sigcachesize is limited to %d MiB"), MAX_SIG_CACHE_SIZE));
+
+    // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
+    int64_t nSignedPruneTarget = GetArg("-prune", 0) * 1024 * 1024;
+    if (nSignedPruneTarget < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    nPruneTarget = (uint64_t) nSignedPruneTarget;
+    if (nPruneTarget) {
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES)
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB.  Please use a higher number."), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
+        LogPrintf("Prune configured to target %uMiB on disk for block and undo files.\n", nPruneTarget / 1024 / 1024);
+        fPruneMode = true;
+        // A pruned node can't serve historical blocks, so stop advertising that it can
+        nLocalServices &= ~NODE_NETWORK;
+    }
+
     fBenchmark = GetBoolArg("-benchmark", false);
+    fFastBlockRelay = GetBoolArg("-fastblockrelay", DEFAULT_FASTBLOCKRELAY);
     mempool.setSanityCheck(GetBoolArg("-checkmempool", RegTest()));
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
 
+    hashAssumeValid = uint256(GetArg("-assumevalid", Params().DefaultAssumeValid().GetHex()));
+    if (hashAssumeValid != 0)
+        LogPrintf("Assuming ancestors of block %s have valid signatures.\n", hashAssumeValid.GetHex());
+    else
+        LogPrintf("Validating signatures for all blocks.\n");
+
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
     if (nScriptCheckThreads <= 0)
@@ -552,6 +627,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // -msghandlerthreads=0 means one per core, up to 4
+    nMessageHandlerThreads = GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads = std::min(4, (int)boost::thread::hardware_concurrency());
+    nMessageHandlerThreads = std::max(1, std::min(nMessageHandlerThreads, MAX_MSGHANDLER_THREADS));
+
     fServer = GetBoolArg("-server", false);
     fPrintToConsole = GetBoolArg("-printtoconsole", false);
     fLogTimestamps = GetBoolArg("-logtimestamps", true);
@@ -829,12 +910,28 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nTotalCache > (nMaxDbCache << 20))
         nTotalCache = (nMaxDbCache << 20); // total cache cannot be greater than nMaxDbCache
     size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
+    if (nBlockTreeDBCache > (1 << 21))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
+    bool fTxIndex = GetBoolArg("-txindex", false);
+    bool fAddressIndex = GetBoolArg("-addressindex", false);
+    size_t nIndexDBCache = 0;
+    if (fTxIndex || fAddressIndex) {
+        nIndexDBCache = nTotalCache / 8; // shared by the optional indexes
+        nTotalCache -= nIndexDBCache;
+        if (fTxIndex && fAddressIndex)
+            nIndexDBCache /= 2;
+    }
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    blockcache.SetMaxBytes((size_t)std::max((int64_t)0, GetArg("-blockcache", DEFAULT_BLOCK_CACHE_SIZE)) << 20);
+    // Existing tables are rewritten in the new format as LevelDB compacts them
+    bool fDBCompression = GetBoolArg("-dbcompression", DEFAULT_DB_COMPRESSION);
+#ifndef USE_SNAPPY
+    if (fDBCompression)
+        LogPrintf("Warning: -dbcompression has no effect, this build has no Snappy support\n");
+#endif
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -850,10 +947,16 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pcoinsTip;
                 delete pcoinsdbview;
                 delete pblocktree;
+                delete ptxindexdb; ptxindexdb = NULL;
+                delete paddressindexdb; paddressindexdb = NULL;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, fDBCompression);
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex, fDBCompression);
                 pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                if (fTxIndex)
+                    ptxindexdb = new CTxIndexDB(nIndexDBCache, false, fReindex);
+                if (fAddressIndex)
+                    paddressindexdb = new CAddressIndexDB(nIndexDBCache, false, fReindex);
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -873,10 +976,13 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
-                // Check for changed -txindex state
-                if (fTxIndex != GetBoolArg("-txindex", false)) {
-                    strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
-                    break;
+                if (mapArgs.count("-loadutxosnapshot")) {
+                    if (chainActive.Height() == 0) {
+                        uiInterface.InitMessage(_("Loading UTXO snapshot..."));
+                        if (!LoadUTXOSnapshot(GetArg("-loadutxosnapshot", "")))
+                            return InitError(_("Error loading UTXO snapshot, see debug.log for details"));
+                    } else
+                        LogPrintf("Block chain is not empty, ignoring -loadutxosnapshot\n");
                 }
 
                 uiInterface.InitMessage(_("Verifying blocks..."));
@@ -1050,6 +1156,17 @@ bool AppInit2(boost::thread_group& threadGroup)
         }
         if (chainActive.Tip() && chainActive.Tip() != pindexRescan)
         {
+            // We can't rescan beyond non-pruned blocks, stop and throw an error
+            if (fHavePruned)
+            {
+                CBlockIndex *block = chainActive.Tip();
+                while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA) && block->pprev->nTx > 0 && pindexRescan != block)
+                    block = block->pprev;
+
+                if (pindexRescan != block)
+                    return InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole blockchain again in case of pruned node)"));
+            }
+
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
@@ -1077,6 +1194,18 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
+    if (InitSnapshotValidation()) {
+        // The history below the snapshot can't be served until it has been downloaded
+        nLocalServices &= ~NODE_NETWORK;
+        threadGroup.create_thread(&ThreadValidateSnapshot);
+    }
+
+    // The optional indexes catch up with the chain in the background
+    if (ptxindexdb)
+        threadGroup.create_thread(boost::bind(&ThreadSyncIndex, ptxindexdb));
+    if (paddressindexdb)
+        threadGroup.create_thread(boost::bind(&ThreadSyncIndex, paddressindexdb));
+
     // ********************************************************* Step 10: load peers
 
     uiInterface.InitMessage(_("Loading addresses..."));
@@ -668,6 +668,10 @@ bool CKey::Load(CPrivKey &privkey, CPubKey &vchPubKey, bool fSkipCheck=false) {
 }
 
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    return Verify(hash, vchSig.empty() ? NULL : &vchSig[0], vchSig.size());
+}
+
+bool CPubKey::Verify(const uint256 &hash, const unsigned char *pchSig, size_t nSigLen) const {
     if (!IsValid())
         return false;
     /*CECKey key;
@@ -684,7 +688,7 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
     if (!secp256k1_ec_pubkey_parse(secp256k1_context_static, &pubkey, vch, size())) {
         return false;
     }
-    if (!ecdsa_signature_parse_der_lax(&sig, vchSig.data(), vchSig.size())) {
+    if (!ecdsa_signature_parse_der_lax(&sig, pchSig, nSigLen)) {
         return false;
     }
     /* libsecp256k1's ECDSA verification requires lower-S signatures, which have
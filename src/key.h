@@ -156,6 +156,7 @@ public:
     // Verify a DER signature (~72 bytes).
     // If this public key is not fully valid, the return value will be false.
     bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
+    bool Verify(const uint256 &hash, const unsigned char *pchSig, size_t nSigLen) const;
 
     // Verify a compact signature (~65 bytes).
     // See CKey::SignCompact.
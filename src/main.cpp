@@ -8,6 +8,7 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -25,6 +26,8 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/tss.hpp>
 
 using namespace std;
 using namespace boost;
@@ -38,18 +41,30 @@ using namespace boost;
 //
 
 CTxMemPool mempool;
+CBlockCache blockcache(DEFAULT_BLOCK_CACHE_SIZE << 20);
 
 map<uint256, CBlockIndex*> mapBlockIndex;
 CChain chainMostWork;
+CBlockIndex *pindexBestHeader = NULL;
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 int64_t nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
-bool fTxIndex = false;
+bool fPruneMode = false;
+bool fHavePruned = false;
+bool fFastBlockRelay = DEFAULT_FASTBLOCKRELAY;
+uint64_t nPruneTarget = 0;
 unsigned int nCoinCacheSize = 5000;
+uint256 hashAssumeValid;
+boost::condition_variable cvBlockChange;
+boost::mutex csBlockChange;
+uint256 hashBlockChangeTip;
 static const int64_t v2checkpoint = 230000;
+// LevelDB cache of the scratch chain state used to validate a UTXO snapshot
+static const size_t nSnapshotValidationDBCache = 8 << 20;
 
 /** The term "satoshi" is kept in homage to entity who gave the block chain to the world */
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -57,20 +72,11 @@ int64_t CTransaction::nMinTxFee = 10000;  // Override with -mintxfee
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying and mining) */
 int64_t CTransaction::nMinRelayTxFee = 1000;
 
-struct COrphanBlock {
-    uint256 hashBlock;
-    uint256 hashPrev;
-    vector<unsigned char> vchBlock;
-};
-map<uint256, COrphanBlock*> mapOrphanBlocks;
-multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
-
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+mapOrphanTx_t mapOrphanTransactions;
+mapOrphanTxByPrev_t mapOrphanTransactionsByPrev;
+// Bytes of orphan transactions kept from each peer that has any, and in total
+map<NodeId, unsigned int> mapOrphanBytesByPeer;
+unsigned int nOrphanBytes = 0;
 void EraseOrphansFor(NodeId peer);
 
 // Constant stuff for coinbase transactions we create:
@@ -102,12 +108,18 @@ namespace {
     };
 
     CBlockIndex *pindexBestInvalid;
-    // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
+    // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS and whose
+    // ancestors were all received, and must contain those who aren't failed
     set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
+    // Blocks whose data was received before that of one of their ancestors, keyed
+    // by their parent. Linked into setBlockIndexValid once the gap is filled.
+    multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
 
     CCriticalSection cs_LastBlockFile;
     CBlockFileInfo infoLastBlockFile;
     int nLastBlockFile = 0;
+    // Set when block or undo files grew, so WriteChainState re-evaluates pruning. Protected by cs_LastBlockFile.
+    bool fCheckForPruning = false;
 
     // Every received block is assigned a unique and increasing identifier, so we
     // know which one to give priority in case of a fork.
@@ -119,15 +131,25 @@ namespace {
     // them, if processing happens afterwards. Protected by cs_main.
     map<uint256, NodeId> mapBlockSource;
 
-    // Blocks that are in flight, and that are in the queue to be downloaded.
-    // Protected by cs_main.
+    // Blocks that are in flight. Protected by cs_main.
     struct QueuedBlock {
         uint256 hash;
+        CBlockIndex *pindex;  // Optional, NULL for blocks requested before their header arrived.
         int64_t nTime;  // Time of "getdata" request in microseconds.
         int nQueuedBefore;  // Number of blocks in flight at the time of request.
+        boost::shared_ptr<CPartialBlock> partialBlock;  // Set while waiting for a blocktxn to complete a compact block.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
-    map<uint256, pair<NodeId, list<uint256>::iterator> > mapBlocksToDownload;
+
+    // Number of peers from which we are fetching headers. Protected by cs_main.
+    int nSyncStarted = 0;
+
+    // Pending background validation of an imported UTXO snapshot: its header,
+    // the chain from genesis up to its block (empty when nothing is pending)
+    // and the height up to which history has been replayed. Protected by cs_main.
+    CCoinsSnapshotHeader snapshotValidation;
+    vector<CBlockIndex*> vSnapshotChain;
+    int nSnapshotValidatedHeight = 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -211,20 +233,36 @@ struct CNodeState {
     std::string name;
     // List of asynchronously-determined block rejections to notify this peer about.
     std::vector<CBlockReject> rejects;
+    // The best known block we know this peer has announced.
+    CBlockIndex *pindexBestKnownBlock;
+    // The hash of the last unknown block this peer has announced.
+    uint256 hashLastUnknownBlock;
+    // The last full block we both have.
+    CBlockIndex *pindexLastCommonBlock;
+    // Whether we've started headers synchronization with this peer.
+    bool fSyncStarted;
+    // Since when we're stalling block download progress (in microseconds), or 0.
+    int64_t nStallingSince;
+    // Whether this peer wants new blocks announced as a cmpctblock rather than an inv.
+    bool fPreferHeaderAndIDs;
+    // Whether this peer can answer getdata for MSG_CMPCT_BLOCK and getblocktxn.
+    bool fProvidesHeaderAndIDs;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
-    list<uint256> vBlocksToDownload;
-    int nBlocksToDownload;
     int64_t nLastBlockReceive;
-    int64_t nLastBlockProcess;
 
     CNodeState() {
         nMisbehavior = 0;
         fShouldBan = false;
-        nBlocksToDownload = 0;
+        pindexBestKnownBlock = NULL;
+        hashLastUnknownBlock = 0;
+        pindexLastCommonBlock = NULL;
+        fSyncStarted = false;
+        nStallingSince = 0;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
         nBlocksInFlight = 0;
         nLastBlockReceive = 0;
-        nLastBlockProcess = 0;
     }
 };
 
@@ -255,10 +293,11 @@ void FinalizeNode(NodeId nodeid) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
 
+    if (state->fSyncStarted)
+        nSyncStarted--;
+
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
-    BOOST_FOREACH(const uint256& hash, state->vBlocksToDownload)
-        mapBlocksToDownload.erase(hash);
 
     EraseOrphansFor(nodeid);
     mapNodeState.erase(nodeid);
@@ -266,19 +305,12 @@ void FinalizeNode(NodeId nodeid) {
   
 // Requires cs_main.
 void MarkBlockAsReceived(const uint256 &hash, NodeId nodeFrom = -1) {
-    map<uint256, pair<NodeId, list<uint256>::iterator> >::iterator itToDownload = mapBlocksToDownload.find(hash);
-    if (itToDownload != mapBlocksToDownload.end()) {
-        CNodeState *state = State(itToDownload->second.first);
-        state->vBlocksToDownload.erase(itToDownload->second.second);
-        state->nBlocksToDownload--;
-        mapBlocksToDownload.erase(itToDownload);
-    }
-
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
+        state->nStallingSince = 0;
         if (itInFlight->second.first == nodeFrom)
             state->nLastBlockReceive = GetTimeMicros();
         mapBlocksInFlight.erase(itInFlight);
@@ -287,31 +319,14 @@ void MarkBlockAsReceived(const uint256 &hash, NodeId nodeFrom = -1) {
 }
 
 // Requires cs_main.
-bool AddBlockToQueue(NodeId nodeid, const uint256 &hash) {
-    if (mapBlocksToDownload.count(hash) || mapBlocksInFlight.count(hash))
-        return false;
-
-    CNodeState *state = State(nodeid);
-    if (state == NULL)
-        return false;
-
-    list<uint256>::iterator it = state->vBlocksToDownload.insert(state->vBlocksToDownload.end(), hash);
-    state->nBlocksToDownload++;
-    if (state->nBlocksToDownload > 5000)
-        Misbehaving(nodeid, 10);
-    mapBlocksToDownload[hash] = std::make_pair(nodeid, it);
-    return true;
-}
-
-// Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256 &hash) {
+void MarkBlockAsInFlight(NodeId nodeid, const uint256 &hash, CBlockIndex *pindex = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    QueuedBlock newentry = {hash, GetTimeMicros(), state->nBlocksInFlight};
+    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), state->nBlocksInFlight, boost::shared_ptr<CPartialBlock>()};
     if (state->nBlocksInFlight == 0)
         state->nLastBlockReceive = newentry.nTime; // Reset when a first request is sent.
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
@@ -319,6 +334,165 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256 &hash) {
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+// Check whether the last unknown block a peer advertized is not yet known. Requires cs_main.
+void ProcessBlockAvailability(NodeId nodeid) {
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+
+    if (state->hashLastUnknownBlock != 0) {
+        map<uint256, CBlockIndex*>::iterator itOld = mapBlockIndex.find(state->hashLastUnknownBlock);
+        if (itOld != mapBlockIndex.end() && itOld->second->nChainWork > 0) {
+            if (state->pindexBestKnownBlock == NULL || itOld->second->nChainWork >= state->pindexBestKnownBlock->nChainWork)
+                state->pindexBestKnownBlock = itOld->second;
+            state->hashLastUnknownBlock = 0;
+        }
+    }
+}
+
+// Update tracking information about which blocks a peer is assumed to have. Requires cs_main.
+void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+
+    ProcessBlockAvailability(nodeid);
+
+    map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hash);
+    if (it != mapBlockIndex.end() && it->second->nChainWork > 0) {
+        // An actually better block was announced.
+        if (state->pindexBestKnownBlock == NULL || it->second->nChainWork >= state->pindexBestKnownBlock->nChainWork)
+            state->pindexBestKnownBlock = it->second;
+    } else {
+        // An unknown block was announced; just assume that the latest one is the best one.
+        state->hashLastUnknownBlock = hash;
+    }
+}
+
+// Find the last common ancestor two blocks have.
+// Both pa and pb must be non-NULL.
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
+    if (pa->nHeight > pb->nHeight) {
+        pa = pa->GetAncestor(pb->nHeight);
+    } else if (pb->nHeight > pa->nHeight) {
+        pb = pb->GetAncestor(pa->nHeight);
+    }
+
+    while (pa != pb && pa && pb) {
+        pa = pa->pprev;
+        pb = pb->pprev;
+    }
+
+    // Eventually all chain branches meet at the genesis block.
+    assert(pa == pb);
+    return pa;
+}
+
+// Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
+// at most count entries. Blocks are fetched at most BLOCK_DOWNLOAD_WINDOW ahead of the last block
+// we have in common with the peer; if that window is blocked by a block in flight from another
+// peer, that peer is returned in nodeStaller. Requires cs_main.
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+    if (count == 0)
+        return;
+
+    vBlocks.reserve(vBlocks.size() + count);
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+
+    // Make sure pindexBestKnownBlock is up to date, we'll need it.
+    ProcessBlockAvailability(nodeid);
+
+    if (state->pindexBestKnownBlock == NULL || state->pindexBestKnownBlock->nChainWork < chainActive.Tip()->nChainWork) {
+        // This peer has nothing interesting.
+        return;
+    }
+
+    if (state->pindexLastCommonBlock == NULL) {
+        // Bootstrap quickly by guessing a parent of our best tip is the forking point.
+        // Guessing wrong in either direction is not a problem.
+        state->pindexLastCommonBlock = chainActive[std::min(state->pindexBestKnownBlock->nHeight, chainActive.Height())];
+    }
+
+    // If the peer reorganized, our previous pindexLastCommonBlock may not be an ancestor
+    // of its current tip anymore. Go back enough to fix that.
+    state->pindexLastCommonBlock = LastCommonAncestor(state->pindexLastCommonBlock, state->pindexBestKnownBlock);
+    if (state->pindexLastCommonBlock == state->pindexBestKnownBlock)
+        return;
+
+    std::vector<CBlockIndex*> vToFetch;
+    CBlockIndex *pindexWalk = state->pindexLastCommonBlock;
+    // Never fetch further than the best block we know the peer has, or more than BLOCK_DOWNLOAD_WINDOW + 1 beyond the last
+    // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
+    // download that next block if the window were 1 larger.
+    int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
+    NodeId waitingfor = -1;
+    while (pindexWalk->nHeight < nMaxHeight) {
+        // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
+        // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
+        // as iterating over ~100 CBlockIndex* entries anyway.
+        int nToFetch = std::min(nMaxHeight - pindexWalk->nHeight, std::max<int>(count - vBlocks.size(), 128));
+        vToFetch.resize(nToFetch);
+        pindexWalk = state->pindexBestKnownBlock->GetAncestor(pindexWalk->nHeight + nToFetch);
+        vToFetch[nToFetch - 1] = pindexWalk;
+        for (unsigned int i = nToFetch - 1; i > 0; i--) {
+            vToFetch[i - 1] = vToFetch[i]->pprev;
+        }
+
+        // Iterate over those blocks in vToFetch (in forward direction), adding the ones that
+        // are not yet downloaded and not in flight to vBlocks. In the meantime, update
+        // pindexLastCommonBlock as long as all ancestors are already downloaded, or
+        // connected and pruned since.
+        BOOST_FOREACH(CBlockIndex* pindex, vToFetch) {
+            if (!pindex->IsValid(BLOCK_VALID_TREE)) {
+                // We consider the chain that this peer is on invalid.
+                return;
+            }
+            if ((pindex->nStatus & BLOCK_HAVE_DATA) || chainActive.Contains(pindex)) {
+                if (pindex->nChainTx)
+                    state->pindexLastCommonBlock = pindex;
+            } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
+                // The block is not already downloaded, and not yet in flight.
+                if (pindex->nHeight > nWindowEnd) {
+                    // We reached the end of the window.
+                    if (vBlocks.size() == 0 && waitingfor != nodeid) {
+                        // We aren't able to fetch anything, but we would be if the download window was one larger.
+                        nodeStaller = waitingfor;
+                    }
+                    return;
+                }
+                vBlocks.push_back(pindex);
+                if (vBlocks.size() == count) {
+                    return;
+                }
+            } else if (waitingfor == -1) {
+                // This is the first already-in-flight block.
+                waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+            }
+        }
+    }
+}
+
+// Requires cs_main.
+bool IsSnapshotBlock(const CBlockIndex *pindex) {
+    return pindex->nHeight < (int)vSnapshotChain.size() && vSnapshotChain[pindex->nHeight] == pindex;
+}
+
+// Find blocks below an imported UTXO snapshot that its validation still needs and
+// that aren't in flight, never more than SNAPSHOT_DOWNLOAD_WINDOW ahead of it.
+// Adds at most count of them to vBlocks. Requires cs_main.
+void FindSnapshotBlocksToDownload(unsigned int count, std::vector<CBlockIndex*>& vBlocks) {
+    if (vSnapshotChain.empty())
+        return;
+    int nMaxHeight = std::min((int)vSnapshotChain.size() - 1, nSnapshotValidatedHeight + SNAPSHOT_DOWNLOAD_WINDOW);
+    for (int nHeight = nSnapshotValidatedHeight + 1; nHeight <= nMaxHeight && count > 0; nHeight++) {
+        CBlockIndex *pindex = vSnapshotChain[nHeight];
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) && !mapBlocksInFlight.count(pindex->GetBlockHash())) {
+            vBlocks.push_back(pindex);
+            count--;
+        }
+    }
+}
+
 }
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
@@ -327,6 +501,12 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     if (state == NULL)
         return false;
     stats.nMisbehavior = state->nMisbehavior;
+    stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
+    stats.nCommonHeight = state->pindexLastCommonBlock ? state->pindexLastCommonBlock->nHeight : -1;
+    BOOST_FOREACH(const QueuedBlock& queue, state->vBlocksInFlight) {
+        if (queue.pindex)
+            stats.vHeightInFlight.push_back(queue.pindex->nHeight);
+    }
     return true;
 }
 
@@ -409,6 +589,8 @@ CBlockIndex *CChain::FindFork(const CBlockLocator &locator) const {
 }
 
 CBlockTreeDB *pblocktree = NULL;
+CTxIndexDB *ptxindexdb = NULL;
+CAddressIndexDB *paddressindexdb = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -426,66 +608,114 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000)
+    if (sz > MAX_ORPHAN_TX_SIZE)
     {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    // Each peer only gets a share of the pool, so one can't push out
+    // everybody else's orphans with its own
+    map<NodeId, unsigned int>::iterator itPeer = mapOrphanBytesByPeer.find(peer);
+    if (itPeer != mapOrphanBytesByPeer.end() && itPeer->second + sz > MAX_ORPHAN_PEER_SIZE)
+    {
+        LogPrint("mempool", "ignoring orphan tx %s, peer=%d already has %u bytes of orphans\n", hash.ToString(), peer, itPeer->second);
+        return false;
+    }
+
+    mapOrphanTx_t::iterator it = mapOrphanTransactions.insert(make_pair(hash, COrphanTx())).first;
+    COrphanTx& orphan = it->second;
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = sz;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(it);
+    mapOrphanBytesByPeer[peer] += sz;
+    nOrphanBytes += sz;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-    		mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u bytes %u)\n", hash.ToString(),
+    		mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanBytes);
     return true;
 }
 
 void static EraseOrphanTx(uint256 hash)
 {
-    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    mapOrphanTx_t::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
     BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
     {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        mapOrphanTxByPrev_t::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
-        itPrev->second.erase(hash);
+        itPrev->second.erase(it);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+
+    map<NodeId, unsigned int>::iterator itPeer = mapOrphanBytesByPeer.find(it->second.fromPeer);
+    assert(itPeer != mapOrphanBytesByPeer.end() && itPeer->second >= it->second.nTxSize);
+    itPeer->second -= it->second.nTxSize;
+    if (itPeer->second == 0)
+        mapOrphanBytesByPeer.erase(itPeer);
+    nOrphanBytes -= it->second.nTxSize;
+
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
+    // Most peers never send us an orphan
+    if (!mapOrphanBytesByPeer.count(peer))
+        return;
+
     int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+    mapOrphanTx_t::iterator iter = mapOrphanTransactions.begin();
     while (iter != mapOrphanTransactions.end())
     {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
+        mapOrphanTx_t::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
         if (maybeErase->second.fromPeer == peer)
         {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
+            EraseOrphanTx(maybeErase->first);
             ++nErased;
         }
     }
+    assert(!mapOrphanBytesByPeer.count(peer));
     if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, unsigned int nMaxBytes)
 {
+    // Orphans whose inputs didn't show up in time won't be resolved anymore
+    static int64_t nNextSweep = 0;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow)
+    {
+        int nErased = 0;
+        int64_t nMinExpireTime = nNow + ORPHAN_TX_EXPIRE_TIME;
+        mapOrphanTx_t::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end())
+        {
+            mapOrphanTx_t::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphanTx(maybeErase->first);
+                ++nErased;
+            } else
+                nMinExpireTime = std::min(maybeErase->second.nTimeExpire, nMinExpireTime);
+        }
+        // Sweep again when the next one expires, but not too often
+        nNextSweep = std::max(nMinExpireTime, nNow + ORPHAN_TX_EXPIRE_INTERVAL);
+        if (nErased > 0) LogPrint("mempool", "Erased %d expired orphan tx\n", nErased);
+    }
+
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanBytes > nMaxBytes)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
+        mapOrphanTx_t::iterator it = mapOrphanTransactions.lower_bound(randomhash);
         if (it == mapOrphanTransactions.end())
             it = mapOrphanTransactions.begin();
         EraseOrphanTx(it->first);
@@ -961,6 +1191,21 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                          hash.ToString(),
                          nFees, CTransaction::nMinRelayTxFee * 10000);
 
+        // Keep chains of unconfirmed transactions short; adding to and
+        // removing from the pool and building block templates walk them
+        {
+        LOCK(pool.cs);
+        string errString;
+        if (!pool.CheckAncestorLimits(entry,
+                                      GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                      GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                                      GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                                      GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000,
+                                      errString))
+            return state.DoS(0, error("AcceptToMemoryPool : %s %s", errString, hash.ToString()),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY))
@@ -1027,9 +1272,13 @@ bool CMerkleTx::AcceptToMemoryPool(bool fLimitFree)
 }
 
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
+// The txindex is filled in the background by ThreadSyncIndex, so it can lag
+// behind the tip or still hold the blocks of a branch that was reorganized
+// away. Positions are only trusted for blocks on the active chain, and the
+// active chain blocks the index has not reached yet are searched directly.
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
-    CBlockIndex *pindexSlow = NULL;
+    vector<CBlockIndex*> vSearch;
     {
         LOCK(cs_main);
         {
@@ -1039,9 +1288,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
             }
         }
 
-        if (fTxIndex) {
+        if (ptxindexdb) {
             CDiskTxPos postx;
-            if (pblocktree->ReadTxIndex(hash, postx)) {
+            if (ptxindexdb->ReadTxPos(hash, postx)) {
                 CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
                 CBlockHeader header;
                 try {
@@ -1051,11 +1300,27 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
                 } catch (std::exception &e) {
                     return error("%s : Deserialize or I/O error - %s", __func__, e.what());
                 }
-                hashBlock = header.GetHash();
                 if (txOut.GetHash() != hash)
                     return error("%s : txid mismatch", __func__);
-                return true;
+                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(header.GetHash());
+                if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second)) {
+                    hashBlock = header.GetHash();
+                    return true;
+                }
             }
+
+            // Blocks the index has not caught up with, newest first
+            CBlockIndex *pindexIndexed = NULL;
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(ptxindexdb->GetBestBlock());
+            if (mi != mapBlockIndex.end())
+                pindexIndexed = mi->second;
+            while (pindexIndexed && !chainActive.Contains(pindexIndexed))
+                pindexIndexed = pindexIndexed->pprev;
+            int nIndexedHeight = pindexIndexed ? pindexIndexed->nHeight : -1;
+            if (chainActive.Height() - nIndexedHeight <= MAX_UNINDEXED_TX_SEARCH)
+                for (int nHeight = chainActive.Height(); nHeight > nIndexedHeight; nHeight--)
+                    if (chainActive[nHeight]->nStatus & BLOCK_HAVE_DATA)
+                        vSearch.push_back(chainActive[nHeight]);
         }
 
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
@@ -1067,11 +1332,11 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
                     nHeight = coins.nHeight;
             }
             if (nHeight > 0)
-                pindexSlow = chainActive[nHeight];
+                vSearch.push_back(chainActive[nHeight]);
         }
     }
 
-    if (pindexSlow) {
+    BOOST_FOREACH(CBlockIndex *pindexSlow, vSearch) {
         CBlock block;
         if (ReadBlockFromDisk(block, pindexSlow)) {
             BOOST_FOREACH(const CTransaction &tx, block.vtx) {
@@ -1150,52 +1415,92 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
-  if (!ReadBlockFromDisk(block, pindex->GetBlockPos())) {
+    return ReadBlockFromDisk(block, pindex->GetBlockPos(), pindex->GetBlockHash());
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hash)
+{
+    // Recently read or accepted blocks have already passed the checks below
+    if (blockcache.GetBlock(hash, block))
+        return true;
+    if (!ReadBlockFromDisk(block, pos))
         return false;
-  }
-    if (block.GetHash() != pindex->GetBlockHash())
-        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*) : GetHash() doesn't match index");
+    if (block.GetHash() != hash)
+        return error("ReadBlockFromDisk(CBlock&, CDiskBlockPos&, uint256&) : GetHash() doesn't match index");
+    blockcache.Insert(hash, block);
     return true;
 }
 
-uint256 static GetOrphanRoot(const uint256& hash)
+bool CBlockUndo::WriteToDisk(CDiskBlockPos &pos, const uint256 &hashBlock, const CBlock *pblockCompact)
 {
-    map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
-    if (it == mapOrphanBlocks.end())
-        return hash;
+    // Open history file to append
+    CAutoFile fileout = CAutoFile(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CBlockUndo::WriteToDisk : OpenUndoFile failed");
+
+    // Serialize once; the checksum covers the same bytes
+    CDataStream ssUndo(SER_DISK, CLIENT_VERSION);
+    if (pblockCompact)
+        ssUndo << CBlockUndoCompressor(*this, *pblockCompact);
+    else
+        ssUndo << *this;
 
-    // Work back to the first block in the orphan chain
-    do {
-        map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.find(it->second->hashPrev);
-        if (it2 == mapOrphanBlocks.end())
-            return it->first;
-        it = it2;
-    } while(true);
+    // Write index header
+    unsigned int nSize = ssUndo.size();
+    fileout << FLATDATA(Params().MessageStart()) << nSize;
+
+    // Write undo data
+    long fileOutPos = ftell(fileout);
+    if (fileOutPos < 0)
+        return error("CBlockUndo::WriteToDisk : ftell failed");
+    pos.nPos = (unsigned int)fileOutPos;
+    fileout.write(&ssUndo[0], ssUndo.size());
+
+    // calculate & write checksum
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << hashBlock;
+    hasher.write(&ssUndo[0], ssUndo.size());
+    fileout << hasher.GetHash();
+
+    // Flush stdio buffers and commit to disk before returning
+    fflush(fileout);
+    if (!IsInitialBlockDownload())
+        FileCommit(fileout);
+
+    return true;
 }
 
-// Remove a random orphan block (which does not have any dependent orphans).
-void static PruneOrphanBlocks()
+bool CBlockUndo::ReadFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock, const CBlock *pblockCompact)
 {
-	if (mapOrphanBlocksByPrev.size() <= (size_t)std::max((int64_t)0, GetArg("-maxorphanblocks", DEFAULT_MAX_ORPHAN_BLOCKS)))
-        return;
-
-    // Pick a random orphan block.
-    int pos = insecure_rand() % mapOrphanBlocksByPrev.size();
-    std::multimap<uint256, COrphanBlock*>::iterator it = mapOrphanBlocksByPrev.begin();
-    while (pos--) it++;
+    // Open history file to read
+    CAutoFile filein = CAutoFile(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
+
+    // Read undo data
+    uint256 hashChecksum;
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << hashBlock;
+    try {
+        if (pblockCompact) {
+            CBlockUndoCompressor compressor(*this, *pblockCompact);
+            filein >> compressor;
+            hasher << compressor;
+        } else {
+            filein >> *this;
+            hasher << *this;
+        }
+        filein >> hashChecksum;
+    }
+    catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
 
-    // As long as this block has other orphans depending on it, move to one of those successors.
-    do {
-        std::multimap<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocksByPrev.find(it->second->hashBlock);
-        if (it2 == mapOrphanBlocksByPrev.end())
-            break;
-        it = it2;
-    } while(1);
+    // Verify checksum
+    if (hashChecksum != hasher.GetHash())
+        return error("CBlockUndo::ReadFromDisk : Checksum mismatch");
 
-    uint256 hash = it->second->hashBlock;
-    delete it->second;
-    mapOrphanBlocksByPrev.erase(it);
-    mapOrphanBlocks.erase(hash);
+    return true;
 }
 
 bool onFork (const CBlockIndex * pindex) { // major changes: multi algo PoW, merge mining, custom DGW, CEM
@@ -1809,12 +2114,13 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
+// Takes cs_main itself, as handlers that don't otherwise need it report misbehaviour too.
 void Misbehaving(NodeId pnode, int howmuch)
 {
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1898,9 +2204,14 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     assert(ret);
 }
 
+// Interpreter stacks reused by every script check run on the same thread
+static boost::thread_specific_ptr<CScriptArena> pScriptArena;
+
 bool CScriptCheck::operator()() const {
+    if (pScriptArena.get() == NULL)
+        pScriptArena.reset(new CScriptArena());
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pSigHashCache.get(), pScriptArena.get())) {
       return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString());
     }
     return true;
@@ -1973,12 +2284,13 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
 	  //LogPrintf("fScriptChecks true\n");
+            boost::shared_ptr<const CSigHashCache> pSigHashCache(new CSigHashCache(tx));
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins &coins = inputs.GetCoins(prevout.hash);
 
                 // Verify signature
-                CScriptCheck check(coins, tx, i, flags, 0);
+                CScriptCheck check(coins, tx, i, flags, 0, pSigHashCache);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1986,7 +2298,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
                     if (flags & SCRIPT_VERIFY_STRICTENC) {
                         // For now, check whether the failure was caused by non-canonical
                         // encodings or not; if so, don't trigger DoS protection.
-                        CScriptCheck check(coins, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                        CScriptCheck check(coins, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0, pSigHashCache);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, "non-canonical");
                     }
@@ -2012,7 +2324,7 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     CDiskBlockPos pos = pindex->GetUndoPos();
     if (pos.IsNull())
         return error("DisconnectBlock() : no undo data available");
-    if (!blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+    if (!blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash(), (pindex->nStatus & BLOCK_UNDO_COMPACT) ? &block : NULL))
         return error("DisconnectBlock() : failure reading undo data");
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
@@ -2112,11 +2424,59 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CBlockCheck> blockcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
 
 void ThreadScriptCheck() {
     RenameThread("bitmark-scriptch");
-    scriptcheckqueue.Thread();
+    blockcheckqueue.Thread();
+}
+
+// Pull coins into the database's caches ahead of the connecting thread
+static bool PrefetchCoinsTask(const std::vector<uint256> &vHash)
+{
+    BOOST_FOREACH(const uint256 &hash, vHash)
+        pcoinsdbview->HaveCoins(hash);
+    return true;
+}
+
+// Coins in existence after pindex: the supply before it (per algorithm after
+// the fork) plus the new coins its coinbase created on top of the fees.
+int64_t static GetMoneySupply(CBlockIndex* pindex, const CBlock& block, int64_t nFees)
+{
+    if (onFork(pindex)) {
+        CBlockIndex * pprev_algo = get_pprev_algo(pindex,-1);
+        if (pprev_algo)
+            return pprev_algo->nMoneySupply + block.vtx[0].GetValueOut() - nFees;
+        int64_t ms_correction = get_mpow_ms_correction(pindex);
+        return ms_correction + block.vtx[0].GetValueOut() - nFees;
+    }
+    if (pindex->pprev)
+        return pindex->pprev->nMoneySupply + block.vtx[0].GetValueOut() - nFees;
+    return 2000000000;
+}
+
+// The -assumevalid block and its ancestors, filled in once the block is in the index
+static CChain chainAssumeValid;
+// The hashAssumeValid chainAssumeValid was built for
+static uint256 hashAssumeValidChain;
+
+bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    if (hashAssumeValid == 0)
+        return false;
+    if (hashAssumeValidChain != hashAssumeValid) {
+        chainAssumeValid.SetTip(NULL);
+        hashAssumeValidChain = hashAssumeValid;
+    }
+    if (chainAssumeValid.Tip() == NULL) {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashAssumeValid);
+        if (mi == mapBlockIndex.end())
+            return false;
+        chainAssumeValid.SetTip(mi->second);
+    }
+    if (chainAssumeValid.Tip()->nStatus & BLOCK_FAILED_MASK)
+        return false;
+    return chainAssumeValid.Contains(pindex);
 }
 
 bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
@@ -2126,8 +2486,9 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
   }
   
     AssertLockHeld(cs_main);
+    CCheckQueueStats statsStart = blockcheckqueue.GetStats();
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(block, state, !fJustCheck, !fJustCheck))
+    if (!CheckBlock(block, state, !fJustCheck, !fJustCheck, true))
         return false;
 
     bool onForkNow = onFork(pindex);
@@ -2194,7 +2555,8 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
       return true;
     }
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    // Scripts below the last checkpoint or the -assumevalid block are not verified
+    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate() && !IsAssumedValid(pindex);
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -2238,15 +2600,39 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
     CBlockUndo blockundo;
 
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    CCheckQueueControl<CBlockCheck> control(nScriptCheckThreads ? &blockcheckqueue : NULL);
+
+    // Have the check threads read the inputs that are not in the coins cache
+    // from disk while the transactions are connected in order; only views on
+    // top of pcoinsTip are backed by pcoinsdbview
+    if (control.IsActive() && pcoinsdbview && view.GetBackend() == pcoinsTip) {
+        std::set<uint256> setSeen;
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+            setSeen.insert(block.GetTxHash(i));
+        std::vector<CBlockCheck> vPrefetch;
+        std::vector<uint256> vHash;
+        BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+            if (tx.IsCoinBase())
+                continue;
+            BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+                if (!setSeen.insert(txin.prevout.hash).second || pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
+                    continue;
+                vHash.push_back(txin.prevout.hash);
+                if (vHash.size() == 16) {
+                    vPrefetch.push_back(CBlockCheck(boost::bind(&PrefetchCoinsTask, vHash)));
+                    vHash.clear();
+                }
+            }
+        }
+        if (!vHash.empty())
+            vPrefetch.push_back(CBlockCheck(boost::bind(&PrefetchCoinsTask, vHash)));
+        control.Add(vPrefetch);
+    }
 
     int64_t nStart = GetTimeMicros();
     int64_t nFees = 0;
     int nInputs = 0;
     unsigned int nSigOps = 0;
-    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
-    vPos.reserve(block.vtx.size());
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
@@ -2276,7 +2662,10 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
             std::vector<CScriptCheck> vChecks;
             if (!CheckInputs(tx, state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
-            control.Add(vChecks);
+            std::vector<CBlockCheck> vBlockChecks(vChecks.size());
+            for (unsigned int j = 0; j < vChecks.size(); j++)
+                vBlockChecks[j].swap(vChecks[j]);
+            control.Add(vBlockChecks);
         }
 
         CTxUndo txundo;
@@ -2284,8 +2673,6 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
         if (!tx.IsCoinBase())
             blockundo.vtxundo.push_back(txundo);
 
-        vPos.push_back(std::make_pair(block.GetTxHash(i), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime = GetTimeMicros() - nStart;
     if (fBenchmark)
@@ -2325,29 +2712,16 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     int64_t nTime2 = GetTimeMicros() - nStart;
     if (fBenchmark)
         LogPrintf("- Verify %u txins: %.2fms (%.3fms/txin)\n", nInputs - 1, 0.001 * nTime2, nInputs <= 1 ? 0 : 0.001 * nTime2 / (nInputs-1));
+    if (fBenchmark && control.IsActive()) {
+        CCheckQueueStats stats = blockcheckqueue.GetStats() - statsStart;
+        LogPrintf("- Check queue: %u checks, %u steals (%.2fms), %.2fms idle\n", (unsigned int)stats.nChecks, (unsigned int)stats.nSteals, 0.001 * stats.nStealMicros, 0.001 * stats.nIdleMicros);
+    }
 
     if (fJustCheck)
         return true;
 
     // Increment the nMoneySupply to include this blocks subsidy
-    
-    if (onForkNow) {
-      if (pprev_algo) {
-	pindex->nMoneySupply = pprev_algo->nMoneySupply + block.vtx[0].GetValueOut() - nFees;
-      }
-      else {
-	int64_t ms_correction = get_mpow_ms_correction(pindex);
-	pindex->nMoneySupply = ms_correction+block.vtx[0].GetValueOut() - nFees;
-      }
-    }
-    else {
-      if (pindex->pprev) {
-	pindex->nMoneySupply = pindex->pprev->nMoneySupply + block.vtx[0].GetValueOut() - nFees;
-      }
-      else {
-	pindex->nMoneySupply = 2000000000;
-      }
-    }
+    pindex->nMoneySupply = GetMoneySupply(pindex, block, nFees);
     //LogPrintf("Total coins emitted: %" PRId64 "\n", pindex->nMoneySupply);
 
     // Write undo information to disk
@@ -2355,14 +2729,17 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     {
         if (pindex->GetUndoPos().IsNull()) {
             CDiskBlockPos pos;
-            if (!FindUndoPos(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+            unsigned int nUndoSize = ::GetSerializeSize(CBlockUndoCompressor(blockundo, block), SER_DISK, CLIENT_VERSION);
+            if (!FindUndoPos(state, pindex->nFile, pos, nUndoSize + 40))
                 return error("ConnectBlock() : FindUndoPos failed");
-            if (!blockundo.WriteToDisk(pos, hashPrevBlock))
+            if (!blockundo.WriteToDisk(pos, hashPrevBlock, &block))
                 return state.Abort(_("Failed to write undo data"));
+            if (fBenchmark)
+                LogPrintf("- Undo: %u bytes (%u uncompacted)\n", nUndoSize, (unsigned int)::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION));
 
             // update nUndoPos in block index
             pindex->nUndoPos = pos.nPos;
-            pindex->nStatus |= BLOCK_HAVE_UNDO;
+            pindex->nStatus |= BLOCK_HAVE_UNDO | BLOCK_UNDO_COMPACT;
         }
 
         pindex->nStatus = (pindex->nStatus & ~BLOCK_VALID_MASK) | BLOCK_VALID_SCRIPTS;
@@ -2372,10 +2749,6 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
             return state.Abort(_("Failed to write block index"));
     }
 
-    if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
-            return state.Abort(_("Failed to write transaction index"));
-
     // add this block to the view's block chain
     bool ret;
     ret = view.SetBestBlock(pindex->GetBlockHash());
@@ -2388,10 +2761,126 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     return true;
 }
 
+// Forget the block and undo data stored in a block file: the index entries
+// lose BLOCK_HAVE_DATA/BLOCK_HAVE_UNDO and the file info is reset. The files
+// themselves are removed by UnlinkPrunedFiles once the index is on disk.
+void static PruneOneBlockFile(int nFile)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_LastBlockFile);
+
+    for (map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (!(pindex->nStatus & BLOCK_HAVE_MASK) || pindex->nFile != nFile)
+            continue;
+        pindex->nStatus &= ~(BLOCK_HAVE_MASK | BLOCK_UNDO_COMPACT);
+        pindex->nFile = 0;
+        pindex->nDataPos = 0;
+        pindex->nUndoPos = 0;
+        pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
+        blockcache.Erase(it->first);
+        // Side branches without data can never be connected any more
+        if (!chainActive.Contains(pindex))
+            setBlockIndexValid.erase(pindex);
+    }
+
+    pblocktree->WriteBlockFileInfo(nFile, CBlockFileInfo());
+}
+
+// Pick the oldest block files to delete so that block and undo data stay
+// within nTarget, given the info of every block file (the last one is being
+// written to and never pruned). Files holding any block within
+// MIN_BLOCKS_TO_KEEP of the tip are never pruned, so a reorg of that depth can
+// still be undone, and neither is history above nSnapshotHeight when an
+// imported UTXO snapshot is still being validated (-1 when none is).
+void SelectFilesToPrune(const vector<CBlockFileInfo>& vinfoBlockFile, int nTipHeight, int nSnapshotHeight, uint64_t nTarget, set<int>& setFilesToPrune)
+{
+    if (nTarget == 0 || nTipHeight <= (int)MIN_BLOCKS_TO_KEEP)
+        return;
+    unsigned int nLastBlockWeCanPrune = nTipHeight - MIN_BLOCKS_TO_KEEP;
+    if (nSnapshotHeight >= 0)
+        nLastBlockWeCanPrune = std::min(nLastBlockWeCanPrune, (unsigned int)nSnapshotHeight);
+
+    uint64_t nCurrentUsage = 0;
+    BOOST_FOREACH(const CBlockFileInfo &info, vinfoBlockFile)
+        nCurrentUsage += info.nSize + info.nUndoSize;
+
+    // Leave room for the next pre-allocation chunks of both files
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    if (nCurrentUsage + nBuffer < nTarget)
+        return;
+
+    for (int nFile = 0; nFile + 1 < (int)vinfoBlockFile.size(); nFile++) {
+        const CBlockFileInfo &info = vinfoBlockFile[nFile];
+        if (info.nSize == 0)
+            continue;
+        if (nCurrentUsage + nBuffer < nTarget)
+            break;
+        if (info.nHeightLast > nLastBlockWeCanPrune)
+            continue;
+
+        setFilesToPrune.insert(nFile);
+        nCurrentUsage -= info.nSize + info.nUndoSize;
+    }
+
+    LogPrint("prune", "Prune: target=%dMiB usage=%dMiB max_prune_height=%d removing %u files\n",
+             nTarget/1024/1024, nCurrentUsage/1024/1024, nLastBlockWeCanPrune, setFilesToPrune.size());
+}
+
+void static FindFilesToPrune(set<int>& setFilesToPrune)
+{
+    AssertLockHeld(cs_main);
+    LOCK(cs_LastBlockFile);
+
+    if (chainActive.Tip() == NULL || nPruneTarget == 0)
+        return;
+
+    vector<CBlockFileInfo> vinfoBlockFile(nLastBlockFile + 1);
+    for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
+        if (nFile == nLastBlockFile)
+            vinfoBlockFile[nFile] = infoLastBlockFile;
+        else
+            pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
+    }
+
+    SelectFilesToPrune(vinfoBlockFile, chainActive.Height(), vSnapshotChain.empty() ? -1 : nSnapshotValidatedHeight, nPruneTarget, setFilesToPrune);
+    BOOST_FOREACH(int nFile, setFilesToPrune)
+        PruneOneBlockFile(nFile);
+}
+
+// Delete the blk?????.dat and rev?????.dat files of pruned block files.
+void static UnlinkPrunedFiles(const set<int>& setFilesToPrune)
+{
+    BOOST_FOREACH(int nFile, setFilesToPrune) {
+        filesystem::path pathBlocks = GetDataDir() / "blocks";
+        filesystem::path pathBlk = pathBlocks / strprintf("blk%05u.dat", nFile);
+        filesystem::path pathRev = pathBlocks / strprintf("rev%05u.dat", nFile);
+        boost::system::error_code ec;
+        filesystem::remove(pathBlk, ec);
+        filesystem::remove(pathRev, ec);
+        LogPrintf("Prune: deleted blk/rev (%05u)\n", nFile);
+    }
+}
+
 // Update the on-disk chain state.
 bool static WriteChainState(CValidationState &state) {
     static int64_t nLastWrite = 0;
-    if (!IsInitialBlockDownload() || pcoinsTip->GetCacheSize() > nCoinCacheSize || GetTimeMicros() > nLastWrite + 600*1000000) {
+    set<int> setFilesToPrune;
+    if (fPruneMode) {
+        bool fCheck = false;
+        {
+            LOCK(cs_LastBlockFile);
+            fCheck = fCheckForPruning;
+            fCheckForPruning = false;
+        }
+        if (fCheck)
+            FindFilesToPrune(setFilesToPrune);
+        if (!setFilesToPrune.empty() && !fHavePruned) {
+            pblocktree->WriteFlag("prunedblockfiles", true);
+            fHavePruned = true;
+        }
+    }
+    if (!setFilesToPrune.empty() || !IsInitialBlockDownload() || pcoinsTip->GetCacheSize() > nCoinCacheSize || GetTimeMicros() > nLastWrite + 600*1000000) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -2401,16 +2890,31 @@ bool static WriteChainState(CValidationState &state) {
             return state.Error("out of disk space");
         FlushBlockFile();
         pblocktree->Sync();
+        int64_t nStart = GetTimeMicros();
+        unsigned int nCoins = pcoinsTip->GetCacheSize();
         if (!pcoinsTip->Flush())
             return state.Abort(_("Failed to write to coin database"));
         nLastWrite = GetTimeMicros();
+        if (fBenchmark)
+            LogPrintf("- Flush %u coins: %.2fms\n", nCoins, 0.001 * (nLastWrite - nStart));
+        // The block index no longer points into the pruned files; now they can go
+        UnlinkPrunedFiles(setFilesToPrune);
     }
     return true;
 }
 
+// Record the tip for waiters on cvBlockChange. A waiter holds csBlockChange
+// from checking hashBlockChangeTip until it sleeps, so none can miss a change.
+void static SetBlockChangeTip(const CBlockIndex *pindex) {
+    boost::lock_guard<boost::mutex> lock(csBlockChange);
+    hashBlockChangeTip = pindex ? pindex->GetBlockHash() : uint256(0);
+}
+
 // Update chainActive and related internal data structures.
 void static UpdateTip(CBlockIndex *pindexNew) {
     chainActive.SetTip(pindexNew);
+    SetBlockChangeTip(pindexNew);
+    cvBlockChange.notify_all();
     //LogPrintf("updatetip pindexNew nHeight %d\n",pindexNew->nHeight);
 
     // Update best block in wallet (so we can detect restored wallets)
@@ -2531,6 +3035,10 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew) {
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    // Notify UI to display prev block's coinbase if it was ours
+    static uint256 hashPrevBestCoinBase;
+    g_signals.UpdatedTransaction(hashPrevBestCoinBase);
+    hashPrevBestCoinBase = block.GetTxHash(0);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     BOOST_FOREACH(const CTransaction &tx, txConflicted) {
@@ -2596,6 +3104,18 @@ void static FindMostWorkChain() {
     chainMostWork.SetTip(pindexNew);
 }
 
+// Send a compact block to a peer that doesn't know the block yet
+void static PushCompactBlock(CNode* pnode, const CBlockHeaderAndShortTxIDs& cmpctblock, const CInv& inv)
+{
+    {
+        LOCK(pnode->cs_inventory);
+        if (pnode->filterInventoryKnown.contains(inv.hash))
+            return;
+    }
+    pnode->PushMessage("cmpctblock", cmpctblock);
+    pnode->AddInventoryKnown(inv);
+}
+
 // Try to activate to the most-work chain (thereby connecting it).
 bool ActivateBestChain(CValidationState &state) {
     LOCK(cs_main);
@@ -2634,6 +3154,32 @@ bool ActivateBestChain(CValidationState &state) {
     }
 
     if (chainActive.Tip() != pindexOldTip) {
+        // Relay inventory, but don't relay old inventory during initial block download
+        uint256 hashNewTip = chainActive.Tip()->GetBlockHash();
+        int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
+
+        // A single new block goes straight out as a compact block to the peers
+        // that asked for that; it is built once and shared between them
+        CInv invNewTip(MSG_BLOCK, hashNewTip);
+        boost::shared_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+        if (chainActive.Tip()->pprev == pindexOldTip && !IsInitialBlockDownload()) {
+            CBlock block;
+            if (ReadBlockFromDisk(block, chainActive.Tip()))
+                pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(block));
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                    continue;
+                CNodeState *nodestate = State(pnode->GetId());
+                if (pcmpctblock && nodestate && nodestate->fPreferHeaderAndIDs)
+                    PushCompactBlock(pnode, *pcmpctblock, invNewTip);
+                else
+                    pnode->PushInventory(invNewTip);
+            }
+        }
+
         std::string strCmd = GetArg("-blocknotify", "");
         if (!IsInitialBlockDownload() && !strCmd.empty())
         {
@@ -2645,20 +3191,21 @@ bool ActivateBestChain(CValidationState &state) {
     return true;
 }
 
-bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos& pos)
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
 {
     // Check for duplicate
     uint256 hash = block.GetHash();
-    if (mapBlockIndex.count(hash))
-        return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString()), 0, "duplicate");
+    map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hash);
+    if (it != mapBlockIndex.end())
+        return it->second;
 
     // Construct new block index object
     CBlockIndex* pindexNew = new CBlockIndex(block);
     assert(pindexNew);
-    {
-         LOCK(cs_nBlockSequenceId);
-         pindexNew->nSequenceId = nBlockSequenceId++;
-    }
+    // We assign the sequence id to blocks only when the full data is available,
+    // to avoid miners withholding blocks but broadcasting headers, to get a
+    // competitive advantage.
+    pindexNew->nSequenceId = 0;
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
     map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
@@ -2666,43 +3213,65 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
-    pindexNew->nTx = block.vtx.size();
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
     if (block.IsAuxpow()) {
       pindexNew->pauxpow = block.auxpow;
       assert(NULL != pindexNew->pauxpow.get());
     }
-    pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0) + pindexNew->nTx;
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
+    pindexNew->RaiseValidity(BLOCK_VALID_TREE);
+    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
+        pindexBestHeader = pindexNew;
+
+    // The header is written again once the block data arrives; this write is
+    // only so restarting doesn't lose the headers we fetched.
+    pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew));
+
+    return pindexNew;
+}
+
+bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBlockIndex* pindexNew, const CDiskBlockPos& pos)
+{
+    pindexNew->nTx = block.vtx.size();
+    pindexNew->nChainTx = 0;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
-    pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
-    setBlockIndexValid.insert(pindexNew);
+    pindexNew->nStatus |= BLOCK_HAVE_DATA;
+    pindexNew->RaiseValidity(BLOCK_VALID_TRANSACTIONS);
+
+    if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx) {
+        // If pindexNew is the genesis block or all parents are received, it and
+        // any of its descendants waiting for it can become candidates.
+        deque<CBlockIndex*> queue;
+        queue.push_back(pindexNew);
+
+        // Recursively process any descendant blocks that now may be eligible to be connected.
+        while (!queue.empty()) {
+            CBlockIndex *pindex = queue.front();
+            queue.pop_front();
+            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            {
+                LOCK(cs_nBlockSequenceId);
+                pindex->nSequenceId = nBlockSequenceId++;
+            }
+            if (!(pindex->nStatus & BLOCK_FAILED_MASK))
+                setBlockIndexValid.insert(pindex);
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+            while (range.first != range.second) {
+                std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
+                queue.push_back(it->second);
+                range.first++;
+                mapBlocksUnlinked.erase(it);
+            }
+        }
+    } else {
+        mapBlocksUnlinked.insert(std::make_pair(pindexNew->pprev, pindexNew));
+    }
 
     if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
         return state.Abort(_("Failed to write block index"));
-    
-    // New best?
-    if (!ActivateBestChain(state))
-        return false;
-
-    LOCK(cs_main);
-    if (pindexNew == chainActive.Tip())
-    {
-        // Clear fork warning if its no longer applicable
-        CheckForkWarningConditions();
-        // Notify UI to display prev block's coinbase if it was ours
-        static uint256 hashPrevBestCoinBase;
-        g_signals.UpdatedTransaction(hashPrevBestCoinBase);
-        hashPrevBestCoinBase = block.GetTxHash(0);
-    } else
-        CheckForkWarningConditionsOnNewFork(pindexNew);
-    
-    if (!pblocktree->Flush())
-        return state.Abort(_("Failed to sync block index"));
-
-    uiInterface.NotifyBlocksChanged();
 
     return true;
 }
@@ -2748,6 +3317,8 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
                     AllocateFileRange(file, pos.nPos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos);
                     fclose(file);
                 }
+                if (fPruneMode)
+                    fCheckForPruning = true;
             }
             else
                 return state.Error("out of disk space");
@@ -2794,6 +3365,8 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
                 AllocateFileRange(file, pos.nPos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos);
                 fclose(file);
             }
+            if (fPruneMode)
+                fCheckForPruning = true;
         }
         else
             return state.Error("out of disk space");
@@ -2803,49 +3376,37 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 }
 
 
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
+static bool CheckBlockProofOfWork(const CBlockHeader& block, CValidationState& state)
 {
-    // These are checks that are independent of context
-    // that can be verified before saving an orphan block.
-
-  unsigned int block_size = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
-  //LogPrintf("In checkblock with block size %d, %d\n",block_size,block.vtx.size());
-  
-    // Size limits
-    if (block.vtx.empty() || block.vtx.size() > MAX_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE)
-        return state.DoS(100, error("CheckBlock() : size limits failed"),
-                         REJECT_INVALID, "bad-blk-length");
-
-    /*
-    bool blockOnFork = false;
-    if (fCheckPOW && block.GetHash() != Params().HashGenesisBlock()) {
-      map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
-      if (mi == mapBlockIndex.end())
-	return state.DoS(10, error("CheckBlock() : prev block not found"), 0, "bad-prevblk");
-      CBlockIndex * pindexPrev = (*mi).second;
-      blockOnFork = (pindexPrev->nHeight >= nForkHeight - 1) && (CBlockIndex::IsSuperMajority(4,pindexPrev,75,100));
-      }*/
-    
     // Check proof of work matches claimed amount
-    if(fCheckPOW && block.IsAuxpow()) {
+    if(block.IsAuxpow()) {
       if (!CheckAuxPowProofOfWork(block, Params())) {
 	return state.DoS(50, error("CheckBlock() : auxpow proof of work failed"),
 			 REJECT_INVALID, "high-hash");
       }
     }
     else {
-          if (fCheckPOW && block.GetAlgo() == ALGO_EQUIHASH && !CheckEquihashSolution(&block, Params())) {
+          if (block.GetAlgo() == ALGO_EQUIHASH && !CheckEquihashSolution(&block, Params())) {
 	    return state.DoS(50, error("CheckBlock() : Invalid Equihash Solution"),
 			     REJECT_INVALID, "bad-equihash-solution");      
 	  }
 
 	  //LogPrintf("check proof of work of block with algo %d\n",block.GetAlgo());
-	  if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(),block.nBits,block.GetAlgo())) {
+	  if (!CheckProofOfWork(block.GetPoWHash(),block.nBits,block.GetAlgo())) {
 	    return state.DoS(50, error("CheckBlock() : proof of work failed"),
 			     REJECT_INVALID, "high-hash");
 	  }
     }
 
+    return true;
+}
+
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW)
+{
+    // Check proof of work matches claimed amount
+    if (fCheckPOW && !CheckBlockProofOfWork(block, state))
+        return false;
+
     // Check timestamp
     int64_t nNow = GetTime();
     //if (fDebug) LogPrintf("block_delta = %ld\n",block.GetBlockTime()-nNow); // for generating statistics
@@ -2856,7 +3417,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
 	fBlockTooFarInFuture = true;
 	LogPrintf("Warning: Block timestamp too far in the future. Please check your clock and be careful of network forks.");
       }
-      return state.Invalid(error("CheckBlock() : block timestamp too far in the future"),
+      return state.Invalid(error("CheckBlockHeader() : block timestamp too far in the future"),
 			   REJECT_INVALID, "time-too-new");
     }
     else {
@@ -2867,6 +3428,90 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
       }
     }
 
+    return true;
+}
+
+static bool CheckProofOfWorkTask(const CBlock *pblock, CValidationState *pstate, bool *pfOk)
+{
+    *pfOk = CheckBlockProofOfWork(*pblock, *pstate);
+    return *pfOk;
+}
+
+static bool HashTransactionsTask(const CBlock *pblock, unsigned int nBegin, unsigned int nEnd, std::vector<uint256> *pvTxHash)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++)
+        (*pvTxHash)[i] = pblock->vtx[i].GetHash();
+    return true;
+}
+
+// The block hash commits to the transactions only through the merkle root.
+// A body that doesn't hash to it, or that repeats transactions so that it
+// still does, isn't the block its header names, so that is all the sender's
+// fault and says nothing about the block itself.
+bool static CheckBlockMerkleRoot(const CBlock& block, CValidationState& state)
+{
+    if (block.vtx.empty())
+        return state.DoS(100, error("CheckBlockMerkleRoot() : no transactions"),
+                         REJECT_INVALID, "bad-blk-length", true);
+
+    if (block.hashMerkleRoot != block.BuildMerkleTree())
+        return state.DoS(100, error("CheckBlockMerkleRoot() : hashMerkleRoot mismatch"),
+                         REJECT_INVALID, "bad-txnmrklroot", true);
+
+    set<uint256> uniqueTx;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        uniqueTx.insert(block.GetTxHash(i));
+    if (uniqueTx.size() != block.vtx.size())
+        return state.DoS(100, error("CheckBlockMerkleRoot() : duplicate transaction"),
+                         REJECT_INVALID, "bad-txns-duplicate", true);
+
+    return true;
+}
+
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fUseCheckQueue)
+{
+    // These are checks that are independent of context
+    // that can be verified before saving an orphan block.
+
+  unsigned int block_size = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+  //LogPrintf("In checkblock with block size %d, %d\n",block_size,block.vtx.size());
+  
+    // Size limits
+    if (block.vtx.empty() || block.vtx.size() > MAX_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE)
+        return state.DoS(100, error("CheckBlock() : size limits failed"),
+                         REJECT_INVALID, "bad-blk-length");
+
+    /*
+    bool blockOnFork = false;
+    if (fCheckPOW && block.GetHash() != Params().HashGenesisBlock()) {
+      map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+      if (mi == mapBlockIndex.end())
+	return state.DoS(10, error("CheckBlock() : prev block not found"), 0, "bad-prevblk");
+      CBlockIndex * pindexPrev = (*mi).second;
+      blockOnFork = (pindexPrev->nHeight >= nForkHeight - 1) && (CBlockIndex::IsSuperMajority(4,pindexPrev,75,100));
+      }*/
+    
+    // Check proof of work matches claimed amount. With script check threads,
+    // that and the transaction hashing overlap with the checks below.
+    bool fParallel = fUseCheckQueue && nScriptCheckThreads;
+    CValidationState statePoW;
+    bool fPoWOk = true;
+    std::vector<uint256> vTxHash;
+    CCheckQueueControl<CBlockCheck> control(fParallel ? &blockcheckqueue : NULL);
+    if (fParallel) {
+        std::vector<CBlockCheck> vChecks;
+        if (fCheckPOW)
+            vChecks.push_back(CBlockCheck(boost::bind(&CheckProofOfWorkTask, &block, &statePoW, &fPoWOk)));
+        vTxHash.resize(block.vtx.size());
+        for (unsigned int i = 0; i < block.vtx.size(); i += 16)
+            vChecks.push_back(CBlockCheck(boost::bind(&HashTransactionsTask, &block, i, std::min(i + 16, (unsigned int)block.vtx.size()), &vTxHash)));
+        control.Add(vChecks);
+    }
+
+    // Check the timestamp, and the proof of work unless it's already queued above
+    if (!CheckBlockHeader(block, state, fCheckPOW && !fParallel))
+        return false;
+
     // First transaction must be coinbase, the rest must not be
     if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
         return state.DoS(100, error("CheckBlock() : first tx is not coinbase"),
@@ -2884,7 +3529,15 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     // Build the merkle tree already. We need it anyway later, and it makes the
     // block cache the transaction hashes, which means they don't need to be
     // recalculated many times during this block's validation.
-    block.BuildMerkleTree();
+    if (fParallel) {
+        control.Wait();
+        if (!fPoWOk) {
+            state = statePoW;
+            return false;
+        }
+        block.BuildMerkleTree(vTxHash);
+    } else
+        block.BuildMerkleTree();
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
@@ -2913,87 +3566,167 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     return true;
 }
 
-bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
+// Checks of a header that depend on its parent
+bool static ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* pindexPrev)
+{
+    uint256 hash = block.GetHash();
+    if (hash == Params().HashGenesisBlock())
+        return true;
+
+    int nHeight = pindexPrev->nHeight+1;
+
+    // Check proof of work
+    int block_algo = GetAlgo(block.nVersion);
+    unsigned int next_work_required = GetNextWorkRequired(pindexPrev, block_algo);
+    if (block.nBits != next_work_required) {
+      if (fDebug) LogPrintf("nbits = %d, required = %d\n",block.nBits,next_work_required);
+      return state.DoS(100, error("ContextualCheckBlockHeader() : incorrect proof of work"),
+		       REJECT_INVALID, "bad-diffbits");
+    }
+
+    // Check timestamp against prev
+    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("ContextualCheckBlockHeader() : block's timestamp is too early"),
+                             REJECT_INVALID, "time-too-old");
+
+    // Check that the block chain matches the known block chain up to a checkpoint
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return state.DoS(100, error("ContextualCheckBlockHeader() : rejected by checkpoint lock-in at %d", nHeight),
+                         REJECT_CHECKPOINT, "checkpoint mismatch");
+
+    // Don't accept any forks from the main chain prior to last checkpoint
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+        return state.DoS(100, error("ContextualCheckBlockHeader() : forked chain older than last checkpoint (height %d)", nHeight));
+
+    // Reject block.nVersion=1 blocks
+    if (block.nVersion < 2)
+    {
+		return state.Invalid(error("ContextualCheckBlockHeader() : rejected nVersion=1 block"),
+							 REJECT_OBSOLETE, "bad-version");
+    }
+
+    // Reject block.nVersion=2 blocks when 95% of the network has upgraded:
+
+    if (block.nVersion < 3 &&
+	CBlockIndex::IsSuperMajority(3, pindexPrev, 950, 1000))
+      {
+	return state.Invalid(error("ContextualCheckBlockHeader() : rejected nVersion=2 block"),
+			     REJECT_OBSOLETE, "bad-version");
+      }
+
+    if (block.IsAuxpow() || block.GetAlgo() != ALGO_SCRYPT) {
+      if (pindexPrev->nHeight < nForkHeight-1 || !CBlockIndex::IsSuperMajority(4,pindexPrev,75,100)) {
+	return state.DoS(100,error("ContextualCheckBlockHeader() : new block format requires fork activation"),REJECT_INVALID,"bad-version-fork");
+      }
+    }
+
+    return true;
+}
+
+// Checks of a block's transactions that depend on its position in the chain
+bool static ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindexPrev)
+{
+    if (pindexPrev == NULL)
+        return true;
+    int nHeight = pindexPrev->nHeight + 1;
+
+    // Check that all transactions are finalized
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        if (!IsFinalTx(tx, nHeight, block.GetBlockTime()))
+            return state.DoS(10, error("ContextualCheckBlock() : contains a non-final transaction"),
+                             REJECT_INVALID, "bad-txns-nonfinal");
+
+    // Enforce block.nVersion=2 rule that the coinbase starts with serialized block height
+    if (block.nVersion >= 2)
+    {
+		CScript expect = CScript() << nHeight;
+		if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
+			!std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin()))
+		  return state.DoS(100, error("ContextualCheckBlock() : block height mismatch in coinbase, nHeight=%d",nHeight),
+							 REJECT_INVALID, "bad-cb-height");
+    }
+
+    return true;
+}
+
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
     uint256 hash = block.GetHash();
-    if (mapBlockIndex.count(hash))
-        return state.Invalid(error("AcceptBlock() : block already in mapBlockIndex"), 0, "duplicate");
+    map<uint256, CBlockIndex*>::iterator miSelf = mapBlockIndex.find(hash);
+    CBlockIndex *pindex = NULL;
+    if (miSelf != mapBlockIndex.end()) {
+        pindex = miSelf->second;
+        if (ppindex)
+            *ppindex = pindex;
+        if (pindex->nStatus & BLOCK_FAILED_MASK)
+            return state.Invalid(error("AcceptBlockHeader() : block %s is marked invalid", hash.ToString()), 0, "duplicate");
+        return true;
+    }
+
+    if (!CheckBlockHeader(block, state))
+        return false;
 
     // Get prev block index
     CBlockIndex* pindexPrev = NULL;
-    int nHeight = 0;
     if (hash != Params().HashGenesisBlock()) {
         map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
         if (mi == mapBlockIndex.end())
-            return state.DoS(10, error("AcceptBlock() : prev block not found"), 0, "bad-prevblk");
+            return state.DoS(10, error("AcceptBlockHeader() : prev block not found"), 0, "bad-prevblk");
         pindexPrev = (*mi).second;
-        nHeight = pindexPrev->nHeight+1;	
-
-        // Check proof of work
-	int block_algo = GetAlgo(block.nVersion);
-	unsigned int next_work_required = GetNextWorkRequired(pindexPrev, block_algo);
-        if (block.nBits != next_work_required) {
-	  if (fDebug) LogPrintf("nbits = %d, required = %d\n",block.nBits,next_work_required);
-	  return state.DoS(100, error("AcceptBlock() : incorrect proof of work"),
-			   REJECT_INVALID, "bad-diffbits");
-	}
+        if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+            return state.DoS(100, error("AcceptBlockHeader() : prev block invalid"), REJECT_INVALID, "bad-prevblk");
+    }
 
-        // Check timestamp against prev
-        if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
-            return state.Invalid(error("AcceptBlock() : block's timestamp is too early"),
-                                 REJECT_INVALID, "time-too-old");
-
-        // Check that all transactions are finalized
-        BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            if (!IsFinalTx(tx, nHeight, block.GetBlockTime()))
-                return state.DoS(10, error("AcceptBlock() : contains a non-final transaction"),
-                                 REJECT_INVALID, "bad-txns-nonfinal");
-
-        // Check that the block chain matches the known block chain up to a checkpoint
-        if (!Checkpoints::CheckBlock(nHeight, hash))
-            return state.DoS(100, error("AcceptBlock() : rejected by checkpoint lock-in at %d", nHeight),
-                             REJECT_CHECKPOINT, "checkpoint mismatch");
-
-        // Don't accept any forks from the main chain prior to last checkpoint
-        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-        if (pcheckpoint && nHeight < pcheckpoint->nHeight)
-            return state.DoS(100, error("AcceptBlock() : forked chain older than last checkpoint (height %d)", nHeight));
-
-        // Reject block.nVersion=1 blocks
-        if (block.nVersion < 2)
-        {
-			return state.Invalid(error("AcceptBlock() : rejected nVersion=1 block"),
-								 REJECT_OBSOLETE, "bad-version");
-        }
+    if (!ContextualCheckBlockHeader(block, state, pindexPrev))
+        return false;
 
-        // Enforce block.nVersion=2 rule that the coinbase starts with serialized block height
-        if (block.nVersion >= 2)
-        {
-			CScript expect = CScript() << nHeight;
-			if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
-				!std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin()))
-			  return state.DoS(100, error("AcceptBlock() : block height mismatch in coinbase, nHeight=%d",nHeight),
-								 REJECT_INVALID, "bad-cb-height");
-        }
+    pindex = AddToBlockIndex(block);
+    if (ppindex)
+        *ppindex = pindex;
 
-        // Reject block.nVersion=2 blocks when 95% of the network has upgraded:
+    return true;
+}
 
-	if (block.nVersion < 3 &&
-	    CBlockIndex::IsSuperMajority(3, pindexPrev, 950, 1000))
-	  {
-	    return state.Invalid(error("AcceptBlock() : rejected nVersion=2 block"),
-				 REJECT_OBSOLETE, "bad-version");
-	  }
+bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp)
+{
+    AssertLockHeld(cs_main);
 
-	if (block.IsAuxpow() || block.GetAlgo() != ALGO_SCRYPT) {
-	  if (pindexPrev->nHeight < nForkHeight-1 || !CBlockIndex::IsSuperMajority(4,pindexPrev,75,100)) {
-	    return state.DoS(100,error("AcceptBlock() : new block format requires fork activation"),REJECT_INVALID,"bad-version-fork");
-	  }
-	}	
+    CBlockIndex *&pindex = *ppindex;
+
+    if (!AcceptBlockHeader(block, state, &pindex))
+        return false;
+
+    // Already stored; nothing more to do
+    if (pindex->nStatus & BLOCK_HAVE_DATA)
+        return true;
+
+    // The header's proof of work was checked when it entered the index, but
+    // the block hash doesn't commit to the auxpow: unless it is the one the
+    // index entry was built from, check the auxpow this block came with.
+    // A bad one is the sender's fault, not the block's, so the index entry
+    // isn't marked failed.
+    if (block.IsAuxpow() && pindex->pauxpow != block.auxpow && !CheckBlockProofOfWork(block, state))
+        return false;
+
+    // Likewise a body that isn't the one the header commits to. Checking that
+    // first means every failure below is the block's own.
+    if (!CheckBlockMerkleRoot(block, state))
+        return false;
+
+    if (!CheckBlock(block, state, false) || !ContextualCheckBlock(block, state, pindex->pprev)) {
+        if (state.IsInvalid() && !state.CorruptionPossible()) {
+            pindex->nStatus |= BLOCK_FAILED_VALID;
+            pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
+        }
+        return false;
     }
 
+    int nHeight = pindex->nHeight;
+    uint256 hash = pindex->GetBlockHash();
+
     // Write block to history file
     try {
         unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
@@ -3002,38 +3735,49 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
             blockPos = *dbp;
         if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.nTime, dbp != NULL))
             return error("AcceptBlock() : FindBlockPos failed");
-        if (dbp == NULL)
+        if (dbp == NULL) {
             if (!WriteBlockToDisk(block, blockPos))
                 return state.Abort(_("Failed to write block"));
-        if (!AddToBlockIndex(block, state, blockPos))
-	  return error("AcceptBlock() : AddToBlockIndex failed");
+            // ConnectTip and peers fetching the new tip will read it right back
+            blockcache.Insert(hash, block);
+        }
+        if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
+            return error("AcceptBlock() : ReceivedBlockTransactions failed");
     } catch(std::runtime_error &e) {
         return state.Abort(_("System error: ") + e.what());
     }
 
-    // Relay inventory, but don't relay old inventory during initial block download
-    int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
-    if (chainActive.Tip()->GetBlockHash() == hash)
-    {
-        LOCK(cs_vNodes);
-        BOOST_FOREACH(CNode* pnode, vNodes)
-            if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
-    }
-    
     return true;
 }
 
-void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
+// Store the data of a block below an imported UTXO snapshot. Its header is
+// already in the active chain, the data is only needed to validate the snapshot.
+bool static AcceptSnapshotBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex)
 {
     AssertLockHeld(cs_main);
-    // Filter out duplicate requests
-    if (pindexBegin == pnode->pindexLastGetBlocksBegin && hashEnd == pnode->hashLastGetBlocksEnd)
-        return;
-    pnode->pindexLastGetBlocksBegin = pindexBegin;
-    pnode->hashLastGetBlocksEnd = hashEnd;
+    uint256 hash = pindex->GetBlockHash();
+    mapBlockSource.erase(hash);
+    if (!CheckBlock(block, state))
+        return error("AcceptSnapshotBlock() : CheckBlock FAILED");
 
-    pnode->PushMessage("getblocks", chainActive.GetLocator(pindexBegin), hashEnd);
+    try {
+        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        CDiskBlockPos blockPos;
+        if (!FindBlockPos(state, blockPos, nBlockSize+8, pindex->nHeight, block.nTime))
+            return error("AcceptSnapshotBlock() : FindBlockPos failed");
+        if (!WriteBlockToDisk(block, blockPos))
+            return state.Abort(_("Failed to write block"));
+        pindex->nFile = blockPos.nFile;
+        pindex->nDataPos = blockPos.nPos;
+        pindex->nStatus |= BLOCK_HAVE_DATA;
+        if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)))
+            return state.Abort(_("Failed to write block index"));
+    } catch(std::runtime_error &e) {
+        return state.Abort(_("System error: ") + e.what());
+    }
+    // The validation thread is about to read it
+    blockcache.Insert(hash, block);
+    return true;
 }
 
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
@@ -3042,98 +3786,76 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
 
     // Check for duplicate
     uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
-        return state.Invalid(error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString()), 0, "duplicate");
-    if (mapOrphanBlocks.count(hash))
-        return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString()), 0, "duplicate");
-    
-    // Preliminary checks
-    if (!CheckBlock(*pblock, state))
-        return error("ProcessBlock() : CheckBlock FAILED");
-
-    if (0) { // skip these extra checks until we have the fork height set
-      CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-      if (pcheckpoint && pblock->hashPrevBlock != (chainActive.Tip() ? chainActive.Tip()->GetBlockHash() : uint256(0)))
-	{
-	  // Extra checks to prevent "fill up memory by spamming with bogus blocks"
-	  int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
-	  if (deltaTime < 0)
-	    {
-	      return state.DoS(100, error("ProcessBlock() : block with timestamp before last checkpoint"),
-			       REJECT_CHECKPOINT, "time-too-old");
-	    }
-	  CBigNum bnNewBlock;
-	  bnNewBlock.SetCompact(pblock->nBits);
-	  CBigNum bnRequired;
-	  bnRequired.SetCompact(ComputeMinWork(pcheckpoint->nBits, deltaTime));
-	  if (bnNewBlock > bnRequired)
-	    {
-	      return state.DoS(100, error("ProcessBlock() : block with too little proof-of-work"),
-			       REJECT_INVALID, "bad-diffbits");
-	    }
-	}
-    }
-
-    // If we don't already have its previous block, shunt it off to holding area until we get it
-    if (pblock->hashPrevBlock != 0 && !mapBlockIndex.count(pblock->hashPrevBlock))
-    {
-      //LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)mapOrphanBlocks.size(), pblock->hashPrevBlock.ToString());
-
-        // Accept orphans as long as there is a node to request its parents from
-        if (pfrom) {
-            PruneOrphanBlocks();
-            COrphanBlock* pblock2 = new COrphanBlock();
-            {
-                CDataStream ss(SER_DISK, CLIENT_VERSION);
-                ss << *pblock;
-                pblock2->vchBlock = std::vector<unsigned char>(ss.begin(), ss.end());
-            }
-            pblock2->hashBlock = hash;
-            pblock2->hashPrev = pblock->hashPrevBlock;
-            mapOrphanBlocks.insert(make_pair(hash, pblock2));
-            mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrev, pblock2));
-
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, chainActive.Tip(), GetOrphanRoot(hash));
-        }
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end()) {
+        CBlockIndex *pindex = mi->second;
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) && IsSnapshotBlock(pindex))
+            return AcceptSnapshotBlock(*pblock, state, pindex);
+        // Entries without the block data are only headers, or pruned
+        if ((pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nTx != 0)
+            return state.Invalid(error("ProcessBlock() : already have block %d %s", pindex->nHeight, hash.ToString()), 0, "duplicate");
+    }
+
+    // Without its parent's header a block can't be placed. As with orphans before,
+    // one that didn't come from a peer we could ask for the headers is dropped.
+    if (pfrom == NULL && pblock->hashPrevBlock != 0 && !mapBlockIndex.count(pblock->hashPrevBlock))
         return true;
-    }
 
     // Store to disk
-    if (!AcceptBlock(*pblock, state, dbp))
+    CBlockIndex *pindex = NULL;
+    if (!AcceptBlock(*pblock, state, &pindex, dbp))
       return error("ProcessBlock() : AcceptBlock FAILED");
 
-    // Recursively process any orphan blocks that depended on this one
-    vector<uint256> vWorkQueue;
-    vWorkQueue.push_back(hash);
-    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-    {
-      //LogPrintf("processblock work queue %d of %d\n",i,vWorkQueue.size());
-        uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
-             mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
-             ++mi)
-        {
-            CBlock block;
-            {
-                CDataStream ss(mi->second->vchBlock, SER_DISK, CLIENT_VERSION);
-                ss >> block;
-            }
-            block.BuildMerkleTree();
-            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan resolution (that is, feeding people an invalid block based on LegitBlockX in order to get anyone relaying LegitBlockX banned)
-            CValidationState stateDummy;
-            if (AcceptBlock(block, stateDummy))
-                vWorkQueue.push_back(mi->second->hashBlock);
-            mapOrphanBlocks.erase(mi->second->hashBlock);
-            delete mi->second;
+    // The proof of work, the merkle root and the other context-free checks
+    // have passed. AcceptBlock checked the block's own auxpow unless it is
+    // the one its index entry was checked with, and without auxpow the hash
+    // commits to everything the header's check covered. A block extending
+    // our tip can go out to the peers that take compact blocks unannounced
+    // now, rather than after its scripts were checked and it was connected.
+    // A peer that sent us a block failing those checks was already punished
+    // by AcceptBlock.
+    if (fFastBlockRelay && dbp == NULL && pindex->pprev == chainActive.Tip() && !IsInitialBlockDownload()) {
+        CBlockHeaderAndShortTxIDs cmpctblock(*pblock);
+        CInv inv(MSG_BLOCK, hash);
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            CNodeState *nodestate = State(pnode->GetId());
+            if (nodestate && nodestate->fPreferHeaderAndIDs && pnode->nStartingHeight != -1 && pindex->nHeight > pnode->nStartingHeight - 2000)
+                PushCompactBlock(pnode, cmpctblock, inv);
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
+        LogPrint("net", "ProcessBlock: relayed %s ahead of validation\n", hash.ToString());
     }
+
+    // New best?
+    if (!ActivateBestChain(state))
+        return error("ProcessBlock() : ActivateBestChain failed");
+
+    if (chainActive.Contains(pindex))
+        // Clear fork warning if its no longer applicable
+        CheckForkWarningConditions();
+    else if (pindex->nChainTx)
+        CheckForkWarningConditionsOnNewFork(pindex);
+
+    if (!pblocktree->Flush())
+        return state.Abort(_("Failed to sync block index"));
+
+    uiInterface.NotifyBlocksChanged();
+
     LogPrintf("ProcessBlock: ACCEPTED\n");
     return true;
 }
 
 CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
+{
+    Init(block, filter, CBloomBlockElements(block));
+}
+
+CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter, const CBloomBlockElements& elements)
+{
+    Init(block, filter, elements);
+}
+
+void CMerkleBlock::Init(const CBlock& block, CBloomFilter& filter, const CBloomBlockElements& elements)
 {
     header = block.GetBlockHeader();
 
@@ -3145,8 +3867,8 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        uint256 hash = block.vtx[i].GetHash();
-        if (filter.IsRelevantAndUpdate(block.vtx[i], hash))
+        const uint256& hash = elements.GetTxHash(i);
+        if (filter.IsRelevantAndUpdate(elements, i))
         {
             vMatch.push_back(true);
             vMatchedTxn.push_back(make_pair(i, hash));
@@ -3337,13 +4059,28 @@ bool static LoadBlockIndexDB()
     {
         CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
-        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK)) {
+        if (pindex->nTx > 0) {
+            if (pindex->pprev) {
+                if (pindex->pprev->nChainTx) {
+                    pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+                } else {
+                    pindex->nChainTx = 0;
+                    mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
+                }
+            } else {
+                pindex->nChainTx = pindex->nTx;
+            }
+        }
+        if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL)) {
 	  //LogPrintf("insert pindex at height %d (%s) as valid\n",pindex->nHeight,(pindex->phashBlock)->GetHex().c_str());
             setBlockIndexValid.insert(pindex);
 	}
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
+        if (pindex->pprev)
+            pindex->BuildSkip();
+        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
+            pindexBestHeader = pindex;
     }
 
     // Load block file info
@@ -3357,9 +4094,15 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadReindexing(fReindexing);
     fReindex |= fReindexing;
 
-    // Check whether we have a transaction index
-    pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
+    // Check whether we have ever pruned block & undo files
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
+
+    // The transaction index used to be kept in the block tree
+    bool fOldTxIndex = false;
+    if (pblocktree->ReadFlag("txindex", fOldTxIndex) && fOldTxIndex)
+        LogPrintf("LoadBlockIndexDB(): transaction index entries in blocks/index are no longer used, -reindex removes them\n");
 
     // Load pointer to end of best chain
     //LogPrintf("load pcoinstip bestblock %s\n",pcoinsTip->GetBestBlock().GetHex().c_str());
@@ -3367,6 +4110,9 @@ bool static LoadBlockIndexDB()
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    SetBlockChangeTip(chainActive.Tip());
+    if (pindexBestHeader == NULL)
+        pindexBestHeader = chainActive.Tip();
     LogPrintf("LoadBlockIndexDB(): hashBestChain=%s height=%d date=%s progress=%f\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -3398,6 +4144,9 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
         boost::this_thread::interruption_point();
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        // Pruned history and history below a UTXO snapshot cannot be verified
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            break;
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -3410,7 +4159,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             CBlockUndo undo;
             CDiskBlockPos pos = pindex->GetUndoPos();
             if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash(), (pindex->nStatus & BLOCK_UNDO_COMPACT) ? &block : NULL))
                     return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
             }
         }
@@ -3453,8 +4202,14 @@ void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
     setBlockIndexValid.clear();
+    mapBlocksUnlinked.clear();
     chainActive.SetTip(NULL);
+    SetBlockChangeTip(NULL);
+    pindexBestHeader = NULL;
+    chainAssumeValid.SetTip(NULL);
+    hashAssumeValidChain = 0;
     pindexBestInvalid = NULL;
+    blockcache.Clear();
 }
 
 bool LoadBlockIndex()
@@ -3471,9 +4226,6 @@ bool InitBlockIndex() {
     if (chainActive.Genesis() != NULL)
         return true;
 
-    // Use the provided setting for -txindex in the new database
-    fTxIndex = GetBoolArg("-txindex", false);
-    pblocktree->WriteFlag("txindex", fTxIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3508,8 +4260,11 @@ bool InitBlockIndex() {
                 return error("LoadBlockIndex() : FindBlockPos failed");
             if (!WriteBlockToDisk(block, blockPos))
                 return error("LoadBlockIndex() : writing genesis block to disk failed");
-            if (!AddToBlockIndex(block, state, blockPos))
+            CBlockIndex *pindex = AddToBlockIndex(block);
+            if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
                 return error("LoadBlockIndex() : genesis block not accepted");
+            if (!ActivateBestChain(state))
+                return error("LoadBlockIndex() : genesis block cannot be activated");
         } catch(std::runtime_error &e) {
             return error("LoadBlockIndex() : failed to initialize block database: %s", e.what());
         }
@@ -3518,6 +4273,438 @@ bool InitBlockIndex() {
     return true;
 }
 
+bool DumpUTXOSnapshot(const boost::filesystem::path &path, CCoinsSnapshotHeader &header)
+{
+    LOCK(cs_main);
+    CBlockIndex *pindexTip = chainActive.Tip();
+    if (pindexTip == NULL || pindexTip->nHeight == 0)
+        return error("DumpUTXOSnapshot() : no blocks to dump");
+
+    // The coin database must describe the tip written below
+    FlushBlockFile();
+    pblocktree->Sync();
+    if (!pcoinsTip->Flush())
+        return error("DumpUTXOSnapshot() : failed to flush the coin database");
+
+    header.SetNull();
+    header.nHeight = pindexTip->nHeight;
+    header.nBlocks = pindexTip->nHeight;
+
+    boost::filesystem::path pathTmp = path.string() + ".new";
+    CAutoFile fileout = CAutoFile(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpUTXOSnapshot() : cannot open %s", pathTmp.string());
+
+    bool fOk = false;
+    try {
+        // Placeholder, rewritten once the coins have been counted and hashed
+        fileout << header;
+        CHashedAutoFile file(fileout);
+        for (int nHeight = 1; nHeight <= pindexTip->nHeight; nHeight++) {
+            CDiskBlockIndex diskindex(chainActive[nHeight]);
+            // Our block file positions mean nothing to the importing node
+            diskindex.nStatus &= ~(BLOCK_HAVE_MASK | BLOCK_UNDO_COMPACT);
+            file << diskindex;
+        }
+        if (pcoinsdbview->WriteSnapshot(file, header) && header.hashBlock == pindexTip->GetBlockHash()) {
+            header.hashChecksum = file.GetHash();
+            fseek(fileout, 0, SEEK_SET);
+            fileout << header;
+            FileCommit(fileout);
+            fOk = true;
+        }
+    } catch (std::exception &e) {
+        error("%s : I/O error - %s", __func__, e.what());
+    }
+    fileout.fclose();
+
+    if (!fOk || !RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp);
+        return error("DumpUTXOSnapshot() : failed to write %s", path.string());
+    }
+    LogPrintf("Dumped UTXO snapshot of %u transactions at height %d (%s) to %s\n", header.nTransactions, header.nHeight, header.hashBlock.ToString(), path.string());
+    return true;
+}
+
+bool LoadUTXOSnapshot(const boost::filesystem::path &path)
+{
+    LOCK(cs_main);
+    if (chainActive.Height() != 0 || mapBlockIndex.size() != 1)
+        return error("LoadUTXOSnapshot() : a snapshot can only be loaded into an empty chain state");
+
+    // First pass: check the whole file before anything is written
+    CCoinsSnapshotHeader header;
+    {
+        CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (!filein)
+            return error("LoadUTXOSnapshot() : cannot open %s", path.string());
+        try {
+            filein >> header;
+            if (!header.IsValid())
+                return error("LoadUTXOSnapshot() : %s is not a UTXO snapshot of a supported version", path.string());
+            if (memcmp(header.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+                return error("LoadUTXOSnapshot() : snapshot is for another network");
+            if (header.nHeight <= 0 || header.nBlocks != (unsigned int)header.nHeight)
+                return error("LoadUTXOSnapshot() : inconsistent snapshot header");
+            CHashedAutoFile file(filein);
+            for (unsigned int i = 0; i < header.nBlocks; i++) {
+                boost::this_thread::interruption_point();
+                CDiskBlockIndex diskindex;
+                file >> diskindex;
+            }
+            if (!pcoinsdbview->LoadSnapshot(file, header, false))
+                return false;
+            if (file.GetHash() != header.hashChecksum)
+                return error("LoadUTXOSnapshot() : checksum mismatch");
+        } catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    LogPrintf("Loading UTXO snapshot of %u transactions at height %d (%s), hash_serialized %s\n",
+        header.nTransactions, header.nHeight, header.hashBlock.ToString(), header.hashSerialized.ToString());
+
+    CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("LoadUTXOSnapshot() : cannot open %s", path.string());
+    try {
+        filein >> header;
+        CHashedAutoFile file(filein);
+
+        // Link the headers onto genesis. Their proof of work is checked once
+        // the blocks themselves arrive for the background validation.
+        CBlockIndex *pindexPrev = chainActive.Genesis();
+        for (unsigned int i = 0; i < header.nBlocks; i++) {
+            boost::this_thread::interruption_point();
+            CDiskBlockIndex diskindex;
+            file >> diskindex;
+            uint256 hash = diskindex.GetBlockHash();
+            int nHeight = pindexPrev->nHeight + 1;
+            if (diskindex.hashPrev != pindexPrev->GetBlockHash() || diskindex.nHeight != nHeight || mapBlockIndex.count(hash))
+                return error("LoadUTXOSnapshot() : block index entries do not form a chain at height %d", nHeight);
+            if (!Checkpoints::CheckBlock(nHeight, hash))
+                return error("LoadUTXOSnapshot() : rejected by checkpoint lock-in at %d", nHeight);
+            if (diskindex.nBits != GetNextWorkRequired(pindexPrev, GetAlgo(diskindex.nVersion)))
+                return error("LoadUTXOSnapshot() : incorrect proof of work target at %d", nHeight);
+
+            CBlockIndex* pindexNew = InsertBlockIndex(hash);
+            pindexNew->pprev          = pindexPrev;
+            pindexNew->pauxpow        = diskindex.pauxpow;
+            pindexNew->nHeight        = nHeight;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nNonce256      = diskindex.nNonce256;
+            pindexNew->nSolution      = diskindex.nSolution;
+            pindexNew->hashReserved   = diskindex.hashReserved;
+            pindexNew->nTx            = diskindex.nTx;
+            // Connected according to the snapshot, but without block data (like pruned blocks)
+            pindexNew->nStatus        = BLOCK_VALID_SCRIPTS;
+            pindexNew->nChainWork     = pindexPrev->nChainWork + pindexNew->GetBlockWork().getuint256();
+            pindexNew->nChainTx       = pindexPrev->nChainTx + pindexNew->nTx;
+            pindexNew->BuildSkip();
+            setBlockIndexValid.insert(pindexNew);
+            pindexPrev = pindexNew;
+        }
+        if (pindexPrev->GetBlockHash() != header.hashBlock)
+            return error("LoadUTXOSnapshot() : block index does not end at the snapshot block");
+
+        vector<CDiskBlockIndex> vIndex;
+        for (CBlockIndex *pindex = pindexPrev; pindex->pprev; pindex = pindex->pprev) {
+            vIndex.push_back(CDiskBlockIndex(pindex));
+            if (vIndex.size() >= 10000 || pindex->nHeight == 1) {
+                if (!pblocktree->WriteBlockIndexBatch(vIndex))
+                    return error("LoadUTXOSnapshot() : failed to write block index");
+                vIndex.clear();
+            }
+        }
+
+        if (!pcoinsdbview->LoadSnapshot(file, header, true))
+            return error("LoadUTXOSnapshot() : failed to write coin database");
+        pcoinsTip->SetBestBlock(header.hashBlock);
+        chainActive.SetTip(pindexPrev);
+        SetBlockChangeTip(pindexPrev);
+        pindexBestHeader = pindexPrev;
+    } catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    // History below the snapshot is missing until the validation downloads it
+    pblocktree->WriteFlag("prunedblockfiles", true);
+    fHavePruned = true;
+    if (!pblocktree->WriteSnapshotValidation(header))
+        return error("LoadUTXOSnapshot() : failed to write snapshot state");
+    LogPrintf("LoadUTXOSnapshot(): new best=%s height=%d\n", chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height());
+    return true;
+}
+
+bool InitSnapshotValidation()
+{
+    LOCK(cs_main);
+    vSnapshotChain.clear();
+    nSnapshotValidatedHeight = 0;
+    if (!pblocktree->ReadSnapshotValidation(snapshotValidation)) {
+        // Left over from a validation that finished or was abandoned by -reindex
+        boost::filesystem::remove_all(GetDataDir() / "chainstate_snapshot");
+        return false;
+    }
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(snapshotValidation.hashBlock);
+    if (mi == mapBlockIndex.end())
+        return error("InitSnapshotValidation() : snapshot block %s not found", snapshotValidation.hashBlock.ToString());
+    vSnapshotChain.resize(mi->second->nHeight + 1);
+    for (CBlockIndex *pindex = mi->second; pindex; pindex = pindex->pprev)
+        vSnapshotChain[pindex->nHeight] = pindex;
+    LogPrintf("UTXO snapshot at height %d is not validated yet\n", snapshotValidation.nHeight);
+    return true;
+}
+
+bool GetSnapshotValidationProgress(int &nHeight, int &nValidatedHeight)
+{
+    LOCK(cs_main);
+    if (vSnapshotChain.empty())
+        return false;
+    nHeight = snapshotValidation.nHeight;
+    nValidatedHeight = nSnapshotValidatedHeight;
+    return true;
+}
+
+// Fees paid by a block, given a view of the coins before it
+bool static GetBlockFees(const CBlock& block, CCoinsViewCache& view, int64_t& nFees)
+{
+    map<uint256, const CTransaction*> mapBlockTx;
+    nFees = 0;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = block.vtx[i];
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+                map<uint256, const CTransaction*>::iterator mi = mapBlockTx.find(txin.prevout.hash);
+                if (mi != mapBlockTx.end()) {
+                    if (txin.prevout.n >= mi->second->vout.size())
+                        return false;
+                    nFees += mi->second->vout[txin.prevout.n].nValue;
+                } else {
+                    if (!view.HaveCoins(txin.prevout.hash))
+                        return false;
+                    const CCoins &coins = view.GetCoins(txin.prevout.hash);
+                    if (!coins.IsAvailable(txin.prevout.n))
+                        return false;
+                    nFees += coins.vout[txin.prevout.n].nValue;
+                }
+            }
+            nFees -= tx.GetValueOut();
+        }
+        mapBlockTx[block.GetTxHash(i)] = &tx;
+    }
+    return true;
+}
+
+void ThreadValidateSnapshot()
+{
+    RenameThread("bitmark-snapshot");
+    CCoinsSnapshotHeader header;
+    int nHeight = 0;
+    {
+        LOCK(cs_main);
+        if (vSnapshotChain.empty())
+            return;
+        header = snapshotValidation;
+    }
+
+    boost::filesystem::path pathState = GetDataDir() / "chainstate_snapshot";
+    bool fValid = false;
+    {
+        CCoinsViewDB viewdb(pathState, nSnapshotValidationDBCache);
+        CCoinsViewCache view(viewdb);
+        std::string strError;
+        try {
+            {
+                // Resume where a previous run stopped
+                LOCK(cs_main);
+                uint256 hashBest = view.GetBestBlock();
+                if (hashBest != 0) {
+                    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBest);
+                    if (mi == mapBlockIndex.end() || !IsSnapshotBlock(mi->second)) {
+                        LogPrintf("ThreadValidateSnapshot() : %s does not match the snapshot chain\n", pathState.string());
+                        return;
+                    }
+                    nHeight = mi->second->nHeight;
+                } else
+                    nHeight = -1;
+                nSnapshotValidatedHeight = std::max(nHeight, 0);
+            }
+            LogPrintf("Validating UTXO snapshot history from height %d\n", nHeight + 1);
+
+            while (nHeight < header.nHeight) {
+                boost::this_thread::interruption_point();
+                bool fWait = false;
+                CBlockIndex *pindex;
+                CDiskBlockPos pos;
+                {
+                    LOCK(cs_main);
+                    pindex = vSnapshotChain[nHeight + 1];
+                    if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                        fWait = true;
+                    else
+                        pos = pindex->GetBlockPos();
+                }
+                if (fWait) {
+                    MilliSleep(500);
+                    continue;
+                }
+                // Blocks above nSnapshotValidatedHeight are never pruned, so the
+                // read and the merkle check need no lock
+                CBlock block;
+                int64_t nFees = 0;
+                if (!ReadBlockFromDisk(block, pos, pindex->GetBlockHash()))
+                    strError = strprintf("cannot read block at height %d", pindex->nHeight);
+                else if (block.BuildMerkleTree() != block.hashMerkleRoot)
+                    strError = strprintf("bad merkle root at height %d", pindex->nHeight);
+                else if (!GetBlockFees(block, view, nFees))
+                    strError = strprintf("block at height %d does not connect", pindex->nHeight);
+                else {
+                    // ConnectBlock shares the script check queue with the active chain
+                    LOCK(cs_main);
+                    CValidationState state;
+                    if (!ConnectBlock(block, state, pindex, view, true))
+                        strError = strprintf("block at height %d does not connect", pindex->nHeight);
+                    else if (GetMoneySupply(pindex, block, nFees) != pindex->nMoneySupply)
+                        strError = strprintf("money supply mismatch at height %d", pindex->nHeight);
+                    else {
+                        view.SetBestBlock(pindex->GetBlockHash());
+                        nSnapshotValidatedHeight = ++nHeight;
+                    }
+                }
+                if (!strError.empty())
+                    break;
+                if (view.GetCacheSize() > nCoinCacheSize / 4 || nHeight % 10000 == 0)
+                    view.Flush();
+            }
+
+            if (strError.empty()) {
+                view.Flush();
+                CCoinsStats stats;
+                LOCK(cs_main);
+                if (!viewdb.GetStats(stats))
+                    strError = "cannot compute the replayed UTXO set hash";
+                else if (stats.hashSerialized != header.hashSerialized)
+                    strError = strprintf("replayed UTXO set hash %s does not match", stats.hashSerialized.ToString());
+                else
+                    fValid = true;
+            }
+        } catch (boost::thread_interrupted) {
+            view.Flush();
+            throw;
+        }
+
+        if (!fValid) {
+            LogPrintf("ThreadValidateSnapshot() : %s\n", strError);
+            AbortNode(_("Error: The imported UTXO snapshot does not match the block chain history. Restart with -reindex to rebuild the block chain."));
+            return;
+        }
+
+        LOCK(cs_main);
+        pblocktree->EraseSnapshotValidation();
+        vSnapshotChain.clear();
+        if (!fPruneMode)
+            nLocalServices |= NODE_NETWORK;
+    }
+    boost::filesystem::remove_all(pathState);
+    LogPrintf("UTXO snapshot at height %d (%s) validated against the block chain history\n", header.nHeight, header.hashBlock.ToString());
+}
+
+void ThreadSyncIndex(CChainIndexDB *pindexdb)
+{
+    RenameThread(("bitmark-" + pindexdb->strName).c_str());
+    const CBlockIndex *pindexBest = NULL;
+    {
+        LOCK(cs_main);
+        uint256 hashBest = pindexdb->GetBestBlock();
+        if (hashBest != 0) {
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBest);
+            if (mi == mapBlockIndex.end()) {
+                LogPrintf("ThreadSyncIndex() : best block of %s is unknown, restart with -reindex to rebuild it\n", pindexdb->strName);
+                return;
+            }
+            pindexBest = mi->second;
+        }
+    }
+    LogPrintf("Syncing %s from height %d\n", pindexdb->strName, pindexBest ? pindexBest->nHeight + 1 : 0);
+
+    bool fSynced = false;
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        // Rewind a block that left the active chain, or add the next one. Block
+        // positions never change once written, so reading happens without cs_main.
+        const CBlockIndex *pindex = NULL;
+        bool fRewind = false, fUndoCompact = false;
+        CDiskBlockPos pos, posUndo;
+        {
+            LOCK(cs_main);
+            if (pindexBest && !chainActive.Contains(pindexBest)) {
+                pindex = pindexBest;
+                fRewind = true;
+            } else
+                pindex = pindexBest ? chainActive.Next(pindexBest) : chainActive.Genesis();
+            if (pindex && pindex->pprev) {
+                if (!(pindex->nStatus & BLOCK_HAVE_DATA) || (pindexdb->NeedsUndo() && !(pindex->nStatus & BLOCK_HAVE_UNDO)))
+                    pindex = NULL;
+                else {
+                    pos = pindex->GetBlockPos();
+                    if (pindexdb->NeedsUndo())
+                        posUndo = pindex->GetUndoPos();
+                    fUndoCompact = pindex->nStatus & BLOCK_UNDO_COMPACT;
+                }
+            }
+        }
+
+        if (!pindex) {
+            if (!fSynced) {
+                pindexdb->Sync();
+                LogPrintf("%s is synced at height %d\n", pindexdb->strName, pindexBest ? pindexBest->nHeight : -1);
+                fSynced = true;
+            }
+            boost::unique_lock<boost::mutex> lock(csBlockChange);
+            cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+            continue;
+        }
+
+        std::string strError;
+        try {
+            if (!pindex->pprev) {
+                // Nothing in the genesis block is spendable or indexed
+                if (!pindexdb->SetBestBlock(pindex->GetBlockHash()))
+                    strError = "cannot write best block";
+            } else {
+                CBlock block;
+                CBlockUndo blockundo;
+                if (!blockcache.GetBlock(pindex->GetBlockHash(), block)) {
+                    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+                    if (!filein)
+                        throw runtime_error("cannot open block file");
+                    filein >> block;
+                }
+                block.BuildMerkleTree();
+                if (block.GetHash() != pindex->GetBlockHash())
+                    strError = "block data does not match the block index";
+                else if (!posUndo.IsNull() && !blockundo.ReadFromDisk(posUndo, pindex->pprev->GetBlockHash(), fUndoCompact ? &block : NULL))
+                    strError = "cannot read undo data";
+                else if (!(fRewind ? pindexdb->RewindBlock(block, blockundo, pindex) : pindexdb->IndexBlock(block, blockundo, pindex)))
+                    strError = "cannot update the index";
+            }
+        } catch (std::exception &e) {
+            strError = e.what();
+        }
+        if (!strError.empty()) {
+            LogPrintf("ThreadSyncIndex() : %s at height %d: %s, restart with -reindex to rebuild it\n", pindexdb->strName, pindex->nHeight, strError);
+            return;
+        }
+        pindexBest = fRewind ? pindex->pprev : pindex;
+    }
+}
+
 void PrintBlockTree()
 {
     AssertLockHeld(cs_main);
@@ -3589,6 +4776,8 @@ void PrintBlockTree()
 
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
+    // Map of disk positions for blocks with unknown parent (only used for reindex)
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
@@ -3635,6 +4824,16 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 blkdat >> block;
                 nRewind = blkdat.GetPos();
 
+                // detect out of order blocks, and store them for later
+                uint256 hash = block.GetHash();
+                if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                            block.hashPrevBlock.ToString());
+                    if (dbp)
+                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                    continue;
+                }
+
                 // process block
                 if (nBlockPos >= nStartByte) {
                     LOCK(cs_main);
@@ -3646,6 +4845,32 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                     if (state.IsError())
                         break;
                 }
+
+                // Recursively process earlier encountered successors of this block
+                deque<uint256> queue;
+                queue.push_back(hash);
+                while (!queue.empty()) {
+                    uint256 head = queue.front();
+                    queue.pop_front();
+                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                    while (range.first != range.second) {
+                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                        CBlock blockSucc;
+                        if (ReadBlockFromDisk(blockSucc, it->second)) {
+                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, blockSucc.GetHash().ToString(),
+                                    head.ToString());
+                            LOCK(cs_main);
+                            CDiskBlockPos posSucc = it->second;
+                            CValidationState dummy;
+                            if (ProcessBlock(dummy, NULL, &blockSucc, &posSucc)) {
+                                nLoaded++;
+                                queue.push_back(blockSucc.GetHash());
+                            }
+                        }
+                        range.first++;
+                        mapBlocksUnknownParent.erase(it);
+                    }
+                }
             } catch (std::exception &e) {
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
@@ -3726,6 +4951,24 @@ string GetWarnings(string strFor)
 // Messages
 //
 
+/** LOCK(cs_main) for the message handlers: adds the time spent waiting for
+ *  the lock to the node's nMainWaitMicros, for the message stats */
+class CMainLockTimed
+{
+private:
+    int64_t nStart;
+    CCriticalBlock lock;
+
+public:
+    CMainLockTimed(CNode* pnode, const char* pszFile, int nLine) :
+        nStart(GetTimeMicros()), lock(cs_main, "cs_main", pszFile, nLine)
+    {
+        pnode->nMainWaitMicros += GetTimeMicros() - nStart;
+    }
+};
+
+#define LOCK_MAIN_TIMED(pnode) CMainLockTimed criticalblock(pnode, __FILE__, __LINE__)
+
 bool static AlreadyHave(const CInv& inv)
 {
     switch (inv.type)
@@ -3738,13 +4981,29 @@ bool static AlreadyHave(const CInv& inv)
                 pcoinsTip->HaveCoins(inv.hash);
         }
     case MSG_BLOCK:
-        return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+        return mapBlockIndex.count(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
 }
 
+// Filtered peers mostly ask for the same new block, so the data elements
+// of the last one sent filtered are kept for the next peer
+static CCriticalSection cs_lastBloomBlock;
+static boost::shared_ptr<const CBloomBlockElements> pLastBloomBlock;
+
+static boost::shared_ptr<const CBloomBlockElements> GetBloomBlockElements(const CBlock& block, const uint256& hash)
+{
+    {
+        LOCK(cs_lastBloomBlock);
+        if (pLastBloomBlock && pLastBloomBlock->GetBlockHash() == hash)
+            return pLastBloomBlock;
+    }
+    boost::shared_ptr<const CBloomBlockElements> pelements(new CBloomBlockElements(block));
+    LOCK(cs_lastBloomBlock);
+    pLastBloomBlock = pelements;
+    return pelements;
+}
 
 void static ProcessGetData(CNode* pfrom)
 {
@@ -3752,8 +5011,6 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -3764,40 +5021,77 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
+                // Decide under cs_main, but read and send the block without it,
+                // so a peer fetching old blocks doesn't hold up everyone else
                 bool send = false;
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                bool fRecent = false;
+                CDiskBlockPos pos;
+                uint256 hashTip;
                 {
-                    // If the requested block is at a height below our last
-                    // checkpoint, only serve it if it's in the checkpointed chain
-                    int nHeight = mi->second->nHeight;
-                    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-                    if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
-                        if (!chainActive.Contains(mi->second))
-                        {
-                            LogPrintf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
+                    LOCK_MAIN_TIMED(pfrom);
+                    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        // If the requested block is at a height below our last
+                        // checkpoint, only serve it if it's in the checkpointed chain
+                        int nHeight = mi->second->nHeight;
+                        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+                        if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
+                            if (!chainActive.Contains(mi->second))
+                            {
+                                LogPrintf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
+                            } else {
+                                send = true;
+                            }
                         } else {
                             send = true;
                         }
-                    } else {
-                        send = true;
+                        // Pruned blocks are gone; don't pretend to serve them
+                        if (send && !(mi->second->nStatus & BLOCK_HAVE_DATA))
+                        {
+                            LogPrint("net", "ProcessGetData(): ignoring request for pruned block %s\n", inv.hash.ToString());
+                            send = false;
+                        }
+                        if (send)
+                        {
+                            pos = mi->second->GetBlockPos();
+                            fRecent = chainActive.Contains(mi->second) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                            hashTip = chainActive.Tip()->GetBlockHash();
+                        }
                     }
                 }
                 if (send)
                 {
-                    // Send block from disk
+                    // Send block from the block cache or from disk
                     CBlock block;
-                    ReadBlockFromDisk(block, (*mi).second);
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    {
+                        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+                        if (blockcache.GetSerializedBlock(inv.hash, ssBlock))
+                            pfrom->PushMessage("block", ssBlock);
+                        else if (ReadBlockFromDisk(block, pos, inv.hash))
+                            pfrom->PushMessage("block", block);
+                    }
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // Only recent blocks are worth reconstructing from the
+                        // peer's mempool; anything older goes out in full
+                        if (ReadBlockFromDisk(block, pos, inv.hash)) {
+                            if (fRecent)
+                                pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                            else
+                                pfrom->PushMessage("block", block);
+                        }
+                    }
+                    else if (ReadBlockFromDisk(block, pos, inv.hash)) // MSG_FILTERED_BLOCK, unless pruned meanwhile
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                            boost::shared_ptr<const CBloomBlockElements> pelements = GetBloomBlockElements(block, inv.hash);
+                            CMerkleBlock merkleBlock(block, *pfrom->pfilter, *pelements);
                             pfrom->PushMessage("merkleblock", merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
@@ -3806,8 +5100,9 @@ void static ProcessGetData(CNode* pfrom)
                             // Thus, the protocol spec specified allows for us to provide duplicate txn here,
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
+                            LOCK(pfrom->cs_inventory);
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -3821,7 +5116,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashTip));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3833,19 +5128,16 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedSerializeData>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessage(inv.GetCommand(), (*mi).second, inv.hash);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
+                    CSharedSerializeData data;
+                    if (mempool.lookupSerialized(inv.hash, data)) {
+                        pfrom->PushMessage("tx", data, inv.hash);
                         pushed = true;
                     }
                 }
@@ -3857,7 +5149,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -3876,6 +5168,38 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Pass a block rebuilt from a compact block on to ProcessBlock, as if it had
+// arrived whole in a "block" message. Requires cs_main.
+void static ProcessReconstructedBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    LogPrint("net", "reconstructed block %s from compact block of peer=%d\n", hash.ToString(), pfrom->id);
+
+    mapBlockSource[hash] = pfrom->GetId();
+    MarkBlockAsReceived(hash, pfrom->GetId());
+
+    CValidationState state;
+    ProcessBlock(state, pfrom, &block);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", string("block"), state.GetRejectCode(),
+                           state.GetRejectReason(), hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+// Relay the mempool's copy of a just-accepted transaction; every peer that
+// asks gets a reference to it
+static void RelayMempoolTransaction(const CTransaction& tx, const uint256& hash)
+{
+    CSharedSerializeData data;
+    if (mempool.lookupSerialized(hash, data))
+        RelayTransaction(tx, hash, data);
+    else
+        RelayTransaction(tx, hash);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3886,10 +5210,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         return true;
     }
 
-    {
-        LOCK(cs_main);
-        State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
-    }
+    pfrom->nLastMessageProcess = GetTimeMicros();
 
     if (strCommand == "version")
     {
@@ -4008,6 +5329,27 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     else if (strCommand == "verack")
     {
         pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION) {
+            // Ask the peers we picked ourselves to push new blocks to us as
+            // compact blocks right away; inbound ones just announce them
+            bool fAnnounceUsingCMPCTBLOCK = !pfrom->fInbound;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK_MAIN_TIMED(pfrom);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -4043,10 +5385,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
+                    // at a time so the filterAddrKnowns of the chosen nodes prevent repeats
+                    static const uint256 hashSalt = GetRandHash();
                     uint64_t hashAddr = addr.GetHash();
                     uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
@@ -4087,7 +5427,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return error("message inv size() = %u", vInv.size());
         }
 
-        LOCK(cs_main);
+        LOCK_MAIN_TIMED(pfrom);
 
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
@@ -4099,15 +5439,33 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave) {
-                if (!fImporting && !fReindex) {
-                    if (inv.type == MSG_BLOCK)
-                        AddBlockToQueue(pfrom->GetId(), inv.hash);
-                    else
-                        pfrom->AskFor(inv);
-                }
-            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                PushGetBlocks(pfrom, chainActive.Tip(), GetOrphanRoot(inv.hash));
+            if (inv.type == MSG_BLOCK)
+                UpdateBlockAvailability(pfrom->GetId(), inv.hash);
+
+            if (!fAlreadyHave && !fImporting && !fReindex) {
+                if (inv.type == MSG_BLOCK) {
+                    if (!mapBlocksInFlight.count(inv.hash)) {
+                        // First request the headers preceding the announced block. In the normal fully-synced
+                        // case where a new block is announced that succeeds the current tip (no reorganization),
+                        // there are no such headers.
+                        // Secondly, and only when we are close to being synced, we request the announced block directly,
+                        // to avoid an extra round-trip. Note that we must *first* ask for the headers, so by the
+                        // time the block arrives, the header chain leading up to it is already validated. Not
+                        // doing this will result in the received block being rejected as an orphan in case it is
+                        // not a direct successor.
+                        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                        if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - nTargetSpacing * 20) {
+                            // A fresh block's transactions are likely in our mempool already
+                            vector<CInv> vGetData(1, inv);
+                            if (State(pfrom->GetId())->fProvidesHeaderAndIDs)
+                                vGetData[0].type = MSG_CMPCT_BLOCK;
+                            pfrom->PushMessage("getdata", vGetData);
+                            MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                        }
+                        LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    }
+                } else
+                    pfrom->AskFor(inv);
             }
 
             // Track requests for our stuff
@@ -4146,7 +5504,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
-        LOCK(cs_main);
+        LOCK_MAIN_TIMED(pfrom);
 
         // Find the last block the caller has in the main chain
         CBlockIndex* pindex = chainActive.FindFork(locator);
@@ -4163,6 +5521,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            // Don't announce blocks we can no longer serve
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            {
+                LogPrint("net", "  getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0)
             {
@@ -4181,7 +5545,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
-        LOCK(cs_main);
+        LOCK_MAIN_TIMED(pfrom);
 
         CBlockIndex* pindex = NULL;
         if (locator.IsNull())
@@ -4202,7 +5566,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = chainActive.Next(pindex))
         {
@@ -4213,6 +5577,56 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->PushMessage("headers", vHeaders);
     }
 
+    else if (strCommand == "headers" && !fImporting && !fReindex) // Ignore headers received while importing
+    {
+        std::vector<CBlockHeader> headers;
+
+        // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
+        unsigned int nCount = ReadCompactSize(vRecv);
+        if (nCount > MAX_HEADERS_RESULTS) {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("headers message size = %u", nCount);
+        }
+        headers.resize(nCount);
+        for (unsigned int n = 0; n < nCount; n++) {
+            vRecv >> headers[n];
+            ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
+        }
+
+        LOCK_MAIN_TIMED(pfrom);
+
+        if (nCount == 0) {
+            // Nothing interesting. Stop asking this peer for more headers.
+            return true;
+        }
+
+        CBlockIndex *pindexLast = NULL;
+        BOOST_FOREACH(const CBlockHeader& header, headers) {
+            CValidationState state;
+            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
+                Misbehaving(pfrom->GetId(), 20);
+                return error("non-continuous headers sequence");
+            }
+            if (!AcceptBlockHeader(header, state, &pindexLast)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid header received");
+                }
+            }
+        }
+
+        if (pindexLast)
+            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+
+        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+            // Headers message had its maximum size; the peer may have more headers.
+            LogPrint("net", "more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
+        }
+    }
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -4223,14 +5637,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
+        LOCK_MAIN_TIMED(pfrom);
 
         bool fMissingInputs = false;
         CValidationState state;
         if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
         {
             mempool.check(pcoinsTip);
-            RelayTransaction(tx, inv.hash);
+            RelayMempoolTransaction(tx, inv.hash);
             mapAlreadyAskedFor.erase(inv);
             vWorkQueue.push_back(inv.hash);
             vEraseQueue.push_back(inv.hash);
@@ -4245,16 +5659,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             set<NodeId> setMisbehaving;
             for (unsigned int i = 0; i < vWorkQueue.size(); i++)
             {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
+                // Orphans spending any output of this one; the outpoints of a
+                // transaction are next to each other in the index
+                set<mapOrphanTx_t::iterator, COrphanTxIteratorCompare> setOrphans;
+                mapOrphanTxByPrev_t::iterator itByPrev = mapOrphanTransactionsByPrev.lower_bound(COutPoint(vWorkQueue[i], 0));
+                for (; itByPrev != mapOrphanTransactionsByPrev.end() && itByPrev->first.hash == vWorkQueue[i]; ++itByPrev)
+                    setOrphans.insert(itByPrev->second.begin(), itByPrev->second.end());
+                for (set<mapOrphanTx_t::iterator, COrphanTxIteratorCompare>::iterator mi = setOrphans.begin();
+                     mi != setOrphans.end();
                      ++mi)
                 {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
+                    const uint256& orphanHash = (*mi)->first;
+                    const CTransaction& orphanTx = (*mi)->second.tx;
+                    NodeId fromPeer = (*mi)->second.fromPeer;
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
                     // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
@@ -4268,7 +5685,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
                     {
                         LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx, orphanHash);
+                        RelayMempoolTransaction(orphanTx, orphanHash);
                         mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
                         vWorkQueue.push_back(orphanHash);
                     }
@@ -4298,7 +5715,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-        	unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        	unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, MAX_ORPHAN_TOTAL_SIZE);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         }
@@ -4326,18 +5743,177 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
+        LOCK_MAIN_TIMED(pfrom);
         // Remember who we got this block from.
         mapBlockSource[inv.hash] = pfrom->GetId();
         MarkBlockAsReceived(inv.hash, pfrom->GetId());
 
         CValidationState state;
         ProcessBlock(state, pfrom, &block);
+        int nDoS;
+        if (state.IsInvalid(nDoS)) {
+            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                               state.GetRejectReason(), inv.hash);
+            if (nDoS > 0)
+                Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        LOCK_MAIN_TIMED(pfrom);
+
+        if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+            // Doesn't connect to anything we know yet; catch up on headers first
+            if (!IsInitialBlockDownload())
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256(0));
+            return true;
+        }
+
+        CBlockIndex *pindex = NULL;
+        CValidationState state;
+        if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid header received in cmpctblock from peer=%d", pfrom->id);
+            }
+            return true;
+        }
+
+        uint256 hash = pindex->GetBlockHash();
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+        UpdateBlockAvailability(pfrom->GetId(), hash);
+
+        // Nothing to do if we have it, or if it wouldn't become our tip
+        if ((pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nChainWork <= chainActive.Tip()->nChainWork)
+            return true;
+
+        // Its parent has to be connectable for the mempool to be any help;
+        // otherwise the normal block download picks it up
+        if (pindex->pprev->nChainTx == 0)
+            return true;
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+        if (itInFlight != mapBlocksInFlight.end()) {
+            if (itInFlight->second.first != pfrom->GetId() || itInFlight->second.second->partialBlock)
+                return true;
+        }
+
+        boost::shared_ptr<CPartialBlock> partialBlock(new CPartialBlock());
+        ReadStatus status = partialBlock->InitData(cmpctblock, mempool);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(hash);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("invalid compact block %s from peer=%d", hash.ToString(), pfrom->id);
+        }
+
+        MarkBlockAsInFlight(pfrom->GetId(), hash, pindex);
+        if (status == READ_STATUS_FAILED) {
+            vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+            pfrom->PushMessage("getdata", vGetData);
+            return true;
+        }
+
+        CBlockTransactionsRequest req;
+        req.hashBlock = hash;
+        for (unsigned int i = 0; i < cmpctblock.BlockTxCount(); i++)
+            if (!partialBlock->IsTxAvailable(i))
+                req.vIndexes.push_back(i);
+
+        if (req.vIndexes.empty()) {
+            CBlock block;
+            if (partialBlock->FillBlock(block, vector<CTransaction>()) != READ_STATUS_OK) {
+                vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+            ProcessReconstructedBlock(pfrom, block);
+        } else {
+            mapBlocksInFlight[hash].second->partialBlock = partialBlock;
+            pfrom->PushMessage("getblocktxn", req);
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK_MAIN_TIMED(pfrom);
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.hashBlock);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "peer=%d asked for transactions of unknown block %s\n", pfrom->id, req.hashBlock.ToString());
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            return error("getblocktxn : failed to read block %s", req.hashBlock.ToString());
+
+        if (mi->second->nHeight < chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+            // Nobody should be rebuilding a block this old from their mempool
+            pfrom->PushMessage("block", block);
+            return true;
+        }
+
+        CBlockTransactions resp(req);
+        for (unsigned int i = 0; i < req.vIndexes.size(); i++) {
+            if (req.vIndexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("getblocktxn with out-of-bounds tx index from peer=%d", pfrom->id);
+            }
+            resp.vtx[i] = block.vtx[req.vIndexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK_MAIN_TIMED(pfrom);
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.hashBlock);
+        if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId() ||
+            !itInFlight->second.second->partialBlock) {
+            LogPrint("net", "peer=%d sent transactions for block %s we weren't expecting\n", pfrom->id, resp.hashBlock.ToString());
+            return true;
+        }
+
+        boost::shared_ptr<CPartialBlock> partialBlock = itInFlight->second.second->partialBlock;
+        itInFlight->second.second->partialBlock.reset();
+
+        CBlock block;
+        ReadStatus status = partialBlock->FillBlock(block, resp.vtx);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.hashBlock);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("invalid blocktxn for block %s from peer=%d", resp.hashBlock.ToString(), pfrom->id);
+        } else if (status == READ_STATUS_FAILED) {
+            // A short id matched the wrong mempool transaction; get the real thing
+            vector<CInv> vGetData(1, CInv(MSG_BLOCK, resp.hashBlock));
+            pfrom->PushMessage("getdata", vGetData);
+        } else {
+            ProcessReconstructedBlock(pfrom, block);
+        }
     }
 
+
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4345,7 +5921,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "mempool")
     {
-        LOCK2(cs_main, pfrom->cs_filter);
+        LOCK(pfrom->cs_filter);
 
         std::vector<uint256> vtxid;
         mempool.queryHashes(vtxid);
@@ -4448,28 +6024,35 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        int nDoS = 0;
         {
-            if (alert.ProcessAlert())
+            LOCK(cs_mapAlerts); // setKnown is filled in by relays from other peers' handlers
+            if (pfrom->setKnown.count(alertHash) == 0)
             {
-                // Relay
-                pfrom->setKnown.insert(alertHash);
+                if (alert.ProcessAlert())
                 {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        alert.RelayTo(pnode);
+                    // Relay
+                    pfrom->setKnown.insert(alertHash);
+                    {
+                        LOCK(cs_vNodes);
+                        BOOST_FOREACH(CNode* pnode, vNodes)
+                            alert.RelayTo(pnode);
+                    }
+                }
+                else {
+                    // Small DoS penalty so peers that send us lots of
+                    // duplicate/expired/invalid-signature/whatever alerts
+                    // eventually get banned.
+                    // This isn't a Misbehaving(100) (immediate ban) because the
+                    // peer might be an older or different implementation with
+                    // a different signature key, etc.
+                    nDoS = 10;
                 }
-            }
-            else {
-                // Small DoS penalty so peers that send us lots of
-                // duplicate/expired/invalid-signature/whatever alerts
-                // eventually get banned.
-                // This isn't a Misbehaving(100) (immediate ban) because the
-                // peer might be an older or different implementation with
-                // a different signature key, etc.
-                Misbehaving(pfrom->GetId(), 10);
             }
         }
+        // Misbehaving takes cs_main, which GetWarnings callers hold while
+        // taking cs_mapAlerts
+        Misbehaving(pfrom->GetId(), nDoS);
     }
 
     else if (strCommand == "filterload")
@@ -4566,8 +6149,13 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
-    if (!pfrom->vRecvGetData.empty())
+    if (!pfrom->vRecvGetData.empty()) {
+        // Serving the rest of an earlier getdata
+        int64_t nStart = GetTimeMicros();
+        pfrom->nMainWaitMicros = 0;
         ProcessGetData(pfrom);
+        pfrom->RecordMessageRecv("getdata", 0, GetTimeMicros() - nStart, pfrom->nMainWaitMicros);
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -4626,6 +6214,8 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nStart = GetTimeMicros();
+        pfrom->nMainWaitMicros = 0;
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv);
@@ -4657,6 +6247,7 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        pfrom->RecordMessageRecv(strCommand, CMessageHeader::HEADER_SIZE + nMessageSize, GetTimeMicros() - nStart, pfrom->nMainWaitMicros);
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand, nMessageSize);
@@ -4703,46 +6294,19 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 			pto->PushMessage("ping", nonce);
         }
 
-        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
-        if (!lockMain)
-            return true;
-
-        // Address refresh broadcast
-        static int64_t nLastRebroadcast;
-        if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60))
-        {
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                {
-                    // Periodically clear setAddrKnown to allow refresh broadcasts
-                    if (nLastRebroadcast)
-                        pnode->setAddrKnown.clear();
-
-                    // Rebroadcast our address
-                    if (!fNoListen)
-                    {
-                        CAddress addr = GetLocalAddress(&pnode->addr);
-                        if (addr.IsRoutable())
-                            pnode->PushAddress(addr);
-                    }
-                }
-            }
-            nLastRebroadcast = GetTime();
-        }
-
         //
         // Message: addr
         //
         if (fSendTrickle)
         {
+            LOCK(pto->cs_addrSend);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                if (!pto->filterAddrKnown.contains(addr.GetKey()))
                 {
+                    pto->filterAddrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000)
@@ -4757,35 +6321,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 pto->PushMessage("addr", vAddr);
         }
 
-        CNodeState &state = *State(pto->GetId());
-        if (state.fShouldBan) {
-            if (pto->addr.IsLocal())
-                LogPrintf("Warning: not banning local node %s!\n", pto->addr.ToString());
-            else {
-                pto->fDisconnect = true;
-                CNode::Ban(pto->addr);
-            }
-            state.fShouldBan = false;
-        }
-
-        BOOST_FOREACH(const CBlockReject& reject, state.rejects)
-            pto->PushMessage("reject", (string)"block", reject.chRejectCode, reject.strRejectReason, reject.hashBlock);
-        state.rejects.clear();
-
-        // Start block sync
-        if (pto->fStartSync && !fImporting && !fReindex) {
-            pto->fStartSync = false;
-            PushGetBlocks(pto, chainActive.Tip(), uint256(0));
-        }
-
-        // Resend wallet transactions that haven't gotten in a block yet
-        // Except during reindex, importing and IBD, when old wallet
-        // transactions become unconfirmed and spams other nodes.
-        if (!fReindex && !fImporting && !IsInitialBlockDownload())
-        {
-            g_signals.Broadcast();
-        }
-
         //
         // Message: inventory
         //
@@ -4797,16 +6332,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
                     // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
+                    static const uint256 hashSalt = GetRandHash();
                     uint256 hashRand = inv.hash ^ hashSalt;
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     bool fTrickleWait = ((hashRand & 3) != 0);
@@ -4818,15 +6351,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -4835,31 +6365,113 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             pto->PushMessage("inv", vInv);
 
 
+        // Everything above only touches this peer; the rest needs chain state
+        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
+        if (!lockMain)
+            return true;
+
+        // Address refresh broadcast
+        static int64_t nLastRebroadcast;
+        if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60))
+        {
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    // Periodically clear filterAddrKnown to allow refresh broadcasts
+                    if (nLastRebroadcast) {
+                        LOCK(pnode->cs_addrSend);
+                        pnode->filterAddrKnown.reset();
+                    }
+
+                    // Rebroadcast our address
+                    if (!fNoListen)
+                    {
+                        CAddress addr = GetLocalAddress(&pnode->addr);
+                        if (addr.IsRoutable())
+                            pnode->PushAddress(addr);
+                    }
+                }
+            }
+            nLastRebroadcast = GetTime();
+        }
+
+        CNodeState &state = *State(pto->GetId());
+        if (state.fShouldBan) {
+            if (pto->addr.IsLocal())
+                LogPrintf("Warning: not banning local node %s!\n", pto->addr.ToString());
+            else {
+                pto->fDisconnect = true;
+                CNode::Ban(pto->addr);
+            }
+            state.fShouldBan = false;
+        }
+
+        BOOST_FOREACH(const CBlockReject& reject, state.rejects)
+            pto->PushMessage("reject", (string)"block", reject.chRejectCode, reject.strRejectReason, reject.hashBlock);
+        state.rejects.clear();
+
+        // Start block sync
+        if (pindexBestHeader == NULL)
+            pindexBestHeader = chainActive.Tip();
+        bool fFetch = !pto->fInbound || (pindexBestHeader && (state.pindexLastCommonBlock ? state.pindexLastCommonBlock->nHeight : 0) + 720 > pindexBestHeader->nHeight); // Download if this is a nice peer, or we're not too far behind.
+        if (!state.fSyncStarted && !pto->fClient && fFetch && !fImporting && !fReindex) {
+            // Only actively request headers from a single peer, unless we're close to today.
+            if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 24 * 60 * 60) {
+                state.fSyncStarted = true;
+                nSyncStarted++;
+                CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+            }
+        }
+
+        // Resend wallet transactions that haven't gotten in a block yet
+        // Except during reindex, importing and IBD, when old wallet
+        // transactions become unconfirmed and spams other nodes.
+        if (!fReindex && !fImporting && !IsInitialBlockDownload())
+        {
+            g_signals.Broadcast();
+        }
+
         // Detect stalled peers. Require that blocks are in flight, we haven't
         // received a (requested) block in one minute, and that all blocks are
         // in flight for over two minutes, since we first had a chance to
         // process an incoming block.
         int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nBlocksInFlight && 
-            state.nLastBlockReceive < state.nLastBlockProcess - BLOCK_DOWNLOAD_TIMEOUT*1000000 && 
-            state.vBlocksInFlight.front().nTime < state.nLastBlockProcess - 2*BLOCK_DOWNLOAD_TIMEOUT*1000000) {
+            state.nLastBlockReceive < pto->nLastMessageProcess - BLOCK_DOWNLOAD_TIMEOUT*1000000 && 
+            state.vBlocksInFlight.front().nTime < pto->nLastMessageProcess - 2*BLOCK_DOWNLOAD_TIMEOUT*1000000) {
             LogPrintf("Peer %s is stalling block download, disconnecting\n", state.name.c_str());
             pto->fDisconnect = true;
         }
+        // The peer holding up the download window had its chance to deliver
+        if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
+            LogPrintf("Peer %s is stalling block download window, disconnecting\n", state.name.c_str());
+            pto->fDisconnect = true;
+        }
 
         //
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        while (!pto->fDisconnect && state.nBlocksToDownload && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-            uint256 hash = state.vBlocksToDownload.front();
-            vGetData.push_back(CInv(MSG_BLOCK, hash));
-            MarkBlockAsInFlight(pto->GetId(), hash);
-            LogPrint("net", "Requesting block %s from %s\n", hash.ToString().c_str(), state.name.c_str());
-            if (vGetData.size() >= 1000)
-            {
-                pto->PushMessage("getdata", vGetData);
-                vGetData.clear();
+        if (!pto->fDisconnect && !pto->fClient && !fImporting && !fReindex && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+            // Blocks the snapshot validation is waiting for come first
+            vector<CBlockIndex*> vToDownload;
+            FindSnapshotBlocksToDownload(MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload);
+            NodeId staller = -1;
+            if (fFetch)
+                FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight - vToDownload.size(), vToDownload, staller);
+            BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
+                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
+                LogPrint("net", "Requesting block %s (%d) from %s\n", pindex->GetBlockHash().ToString(), pindex->nHeight, state.name.c_str());
+            }
+            if (state.nBlocksInFlight == 0 && staller != -1) {
+                if (State(staller)->nStallingSince == 0) {
+                    State(staller)->nStallingSince = nNow;
+                    LogPrint("net", "Stall started peer=%d\n", staller);
+                }
             }
         }
 
@@ -4900,15 +6512,10 @@ public:
             delete (*it1).second;
         mapBlockIndex.clear();
 
-        // orphan blocks
-        std::map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.begin();
-        for (; it2 != mapOrphanBlocks.end(); it2++)
-            delete (*it2).second;
-        mapOrphanBlocks.clear();
-
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanBytesByPeer.clear();
     }
 } instance_of_cmaincleanup;
 
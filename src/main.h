@@ -11,6 +11,7 @@
 #include "bitmark-config.h"
 #endif
 
+#include "blockcache.h"
 #include "chainparams.h"
 #include "coins.h"
 #include "core.h"
@@ -29,6 +30,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/function.hpp>
+
 class CBlockIndex;
 class CBloomFilter;
 class CInv;
@@ -42,12 +45,26 @@ static const unsigned int DEFAULT_BLOCK_MIN_SIZE = 0;
 static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 50000;
 /** The maximum size for transactions we're willing to relay/mine */
 static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
+/** Defaults for -limitancestorcount and -limitdescendantcount, the longest chains of unconfirmed transactions accepted */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Defaults for -limitancestorsize and -limitdescendantsize, in kilobytes */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** The maximum allowed number of signature check operations in a block (network rule) */
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
-/** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
-static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
+/** Larger orphans are not kept; their sender is expected to send them again once the parents are in */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Most bytes of orphan transactions kept in memory, over all peers */
+static const unsigned int MAX_ORPHAN_TOTAL_SIZE = 250000;
+/** Most bytes of orphan transactions kept from any one peer */
+static const unsigned int MAX_ORPHAN_PEER_SIZE = 50000;
+/** Seconds an orphan transaction is kept waiting for its inputs */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum seconds between sweeps for expired orphans */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -60,10 +77,28 @@ static const int COINBASE_MATURITY = 720;
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Relay new blocks to compact block peers ahead of script validation */
+static const bool DEFAULT_FASTBLOCKRELAY = false;
 /** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds before considering a block download peer unresponsive. */
 static const unsigned int BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
+static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Size of the "block download window": how far ahead of our current height do we fetch?
+ *  Larger windows tolerate larger download speed differences between peers, but increase the potential
+ *  degree of disordering of blocks on disk (which make reindexing and pruning harder). */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Number of headers sent in one getheaders result. */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Block files containing a block within MIN_BLOCKS_TO_KEEP of the tip are never pruned (about two days of blocks). */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 1440;
+/** Minimum disk space (in bytes) that -prune may target for block and undo files. */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
+/** GetTransaction searches at most this many blocks the txindex has not caught up with yet. */
+static const int MAX_UNINDEXED_TX_SEARCH = 100;
+/** Blocks below an imported UTXO snapshot are downloaded at most this far ahead of its validation. */
+static const int SNAPSHOT_DOWNLOAD_WINDOW = 1024;
 
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
@@ -84,6 +119,7 @@ static const unsigned char REJECT_CHECKPOINT = 0x43;
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+extern CBlockCache blockcache;
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
@@ -93,14 +129,35 @@ extern bool fImporting;
 extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
-extern bool fTxIndex;
+/** True if -prune is set: old block and undo files are deleted to stay below nPruneTarget */
+extern bool fPruneMode;
+/** True if any block files have ever been pruned (persisted in the block tree) */
+extern bool fHavePruned;
+/** True if -fastblockrelay is set: new blocks go out as compact blocks before their scripts are checked */
+extern bool fFastBlockRelay;
+/** Number of bytes of block and undo files to keep on disk in prune mode */
+extern uint64_t nPruneTarget;
 extern unsigned int nCoinCacheSize;
+/** Best header we've seen so far (used for getheaders queries' starting points). */
+extern CBlockIndex *pindexBestHeader;
+/** Ancestors of this block skip script verification when connected (-assumevalid, 0 = none) */
+extern uint256 hashAssumeValid;
+/** Notified whenever the tip of the active chain changes */
+extern boost::condition_variable cvBlockChange;
+extern boost::mutex csBlockChange;
+/** Hash of the active chain's tip, guarded by csBlockChange so its waiters needn't take cs_main */
+extern uint256 hashBlockChangeTip;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
 class CCoinsDB;
+class CCoinsSnapshotHeader;
+class CCoinsViewDB;
 class CBlockTreeDB;
+class CChainIndexDB;
+class CTxIndexDB;
+class CAddressIndexDB;
 class CTxUndo;
 class CScriptCheck;
 class CValidationState;
@@ -123,8 +180,6 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals);
 /** Unregister a network node */
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
-void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
-
 /** Process an incoming block */
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
 /** Check whether enough disk space is available for an incoming block */
@@ -143,18 +198,32 @@ bool LoadBlockIndex();
 void UnloadBlockIndex();
 /** Verify consistency of the block and coin databases */
 bool VerifyDB(int nCheckLevel, int nCheckDepth);
+/** Write the coin database and the active chain's block index to a UTXO snapshot file */
+bool DumpUTXOSnapshot(const boost::filesystem::path &path, CCoinsSnapshotHeader &header);
+/** Replace an empty chain state with the contents of a UTXO snapshot file */
+bool LoadUTXOSnapshot(const boost::filesystem::path &path);
+/** Prepare the background validation of an imported UTXO snapshot; returns whether one is pending */
+bool InitSnapshotValidation();
+/** Height of a UTXO snapshot that is still being validated, and how far validation got */
+bool GetSnapshotValidationProgress(int &nHeight, int &nValidatedHeight);
+/** Replay the block chain history below an imported UTXO snapshot and compare the result with it */
+void ThreadValidateSnapshot();
+/** Bring an optional index up to date with the active chain and keep following it */
+void ThreadSyncIndex(CChainIndexDB *pindexdb);
 /** Print the loaded block tree */
 void PrintBlockTree();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
-/** Run an instance of the script checking thread */
+/** Run a worker of the block validation check queue (scripts, proof of work, hashing and prefetches) */
 void ThreadScriptCheck();
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
 unsigned int ComputeMinWork(unsigned int nBase, int64_t nTime);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
+/** Whether pindex is the -assumevalid block or one of its ancestors, so its scripts needn't be verified. Requires cs_main. */
+bool IsAssumedValid(const CBlockIndex* pindex);
 /** Format a string that describes several potential problems detected by the core */
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -185,8 +254,32 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
 struct CNodeStateStats {
     int nMisbehavior;
+    int nSyncHeight;
+    int nCommonHeight;
+    std::vector<int> vHeightInFlight;
+};
+
+/** A transaction we don't have the inputs of yet, kept until they turn up */
+struct COrphanTx {
+    CTransaction tx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
+};
+
+typedef std::map<uint256, COrphanTx> mapOrphanTx_t;
+
+// Orders entries of mapOrphanTransactions by the txid they point to
+struct COrphanTxIteratorCompare {
+    bool operator()(const mapOrphanTx_t::iterator& a, const mapOrphanTx_t::iterator& b) const
+    {
+        return a->first < b->first;
+    }
 };
 
+/** Orphans spending each outpoint */
+typedef std::map<COutPoint, std::set<mapOrphanTx_t::iterator, COrphanTxIteratorCompare> > mapOrphanTxByPrev_t;
+
 struct CDiskTxPos : public CDiskBlockPos
 {
     unsigned int nTxOffset; // after header
@@ -286,63 +379,67 @@ public:
         READWRITE(vtxundo);
     )
 
-    bool WriteToDisk(CDiskBlockPos &pos, const uint256 &hashBlock)
-    {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
-        if (!fileout)
-            return error("CBlockUndo::WriteToDisk : OpenUndoFile failed");
-
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(Params().MessageStart()) << nSize;
-
-        // Write undo data
-        long fileOutPos = ftell(fileout);
-        if (fileOutPos < 0)
-            return error("CBlockUndo::WriteToDisk : ftell failed");
-        pos.nPos = (unsigned int)fileOutPos;
-        fileout << *this;
-
-        // calculate & write checksum
-        CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
-        hasher << hashBlock;
-        hasher << *this;
-        fileout << hasher.GetHash();
-
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout);
-        if (!IsInitialBlockDownload())
-            FileCommit(fileout);
-
-        return true;
-    }
+    // pblockCompact selects the compact encoding (CBlockUndoCompressor) for that block
+    bool WriteToDisk(CDiskBlockPos &pos, const uint256 &hashBlock, const CBlock *pblockCompact = NULL);
+    bool ReadFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock, const CBlock *pblockCompact = NULL);
+};
 
-    bool ReadFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock)
-    {
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
-
-        // Read block
-        uint256 hashChecksum;
-        try {
-            filein >> *this;
-            filein >> hashChecksum;
-        }
-        catch (std::exception &e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+/** Compact serialization of a CBlockUndo, relative to the block it undoes.
+ *
+ *  The transaction and input counts are checked against the block, and
+ *  each spent output is written with CTxInUndoCompressor, so standard
+ *  scriptPubKeys are not repeated when the spending scriptSig implies them.
+ */
+class CBlockUndoCompressor
+{
+private:
+    CBlockUndo &blockundo;
+    const CBlock &block;
+
+public:
+    CBlockUndoCompressor(CBlockUndo &blockundoIn, const CBlock &blockIn) : blockundo(blockundoIn), block(blockIn) { }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        unsigned int nSize = GetSizeOfCompactSize(blockundo.vtxundo.size());
+        for (unsigned int i = 0; i < blockundo.vtxundo.size(); i++) {
+            CTxUndo &txundo = blockundo.vtxundo[i];
+            nSize += GetSizeOfCompactSize(txundo.vprevout.size());
+            for (unsigned int j = 0; j < txundo.vprevout.size(); j++)
+                nSize += ::GetSerializeSize(CTxInUndoCompressor(txundo.vprevout[j], block.vtx[i+1].vin[j].scriptSig), nType, nVersion);
         }
+        return nSize;
+    }
 
-        // Verify checksum
-        CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
-        hasher << hashBlock;
-        hasher << *this;
-        if (hashChecksum != hasher.GetHash())
-            return error("CBlockUndo::ReadFromDisk : Checksum mismatch");
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        assert(blockundo.vtxundo.size() + 1 == block.vtx.size());
+        WriteCompactSize(s, blockundo.vtxundo.size());
+        for (unsigned int i = 0; i < blockundo.vtxundo.size(); i++) {
+            CTxUndo &txundo = blockundo.vtxundo[i];
+            assert(txundo.vprevout.size() == block.vtx[i+1].vin.size());
+            WriteCompactSize(s, txundo.vprevout.size());
+            for (unsigned int j = 0; j < txundo.vprevout.size(); j++)
+                ::Serialize(s, CTxInUndoCompressor(txundo.vprevout[j], block.vtx[i+1].vin[j].scriptSig), nType, nVersion);
+        }
+    }
 
-        return true;
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        uint64_t nTx = ReadCompactSize(s);
+        if (nTx + 1 != block.vtx.size())
+            throw std::ios_base::failure("CBlockUndoCompressor : transaction count mismatch");
+        blockundo.vtxundo.resize(nTx);
+        for (unsigned int i = 0; i < nTx; i++) {
+            CTxUndo &txundo = blockundo.vtxundo[i];
+            uint64_t nIn = ReadCompactSize(s);
+            if (nIn != block.vtx[i+1].vin.size())
+                throw std::ios_base::failure("CBlockUndoCompressor : input count mismatch");
+            txundo.vprevout.resize(nIn);
+            for (unsigned int j = 0; j < nIn; j++) {
+                CTxInUndoCompressor compressor(txundo.vprevout[j], block.vtx[i+1].vin[j].scriptSig);
+                ::Unserialize(s, compressor, nType, nVersion);
+            }
+        }
     }
 };
 
@@ -356,12 +453,14 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    boost::shared_ptr<const CSigHashCache> pSigHashCache; // shared by the checks of one transaction
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSigHashCache> &pSigHashCacheIn = boost::shared_ptr<const CSigHashCache>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pSigHashCache(pSigHashCacheIn) { }
 
     bool operator()() const;
 
@@ -371,6 +470,34 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        pSigHashCache.swap(check.pSigHashCache);
+    }
+};
+
+/** Unit of work for the block validation check queue: either a script check,
+ *  or any other closure returning whether it succeeded, such as a proof of
+ *  work check or a batch of transaction hashes. */
+class CBlockCheck
+{
+private:
+    CScriptCheck script;
+    boost::function<bool()> func;
+
+public:
+    CBlockCheck() {}
+    CBlockCheck(const boost::function<bool()> &funcIn) : func(funcIn) {}
+
+    bool operator()() const {
+        return func ? func() : script();
+    }
+
+    void swap(CScriptCheck &check) {
+        script.swap(check);
+    }
+
+    void swap(CBlockCheck &check) {
+        script.swap(check.script);
+        func.swap(check.func);
     }
 };
 
@@ -474,6 +601,7 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hash);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -486,15 +614,24 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 // Apply the effects of this block (with given index) on the UTXO set represented by coins
 bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
 
-// Add this block to the block index, and if necessary, switch the active block chain to this
-bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos& pos);
+// Add a header to the block index, without its transactions
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block);
+
+// Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS)
+bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBlockIndex* pindexNew, const CDiskBlockPos& pos);
+
+// Context-independent header checks: proof of work and timestamp
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
 
 // Context-independent validity checks
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+// With fUseCheckQueue, proof of work and transaction hashing run on the script check threads
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fUseCheckQueue = false);
 
 // Store block on disk
 // if dbp is provided, the file is known to already reside on disk
-bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp = NULL);
+bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp = NULL);
+// Check a block header against its parent and add it to the block index
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex = NULL);
 
 class CBlockFileInfo
 {
@@ -612,15 +749,22 @@ public:
     std::string GetRejectReason() const { return strRejectReason; }
 };
 
-/** The currently best known chain of headers (some of which may be invalid). */
+/** The most-work chain of fully received blocks (some of which may be invalid). */
 extern CChain chainMostWork;
 
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coin database below pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Optional indexes (-txindex, -addressindex), NULL when disabled. Updated by ThreadSyncIndex. */
+extern CTxIndexDB *ptxindexdb;
+extern CAddressIndexDB *paddressindexdb;
+
 struct CBlockTemplate
 {
     CBlock block;
@@ -647,6 +791,13 @@ public:
     // Note that this will call IsRelevantAndUpdate on the filter for each transaction,
     // thus the filter will likely be modified.
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
+    // The same, with the block's data elements extracted already
+    CMerkleBlock(const CBlock& block, CBloomFilter& filter, const CBloomBlockElements& elements);
+
+private:
+    void Init(const CBlock& block, CBloomFilter& filter, const CBloomBlockElements& elements);
+
+public:
 
     IMPLEMENT_SERIALIZE
     (
@@ -56,57 +56,266 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+// Mempool transactions whose scripts passed for an earlier template. Scripts
+// don't depend on the tip, so they needn't be run again; the set is replaced
+// with what went into each new template. Protected by cs_main.
+static set<uint256> setTemplateScriptsChecked;
+
+// The priority area is sorted by priority, then fee per byte:
+typedef std::pair<double, txiter> TxPriority;
+class TxPriorityCompare
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
+    bool operator()(const TxPriority& a, const TxPriority& b) const
+    {
+        if (a.first == b.first)
+            return (double)a.second->second.GetFee() * b.second->second.GetTxSize() <
+                   (double)b.second->second.GetFee() * a.second->second.GetTxSize();
+        return a.first < b.first;
+    }
+};
 
-    COrphan(const CTransaction* ptxIn)
+// Parents have fewer ancestors than their children, so this puts a package in block order
+struct CompareTxIterByAncestorCount
+{
+    bool operator()(const txiter& a, const txiter& b) const
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        return a->second.GetCountWithAncestors() < b->second.GetCountWithAncestors();
     }
+};
 
-    void print() const
+/** Fills a block template from the mempool. The priority area still has to
+ *  be sorted here, as priority changes with the height; after that whole
+ *  packages (a transaction and the ancestors it needs) are taken in the
+ *  order of the mempool's ancestor fee rate index. Needs cs_main and mempool.cs. */
+class CBlockAssembler
+{
+private:
+    CBlockTemplate& blocktemplate;
+    CBlockIndex* pindexPrev;
+    CCoinsViewCache& view;
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+    bool fPrintPriority;
+    setTxIter setInBlock;
+    setTxIter setFailed;
+
+    bool TestAndAdd(txiter it, double dPriority, double dFeePerKb);
+
+public:
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    int64_t nFees;
+    set<uint256> setScriptsChecked;
+
+    CBlockAssembler(CBlockTemplate& blocktemplateIn, CBlockIndex* pindexPrevIn, CCoinsViewCache& viewIn) :
+        blocktemplate(blocktemplateIn), pindexPrev(pindexPrevIn), view(viewIn),
+        nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0)
     {
-        LogPrintf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            LogPrintf("   setDependsOn %s\n", hash.ToString());
+        // Largest block you're willing to create:
+        nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+        // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+        nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+
+        // How much of the block should be dedicated to high-priority transactions,
+        // included regardless of the fees they pay
+        nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+        nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+        // Minimum block size you want to create; block will be filled with free transactions
+        // until there are no more or the block reaches this size:
+        nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+        nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+        fPrintPriority = GetBoolArg("-printpriority", false);
     }
+
+    void AddPriorityTxs();
+    void AddPackages();
 };
 
+bool CBlockAssembler::TestAndAdd(txiter it, double dPriority, double dFeePerKb)
+{
+    const CTransaction& tx = it->second.GetTx();
+    const uint256& hash = it->first;
+    if (tx.IsCoinBase() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
+        return false;
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+    // Size limits
+    unsigned int nTxSize = it->second.GetTxSize();
+    if (nBlockSize + nTxSize >= nBlockMaxSize)
+        return false;
 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, const CTransaction*> TxPriority;
-class TxPriorityCompare
+    // Legacy limits on sigOps:
+    unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    if (!view.HaveInputs(tx))
+        return false;
+
+    int64_t nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+
+    nTxSigOps += GetP2SHSigOpCount(tx, view);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    // Amounts and coinbase maturity are checked every time; scripts only if
+    // no earlier template did
+    CValidationState state;
+    if (!CheckInputs(tx, state, view, !setTemplateScriptsChecked.count(hash), SCRIPT_VERIFY_P2SH))
+        return false;
+    setScriptsChecked.insert(hash);
+
+    CTxUndo txundo;
+    UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight+1, hash);
+
+    // Added
+    blocktemplate.block.vtx.push_back(tx);
+    blocktemplate.vTxFees.push_back(nTxFees);
+    blocktemplate.vTxSigOps.push_back(nTxSigOps);
+    nBlockSize += nTxSize;
+    ++nBlockTx;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+    setInBlock.insert(it);
+
+    if (fPrintPriority)
+    {
+        LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+               dPriority, dFeePerKb, hash.ToString());
+    }
+    return true;
+}
+
+void CBlockAssembler::AddPriorityTxs()
 {
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // Transactions without unconfirmed parents to start with; the others
+    // become candidates once all their parents are in
+    unsigned int nHeight = pindexPrev->nHeight + 1;
+    vector<TxPriority> vecPriority;
+    for (txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+        if (it->second.GetCountWithAncestors() == 1)
+            vecPriority.push_back(TxPriority(it->second.GetPriority(nHeight), it));
+
+    TxPriorityCompare comparer;
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+    while (!vecPriority.empty())
     {
-        if (byFee)
+        // Take highest priority transaction off the priority queue:
+        double dPriority = vecPriority.front().first;
+        txiter it = vecPriority.front().second;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        if (setInBlock.count(it) || setFailed.count(it))
+            continue;
+
+        // The rest of the block goes by fee once past the priority size or
+        // out of high-priority transactions
+        if (nBlockSize + it->second.GetTxSize() >= nBlockPrioritySize || !AllowFree(dPriority))
+            break;
+
+        double dFeePerKb = double(it->second.GetFee()) / (double(it->second.GetTxSize())/1000.0);
+        if (!TestAndAdd(it, dPriority, dFeePerKb))
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            setFailed.insert(it);
+            continue;
         }
-        else
+
+        // Add transactions that depend on this one to the priority queue
+        std::map<COutPoint, CInPoint>::const_iterator itNext = mempool.mapNextTx.lower_bound(COutPoint(it->first, 0));
+        for (; itNext != mempool.mapNextTx.end() && itNext->first.hash == it->first; ++itNext)
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            txiter itChild = mempool.mapTx.find(itNext->second.ptx->GetHash());
+            if (itChild == mempool.mapTx.end() || setInBlock.count(itChild))
+                continue;
+            bool fReady = true;
+            BOOST_FOREACH(const CTxIn& txin, itChild->second.GetTx().vin)
+            {
+                txiter itParent = mempool.mapTx.find(txin.prevout.hash);
+                if (itParent != mempool.mapTx.end() && !setInBlock.count(itParent))
+                {
+                    fReady = false;
+                    break;
+                }
+            }
+            if (fReady)
+            {
+                vecPriority.push_back(TxPriority(itChild->second.GetPriority(nHeight), itChild));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            }
         }
     }
-};
+}
+
+void CBlockAssembler::AddPackages()
+{
+    for (std::set<txiter, CompareTxIterByAncestorFee>::const_iterator mi = mempool.setByAncestorFee.begin();
+         mi != mempool.setByAncestorFee.end(); ++mi)
+    {
+        txiter it = *mi;
+        if (setInBlock.count(it) || setFailed.count(it))
+            continue;
+
+        // The ancestors that aren't in yet have to come along. Mempool limits
+        // keep the walk short; most transactions have no ancestors at all.
+        setTxIter setAncestors;
+        if (it->second.GetCountWithAncestors() > 1)
+            mempool.CalculateAncestors(it->second.GetTx(), setAncestors);
+        vector<txiter> vPackage(1, it);
+        size_t nPackageSize = it->second.GetTxSize();
+        int64_t nPackageFees = it->second.GetFee();
+        bool fFailed = false;
+        BOOST_FOREACH(const txiter& itAncestor, setAncestors)
+        {
+            if (setInBlock.count(itAncestor))
+                continue;
+            if (setFailed.count(itAncestor))
+                fFailed = true;
+            vPackage.push_back(itAncestor);
+            nPackageSize += itAncestor->second.GetTxSize();
+            nPackageFees += itAncestor->second.GetFee();
+        }
+        if (fFailed)
+        {
+            setFailed.insert(it);
+            continue;
+        }
+
+        // Size limits
+        if (nBlockSize + nPackageSize >= nBlockMaxSize)
+            continue;
+
+        // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+        // client code rounds up the size to the nearest 1K. That's good, because it gives an
+        // incentive to create smaller transactions.
+        double dFeePerKb = double(nPackageFees) / (double(nPackageSize)/1000.0);
+
+        // Skip free transactions if we're past the minimum block size:
+        if ((dFeePerKb < CTransaction::nMinRelayTxFee) && (nBlockSize + nPackageSize >= nBlockMinSize))
+            continue;
+
+        std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+        BOOST_FOREACH(const txiter& itPackage, vPackage)
+        {
+            if (!TestAndAdd(itPackage, itPackage->second.GetPriority(pindexPrev->nHeight + 1), dFeePerKb))
+            {
+                // Nothing that needs it can go in either
+                setFailed.insert(itPackage);
+                setFailed.insert(it);
+                break;
+            }
+        }
+    }
+}
 
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
 {
@@ -153,21 +362,6 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Collect memory pool transactions into the block
     int64_t nFees = 0;
     {
@@ -175,179 +369,14 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
         CBlockIndex* pindexPrev = chainActive.Tip();
         CCoinsViewCache view(*pcoinsTip, true);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
+        CBlockAssembler assembler(*pblocktemplate, pindexPrev, view);
+        assembler.AddPriorityTxs();
+        assembler.AddPackages();
+        setTemplateScriptsChecked.swap(assembler.setScriptsChecked);
+        nFees = assembler.nFees;
 
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < CTransaction::nMinRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            int64_t nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH))
-                continue;
-
-            CTxUndo txundo;
-            uint256 hash = tx.GetHash();
-            UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight+1, hash);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
-
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
+        nLastBlockTx = assembler.nBlockTx;
+        nLastBlockSize = assembler.nBlockSize;
         //LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
 
 	if (pindexPrev->nHeight>=nForkHeight-1 && CBlockIndex::IsSuperMajority(4,pindexPrev,75,100)) {
@@ -430,6 +459,85 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
 
+CBlockTemplateManager templateManager;
+
+CBlockTemplateManager::CBlockTemplateManager() : nLastId(0), nExtraNonce(0)
+{
+}
+
+CBlockTemplateManager::~CBlockTemplateManager()
+{
+    for (int i = 0; i < NUM_ALGOS; i++)
+        delete vEntry[i].pblocktemplate;
+}
+
+CBlockTemplateManager::CEntry* CBlockTemplateManager::Refresh(int algo)
+{
+    if (algo < 0 || algo >= NUM_ALGOS)
+        return NULL;
+    CEntry& entry = vEntry[algo];
+
+    if (entry.pblocktemplate && entry.pindexPrev == chainActive.Tip() &&
+        (mempool.GetTransactionsUpdated() == entry.nTransactionsUpdated || GetTime() - entry.nTime <= TEMPLATE_REFRESH_SECONDS))
+        return &entry;
+
+    // The coinbase script is filled in for each copy
+    unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    CBlockTemplate* pblocktemplate = CreateNewBlock(CScript() << OP_TRUE, algo);
+    if (!pblocktemplate)
+        return NULL;
+
+    delete entry.pblocktemplate;
+    entry.pblocktemplate = pblocktemplate;
+    entry.pindexPrev = chainActive.Tip();
+    entry.nTransactionsUpdated = nTransactionsUpdated;
+    entry.nTime = GetTime();
+    entry.nId = ++nLastId;
+    return &entry;
+}
+
+unsigned int CBlockTemplateManager::Update(int algo)
+{
+    // cs_main first, as callers like getwork already hold it
+    LOCK2(cs_main, cs);
+    CEntry* pentry = Refresh(algo);
+    return pentry ? pentry->nId : 0;
+}
+
+CBlockTemplate* CBlockTemplateManager::Get(int algo, const CScript& scriptPubKey, CBlockIndex*& pindexPrev, unsigned int& nId)
+{
+    LOCK2(cs_main, cs);
+    CEntry* pentry = Refresh(algo);
+    if (!pentry)
+        return NULL;
+
+    CBlockTemplate* pblocktemplate = new CBlockTemplate(*pentry->pblocktemplate);
+    CBlock* pblock = &pblocktemplate->block;
+    pblock->vtx[0].vout[0].scriptPubKey = scriptPubKey;
+    ::IncrementExtraNonce(pblock, pentry->pindexPrev, nExtraNonce);
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+
+    pindexPrev = pentry->pindexPrev;
+    nId = pentry->nId;
+    return pblocktemplate;
+}
+
+void CBlockTemplateManager::IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev)
+{
+    LOCK(cs);
+    ::IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+}
+
+void CBlockTemplateManager::Clear()
+{
+    LOCK(cs);
+    for (int i = 0; i < NUM_ALGOS; i++)
+    {
+        delete vEntry[i].pblocktemplate;
+        vEntry[i] = CEntry();
+    }
+}
+
 
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1)
 {
@@ -484,16 +592,6 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 double dHashesPerSec = 0.0;
 int64_t nHPSTimerStart = 0;
 
-CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, int algo)
-{
-    CPubKey pubkey;
-    if (!reservekey.GetReservedKey(pubkey))
-        return NULL;
-
-    CScript scriptPubKey = CScript() << pubkey << OP_CHECKSIG;
-    return CreateNewBlock(scriptPubKey,algo);
-}
-
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
     uint256 hash;
@@ -544,9 +642,8 @@ void static BitmarkMiner(CWallet *pwallet)
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("bitmark-miner");
 
-    // Each thread has its own key and counter
+    // Each thread has its own key; templates and extranonces come from templateManager
     CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
 
     int n_blocks_created = 0;
 
@@ -569,14 +666,17 @@ void static BitmarkMiner(CWallet *pwallet)
         // Create new block
         //
         unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrev = chainActive.Tip();
+        CPubKey pubkey;
+        if (!reservekey.GetReservedKey(pubkey))
+            return;
+        CBlockIndex* pindexPrev;
+        unsigned int nTemplateId;
 
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
+        auto_ptr<CBlockTemplate> pblocktemplate(templateManager.Get(miningAlgo, CScript() << pubkey << OP_CHECKSIG, pindexPrev, nTemplateId));
 	n_blocks_created++;
         if (!pblocktemplate.get())
             return;
         CBlock *pblock = &pblocktemplate->block;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
 	//printf("Running BitmarkMiner with %lu transactions in block (%u bytes)\n", pblock->vtx.size(),
 	//::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
 
@@ -7,6 +7,9 @@
 #ifndef BITMARK_MINER_H
 #define BITMARK_MINER_H
 
+#include "pureheader.h"
+#include "sync.h"
+
 #include <stdint.h>
 
 class CBlock;
@@ -20,7 +23,6 @@ class CWallet;
 void GenerateBitmarks(bool fGenerate, CWallet* pwallet, int nThreads);
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo=-1);
-CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, int algo=-1);
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Do mining precalculation */
@@ -30,6 +32,55 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 /** Base sha256 mining transform */
 void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
+/** Seconds a template is kept after the mempool has changed */
+static const int64_t TEMPLATE_REFRESH_SECONDS = 5;
+
+/** The current block template for each algo, shared by getblocktemplate,
+ *  getauxblock, getwork and the internal miner so that callers polling for
+ *  work don't each run CreateNewBlock. A template is rebuilt when the tip
+ *  changes, or when the mempool has changed and the template is older than
+ *  TEMPLATE_REFRESH_SECONDS. Callers get copies paying to their own script. */
+class CBlockTemplateManager
+{
+private:
+    struct CEntry
+    {
+        CBlockTemplate* pblocktemplate;
+        CBlockIndex* pindexPrev;
+        unsigned int nTransactionsUpdated;
+        int64_t nTime;
+        unsigned int nId;
+
+        CEntry() : pblocktemplate(NULL), pindexPrev(NULL), nTransactionsUpdated(0), nTime(0), nId(0) {}
+    };
+
+    CCriticalSection cs;
+    CEntry vEntry[NUM_ALGOS];
+    unsigned int nLastId;
+    unsigned int nExtraNonce;
+
+    // Rebuild algo's template if it is stale; NULL if that failed. Needs cs_main and cs.
+    CEntry* Refresh(int algo);
+
+public:
+    CBlockTemplateManager();
+    ~CBlockTemplateManager();
+
+    /** Rebuild algo's template if it is stale and return its id, which is
+     *  new with every rebuild; 0 if there is no template */
+    unsigned int Update(int algo);
+    /** A copy of algo's current template paying to scriptPubKey, with an
+     *  extranonce no other copy for this tip has. Returns NULL on failure,
+     *  otherwise the caller owns the copy. */
+    CBlockTemplate* Get(int algo, const CScript& scriptPubKey, CBlockIndex*& pindexPrev, unsigned int& nId);
+    /** Give a copy the next free extranonce */
+    void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev);
+    /** Drop all templates */
+    void Clear();
+};
+
+extern CBlockTemplateManager templateManager;
+
 extern double dHashesPerSec;
 extern int64_t nHPSTimerStart;
 
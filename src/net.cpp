@@ -21,6 +21,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -55,15 +59,15 @@ map<CNetAddr, LocalServiceInfo> mapLocalHost;
 static bool vfReachable[NET_MAX] = {};
 static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
-static CNode* pnodeSync = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+int nMessageHandlerThreads = 1;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedSerializeData> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -410,6 +414,8 @@ void AddressCurrentlyConnected(const CService& addr)
 
 uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
+CCriticalSection CNode::cs_totalMsgStats;
+mapMsgStats_t CNode::mapTotalMsgStats;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
 
@@ -511,10 +517,6 @@ void CNode::CloseSocketDisconnect()
     TRY_LOCK(cs_vRecvMsg, lockRecv);
     if (lockRecv)
         vRecvMsg.clear();
-
-    // if this was the sync node, we'll need a new one
-    if (this == pnodeSync)
-        pnodeSync = NULL;
 }
 
 void CNode::Cleanup()
@@ -590,7 +592,10 @@ void CNode::copyStats(CNodeStats &stats)
     X(nStartingHeight);
     X(nSendBytes);
     X(nRecvBytes);
-    stats.fSyncNode = (this == pnodeSync);
+    {
+        LOCK(cs_msgStats);
+        X(mapMsgStats);
+    }
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -695,10 +700,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSharedSerializeData>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -738,6 +743,294 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+//
+// Socket readiness. select() rebuilds its descriptor sets on every pass and
+// stops at FD_SETSIZE; epoll keeps each socket registered, edge-triggered, and
+// only reports what changed. Readiness an edge reported is remembered in
+// CNode::fRecvReady/fSendReady until a read or write comes up short.
+//
+enum SocketEventsMode
+{
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_EPOLL,
+};
+
+static SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
+
+// What either backend reports per node
+static const unsigned int SOCKET_EVENT_RECV = 1; // readable, closed or failed
+static const unsigned int SOCKET_EVENT_SEND = 2; // writable
+
+#ifdef HAVE_SYS_EPOLL_H
+static int hEpoll = -1;
+// Written to by WakeSocketHandler, read end registered with hEpoll
+static int hWakeupPipe[2] = {-1, -1};
+// epoll_event.data.u64 holds the node id, or one of these tags
+static const uint64_t EPOLL_TAG_WAKEUP = 1ULL << 62;
+static const uint64_t EPOLL_TAG_LISTEN = 1ULL << 63;
+static const int MAX_EPOLL_EVENTS = 256;
+
+static void CloseEpoll()
+{
+    if (hEpoll != -1)
+        close(hEpoll);
+    for (int i = 0; i < 2; i++)
+        if (hWakeupPipe[i] != -1)
+            close(hWakeupPipe[i]);
+    hEpoll = hWakeupPipe[0] = hWakeupPipe[1] = -1;
+}
+#endif
+
+bool InitSocketEvents(const std::string& strMode)
+{
+    if (strMode == "select") {
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+    if (strMode != "epoll")
+        return false;
+#ifdef HAVE_SYS_EPOLL_H
+    hEpoll = epoll_create(MAX_EPOLL_EVENTS);
+    if (hEpoll == -1 || pipe(hWakeupPipe) != 0) {
+        LogPrintf("epoll unavailable (%s), falling back to select\n", strerror(errno));
+        CloseEpoll();
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(hWakeupPipe[i], F_SETFL, fcntl(hWakeupPipe[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(hWakeupPipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    fcntl(hEpoll, F_SETFD, FD_CLOEXEC);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = EPOLL_TAG_WAKEUP;
+    epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWakeupPipe[0], &event);
+
+    nSocketEventsMode = SOCKETEVENTS_EPOLL;
+    LogPrintf("Using epoll for socket events\n");
+    return true;
+#else
+    LogPrintf("epoll not supported on this platform, falling back to select\n");
+    nSocketEventsMode = SOCKETEVENTS_SELECT;
+    return true;
+#endif
+}
+
+bool SocketEventsUseSelect()
+{
+    return nSocketEventsMode == SOCKETEVENTS_SELECT;
+}
+
+void WakeSocketHandler()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hWakeupPipe[1] != -1) {
+        // A full pipe means a wakeup is pending already
+        char ch = 0;
+        ssize_t nWritten = write(hWakeupPipe[1], &ch, 1);
+        (void)nWritten;
+    }
+#endif
+}
+
+// Whether there is room to receive more from this node. Requires cs_vRecvMsg.
+//
+// If there is no (complete) message in the receive buffer, or there is space
+// left in the buffer, wait for data. Otherwise there is certainly a message to
+// be processed by the message handler thread first.
+static bool CanReceive(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+// Wait up to 50ms for any socket to become ready with select(). Returns the
+// listen sockets that can accept and the events seen per node.
+static void WaitSocketEventsSelect(vector<SOCKET>& vListenReady, map<NodeId, unsigned int>& mapEvents)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket);
+        have_fds = true;
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if CanReceive(), select() for receiving data.
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty()) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    continue;
+                }
+            }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && CanReceive(pnode))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+            vListenReady.push_back(hListenSocket);
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        unsigned int nEvents = 0;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            nEvents |= SOCKET_EVENT_RECV;
+        if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            nEvents |= SOCKET_EVENT_SEND;
+        if (nEvents)
+            mapEvents[pnode->id] = nEvents;
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+// Keep every node's socket registered with epoll, with write interest only
+// while it has data queued, then wait. Returns the listen sockets that can
+// accept and the events seen per node.
+static void WaitSocketEventsEpoll(vector<SOCKET>& vListenReady, map<NodeId, unsigned int>& mapEvents)
+{
+    static bool fListenRegistered = false;
+    if (!fListenRegistered) {
+        for (unsigned int i = 0; i < vhListenSocket.size(); i++) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.u64 = EPOLL_TAG_LISTEN | i;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, vhListenSocket[i], &event) != 0)
+                LogPrintf("epoll_ctl failed for listen socket: %s\n", strerror(errno));
+        }
+        fListenRegistered = true;
+    }
+
+    // Don't sleep while there is readiness left over from earlier edges
+    bool fPending = false;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+
+            bool fWantWrite = pnode->fEventsWantWrite;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend) {
+                    fWantWrite = !pnode->vSendMsg.empty();
+                    if (fWantWrite && pnode->fSendReady)
+                        fPending = true;
+                }
+            }
+            if (pnode->fRecvReady) {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && CanReceive(pnode))
+                    fPending = true;
+            }
+
+            if (!pnode->fEventsRegistered || fWantWrite != pnode->fEventsWantWrite) {
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (fWantWrite ? (uint32_t)EPOLLOUT : 0);
+                event.data.u64 = pnode->id;
+                int op = pnode->fEventsRegistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+                if (epoll_ctl(hEpoll, op, pnode->hSocket, &event) == 0) {
+                    pnode->fEventsRegistered = true;
+                    pnode->fEventsWantWrite = fWantWrite;
+                    // Re-arming reports the current state as a fresh edge
+                    pnode->fSendReady = false;
+                } else
+                    LogPrint("net", "epoll_ctl failed for peer=%d: %s\n", pnode->id, strerror(errno));
+            }
+        }
+    }
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, fPending ? 0 : 50);
+    boost::this_thread::interruption_point();
+
+    if (nEvents < 0) {
+        if (errno != EINTR) {
+            LogPrintf("socket epoll_wait error %s\n", strerror(errno));
+            MilliSleep(50);
+        }
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        uint64_t nTag = events[i].data.u64;
+        if (nTag == EPOLL_TAG_WAKEUP) {
+            char buf[64];
+            while (read(hWakeupPipe[0], buf, sizeof(buf)) > 0) {}
+        } else if (nTag & EPOLL_TAG_LISTEN) {
+            vListenReady.push_back(vhListenSocket[nTag & ~EPOLL_TAG_LISTEN]);
+        } else {
+            unsigned int nEvents = 0;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                nEvents |= SOCKET_EVENT_RECV;
+            if (events[i].events & EPOLLOUT)
+                nEvents |= SOCKET_EVENT_SEND;
+            mapEvents[(NodeId)nTag] |= nEvents;
+        }
+    }
+}
+#endif
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
@@ -811,90 +1104,21 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
+        bool fEpoll = (nSocketEventsMode == SOCKETEVENTS_EPOLL);
+        vector<SOCKET> vListenReady;
+        map<NodeId, unsigned int> mapEvents;
+#ifdef HAVE_SYS_EPOLL_H
+        if (fEpoll)
+            WaitSocketEventsEpoll(vListenReady, mapEvents);
+        else
+#endif
+            WaitSocketEventsSelect(vListenReady, mapEvents);
 
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        BOOST_FOREACH(SOCKET hListenSocket, vListenReady)
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -960,10 +1184,21 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            map<NodeId, unsigned int>::const_iterator itEvents = mapEvents.find(pnode->id);
+            unsigned int nEvents = (itEvents != mapEvents.end() ? itEvents->second : 0);
+            bool fRecv = (nEvents & SOCKET_EVENT_RECV);
+            bool fSend = (nEvents & SOCKET_EVENT_SEND);
+            if (fEpoll) {
+                // Edges only come once; act on them until the socket runs dry
+                pnode->fRecvReady |= fRecv;
+                pnode->fSendReady |= fSend;
+                fRecv = pnode->fRecvReady;
+                fSend = pnode->fSendReady;
+            }
+            if (fRecv)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (lockRecv && (!fEpoll || CanReceive(pnode)))
                 {
                     {
                         // typical socket buffer is 8K-64K
@@ -976,6 +1211,9 @@ void ThreadSocketHandler()
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            // A short read drained the socket; new data brings a new edge
+                            if (nBytes < (int)sizeof(pchBuf))
+                                pnode->fRecvReady = false;
                         }
                         else if (nBytes == 0)
                         {
@@ -988,7 +1226,9 @@ void ThreadSocketHandler()
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fRecvReady = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
@@ -1004,11 +1244,15 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (fSend)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend) {
                     SocketSendData(pnode);
+                    // Still data left, so the socket is full; wait for the next edge
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSendReady = false;
+                }
             }
 
             //
@@ -1455,73 +1699,42 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-// for now, use a very simple selection metric: the node from which we received
-// most recently
-static int64_t NodeSyncScore(const CNode *pnode) {
-    return pnode->nLastRecv;
-}
-
-void static StartSync(const vector<CNode*> &vNodes) {
-    CNode *pnodeNewSync = NULL;
-    int64_t nBestScore = 0;
-
-    int nBestHeight = g_signals.GetHeight().get_value_or(0);
-
-    // Iterate over all nodes
-    BOOST_FOREACH(CNode* pnode, vNodes) {
-        // check preconditions for allowing a sync
-        if (!pnode->fClient && !pnode->fOneShot &&
-            !pnode->fDisconnect && pnode->fSuccessfullyConnected &&
-            (pnode->nStartingHeight > (nBestHeight - 144)) &&
-            (pnode->nVersion < NOBLKS_VERSION_START || pnode->nVersion >= NOBLKS_VERSION_END)) {
-            // if ok, compare node's score with the best so far
-            int64_t nScore = NodeSyncScore(pnode);
-            if (pnodeNewSync == NULL || nScore > nBestScore) {
-                pnodeNewSync = pnode;
-                nBestScore = nScore;
-            }
-        }
-    }
-    // if a new sync candidate was found, start sync!
-    if (pnodeNewSync) {
-        pnodeNewSync->fStartSync = true;
-        pnodeSync = pnodeNewSync;
-    }
-}
-
-void ThreadMessageHandler()
+// Each handler thread walks every node, starting from a different point, and
+// skips the ones another thread is already busy with. cs_msgProcess keeps a
+// peer's messages and replies in order no matter which thread picks it up.
+void ThreadMessageHandler(int nThread)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
-        bool fHaveSyncNode = false;
-
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
             vNodesCopy = vNodes;
             BOOST_FOREACH(CNode* pnode, vNodesCopy) {
                 pnode->AddRef();
-                if (pnode == pnodeSync)
-                    fHaveSyncNode = true;
             }
         }
 
-        if (!fHaveSyncNode)
-            StartSync(vNodesCopy);
-
-        // Poll the connected nodes for messages
+        // Poll the connected nodes for messages. Only the first thread picks
+        // a trickle node, so addresses and tx invs trickle at the usual rate.
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (nThread == 0 && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        size_t nOffset = vNodesCopy.empty() ? 0 : (nThread * vNodesCopy.size() / nMessageHandlerThreads);
+        for (size_t i = 0; i < vNodesCopy.size(); i++)
         {
+            CNode* pnode = vNodesCopy[(nOffset + i) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
+            TRY_LOCK(pnode->cs_msgProcess, lockProcess);
+            if (!lockProcess)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1750,7 +1963,8 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1785,6 +1999,9 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     LogPrintf("closesocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef HAVE_SYS_EPOLL_H
+        CloseEpoll();
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -1815,12 +2032,14 @@ instance_of_cnetcleanup;
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
+    ss.reserve(::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
     ss << tx;
-    RelayTransaction(tx, hash, ss);
+    boost::shared_ptr<CSerializeData> data(new CSerializeData());
+    ss.GetAndClear(*data);
+    RelayTransaction(tx, hash, data);
 }
 
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
+void RelayTransaction(const CTransaction& tx, const uint256& hash, const CSharedSerializeData& data)
 {
     CInv inv(MSG_TX, hash);
     {
@@ -1833,7 +2052,7 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         }
 
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, data));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1875,6 +2094,65 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+// Commands get their own entry in the message stats; anything else a peer
+// sends or we don't know about is counted under "*other*"
+static const char* ppszMessageStatsCommands[] = {
+    "version", "verack", "addr", "inv", "getdata", "merkleblock", "getblocks",
+    "getheaders", "tx", "headers", "block", "getaddr", "mempool", "ping", "pong",
+    "alert", "notfound", "filterload", "filteradd", "filterclear", "reject",
+    "sendcmpct", "cmpctblock", "getblocktxn", "blocktxn",
+};
+
+static const std::string& MessageStatsKey(const std::string& strCommand)
+{
+    static const std::set<std::string> setCommands(ppszMessageStatsCommands, ppszMessageStatsCommands + ARRAYLEN(ppszMessageStatsCommands));
+    static const std::string strOther("*other*");
+    std::set<std::string>::const_iterator it = setCommands.find(strCommand);
+    return it == setCommands.end() ? strOther : *it;
+}
+
+static void AddMessageRecv(CMessageStats& stats, unsigned int nBytes, int64_t nProcessMicros, int64_t nMainWaitMicros)
+{
+    if (nBytes) {
+        stats.nMsgsRecv++;
+        stats.nBytesRecv += nBytes;
+    }
+    stats.nProcessMicros += nProcessMicros;
+    stats.nMainWaitMicros += nMainWaitMicros;
+}
+
+void CNode::RecordMessageRecv(const std::string& strCommand, unsigned int nBytes, int64_t nProcessMicros, int64_t nMainWaitMicros)
+{
+    const std::string& strKey = MessageStatsKey(strCommand);
+    {
+        LOCK(cs_msgStats);
+        AddMessageRecv(mapMsgStats[strKey], nBytes, nProcessMicros, nMainWaitMicros);
+    }
+    LOCK(cs_totalMsgStats);
+    AddMessageRecv(mapTotalMsgStats[strKey], nBytes, nProcessMicros, nMainWaitMicros);
+}
+
+void CNode::RecordMessageSent(const std::string& strCommand, unsigned int nBytes)
+{
+    const std::string& strKey = MessageStatsKey(strCommand);
+    {
+        LOCK(cs_msgStats);
+        CMessageStats& stats = mapMsgStats[strKey];
+        stats.nMsgsSent++;
+        stats.nBytesSent += nBytes;
+    }
+    LOCK(cs_totalMsgStats);
+    CMessageStats& stats = mapTotalMsgStats[strKey];
+    stats.nMsgsSent++;
+    stats.nBytesSent += nBytes;
+}
+
+void CNode::GetTotalMessageStats(mapMsgStats_t& mapStats)
+{
+    LOCK(cs_totalMsgStats);
+    mapStats = mapTotalMsgStats;
+}
+
 void CNode::Fuzz(int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
@@ -11,7 +11,6 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "sync.h"
@@ -43,6 +42,16 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Addresses a peer is remembered to know about, and how often one it doesn't
+ *  know is mistaken for one it does (and so never sent to it) */
+static const unsigned int ADDR_KNOWN_SIZE = 5000;
+static const double ADDR_KNOWN_FP_RATE = 0.001;
+/** Same for inventory; a false positive there means the peer doesn't hear of that tx or block from us */
+static const double INVENTORY_KNOWN_FP_RATE = 0.000001;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
+/** -msghandlerthreads default (0 = one per core, up to 4) */
+static const int DEFAULT_MSGHANDLER_THREADS = 0;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -60,6 +69,13 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Choose how the socket thread waits for readiness: "epoll" (where the
+ *  platform has it) or "select". Returns false for an unknown mode. */
+bool InitSocketEvents(const std::string& strMode);
+/** True when select() is in use, which can't watch sockets past FD_SETSIZE */
+bool SocketEventsUseSelect();
+/** Interrupt the socket thread's wait, e.g. when a send couldn't complete */
+void WakeSocketHandler();
 
 typedef int NodeId;
 
@@ -107,10 +123,11 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedSerializeData> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -129,6 +146,22 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Traffic and processing time for one message command */
+class CMessageStats
+{
+public:
+    uint64_t nMsgsRecv;
+    uint64_t nBytesRecv;
+    uint64_t nMsgsSent;
+    uint64_t nBytesSent;
+    int64_t nProcessMicros;  // spent in ProcessMessage, waiting included
+    int64_t nMainWaitMicros; // of which waiting for cs_main
+
+    CMessageStats() : nMsgsRecv(0), nBytesRecv(0), nMsgsSent(0), nBytesSent(0), nProcessMicros(0), nMainWaitMicros(0) {}
+};
+
+typedef std::map<std::string, CMessageStats> mapMsgStats_t;
+
 class CNodeStats
 {
 public:
@@ -144,10 +177,10 @@ public:
     int nStartingHeight;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
-    bool fSyncNode;
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    mapMsgStats_t mapMsgStats;
 };
 
 
@@ -203,15 +236,27 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedSerializeData> vSendMsg; // messages, or a header and a shared payload
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Held by the message handler thread working on this node, so its
+    // messages are processed and answered one at a time and in order
+    CCriticalSection cs_msgProcess;
+    int64_t nLastMessageProcess;
+    int64_t nMainWaitMicros; // waited for cs_main by the message being processed
     uint64_t nRecvBytes;
     int nRecvVersion;
 
+    // Edge-triggered readiness not yet consumed, and what the socket is
+    // registered for with the event loop. Only used by the socket thread.
+    bool fRecvReady;
+    bool fSendReady;
+    bool fEventsRegistered;
+    bool fEventsWantWrite;
+
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nLastSendEmpty;
@@ -253,19 +298,17 @@ protected:
 
 public:
     uint256 hashContinue;
-    CBlockIndex* pindexLastGetBlocksBegin;
-    uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
-    bool fStartSync;
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter filterAddrKnown;
+    CCriticalSection cs_addrSend; // other peers' handlers push addresses too
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -276,13 +319,24 @@ public:
     int64_t nPingUsecTime;
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    // Per-command counters, see RecordMessageRecv/RecordMessageSent
+    mapMsgStats_t mapMsgStats;
+    CCriticalSection cs_msgStats;
+
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+        filterAddrKnown(ADDR_KNOWN_SIZE, ADDR_KNOWN_FP_RATE), filterInventoryKnown(SendBufferSize() / 1000, INVENTORY_KNOWN_FP_RATE)
     {
         nServices = 0;
         hSocket = hSocketIn;
         nRecvVersion = INIT_PROTO_VERSION;
+        fRecvReady = false;
+        fSendReady = false;
+        fEventsRegistered = false;
+        fEventsWantWrite = false;
         nLastSend = 0;
         nLastRecv = 0;
+        nLastMessageProcess = 0;
+        nMainWaitMicros = 0;
         nSendBytes = 0;
         nRecvBytes = 0;
         nLastSendEmpty = GetTime();
@@ -301,13 +355,9 @@ public:
         nSendSize = 0;
         nSendOffset = 0;
         hashContinue = 0;
-        pindexLastGetBlocksBegin = 0;
-        hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
-        fStartSync = false;
         fGetAddr = false;
         fRelayTxes = false;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
         pfilter = new CBloomFilter();
         nPingNonceSent = 0;
         nPingUsecStart = 0;
@@ -344,6 +394,8 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static CCriticalSection cs_totalMsgStats;
+    static mapMsgStats_t mapTotalMsgStats;
 
     CNode(const CNode&);
     void operator=(const CNode&);
@@ -395,7 +447,8 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        LOCK(cs_addrSend);
+        filterAddrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -403,7 +456,8 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        LOCK(cs_addrSend);
+        if (addr.IsValid() && !filterAddrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -417,7 +471,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -425,7 +479,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -512,17 +566,55 @@ public:
 
         LogPrint("net", "(%d bytes)\n", nSize);
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        const char* pchCommand = &ssSend[MESSAGE_START_SIZE];
+        RecordMessageSent(std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE)), ssSend.size());
 
-        // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
-            SocketSendData(this);
+        boost::shared_ptr<CSerializeData> data(new CSerializeData());
+        ssSend.GetAndClear(*data);
+        bool fQueued = !vSendMsg.empty();
+        vSendMsg.push_back(data);
+        nSendSize += data->size();
+        if (!fQueued)
+            OptimisticWrite();
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    // Send a payload that is already serialized without copying it: the send
+    // queue holds a reference until it has gone out. hashPayload must be the
+    // double SHA256 of the payload (for "tx", the transaction's hash), which
+    // the header checksum is taken from.
+    void PushMessage(const char* pszCommand, const CSharedSerializeData& payload, const uint256& hashPayload)
+    {
+        LOCK(cs_vSend);
+        CMessageHeader hdr(pszCommand, payload->size());
+        memcpy(&hdr.nChecksum, hashPayload.begin(), sizeof(hdr.nChecksum));
+        CDataStream ssHeader(SER_NETWORK, INIT_PROTO_VERSION);
+        ssHeader << hdr;
+        boost::shared_ptr<CSerializeData> header(new CSerializeData());
+        ssHeader.GetAndClear(*header);
+
+        LogPrint("net", "sending: %s (%d bytes, shared)\n", pszCommand, payload->size());
+        RecordMessageSent(pszCommand, header->size() + payload->size());
+        bool fQueued = !vSendMsg.empty();
+        vSendMsg.push_back(header);
+        nSendSize += header->size();
+        vSendMsg.push_back(payload);
+        nSendSize += payload->size();
+        if (!fQueued)
+            OptimisticWrite();
+    }
+
+    // requires LOCK(cs_vSend)
+    // The write queue was empty before this message; try sending it right away
+    void OptimisticWrite()
+    {
+        SocketSendData(this);
+        // Whatever didn't fit has to wait until the socket is writable again
+        if (!vSendMsg.empty())
+            WakeSocketHandler();
+    }
+
     void PushVersion();
 
 
@@ -716,13 +808,21 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    // Per-command stats, for this node and the totals over all nodes. Commands
+    // we don't know are counted together, so peers can't grow the maps.
+    // nBytes of a received message includes its header; nBytes == 0 adds
+    // processing time to the command without counting another message.
+    void RecordMessageRecv(const std::string& strCommand, unsigned int nBytes, int64_t nProcessMicros, int64_t nMainWaitMicros);
+    void RecordMessageSent(const std::string& strCommand, unsigned int nBytes);
+    static void GetTotalMessageStats(mapMsgStats_t& mapStats);
 };
 
 
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+void RelayTransaction(const CTransaction& tx, const uint256& hash, const CSharedSerializeData& data);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
@@ -5,9 +5,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "rpcserver.h"
+#include "base58.h"
 #include "main.h"
 #include "sync.h"
 #include "checkpoints.h"
+#include "txdb.h"
 
 #include <stdint.h>
 
@@ -582,20 +584,63 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
-    if(!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+
+    if (!(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx == 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (only its header is known)");
 
     if (!fVerbose)
     {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-        ssBlock << block;
+        if (!blockcache.GetSerializedBlock(hash, ssBlock))
+        {
+            if(!ReadBlockFromDisk(block, pblockindex))
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+            ssBlock << block;
+        }
         std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
         return strHex;
     }
 
+    if(!ReadBlockFromDisk(block, pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
     return blockToJSON(block, pblockindex);
 }
 
+Value getblockcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockcacheinfo\n"
+            "\nReturns statistics about the in-memory cache of recently used blocks.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"entries\": n,     (numeric) The number of cached blocks\n"
+            "  \"bytes\": n,       (numeric) Estimated memory used by the cache\n"
+            "  \"maxbytes\": n,    (numeric) The cache budget (-blockcache)\n"
+            "  \"hits\": n,        (numeric) Lookups served from the cache\n"
+            "  \"misses\": n       (numeric) Lookups that had to go to disk\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockcacheinfo", "")
+            + HelpExampleRpc("getblockcacheinfo", "")
+        );
+
+    CBlockCacheStats stats;
+    blockcache.GetStats(stats);
+
+    Object ret;
+    ret.push_back(Pair("entries", (uint64_t)stats.nEntries));
+    ret.push_back(Pair("bytes", (uint64_t)stats.nBytes));
+    ret.push_back(Pair("maxbytes", (uint64_t)stats.nMaxBytes));
+    ret.push_back(Pair("hits", stats.nHits));
+    ret.push_back(Pair("misses", stats.nMisses));
+    return ret;
+}
+
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -633,6 +678,168 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value dumptxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"filename\"\n"
+            "\nWrite the unspent transaction output set and the block index of the active chain\n"
+            "to a snapshot file that another node can start from with -loadutxosnapshot.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"filename\"    (string, required) The snapshot file, relative to the data directory unless absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"filename\": \"path\",      (string) The file that was written\n"
+            "  \"height\": n,              (numeric) The height of the snapshot block\n"
+            "  \"bestblock\": \"hex\",      (string) The snapshot block hash\n"
+            "  \"transactions\": n,        (numeric) The number of transactions\n"
+            "  \"txouts\": n,              (numeric) The number of unspent outputs\n"
+            "  \"hash_serialized\": \"hash\", (string) The serialized hash, as in gettxoutsetinfo\n"
+            "  \"checksum\": \"hash\"       (string) Checksum of the file contents\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path(params[0].get_str());
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+
+    CCoinsSnapshotHeader header;
+    if (!DumpUTXOSnapshot(path, header))
+        throw JSONRPCError(RPC_MISC_ERROR, "Failed to write UTXO snapshot, see debug.log for details");
+
+    Object ret;
+    ret.push_back(Pair("filename", path.string()));
+    ret.push_back(Pair("height", header.nHeight));
+    ret.push_back(Pair("bestblock", header.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)header.nTransactions));
+    ret.push_back(Pair("txouts", (int64_t)header.nTransactionOutputs));
+    ret.push_back(Pair("hash_serialized", header.hashSerialized.GetHex()));
+    ret.push_back(Pair("checksum", header.hashChecksum.GetHex()));
+    return ret;
+}
+
+static void ParseIndexedAddress(const Value& param, CBitmarkAddress &address, unsigned char &type, uint160 &hashBytes)
+{
+    address.SetString(param.get_str());
+    CScript scriptPubKey;
+    if (address.IsValid())
+        scriptPubKey.SetDestination(address.Get());
+    if (!GetAddressIndexKey(scriptPubKey, type, hashBytes))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitmark address");
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddresstxids \"bitmarkaddress\" ( start end )\n"
+            "\nReturns the ids of the block chain transactions that pay to or spend from an address,\n"
+            "in block order. Requires -addressindex.\n"
+            "\nArguments:\n"
+            "1. \"bitmarkaddress\"  (string, required) The bitmark address\n"
+            "2. start             (numeric, optional) The lowest block height to include\n"
+            "3. end               (numeric, optional) The highest block height to include\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"transactionid\"   (string) The transaction id\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresstxids", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"")
+            + HelpExampleCli("getaddresstxids", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\" 1000 2000")
+            + HelpExampleRpc("getaddresstxids", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"")
+        );
+
+    if (!paddressindexdb)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex");
+
+    CBitmarkAddress address;
+    unsigned char type;
+    uint160 hashBytes;
+    ParseIndexedAddress(params[0], address, type, hashBytes);
+    int nStart = params.size() > 1 ? params[1].get_int() : 0;
+    int nEnd = params.size() > 2 ? params[2].get_int() : std::numeric_limits<int>::max();
+    if (nStart < 0 || nEnd < nStart)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid block height range");
+
+    std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > vEntries;
+    if (!paddressindexdb->ReadAddressIndex(type, hashBytes, vEntries, nStart, nEnd))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+
+    // Entries of one transaction are adjacent
+    Array result;
+    uint256 txidLast = 0;
+    for (std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> >::const_iterator it = vEntries.begin(); it != vEntries.end(); ++it) {
+        if (it->first.txid == txidLast)
+            continue;
+        txidLast = it->first.txid;
+        result.push_back(txidLast.GetHex());
+    }
+    return result;
+}
+
+static bool CompareUnspentHeight(const std::pair<CAddressUnspentKey, CAddressUnspentValue> &a, const std::pair<CAddressUnspentKey, CAddressUnspentValue> &b)
+{
+    return a.second.nHeight < b.second.nHeight;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos \"bitmarkaddress\"\n"
+            "\nReturns the unspent outputs of an address in the block chain, oldest first.\n"
+            "Requires -addressindex.\n"
+            "\nArguments:\n"
+            "1. \"bitmarkaddress\"  (string, required) The bitmark address\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\" : \"address\",  (string) The bitmark address\n"
+            "    \"txid\" : \"txid\",        (string) The transaction id\n"
+            "    \"vout\" : n,               (numeric) The output number\n"
+            "    \"scriptPubKey\" : \"key\", (string) The script key\n"
+            "    \"amount\" : x.xxx,         (numeric) The output value in btm\n"
+            "    \"height\" : n              (numeric) The height of the block containing the output\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"")
+            + HelpExampleRpc("getaddressutxos", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"")
+        );
+
+    if (!paddressindexdb)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex");
+
+    CBitmarkAddress address;
+    unsigned char type;
+    uint160 hashBytes;
+    ParseIndexedAddress(params[0], address, type, hashBytes);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    if (!paddressindexdb->ReadAddressUnspent(type, hashBytes, vUnspent))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+    std::stable_sort(vUnspent.begin(), vUnspent.end(), CompareUnspentHeight);
+
+    Array result;
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = vUnspent.begin(); it != vUnspent.end(); ++it) {
+        Object entry;
+        entry.push_back(Pair("address", address.ToString()));
+        entry.push_back(Pair("txid", it->first.txid.GetHex()));
+        entry.push_back(Pair("vout", (int)it->first.n));
+        entry.push_back(Pair("scriptPubKey", HexStr(it->second.txout.scriptPubKey.begin(), it->second.txout.scriptPubKey.end())));
+        entry.push_back(Pair("amount", ValueFromAmount(it->second.txout.nValue)));
+        entry.push_back(Pair("height", (int)it->second.nHeight));
+        result.push_back(entry);
+    }
+    return result;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -737,6 +944,13 @@ Value verifychain(const Array& params, bool fHelp)
     return VerifyDB(nCheckLevel, nCheckDepth);
 }
 
+// Height of the last block an optional index has processed, -1 before it started
+static int GetIndexHeight(CChainIndexDB *pindexdb)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(pindexdb->GetBestBlock());
+    return mi == mapBlockIndex.end() ? -1 : mi->second->nHeight;
+}
+
 Value getblockchaininfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -747,10 +961,17 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             "{\n"
             "  \"chain\": \"xxxx\",        (string) current chain (main, testnet3, regtest)\n"
             "  \"blocks\": xxxxxx,         (numeric) the current number of blocks processed in the server\n"
+            "  \"headers\": xxxxxx,        (numeric) the current number of headers we have validated\n"
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
-            "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"chainwork\": \"xxxx\",    (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
+            "  \"pruneheight\": xxxxxx,    (numeric) lowest-height complete block stored (only present if pruning is enabled)\n"
+            "  \"snapshotheight\": xxxxxx, (numeric) height of a loaded UTXO snapshot (only present while its history is being validated)\n"
+            "  \"snapshotvalidated\": xxxxxx, (numeric) height up to which that history has been validated\n"
+            "  \"txindexheight\": xxxxxx,  (numeric) height the transaction index has caught up to (only present with -txindex)\n"
+            "  \"addressindexheight\": xxxxxx, (numeric) height the address index has caught up to (only present with -addressindex)\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getblockchaininfo", "")
@@ -766,9 +987,29 @@ Value getblockchaininfo(const Array& params, bool fHelp)
         chain = "main";
     obj.push_back(Pair("chain",         chain));
     obj.push_back(Pair("blocks",        (int)chainActive.Height()));
+    obj.push_back(Pair("headers",       pindexBestHeader ? pindexBestHeader->nHeight : -1));
     obj.push_back(Pair("bestblockhash", chainActive.Tip()->GetBlockHash().GetHex()));
     obj.push_back(Pair("difficulty",    (double)GetDifficulty(NULL,-1)));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork",     chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("pruned",        fPruneMode));
+    if (fPruneMode)
+    {
+        CBlockIndex *block = chainActive.Tip();
+        while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA))
+            block = block->pprev;
+
+        obj.push_back(Pair("pruneheight",        block->nHeight));
+    }
+    int nSnapshotHeight, nSnapshotValidated;
+    if (GetSnapshotValidationProgress(nSnapshotHeight, nSnapshotValidated))
+    {
+        obj.push_back(Pair("snapshotheight",     nSnapshotHeight));
+        obj.push_back(Pair("snapshotvalidated",  nSnapshotValidated));
+    }
+    if (ptxindexdb)
+        obj.push_back(Pair("txindexheight",      GetIndexHeight(ptxindexdb)));
+    if (paddressindexdb)
+        obj.push_back(Pair("addressindexheight", GetIndexHeight(paddressindexdb)));
     return obj;
 }
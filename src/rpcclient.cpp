@@ -172,6 +172,8 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listunspent"            && n > 2) ConvertTo<Array>(params[2]);
     if (strMethod == "getblock"               && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getrawtransaction"      && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 2) ConvertTo<int64_t>(params[2]);
     if (strMethod == "createrawtransaction"   && n > 0) ConvertTo<Array>(params[0]);
     if (strMethod == "createrawtransaction"   && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "signrawtransaction"     && n > 1) ConvertTo<Array>(params[1], true);
@@ -207,6 +209,8 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "chaindynamics" && n>0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "chaindynamics" && n>1) ConvertTo<bool>(params[1]);
     if (strMethod == "getauxblock" && n==1) ConvertTo<int64_t>(params[0]);
+    // algo and longpollid, rather than a block hash and auxpow
+    if (strMethod == "getauxblock" && n==2 && params[0].get_str().size() < 64) ConvertTo<int64_t>(params[0]);
     return params;
 }
 
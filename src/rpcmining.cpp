@@ -55,8 +55,6 @@ void ShutdownRPCMining()
 
 /* Set mining algo here for rpc mining */
 int miningAlgo = ALGO_SCRYPT;
-int miningAlgoGBT = miningAlgo;
-int miningAlgoGAB = miningAlgo;
 bool confAlgoIsSet = false;
 
 // Return average network hashes per second based on the last 'lookup' blocks,
@@ -423,14 +421,24 @@ Value getwork(const Array& params, bool fHelp)
     if (params.size() == 0)
     {
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
         static CBlockIndex* pindexPrev;
-        static int64_t nStart;
+        static unsigned int nTemplateId;
         static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != chainActive.Tip() ||
-            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        if (!pblocktemplate || templateManager.Update(miningAlgo) != nTemplateId)
         {
-            if (pindexPrev != chainActive.Tip())
+            CPubKey pubkey;
+            if (!pMiningKey->GetReservedKey(pubkey))
+                throw JSONRPCError(RPC_WALLET_KEYPOOL_RAN_OUT, "Error: Keypool ran out, please call keypoolrefill first");
+
+            // Clear pblocktemplate so future getworks take a new copy, despite any failures from here on
+            pblocktemplate = NULL;
+
+            CBlockIndex* pindexPrevNew;
+            CBlockTemplate* pblocktemplateNew = templateManager.Get(miningAlgo, CScript() << pubkey << OP_CHECKSIG, pindexPrevNew, nTemplateId);
+            if (!pblocktemplateNew)
+                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+
+            if (pindexPrev != pindexPrevNew)
             {
                 // Deallocate old blocks since they're obsolete now
                 mapNewBlock.clear();
@@ -438,38 +446,21 @@ Value getwork(const Array& params, bool fHelp)
                     delete pblocktemplate;
                 vNewBlockTemplate.clear();
             }
-
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrevNew = chainActive.Tip();
-            nStart = GetTime();
-
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
-            if (!pblocktemplate)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
-
-            // Need to update only after we know CreateNewBlock succeeded
+            vNewBlockTemplate.push_back(pblocktemplateNew);
+            pblocktemplate = pblocktemplateNew;
             pindexPrev = pindexPrevNew;
         }
+        else
+        {
+            // Update nExtraNonce
+            templateManager.IncrementExtraNonce(&pblocktemplate->block, pindexPrev);
+        }
         CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
-	if ((pindexPrev->nHeight >= nForkHeight - 1 && CBlockIndex::IsSuperMajority(4,pindexPrev,75,100))) {
-	  pblock->SetAlgo(miningAlgo);
-	}
-
         // Update nTime
         UpdateTime(*pblock, pindexPrev);
         pblock->nNonce = 0;
 
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
         // Save
         mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
 
@@ -516,6 +507,45 @@ Value getwork(const Array& params, bool fHelp)
 }
 #endif
 
+// BIP22 long polling: the id names the tip and the template a client works on
+static std::string LongPollId(CBlockIndex* pindexPrev, unsigned int nTemplateId)
+{
+    return pindexPrev->GetBlockHash().GetHex() + strprintf("%u", nTemplateId);
+}
+
+// Block until the work named by strLongPollId is out of date: the tip has
+// moved, or, checked after a minute and every ten seconds from then on,
+// algo's template has been rebuilt for new transactions
+static void WaitForLongPoll(const std::string& strLongPollId, int algo)
+{
+    if (strLongPollId.size() <= 64)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+    uint256 hashWatchedChain(strLongPollId.substr(0, 64));
+    unsigned int nIdWatched = atoi64(strLongPollId.substr(64));
+
+    boost::system_time checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+    while (!ShutdownRequested())
+    {
+        {
+            // UpdateTip wakes us; the timeout is only there to notice shutdown.
+            // hashBlockChangeTip is read under csBlockChange, not cs_main.
+            boost::unique_lock<boost::mutex> lock(csBlockChange);
+            while (hashBlockChangeTip == hashWatchedChain &&
+                   boost::get_system_time() < checktxtime && !ShutdownRequested())
+                cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+            if (hashBlockChangeTip != hashWatchedChain)
+                return;
+        }
+        if (boost::get_system_time() >= checktxtime)
+        {
+            if (templateManager.Update(algo) != nIdWatched)
+                return;
+            checktxtime += boost::posix_time::seconds(10);
+        }
+    }
+    throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+}
+
 Value getblocktemplate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -534,6 +564,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "           ,...\n"
             "         ]\n"
 	    "       \"algo\": n             (numeric, optional) The mining algo id for the block\n"
+            "       \"longpollid\":\"id\"    (string, optional) wait until the work with this longpollid is out of date\n"
             "     }\n"
             "\n"
 
@@ -572,6 +603,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"curtime\" : ttt,                  (numeric) current timestamp in seconds since epoch (Jan 1 1970 GMT)\n"
             "  \"bits\" : \"xxx\",                 (string) compressed target of next block\n"
             "  \"height\" : n                      (numeric) The height of the next block\n"
+            "  \"longpollid\" : \"xxx\"             (string) id to pass back in the next request to wait for new work\n"
             "}\n"
 
             "\nExamples:\n"
@@ -579,14 +611,20 @@ Value getblocktemplate(const Array& params, bool fHelp)
             + HelpExampleRpc("getblocktemplate", "")
          );
 
-    if (!confAlgoIsSet) {
-      miningAlgo = GetArg("-miningalgo", miningAlgo);
-      confAlgoIsSet = true;
+    // Unlike the other mining calls this one runs without cs_main; take it
+    // for the shared default algo, which they set holding it
+    int miningAlgoChosen;
+    {
+        LOCK(cs_main);
+        if (!confAlgoIsSet) {
+            miningAlgo = GetArg("-miningalgo", miningAlgo);
+            confAlgoIsSet = true;
+        }
+        miningAlgoChosen = miningAlgo;
     }
 
-    int miningAlgoChosen = miningAlgo;
-
     std::string strMode = "template";
+    std::string strLongPollId;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -608,48 +646,37 @@ Value getblocktemplate(const Array& params, bool fHelp)
 	  }
 	else
 	  throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid algo");
+        const Value& lpval = find_value(oparam, "longpollid");
+        if (lpval.type() == str_type)
+            strLongPollId = lpval.get_str();
+        else if (lpval.type() != null_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
     }
 
     if (strMode != "template")
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
 
-    if (vNodes.empty())
-        throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Bitmark is not connected!");
+    {
+        LOCK(cs_vNodes);
+        if (vNodes.empty())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Bitmark is not connected!");
+    }
 
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitmark is downloading blocks...");
 
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() || miningAlgoChosen != miningAlgoGBT ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
+    if (miningAlgoChosen < 0 || miningAlgoChosen >= NUM_ALGOS)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid algo");
 
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
+    if (!strLongPollId.empty())
+        WaitForLongPoll(strLongPollId, miningAlgoChosen);
 
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy,miningAlgoChosen);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-	miningAlgoGBT = miningAlgoChosen;
-    }
+    // Take a copy of the current template; the client builds its own coinbase
+    CBlockIndex* pindexPrev;
+    unsigned int nTemplateId;
+    auto_ptr<CBlockTemplate> pblocktemplate(templateManager.Get(miningAlgoChosen, CScript() << OP_TRUE, pindexPrev, nTemplateId));
+    if (!pblocktemplate.get())
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
     // Update nTime
@@ -695,13 +722,10 @@ Value getblocktemplate(const Array& params, bool fHelp)
 
     uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
 
-    static Array aMutable;
-    if (aMutable.empty())
-    {
-        aMutable.push_back("time");
-        aMutable.push_back("transactions");
-        aMutable.push_back("prevblock");
-    }
+    Array aMutable;
+    aMutable.push_back("time");
+    aMutable.push_back("transactions");
+    aMutable.push_back("prevblock");
 
     Object result;
     result.push_back(Pair("version", pblock->nVersion));
@@ -718,6 +742,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", HexBits(pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", LongPollId(pindexPrev, nTemplateId)));
 
     return result;
 }
@@ -771,12 +796,13 @@ Value getauxblock(const Array& params, bool fHelp)
     throw runtime_error(
 			"getauxblock (hash auxpow)\n"
 	                "\nCreate or submit a merge-mined block.\n"
-	                "\nWith 0 to 1 arguments, create a new block and return information\n"
-	                "required to merge-mine it.  With two arguments, submit a solved\n"
-	                "auxpow for a previously returned block.\n"
+	                "\nWithout arguments or with an algo, create a new block and return\n"
+	                "information required to merge-mine it.  With a hash and auxpow,\n"
+	                "submit a solved auxpow for a previously returned block.\n"
 	                "\nArguments:\n"
 			"Either\n"
 			"1. \"algo\"    (numeric, optional) mining algo for aux block\n"
+			"2. \"longpollid\" (string, optional) wait until the block with this longpollid is out of date\n"
 			"Or\n"
 	                "1. \"hash\"    (string, optional) hash of the block to submit\n"
 	                "2. \"auxpow\"  (string, optional) serialised auxpow found\n"
@@ -793,6 +819,7 @@ Value getauxblock(const Array& params, bool fHelp)
 			"  \"version\"            (numeric) block version number\n"
 			"  \"curtime\"            (numeric) block timestamp\n"
 			"  \"scriptsig\"          (string) scriptSig for coinbase tx\n"
+			"  \"longpollid\"         (string) id to pass back to wait for new work\n"
 			"}\n"
 			"\nResult (with arguments):\n"
 			"xxxxx        (boolean) whether the submitted block was correct\n"
@@ -802,68 +829,80 @@ Value getauxblock(const Array& params, bool fHelp)
 			+ HelpExampleRpc("getauxblock", "")
 			);
 
-  if (!confAlgoIsSet) {
-    miningAlgo = GetArg("-miningalgo", miningAlgo);
-    confAlgoIsSet = true;
+  // Runs without cs_main, see getblocktemplate
+  int miningAlgoChosen;
+  {
+    LOCK(cs_main);
+    if (!confAlgoIsSet) {
+      miningAlgo = GetArg("-miningalgo", miningAlgo);
+      confAlgoIsSet = true;
+    }
+    miningAlgoChosen = miningAlgo;
   }
 
-  int miningAlgoChosen = miningAlgo;
-  
   if (pwalletMain == NULL)
     throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
   if (vNodes.empty())
     throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Bitmark is not connected!");
   if (IsInitialBlockDownload())
     throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitmark is downloading blocks...");
+
+  // Asked for work: getauxblock ( algo ( "longpollid" ) )
+  bool fCreate = params.size() < 2 || params[0].type() == int_type;
+  if (fCreate && params.size() > 0) {
+    miningAlgoChosen = params[0].get_int();
+    if (miningAlgoChosen < 0 || miningAlgoChosen >= NUM_ALGOS)
+      throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid algo");
+    // Wait before taking the cache lock so submissions aren't held up
+    if (params.size() > 1)
+      WaitForLongPoll(params[1].get_str(), miningAlgoChosen);
+  }
+
   static CCriticalSection cs_auxblockCache;
   LOCK(cs_auxblockCache);
   static std::map<uint256, CBlock*> mapNewBlock;
   static std::vector<CBlockTemplate*> vNewBlockTemplate;
-  if (params.size() < 2) {
+  if (fCreate) {
 
-    if (params.size() == 1) {
-      miningAlgoChosen = params[0].get_int();
-    }
-    
-    static unsigned nTransactionsUpdatedLast;
+    // The block handed out last for each algo, repeated until its template changes
     static CBlockIndex* pindexPrev = NULL;
-    static uint64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    static unsigned int nExtraNonce = 0;
-    CReserveKey reservekey(pwalletMain);
-
-    {
-      LOCK(cs_main);
-      if (pindexPrev != chainActive.Tip() || miningAlgoChosen != miningAlgoGAB
-	  || (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast
-	      && GetTime() - nStart > 60)) {
-	if (pindexPrev != chainActive.Tip()) {
-	  mapNewBlock.clear();
-	  BOOST_FOREACH(CBlockTemplate* pbt, vNewBlockTemplate)
-	    delete pbt;
-	  vNewBlockTemplate.clear();
-	}
-
-	pblocktemplate = CreateNewBlockWithKey(reservekey,miningAlgoChosen);
-	if (!pblocktemplate)
-	  throw JSONRPCError(RPC_OUT_OF_MEMORY, "out of memory");
-
-	nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-	pindexPrev = chainActive.Tip();
-	nStart = GetTime();
+    static CBlockTemplate* vpblocktemplate[NUM_ALGOS];
+    static unsigned int vnTemplateId[NUM_ALGOS];
+
+    if (!vpblocktemplate[miningAlgoChosen]
+	|| templateManager.Update(miningAlgoChosen) != vnTemplateId[miningAlgoChosen]) {
+      CReserveKey reservekey(pwalletMain);
+      CPubKey pubkey;
+      if (!reservekey.GetReservedKey(pubkey))
+	throw JSONRPCError(RPC_WALLET_KEYPOOL_RAN_OUT, "Error: Keypool ran out, please call keypoolrefill first");
+
+      CBlockIndex* pindexPrevNew;
+      CBlockTemplate* pblocktemplate = templateManager.Get(miningAlgoChosen, CScript() << pubkey << OP_CHECKSIG,
+							   pindexPrevNew, vnTemplateId[miningAlgoChosen]);
+      if (!pblocktemplate)
+	throw JSONRPCError(RPC_OUT_OF_MEMORY, "out of memory");
+
+      if (pindexPrev != pindexPrevNew) {
+	mapNewBlock.clear();
+	BOOST_FOREACH(CBlockTemplate* pbt, vNewBlockTemplate)
+	  delete pbt;
+	vNewBlockTemplate.clear();
+	for (int i = 0; i < NUM_ALGOS; i++)
+	  vpblocktemplate[i] = NULL;
+	pindexPrev = pindexPrevNew;
+      }
 
-	CBlock* pblock = &pblocktemplate->block;
-	IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-	pblock->SetAuxpow(true);
-	pblock->SetChainId(Params().GetAuxpowChainId());
-	pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+      CBlock* pblock = &pblocktemplate->block;
+      pblock->SetAuxpow(true);
+      pblock->SetChainId(Params().GetAuxpowChainId());
+      pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
-	mapNewBlock[pblock->GetHash()] = pblock;
-	vNewBlockTemplate.push_back(pblocktemplate);
-	miningAlgoGAB = miningAlgoChosen;
-      }	    	  
+      mapNewBlock[pblock->GetHash()] = pblock;
+      vNewBlockTemplate.push_back(pblocktemplate);
+      vpblocktemplate[miningAlgoChosen] = pblocktemplate;
     }
 
+    const CBlockTemplate* pblocktemplate = vpblocktemplate[miningAlgoChosen];
     const CBlock& block = pblocktemplate->block;
 
     uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
@@ -890,6 +929,7 @@ Value getauxblock(const Array& params, bool fHelp)
     result.push_back(Pair("version",block.nVersion));
     result.push_back(Pair("curtime", (int64_t)block.nTime));
     result.push_back(Pair("scriptsig",HexStr(block.vtx[0].vin[0].scriptSig)));
+    result.push_back(Pair("longpollid", LongPollId(pindexPrev, vnTemplateId[miningAlgoChosen])));
 
     return result;
   }
@@ -922,7 +962,11 @@ Value getauxblock(const Array& params, bool fHelp)
     assert(block.GetHash() == hash);
   }
   CValidationState state;
-  bool fAccepted = ProcessBlock(state, NULL, &block);
+  bool fAccepted;
+  {
+    LOCK(cs_main);
+    fAccepted = ProcessBlock(state, NULL, &block);
+  }
   if (!fAccepted)
     return "rejected";
   return Value::null;
@@ -70,6 +70,23 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static Object MessageStatsToJSON(const mapMsgStats_t& mapStats)
+{
+    Object ret;
+    BOOST_FOREACH(const PAIRTYPE(std::string, CMessageStats)& item, mapStats) {
+        const CMessageStats& stats = item.second;
+        Object obj;
+        obj.push_back(Pair("msgsrecv", stats.nMsgsRecv));
+        obj.push_back(Pair("bytesrecv", stats.nBytesRecv));
+        obj.push_back(Pair("msgssent", stats.nMsgsSent));
+        obj.push_back(Pair("bytessent", stats.nBytesSent));
+        obj.push_back(Pair("processtime", stats.nProcessMicros / 1e6));
+        obj.push_back(Pair("mainwait", stats.nMainWaitMicros / 1e6));
+        ret.push_back(Pair(item.first, obj));
+    }
+    return ret;
+}
+
 Value getpeerinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -94,7 +111,23 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"inbound\": true|false,     (boolean) Inbound (true) or Outbound (false)\n"
             "    \"startingheight\": n,       (numeric) The starting height (block) of the peer\n"
             "    \"banscore\": n,              (numeric) The ban score (stats.nMisbehavior)\n"
-            "    \"syncnode\" : true|false     (booleamn) if sync node\n"
+            "    \"synced_headers\": n,        (numeric) The last header we have in common with this peer\n"
+            "    \"synced_blocks\": n,         (numeric) The last block we have in common with this peer\n"
+            "    \"inflight\": [               (array) The heights of blocks we're currently asking from this peer\n"
+            "       n,\n"
+            "       ...\n"
+            "    ],\n"
+            "    \"msgstats\": {             (object) Traffic and processing time per message command\n"
+            "      \"command\": {            (object) Commands we don't know are counted under \"*other*\"\n"
+            "        \"msgsrecv\": n,         (numeric) Messages received\n"
+            "        \"bytesrecv\": n,        (numeric) Bytes received, headers included\n"
+            "        \"msgssent\": n,         (numeric) Messages sent\n"
+            "        \"bytessent\": n,        (numeric) Bytes sent, headers included\n"
+            "        \"processtime\": n,      (numeric) Seconds spent processing received messages\n"
+            "        \"mainwait\": n          (numeric) Seconds of processtime spent waiting for the main lock\n"
+            "      },\n"
+            "      ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "}\n"
@@ -134,8 +167,15 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         if (fStateStats) {
             obj.push_back(Pair("banscore", statestats.nMisbehavior));
+            obj.push_back(Pair("synced_headers", statestats.nSyncHeight));
+            obj.push_back(Pair("synced_blocks", statestats.nCommonHeight));
+            Array heights;
+            BOOST_FOREACH(int height, statestats.vHeightInFlight) {
+                heights.push_back(height);
+            }
+            obj.push_back(Pair("inflight", heights));
         }
-        obj.push_back(Pair("syncnode", stats.fSyncNode));
+        obj.push_back(Pair("msgstats", MessageStatsToJSON(stats.mapMsgStats)));
 
         ret.push_back(obj);
     }
@@ -321,7 +361,9 @@ Value getnettotals(const Array& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"msgstats\": {...}      (object) Per message command totals over all peers,\n"
+            "                           including disconnected ones, as in getpeerinfo\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getnettotals", "")
@@ -332,6 +374,9 @@ Value getnettotals(const Array& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+    mapMsgStats_t mapMsgStats;
+    CNode::GetTotalMessageStats(mapMsgStats);
+    obj.push_back(Pair("msgstats", MessageStatsToJSON(mapMsgStats)));
     return obj;
 }
 
@@ -259,6 +259,8 @@ static const CRPCCommand vRPCCommands[] =
     { "gbc",                    &getblockcount,          true,      false,      false },
     { "getblock",               &getblock,               true,      false,      false },
     { "gb",                     &getblock,               true,      false,      false },
+    { "getblockcacheinfo",      &getblockcacheinfo,      true,      true,       false },
+    { "gbcai",                  &getblockcacheinfo,      true,      true,       false },
     { "getblockhash",           &getblockhash,           true,      false,      false },
     { "gbh",                    &getblockhash,           true,      false,      false },
     { "getrawmempool",          &getrawmempool,          true,      false,      false },
@@ -267,6 +269,12 @@ static const CRPCCommand vRPCCommands[] =
     { "gtxo",                   &gettxout,               true,      false,      false },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
     { "gtxosi",                 &gettxoutsetinfo,        true,      false,      false },
+    { "dumptxoutset",           &dumptxoutset,           true,      false,      false },
+    { "dtxos",                  &dumptxoutset,           true,      false,      false },
+    { "getaddresstxids",        &getaddresstxids,        true,      true,       false },
+    { "gatxids",                &getaddresstxids,        true,      true,       false },
+    { "getaddressutxos",        &getaddressutxos,        true,      true,       false },
+    { "gautxos",                &getaddressutxos,        true,      true,       false },
     { "verifychain",            &verifychain,            true,      false,      false },
     { "vc",                     &verifychain,            true,      false,      false },
     { "getblockspacing",        &getblockspacing,        true,      false,      false },
@@ -279,16 +287,16 @@ static const CRPCCommand vRPCCommands[] =
     { "gd",                     &getdifficulty,          true,      false,      false },
 
     /* Mining */
-    { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
-    { "gbt",                    &getblocktemplate,       true,      false,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,      true,       false },
+    { "gbt",                    &getblocktemplate,       true,      true,       false },
     { "getmininginfo",          &getmininginfo,          true,      false,      false },
     { "gmi",                    &getmininginfo,          true,      false,      false },
     { "getnetworkhashps",       &getnetworkhashps,       true,      false,      false },
     { "gnhps",                  &getnetworkhashps,       true,      false,      false },
     { "submitblock",            &submitblock,            true,     false,      false },
     { "sb",                     &submitblock,            true,     false,      false },
-    { "getauxblock",            &getauxblock,            true,     false,      false },
-    { "gab",            	&getauxblock,            true,     false,      false },
+    { "getauxblock",            &getauxblock,            true,     true,       false },
+    { "gab",            	&getauxblock,            true,     true,       false },
 
     /* Raw transactions */
     { "createrawtransaction",   &createrawtransaction,   true,     false,      false },
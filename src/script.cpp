@@ -7,6 +7,7 @@
 #include "script.h"
 
 #include "core.h"
+#include "cuckoocache.h"
 #include "hash.h"
 #include "key.h"
 #include "keystore.h"
@@ -15,24 +16,22 @@
 #include "util.h"
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
 
 typedef vector<unsigned char> valtype;
-static const valtype vchFalse(0);
-static const valtype vchZero(0);
-static const valtype vchTrue(1, 1);
+static const CScriptElement vchFalse(0);
+static const CScriptElement vchZero(0);
+static const CScriptElement vchTrue(1, 1);
 static const CScriptNum bnZero(0);
 static const CScriptNum bnOne(1);
 static const CScriptNum bnFalse(0);
 static const CScriptNum bnTrue(1);
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(const CScriptElement &vchSig, const CScriptElement &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSigHashCache *pSigHashCache);
 
-bool CastToBool(const valtype& vch)
+bool CastToBool(const CScriptElement& vch)
 {
     for (unsigned int i = 0; i < vch.size(); i++)
     {
@@ -53,7 +52,8 @@ bool CastToBool(const valtype& vch)
 //
 #define stacktop(i)  (stack.at(stack.size()+(i)))
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+template<typename T>
+static inline void popstack(vector<T>& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack() : stack empty");
@@ -220,7 +220,7 @@ const char* GetOpName(opcodetype opcode)
     }
 }
 
-bool static IsCompressedOrUncompressedPubKey(const valtype &vchPubKey) {
+bool static IsCompressedOrUncompressedPubKey(const CScriptElement &vchPubKey) {
     if (vchPubKey.size() < 33) {
         //  Non-canonical public key: too short
         return false;
@@ -252,7 +252,7 @@ bool static IsCompressedOrUncompressedPubKey(const valtype &vchPubKey) {
  *
  * This function is consensus-critical since BIP66.
  */
-bool static IsValidSignatureEncoding(const std::vector<unsigned char> &sig) {
+bool static IsValidSignatureEncoding(const CScriptElement &sig) {
     // Format: 0x30 [total-length] 0x02 [R-length] [R] 0x02 [S-length] [S] [sighash]
     // * total-length: 1-byte length descriptor of everything that follows,
     //   excluding the sighash byte.
@@ -317,7 +317,7 @@ bool static IsValidSignatureEncoding(const std::vector<unsigned char> &sig) {
     return true;
 }
 
-bool static IsLowDERSignature(const valtype &vchSig) { //not needed for now so commented out last return
+bool static IsLowDERSignature(const CScriptElement &vchSig) { //not needed for now so commented out last return
     if (!IsValidSignatureEncoding(vchSig)) {
       return false;
     }
@@ -333,7 +333,7 @@ bool static IsLowDERSignature(const valtype &vchSig) { //not needed for now so c
     return true;
 }
 
-bool static IsDefinedHashtypeSignature(const valtype &vchSig) {
+bool static IsDefinedHashtypeSignature(const CScriptElement &vchSig) {
     if (vchSig.size() == 0) {
         return false;
     }
@@ -344,7 +344,7 @@ bool static IsDefinedHashtypeSignature(const valtype &vchSig) {
     return true;
 }
 
-bool static CheckSignatureEncoding(const valtype &vchSig, unsigned int flags) {
+bool static CheckSignatureEncoding(const CScriptElement &vchSig, unsigned int flags) {
     // Empty signature. Not strictly DER encoded, but allowed to provide a
     // compact way to provide an invalid signature for use with CHECK(MULTI)SIG
     if (vchSig.size() == 0) {
@@ -363,7 +363,7 @@ bool static CheckSignatureEncoding(const valtype &vchSig, unsigned int flags) {
     return true;
 }
 
-bool static CheckPubKeyEncoding(const valtype &vchSig, unsigned int flags) {
+bool static CheckPubKeyEncoding(const CScriptElement &vchSig, unsigned int flags) {
     if ((flags & SCRIPT_VERIFY_STRICTENC) != 0 && !IsCompressedOrUncompressedPubKey(vchSig)) {
       //printf("bad pubkey encoding 1\n");
       return false;
@@ -444,15 +444,28 @@ bool IsCanonicalSignature(const valtype &vchSig, unsigned int flags) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache *pSigHashCache)
+{
+    CScriptArena arena;
+    arena.stack.assign(stack.begin(), stack.end());
+    bool fRet = EvalScript(arena.stack, script, txTo, nIn, flags, nHashType, pSigHashCache, arena);
+    stack.clear();
+    BOOST_FOREACH(const CScriptElement &vch, arena.stack)
+        stack.push_back(valtype(vch.begin(), vch.end()));
+    return fRet;
+}
+
+bool EvalScript(vector<CScriptElement>& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache *pSigHashCache, CScriptArena &arena)
 {
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     opcodetype opcode;
-    valtype vchPushValue;
-    vector<bool> vfExec;
-    vector<valtype> altstack;
+    valtype &vchPushValue = arena.vchPushValue;
+    vector<bool> &vfExec = arena.vfExec;
+    vector<CScriptElement> &altstack = arena.altstack;
+    vfExec.clear();
+    altstack.clear();
     if (script.size() > 10000)
         return false;
     int nOpCount = 0;
@@ -575,7 +588,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     {
                         if (stack.size() < 1)
                             return false;
-                        valtype& vch = stacktop(-1);
+                        CScriptElement& vch = stacktop(-1);
                         fValue = CastToBool(vch);
                         if (opcode == OP_NOTIF)
                             fValue = !fValue;
@@ -658,8 +671,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
+                    CScriptElement vch1 = stacktop(-2);
+                    CScriptElement vch2 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -670,9 +683,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
+                    CScriptElement vch1 = stacktop(-3);
+                    CScriptElement vch2 = stacktop(-2);
+                    CScriptElement vch3 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                     stack.push_back(vch3);
@@ -684,8 +697,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
+                    CScriptElement vch1 = stacktop(-4);
+                    CScriptElement vch2 = stacktop(-3);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -696,8 +709,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
+                    CScriptElement vch1 = stacktop(-6);
+                    CScriptElement vch2 = stacktop(-5);
                     stack.erase(stack.end()-6, stack.end()-4);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
@@ -719,7 +732,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptElement vch = stacktop(-1);
                     if (CastToBool(vch))
                         stack.push_back(vch);
                 }
@@ -747,7 +760,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptElement vch = stacktop(-1);
                     stack.push_back(vch);
                 }
                 break;
@@ -766,7 +779,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
+                    CScriptElement vch = stacktop(-2);
                     stack.push_back(vch);
                 }
                 break;
@@ -782,7 +795,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
+                    CScriptElement vch = stacktop(-n-1);
                     if (opcode == OP_ROLL)
                         stack.erase(stack.end()-n-1);
                     stack.push_back(vch);
@@ -815,7 +828,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptElement vch = stacktop(-1);
                     stack.insert(stack.end()-2, vch);
                 }
                 break;
@@ -842,8 +855,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - bool)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    CScriptElement& vch1 = stacktop(-2);
+                    CScriptElement& vch2 = stacktop(-1);
                     bool fEqual = (vch1 == vch2);
                     // OP_NOTEQUAL is disabled because it would be too easy to say
                     // something like n != 1 and have some wiseguy pass in 1 with extra
@@ -979,8 +992,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- hash)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    CScriptElement& vch = stacktop(-1);
+                    CScriptElement vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
                     if (opcode == OP_RIPEMD160)
                         RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
                     else if (opcode == OP_SHA1)
@@ -989,7 +1002,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         SHA256(&vch[0], vch.size(), &vchHash[0]);
                     else if (opcode == OP_HASH160)
                     {
-                        uint160 hash160 = Hash160(vch);
+                        uint160 hash160 = Hash160(vch.begin(), vch.end());
                         memcpy(&vchHash[0], &hash160, sizeof(hash160));
                     }
                     else if (opcode == OP_HASH256)
@@ -1016,8 +1029,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
 
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
+                    CScriptElement& vchSig    = stacktop(-2);
+                    CScriptElement& vchPubKey = stacktop(-1);
 
                     ////// debug print
                     //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
@@ -1027,10 +1040,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     CScript scriptCode(pbegincodehash, pend);
 
                     // Drop the signature, since there's no way for a signature to sign itself
-                    scriptCode.FindAndDelete(CScript(vchSig));
+                    scriptCode.FindAndDelete(CScript() << vchSig);
 
 		    bool fSuccess = CheckSignatureEncoding(vchSig, flags) && CheckPubKeyEncoding(vchPubKey, flags) &&
-		      CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+		      CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pSigHashCache);
 		    /*
 		    else {
 		      bool fSuccess = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
@@ -1086,19 +1099,19 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // Drop the signatures, since there's no way for a signature to sign itself
                     for (int k = 0; k < nSigsCount; k++)
                     {
-                        valtype& vchSig = stacktop(-isig-k);
-                        scriptCode.FindAndDelete(CScript(vchSig));
+                        CScriptElement& vchSig = stacktop(-isig-k);
+                        scriptCode.FindAndDelete(CScript() << vchSig);
                     }
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
                     {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
+                        CScriptElement& vchSig    = stacktop(-isig);
+                        CScriptElement& vchPubKey = stacktop(-ikey);
 
                         // Check signature
 			bool fOk = CheckSignatureEncoding(vchSig, flags) && CheckPubKeyEncoding(vchPubKey, flags) &&
-			  CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+			  CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pSigHashCache);
 
 			
                         /*bool fOk = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
@@ -1254,7 +1267,32 @@ public:
 };
 }
 
+// Size of an input with an empty script: prevout, script length and nSequence
+static const unsigned int BLANK_INPUT_SIZE = 32 + 4 + 1 + 4;
+
+CSigHashCache::CSigHashCache(const CTransaction &txTo) : ssInputs(SER_GETHASH, 0), ssOutputs(SER_GETHASH, 0)
+{
+    ssInputs.reserve(txTo.vin.size() * BLANK_INPUT_SIZE);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        ssInputs << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+    ssOutputs << txTo.vout;
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+    vPrefix.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vPrefix.push_back(ss);
+        ss.write(&ssInputs[i * BLANK_INPUT_SIZE], BLANK_INPUT_SIZE);
+    }
+}
+
 uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    return SignatureHash(scriptCode, txTo, nIn, nHashType, NULL);
+}
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSigHashCache *pSigHashCache)
 {
     if (nIn >= txTo.vin.size()) {
         LogPrintf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
@@ -1272,6 +1310,21 @@ uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    // Same serialization as below, resumed after the inputs before nIn
+    if (pSigHashCache && !(nHashType & SIGHASH_ANYONECANPAY) && (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        assert(pSigHashCache->vPrefix.size() == txTo.vin.size());
+        CHashWriter ss(pSigHashCache->vPrefix[nIn]);
+        ss << txTo.vin[nIn].prevout;
+        txTmp.SerializeScriptCode(ss, SER_GETHASH, 0);
+        ss << txTo.vin[nIn].nSequence;
+        unsigned int nRest = (nIn + 1) * BLANK_INPUT_SIZE;
+        if (nRest < pSigHashCache->ssInputs.size())
+            ss.write(&pSigHashCache->ssInputs[nRest], pSigHashCache->ssInputs.size() - nRest);
+        ss.write(&pSigHashCache->ssOutputs[0], pSigHashCache->ssOutputs.size());
+        ss << txTo.nLockTime << nHashType;
+        return ss.GetHash();
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1286,61 +1339,51 @@ uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsig
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    // Entries are SHA256(salt, signature hash, public key, signature); the
+    // salt keeps peers from aiming entries at particular cache slots.
+    SHA256_CTX ctxSalted;
+    CCuckooCache setValid;
 
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache()
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+        uint256 nonce = GetRandHash();
+        unsigned char vchPadding[32] = {};
+        SHA256_Init(&ctxSalted);
+        SHA256_Update(&ctxSalted, nonce.begin(), nonce.size());
+        SHA256_Update(&ctxSalted, vchPadding, sizeof(vchPadding)); // salt fills one compression block
+        int64_t nMaxCacheSize = std::max((int64_t)0, std::min(GetArg("-sigcachesize", DEFAULT_SIG_CACHE_SIZE), MAX_SIG_CACHE_SIZE));
+        uint32_t nSlots = setValid.Setup((size_t)nMaxCacheSize << 20);
+        LogPrintf("Using %d MiB for the signature cache, able to store %u entries\n", nMaxCacheSize, nSlots);
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    void ComputeEntry(uint256 &entry, const uint256 &hash, const unsigned char *pchSig, size_t nSigLen, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        SHA256_CTX ctx = ctxSalted;
+        SHA256_Update(&ctx, hash.begin(), hash.size());
+        SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+        if (nSigLen)
+            SHA256_Update(&ctx, pchSig, nSigLen);
+        SHA256_Final(entry.begin(), &ctx);
+    }
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
+    bool Get(const uint256 &entry, bool fErase)
+    {
+        return setValid.Contains(entry, fErase);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void Set(const uint256 &entry)
+    {
+        setValid.Insert(entry);
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+bool CheckSig(const CScriptElement &vchSig, const CScriptElement &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSigHashCache *pSigHashCache)
 {
     static CSignatureCache signatureCache;
 
-    CPubKey pubkey(vchPubKey);
+    CPubKey pubkey(vchPubKey.begin(), vchPubKey.end());
     if (!pubkey.IsValid()) {
       //printf("checksig: pubkey not valid\n");
       return false;
@@ -1358,14 +1401,21 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
       //printf("checksig nHashType != vchSig.back()\n");
       return false;
     }
-    vchSig.pop_back();
+    // The DER signature is everything before the hash type
+    const unsigned char *pchSig = vchSig.data();
+    size_t nSigLen = vchSig.size() - 1;
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType, pSigHashCache);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    // Signatures checked while connecting a block are not stored, and once
+    // found they will not be needed again, so their slots are freed
+    bool fStore = !(flags & SCRIPT_VERIFY_NOCACHE);
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, pchSig, nSigLen, pubkey);
+    if (signatureCache.Get(entry, !fStore))
       return true;
 
-    if (!pubkey.Verify(sighash, vchSig)) {
+    if (!pubkey.Verify(sighash, pchSig, nSigLen)) {
       //printf("checksig !pubkey.Verify txid = %s\n",txTo.GetHash().GetHex().c_str());
       /*for (int i=0; i<vchSig.size(); i++) {
 	LogPrintf("%02x",vchSig[i]);
@@ -1374,8 +1424,8 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
       return false;
     }
 
-    if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, pubkey);
+    if (fStore)
+        signatureCache.Set(entry);
 
     return true;
 }
@@ -1811,7 +1861,7 @@ void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey,
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSigHashCache *pSigHashCache, CScriptArena *pArena)
 {
   if (flags & SCRIPT_VERIFY_DERSIG) {
     //printf("%lu verify script with dersig\n",(unsigned long)GetTime());
@@ -1819,14 +1869,18 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
   else {
     //printf("%lu verify script without dersig\n",(unsigned long)GetTime());
   }
-    vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType)) {
+    CScriptArena arenaLocal;
+    CScriptArena &arena = pArena ? *pArena : arenaLocal;
+    vector<CScriptElement> &stack = arena.stack, &stackCopy = arena.stackCopy;
+    stack.clear();
+    stackCopy.clear();
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, pSigHashCache, arena)) {
       //printf("verify script err 1\n");
         return false;
     }
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType)) {
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, pSigHashCache, arena)) {
       //printf("verify script err 2\n");
         return false;
     }
@@ -1853,11 +1907,11 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         // an empty stack and the EvalScript above would return false.
         assert(!stackCopy.empty());
 
-        const valtype& pubKeySerialized = stackCopy.back();
+        const CScriptElement& pubKeySerialized = stackCopy.back();
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType)) {
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, pSigHashCache, arena)) {
 	  //printf("verify script err 6\n");
             return false;
 	}
@@ -1876,6 +1930,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
+    txTo.InvalidateHash();
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
@@ -1955,7 +2010,7 @@ static CScript CombineMultisig(CScript scriptPubKey, const CTransaction& txTo, u
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0, 0))
+            if (CheckSig(CScriptElement(sig), CScriptElement(pubkey), scriptPubKey, txTo, nIn, 0, 0, NULL))
             {
                 sigs[pubkey] = sig;
                 break;
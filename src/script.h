@@ -8,6 +8,7 @@
 #define H_BITMARK_SCRIPT
 
 #include "key.h"
+#include "smallvector.h"
 #include "util.h"
 
 #include <stdexcept>
@@ -24,6 +25,9 @@ class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 40;      // bytes
+// -sigcachesize default and maximum (MiB)
+static const int64_t DEFAULT_SIG_CACHE_SIZE = 32;
+static const int64_t MAX_SIG_CACHE_SIZE = 256;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 
@@ -39,6 +43,12 @@ public:
     explicit scriptnum_error(const std::string& str) : std::runtime_error(str) {}
 };
 
+/** Script stack elements keep up to this many bytes inline: enough for DER
+ *  signatures with their hash type byte, public keys and hashes. */
+static const unsigned int MAX_INLINE_SCRIPT_ELEMENT_SIZE = 75;
+
+typedef smallvector<MAX_INLINE_SCRIPT_ELEMENT_SIZE, unsigned char> CScriptElement;
+
 class CScriptNum
 {
 // Numeric opcodes (OP_1ADD, etc) are restricted to operating on 4-byte integers.
@@ -64,6 +74,14 @@ public:
         m_value = set_vch(vch);
     }
 
+    explicit CScriptNum(const CScriptElement& vch,
+                        const size_t nMaxNumSize = nDefaultMaxNumSize)
+    {
+        if (vch.size() > nMaxNumSize)
+            throw scriptnum_error("CScriptNum(const CScriptElement&) : overflow");
+        m_value = set_vch(vch);
+    }
+
     inline bool operator==(const int64_t& rhs) const    { return m_value == rhs; }
     inline bool operator!=(const int64_t& rhs) const    { return m_value != rhs; }
     inline bool operator<=(const int64_t& rhs) const    { return m_value <= rhs; }
@@ -164,7 +182,8 @@ public:
 
 
 private:
-    static int64_t set_vch(const std::vector<unsigned char>& vch)
+    template<typename T>
+    static int64_t set_vch(const T& vch)
     {
       if (vch.empty())
           return 0;
@@ -425,6 +444,34 @@ inline std::string StackString(const std::vector<std::vector<unsigned char> >& v
 class CScript : public std::vector<unsigned char>
 {
 protected:
+    CScript& PushData(const unsigned char* pch, size_t nSize)
+    {
+        if (nSize < OP_PUSHDATA1)
+        {
+            insert(end(), (unsigned char)nSize);
+        }
+        else if (nSize <= 0xff)
+        {
+            insert(end(), OP_PUSHDATA1);
+            insert(end(), (unsigned char)nSize);
+        }
+        else if (nSize <= 0xffff)
+        {
+            insert(end(), OP_PUSHDATA2);
+            unsigned short nSize2 = nSize;
+            insert(end(), (unsigned char*)&nSize2, (unsigned char*)&nSize2 + sizeof(nSize2));
+        }
+        else
+        {
+            insert(end(), OP_PUSHDATA4);
+            unsigned int nSize4 = nSize;
+            insert(end(), (unsigned char*)&nSize4, (unsigned char*)&nSize4 + sizeof(nSize4));
+        }
+        if (nSize)
+            insert(end(), pch, pch + nSize);
+        return *this;
+    }
+
     CScript& push_int64(int64_t n)
     {
         if (n == -1 || (n >= 1 && n <= 16))
@@ -508,29 +555,12 @@ public:
 
     CScript& operator<<(const std::vector<unsigned char>& b)
     {
-        if (b.size() < OP_PUSHDATA1)
-        {
-            insert(end(), (unsigned char)b.size());
-        }
-        else if (b.size() <= 0xff)
-        {
-            insert(end(), OP_PUSHDATA1);
-            insert(end(), (unsigned char)b.size());
-        }
-        else if (b.size() <= 0xffff)
-        {
-            insert(end(), OP_PUSHDATA2);
-            unsigned short nSize = b.size();
-            insert(end(), (unsigned char*)&nSize, (unsigned char*)&nSize + sizeof(nSize));
-        }
-        else
-        {
-            insert(end(), OP_PUSHDATA4);
-            unsigned int nSize = b.size();
-            insert(end(), (unsigned char*)&nSize, (unsigned char*)&nSize + sizeof(nSize));
-        }
-        insert(end(), b.begin(), b.end());
-        return *this;
+        return PushData(b.empty() ? NULL : &b[0], b.size());
+    }
+
+    CScript& operator<<(const CScriptElement& b)
+    {
+        return PushData(b.data(), b.size());
     }
 
     CScript& operator<<(const CScript& b)
@@ -809,10 +839,44 @@ public:
     }
 };
 
+/** Serialized pieces of a transaction that the signature hashes of all its
+ *  inputs have in common. Built once per transaction and shared by its
+ *  script checks, so that hashing for n inputs does not serialize the
+ *  transaction n times. Used for the hash types that commit to every input
+ *  and output (not SIGHASH_NONE, SIGHASH_SINGLE or SIGHASH_ANYONECANPAY).
+ */
+class CSigHashCache
+{
+public:
+    // Hash state after nVersion, the input count and the first i inputs, blanked
+    std::vector<CHashWriter> vPrefix;
+    // All inputs with an empty script, back to back
+    CDataStream ssInputs;
+    // Output count and outputs
+    CDataStream ssOutputs;
+
+    CSigHashCache(const CTransaction &txTo);
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSigHashCache *pSigHashCache);
+
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey, unsigned int flags);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig, unsigned int flags);
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+/** Stacks reused from one script evaluation to the next, so that a thread
+ *  verifying many scripts keeps their memory instead of reallocating it. */
+class CScriptArena
+{
+public:
+    std::vector<CScriptElement> stack;
+    std::vector<CScriptElement> stackCopy;
+    std::vector<CScriptElement> altstack;
+    std::vector<bool> vfExec;
+    std::vector<unsigned char> vchPushValue;
+};
+
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache *pSigHashCache = NULL);
+bool EvalScript(std::vector<CScriptElement>& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache *pSigHashCache, CScriptArena &arena);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -823,7 +887,7 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache *pSigHashCache = NULL, CScriptArena *pArena = NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
@@ -0,0 +1,182 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_SMALLVECTOR_H
+#define BITMARK_SMALLVECTOR_H
+
+#include <algorithm>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/** STL-like vector of plain-old-data elements that keeps up to N of them
+ *  inline, and only allocates on the heap beyond that. Once it has moved to
+ *  the heap a vector stays there until destroyed, so clearing and refilling
+ *  it doesn't allocate again. Elements are copied with memcpy and are not
+ *  value-initialized by resize(). */
+template <unsigned int N, typename T> class smallvector
+{
+public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef uint32_t size_type;
+
+private:
+    size_type nSize;
+    size_type nCapacity; // N while the elements are inline
+    union {
+        T vInline[N];
+        T *pHeap;
+    };
+
+    bool IsInline() const { return nCapacity == N; }
+
+    // Make room for n elements, keeping the current ones
+    void Grow(size_type n)
+    {
+        if (n <= nCapacity)
+            return;
+        size_type nNew = std::max(n, nCapacity + nCapacity / 2);
+        T *pNew = (T*)malloc(nNew * sizeof(T));
+        if (pNew == NULL)
+            throw std::bad_alloc();
+        memcpy(pNew, data(), nSize * sizeof(T));
+        if (!IsInline())
+            free(pHeap);
+        pHeap = pNew;
+        nCapacity = nNew;
+    }
+
+    void Release()
+    {
+        if (!IsInline())
+            free(pHeap);
+        nSize = 0;
+        nCapacity = N;
+    }
+
+public:
+    smallvector() : nSize(0), nCapacity(N) {}
+
+    explicit smallvector(size_type n, const T& value = T()) : nSize(0), nCapacity(N) { assign(n, value); }
+    smallvector(const T* pbegin, const T* pend) : nSize(0), nCapacity(N) { assign(pbegin, pend); }
+    smallvector(const std::vector<T>& v) : nSize(0), nCapacity(N) { assign(v.empty() ? NULL : &v[0], v.empty() ? NULL : &v[0] + v.size()); }
+    smallvector(const smallvector& other) : nSize(0), nCapacity(N) { assign(other.begin(), other.end()); }
+
+    smallvector(smallvector&& other) : nSize(0), nCapacity(N)
+    {
+        *this = static_cast<smallvector&&>(other);
+    }
+
+    ~smallvector() { Release(); }
+
+    smallvector& operator=(const smallvector& other)
+    {
+        if (&other != this)
+            assign(other.begin(), other.end());
+        return *this;
+    }
+
+    // Heap buffers are handed over, inline elements copied
+    smallvector& operator=(smallvector&& other)
+    {
+        if (&other == this)
+            return *this;
+        if (other.IsInline()) {
+            assign(other.begin(), other.end());
+        } else {
+            Release();
+            pHeap = other.pHeap;
+            nSize = other.nSize;
+            nCapacity = other.nCapacity;
+            other.nSize = 0;
+            other.nCapacity = N;
+        }
+        other.clear();
+        return *this;
+    }
+
+    void assign(const T* pbegin, const T* pend)
+    {
+        size_type n = pend - pbegin;
+        if (n > nCapacity) {
+            nSize = 0;
+            Grow(n);
+        }
+        if (n)
+            memmove(data(), pbegin, n * sizeof(T));
+        nSize = n;
+    }
+
+    void assign(size_type n, const T& value)
+    {
+        nSize = 0;
+        Grow(n);
+        std::fill_n(data(), n, value);
+        nSize = n;
+    }
+
+    T* data() { return IsInline() ? vInline : pHeap; }
+    const T* data() const { return IsInline() ? vInline : pHeap; }
+    iterator begin() { return data(); }
+    const_iterator begin() const { return data(); }
+    iterator end() { return data() + nSize; }
+    const_iterator end() const { return data() + nSize; }
+
+    size_type size() const { return nSize; }
+    size_type capacity() const { return nCapacity; }
+    bool empty() const { return nSize == 0; }
+
+    T& operator[](size_type pos) { return data()[pos]; }
+    const T& operator[](size_type pos) const { return data()[pos]; }
+    T& front() { return data()[0]; }
+    const T& front() const { return data()[0]; }
+    T& back() { return data()[nSize - 1]; }
+    const T& back() const { return data()[nSize - 1]; }
+
+    void reserve(size_type n) { Grow(n); }
+    void clear() { nSize = 0; }
+
+    void resize(size_type n)
+    {
+        Grow(n);
+        nSize = n;
+    }
+
+    void push_back(const T& value)
+    {
+        if (nSize == nCapacity) {
+            T copy = value; // value may live in our own buffer
+            Grow(nSize + 1);
+            data()[nSize++] = copy;
+        } else
+            data()[nSize++] = value;
+    }
+
+    void pop_back() { nSize--; }
+
+    void swap(smallvector& other)
+    {
+        smallvector tmp(static_cast<smallvector&&>(other));
+        other = static_cast<smallvector&&>(*this);
+        *this = static_cast<smallvector&&>(tmp);
+    }
+
+    friend bool operator==(const smallvector& a, const smallvector& b)
+    {
+        return a.nSize == b.nSize && (a.nSize == 0 || memcmp(a.data(), b.data(), a.nSize * sizeof(T)) == 0);
+    }
+    friend bool operator!=(const smallvector& a, const smallvector& b) { return !(a == b); }
+    friend bool operator<(const smallvector& a, const smallvector& b)
+    {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+    }
+
+    friend void swap(smallvector& a, smallvector& b) { a.swap(b); }
+};
+
+#endif // BITMARK_SMALLVECTOR_H
@@ -15,6 +15,7 @@
 #include "net.h"
 #include "script.h"
 #include "serialize.h"
+#include "test/test_bitmark.h"
 
 #include <stdint.h>
 
@@ -26,9 +27,11 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CTransaction> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, unsigned int nMaxBytes = MAX_ORPHAN_TOTAL_SIZE);
+extern mapOrphanTx_t mapOrphanTransactions;
+extern mapOrphanTxByPrev_t mapOrphanTransactionsByPrev;
+extern std::map<NodeId, unsigned int> mapOrphanBytesByPeer;
+extern unsigned int nOrphanBytes;
 
 CService ip(uint32_t i)
 {
@@ -153,11 +156,11 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CTransaction>::iterator it;
+    mapOrphanTx_t::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second;
+    return it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -239,6 +242,68 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     LimitOrphanTxSize(0);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanBytesByPeer.empty());
+    BOOST_CHECK_EQUAL(nOrphanBytes, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanLimits)
+{
+    // Indexed by outpoint: two orphans spending different outputs of the same
+    // parent, and one spending both
+    uint256 hashParent = GetRandHash();
+    CTransaction tx0 = MakeTx(COutPoint(hashParent, 0)), tx1 = MakeTx(COutPoint(hashParent, 1));
+    CTransaction txBoth = MakeTx(COutPoint(hashParent, 0));
+    txBoth.vin.push_back(tx1.vin[0]);
+    BOOST_CHECK(AddOrphanTx(tx0, 1));
+    BOOST_CHECK(AddOrphanTx(tx1, 1));
+    BOOST_CHECK(AddOrphanTx(txBoth, 2));
+    BOOST_CHECK(!AddOrphanTx(tx0, 3));
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev.size(), 2U);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev[COutPoint(hashParent, 0)].size(), 2U);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev[COutPoint(hashParent, 1)].size(), 2U);
+
+    // Bytes are tracked per peer and go away with the peer
+    unsigned int nSize = ::GetSerializeSize(tx0, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(mapOrphanBytesByPeer[1], 2 * nSize);
+    BOOST_CHECK_EQUAL(nOrphanBytes, 2 * nSize + ::GetSerializeSize(txBoth, SER_NETWORK, PROTOCOL_VERSION));
+    EraseOrphansFor(1);
+    BOOST_CHECK(!mapOrphanBytesByPeer.count(1));
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 1U);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev.size(), 2U);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev[COutPoint(hashParent, 0)].size(), 1U);
+    EraseOrphansFor(2);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanBytes, 0U);
+
+    // A peer can't go past its share of the pool, but others still can
+    CTransaction txPadded = MakeTx(COutPoint(0, 0));
+    txPadded.vin[0].scriptSig << std::vector<unsigned char>(2000, 0x42);
+    unsigned int nAdded = 0;
+    for (int i = 0; i < 100; i++) {
+        txPadded.vin[0].prevout.hash = GetRandHash();
+        nAdded += AddOrphanTx(txPadded, 1);
+    }
+    BOOST_CHECK(mapOrphanBytesByPeer[1] <= MAX_ORPHAN_PEER_SIZE);
+    BOOST_CHECK(nAdded < 100);
+    txPadded.vin[0].prevout.hash = GetRandHash();
+    BOOST_CHECK(AddOrphanTx(txPadded, 2));
+
+    // The byte limit evicts as well as the count limit
+    LimitOrphanTxSize(1000, 10000);
+    BOOST_CHECK(nOrphanBytes <= 10000);
+    BOOST_CHECK(!mapOrphanTransactions.empty());
+
+    // Orphans expire
+    int64_t nNow = GetTime();
+    SetMockTime(nNow);
+    LimitOrphanTxSize(1000);
+    BOOST_CHECK(AddOrphanTx(MakeTx(COutPoint(GetRandHash(), 0)), 3));
+    SetMockTime(nNow + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL);
+    LimitOrphanTxSize(1000);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanBytesByPeer.empty());
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
@@ -315,15 +380,12 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     BOOST_CHECK(!VerifySignature(CCoins(orphans[1], MEMPOOL_HEIGHT), tx, 1, flags, SIGHASH_ALL));
     std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
 
-    // Exercise -maxsigcachesize code:
-    mapArgs["-maxsigcachesize"] = "10";
-    // Generate a new, different signature for vin[0] to trigger cache clear:
+    // A fresh signature for vin[0] must verify, not hit a stale cache entry:
     CScript oldSig = tx.vin[0].scriptSig;
     BOOST_CHECK(SignSignature(keystore, orphans[0], tx, 0));
     BOOST_CHECK(tx.vin[0].scriptSig != oldSig);
     for (unsigned int j = 0; j < tx.vin.size(); j++)
         BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
-    mapArgs.erase("-maxsigcachesize");
 
     LimitOrphanTxSize(0);
 }
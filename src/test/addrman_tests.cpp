@@ -0,0 +1,147 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for the address manager and its peers.dat format
+//
+
+#include "addrman.h"
+
+#include "serialize.h"
+#include "util.h"
+#include "version.h"
+
+#include <set>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static CAddress MakeAddr(int n)
+{
+    CAddress addr(CService(strprintf("%d.%d.%d.1", 1 + n / 256, n % 256, n % 7), 9265));
+    addr.nTime = GetAdjustedTime() - n;
+    return addr;
+}
+
+static CSerializeData Serialized(const CAddrMan& addrman)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    return CSerializeData(ss.begin(), ss.end());
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_select)
+{
+    CAddrMan addrman;
+    BOOST_CHECK(!addrman.Select().IsValid());
+
+    CNetAddr source("252.2.2.2");
+    for (int i = 0; i < 500; i++)
+        addrman.Add(MakeAddr(i), source);
+    BOOST_CHECK_EQUAL(addrman.size(), 500);
+
+    // Adding the same address again doesn't make a second entry
+    BOOST_CHECK(!addrman.Add(MakeAddr(7), source));
+    BOOST_CHECK_EQUAL(addrman.size(), 500);
+
+    // Nothing is tried yet, so even a "tried only" selection gets a new one
+    CAddress addr = addrman.Select(0);
+    BOOST_CHECK(addr.IsValid());
+
+    // Once some are good, they are the only ones selected with no bias towards new ones
+    set<CService> setGood;
+    for (int i = 0; i < 500; i += 50) {
+        addrman.Good(MakeAddr(i));
+        setGood.insert(MakeAddr(i));
+    }
+    BOOST_CHECK_EQUAL(addrman.size(), 500);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(setGood.count(addrman.Select(0)));
+
+    // A port mismatch is a different service
+    CAddress addrOtherPort(CService(MakeAddr(1), 1234));
+    addrman.Good(addrOtherPort);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(addrman.Select(0) != addrOtherPort);
+
+    vector<CAddress> vAddr = addrman.GetAddr();
+    BOOST_CHECK_EQUAL(vAddr.size(), (size_t)(ADDRMAN_GETADDR_MAX_PCT * 500 / 100));
+    set<CService> setAddr(vAddr.begin(), vAddr.end());
+    BOOST_CHECK_EQUAL(setAddr.size(), vAddr.size());
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrMan addrman;
+    CNetAddr source("252.2.2.2");
+    for (int i = 0; i < 1000; i++)
+        addrman.Add(MakeAddr(i), source);
+    set<CService> setGood;
+    for (int i = 0; i < 1000; i += 10) {
+        addrman.Good(MakeAddr(i));
+        setGood.insert(MakeAddr(i));
+    }
+
+    // The tables are stored as they are, so loading them gives back the same bytes
+    CSerializeData vch = Serialized(addrman);
+    CDataStream ss(vch.begin(), vch.end(), SER_DISK, CLIENT_VERSION);
+    CAddrMan addrman2;
+    ss >> addrman2;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+    BOOST_CHECK(Serialized(addrman2) == vch);
+
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(setGood.count(addrman2.Select(0)));
+
+    // Corrupt bucket contents are rejected
+    CSerializeData vchBad(vch);
+    CDataStream ssBad(vchBad.begin(), vchBad.end() - 4, SER_DISK, CLIENT_VERSION);
+    int nBad = 1000000;
+    ssBad << nBad;
+    CAddrMan addrman3;
+    BOOST_CHECK_THROW(ssBad >> addrman3, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_load_v0)
+{
+    // A peers.dat written before the buckets were stored: one new and one tried entry
+    vector<unsigned char> nKey(32, 0x11);
+    CNetAddr source("252.2.2.2");
+    CAddrInfo infoNew(MakeAddr(1), source), infoTried(MakeAddr(2), source);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    unsigned char nFormat = 0;
+    int nNew = 1, nTried = 1, nUBuckets = ADDRMAN_NEW_BUCKET_COUNT;
+    ss << nFormat << nKey << nNew << nTried << nUBuckets << infoNew << infoTried;
+    int nUBucket = infoNew.GetNewBucket(nKey);
+    for (int b = 0; b < ADDRMAN_NEW_BUCKET_COUNT; b++) {
+        int nSize = b == nUBucket ? 1 : 0, nIndex = 0;
+        ss << nSize;
+        if (nSize)
+            ss << nIndex;
+    }
+
+    CAddrMan addrman;
+    ss >> addrman;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(addrman.size(), 2);
+    BOOST_CHECK(addrman.Select(0) == CService(MakeAddr(2)));
+    BOOST_CHECK(addrman.Select(100) == CService(MakeAddr(1)));
+
+    // It is written back in the current format and keeps the key
+    CSerializeData vch = Serialized(addrman);
+    BOOST_CHECK_EQUAL(vch[0], 1);
+    BOOST_CHECK(vector<unsigned char>(vch.begin() + 2, vch.begin() + 34) == nKey);
+    CDataStream ss2(vch.begin(), vch.end(), SER_DISK, CLIENT_VERSION);
+    CAddrMan addrman2;
+    ss2 >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), 2);
+    BOOST_CHECK(Serialized(addrman2) == vch);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,88 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "core.h"
+#include "serialize.h"
+#include "test/test_bitmark.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockcache_tests)
+
+BOOST_AUTO_TEST_CASE(blockcache_hit_miss)
+{
+    CBlockCache cache(1 << 20);
+    CBlock block = MakeBlock(10, 1);
+    uint256 hash = block.GetHash();
+
+    CBlock blockOut;
+    BOOST_CHECK(!cache.GetBlock(hash, blockOut));
+
+    cache.Insert(hash, block);
+    BOOST_CHECK(cache.Contains(hash));
+    BOOST_CHECK(cache.GetBlock(hash, blockOut));
+    BOOST_CHECK(blockOut.GetHash() == hash);
+    BOOST_CHECK(blockOut.vtx.size() == block.vtx.size());
+
+    CDataStream ssExpected(SER_NETWORK, PROTOCOL_VERSION);
+    ssExpected << block;
+    CDataStream ssOut(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(cache.GetSerializedBlock(hash, ssOut));
+    BOOST_CHECK(ssOut.str() == ssExpected.str());
+
+    CBlockCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nHits, 2U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 1U);
+    BOOST_CHECK_EQUAL(stats.nEntries, 1U);
+    BOOST_CHECK(stats.nBytes >= 2 * ssExpected.size());
+
+    cache.Erase(hash);
+    BOOST_CHECK(!cache.Contains(hash));
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBytes, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru_eviction)
+{
+    vector<CBlock> blocks;
+    for (unsigned int i = 0; i < 4; i++)
+        blocks.push_back(MakeBlock(20, i));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << blocks[0];
+    // Room for three blocks, but not four
+    CBlockCache cache(3 * (2 * ss.size() + 256) + 16);
+
+    for (unsigned int i = 0; i < 3; i++)
+        cache.Insert(blocks[i].GetHash(), blocks[i]);
+
+    // Touch the oldest entry so the second one becomes least recently used
+    CBlock blockOut;
+    BOOST_CHECK(cache.GetBlock(blocks[0].GetHash(), blockOut));
+
+    cache.Insert(blocks[3].GetHash(), blocks[3]);
+    BOOST_CHECK(cache.Contains(blocks[0].GetHash()));
+    BOOST_CHECK(!cache.Contains(blocks[1].GetHash()));
+    BOOST_CHECK(cache.Contains(blocks[2].GetHash()));
+    BOOST_CHECK(cache.Contains(blocks[3].GetHash()));
+
+    // Shrinking the budget evicts down to it, zero disables the cache
+    cache.SetMaxBytes(2 * ss.size() + 256);
+    CBlockCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 1U);
+    BOOST_CHECK(cache.Contains(blocks[3].GetHash()));
+
+    cache.SetMaxBytes(0);
+    cache.Insert(blocks[1].GetHash(), blocks[1]);
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
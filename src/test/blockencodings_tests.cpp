@@ -0,0 +1,138 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "core.h"
+#include "serialize.h"
+#include "txmempool.h"
+#include "test/test_bitmark.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+BOOST_AUTO_TEST_CASE(cmpctblock_roundtrip)
+{
+    CBlock block = MakeBlock(300);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.vShortTxIDs.size(), 300U);
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    // Header, nonce, 6 bytes per short id and the coinbase: much less than the block
+    BOOST_CHECK(ss.size() < ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) / 4);
+
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    ss >> cmpctblock2;
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblock2.nNonce == cmpctblock.nNonce);
+    BOOST_CHECK(cmpctblock2.vShortTxIDs == cmpctblock.vShortTxIDs);
+    BOOST_CHECK_EQUAL(cmpctblock2.vPrefilledTxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock2.vPrefilledTxn[0].nIndex, 0);
+    BOOST_CHECK(cmpctblock2.vPrefilledTxn[0].tx.GetHash() == block.vtx[0].GetHash());
+
+    // The receiver derives the same short ids from the header and nonce
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        BOOST_CHECK_EQUAL(cmpctblock2.GetShortID(block.vtx[i].GetHash()), cmpctblock.vShortTxIDs[i - 1]);
+    BOOST_CHECK(cmpctblock2.vShortTxIDs[0] <= 0xffffffffffffULL);
+
+    // Two encodings of the same block use different keys
+    CBlockHeaderAndShortTxIDs cmpctblock3(block);
+    BOOST_CHECK(cmpctblock3.vShortTxIDs != cmpctblock.vShortTxIDs);
+}
+
+BOOST_AUTO_TEST_CASE(blocktxn_request_roundtrip)
+{
+    CBlockTransactionsRequest req;
+    req.hashBlock = uint256(12345);
+    req.vIndexes.push_back(1);
+    req.vIndexes.push_back(2);
+    req.vIndexes.push_back(300);
+    req.vIndexes.push_back(65535);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << req;
+    CBlockTransactionsRequest req2;
+    ss >> req2;
+    BOOST_CHECK(req2.hashBlock == req.hashBlock);
+    BOOST_CHECK(req2.vIndexes == req.vIndexes);
+
+    // Differences that add up past 16 bits are rejected
+    CDataStream ssBad(SER_NETWORK, PROTOCOL_VERSION);
+    unsigned int nCount = 2, nFirst = 65535, nSecond = 1;
+    ssBad << req.hashBlock << VARINT(nCount) << VARINT(nFirst) << VARINT(nSecond);
+    CBlockTransactionsRequest req3;
+    BOOST_CHECK_THROW(ssBad >> req3, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(partialblock_reconstruct)
+{
+    CBlock block = MakeBlock(20);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+
+    // The mempool has all but two of the block's transactions, plus one unrelated one
+    CTxMemPool pool;
+    for (unsigned int i = 1; i < block.vtx.size(); i++) {
+        if (i == 5 || i == 17)
+            continue;
+        pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+    }
+    CTransaction txOther = MakeTx(1000);
+    pool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 0, 0, 0.0, 1));
+
+    CPartialBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 18U);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(5));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(17));
+
+    // Too few, too many and wrong transactions
+    CBlock blockOut;
+    vector<CTransaction> vtxMissing;
+    vtxMissing.push_back(block.vtx[5]);
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vtxMissing) == READ_STATUS_INVALID);
+    vtxMissing.push_back(block.vtx[17]);
+    vtxMissing.push_back(block.vtx[1]);
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vtxMissing) == READ_STATUS_INVALID);
+    vtxMissing.pop_back();
+    swap(vtxMissing[0], vtxMissing[1]);
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vtxMissing) == READ_STATUS_FAILED);
+
+    swap(vtxMissing[0], vtxMissing[1]);
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vtxMissing) == READ_STATUS_OK);
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(blockOut.vtx.size(), block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(blockOut.vtx[i].GetHash() == block.vtx[i].GetHash());
+
+    // A partial block is only initialized once
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_CASE(partialblock_bad_cmpctblock)
+{
+    CBlock block = MakeBlock(10);
+    CTxMemPool pool;
+
+    // Prefilled index past the end of the block
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.vPrefilledTxn[0].nIndex = 11;
+    CPartialBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == READ_STATUS_INVALID);
+
+    // Two transactions sharing a short id can't be told apart
+    CBlockHeaderAndShortTxIDs cmpctblock2(block);
+    cmpctblock2.vShortTxIDs[3] = cmpctblock2.vShortTxIDs[4];
+    CPartialBlock partialBlock2;
+    BOOST_CHECK(partialBlock2.InitData(cmpctblock2, pool) == READ_STATUS_FAILED);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
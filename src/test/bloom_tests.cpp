@@ -8,9 +8,12 @@
 #include "base58.h"
 #include "key.h"
 #include "main.h"
+#include "net.h"
+#include "protocol.h"
 #include "serialize.h"
 #include "uint256.h"
 #include "util.h"
+#include "test/test_bitmark.h"
 
 #include <vector>
 
@@ -452,4 +455,151 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(bloom_block_elements)
+{
+    // Each transaction spends the one before, so what an earlier one added
+    // to the filter decides what later ones match
+    CBlock block;
+    uint256 hashPrev = 1;
+    for (unsigned int n = 0; n < 60; n++)
+    {
+        // Pay-to-pubkey, pay-to-pubkey-hash and bare multisig outputs, spent
+        // by inputs that push a signature and a pubkey
+        vector<unsigned char> vchPubKey(33, n & 0xff), vchPubKey2(33, (n >> 8) & 0xff), vchSig(72, n * 3);
+        vchPubKey[0] = vchPubKey2[0] = 0x02;
+        CTransaction tx = MakeTx(COutPoint(hashPrev, 0), 3);
+        for (unsigned int i = 1; i <= n % 3; i++)
+            tx.vin.push_back(CTxIn(COutPoint(hashPrev, i)));
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            tx.vin[i].scriptSig = CScript() << vchSig << vchPubKey2;
+        tx.vout[0].scriptPubKey = CScript() << vchPubKey << OP_CHECKSIG;
+        tx.vout[1].scriptPubKey.SetDestination(CKeyID(uint160(n)));
+        tx.vout[2].scriptPubKey = CScript() << OP_1 << vchPubKey << vchPubKey2 << OP_2 << OP_CHECKMULTISIG;
+        block.vtx.push_back(tx);
+        hashPrev = tx.GetHash();
+    }
+    CBloomBlockElements elements(block);
+    BOOST_CHECK(elements.GetBlockHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(elements.size(), block.vtx.size());
+
+    for (unsigned char nFlags = BLOOM_UPDATE_NONE; nFlags <= BLOOM_UPDATE_P2PUBKEY_ONLY; nFlags++)
+    {
+        for (unsigned int nTest = 0; nTest < 20; nTest++)
+        {
+            // A high fp rate makes for plenty of matches
+            CBloomFilter filter(20, 0.1, nTest, nFlags);
+            vector<unsigned char> vchPubKey(33, nTest * 3);
+            vchPubKey[0] = 0x02;
+            filter.insert(vchPubKey);
+            filter.insert(block.vtx[nTest].GetHash());
+            CBloomFilter filter2 = filter;
+
+            for (unsigned int i = 0; i < block.vtx.size(); i++)
+            {
+                BOOST_CHECK(elements.GetTxHash(i) == block.vtx[i].GetHash());
+                BOOST_CHECK_EQUAL(filter.IsRelevantAndUpdate(block.vtx[i], block.vtx[i].GetHash()),
+                                  filter2.IsRelevantAndUpdate(elements, i));
+            }
+
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION), ss2(SER_NETWORK, PROTOCOL_VERSION);
+            ss << filter;
+            ss2 << filter2;
+            BOOST_CHECK(ss.str() == ss2.str());
+        }
+    }
+}
+
+static uint256 TestHash(unsigned int n)
+{
+    return Hash(BEGIN(n), END(n));
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    CRollingBloomFilter rb(100, 0.01);
+
+    // The last 100 inserts are always there, whenever the generation moves on
+    bool fAllRecent = true;
+    for (unsigned int i = 0; i < 1000; i++) {
+        rb.insert(TestHash(i));
+        for (unsigned int j = (i >= 99 ? i - 99 : 0); j <= i; j++)
+            fAllRecent &= rb.contains(TestHash(j));
+    }
+    BOOST_CHECK(fAllRecent);
+
+    // Anything older than 150 inserts has been wiped, bar false positives
+    unsigned int nOld = 0;
+    for (unsigned int i = 0; i < 800; i++)
+        if (rb.contains(TestHash(i)))
+            nOld++;
+    BOOST_CHECK(nOld < 30);
+
+    // Never inserted; 1% expected, allow for bad luck
+    unsigned int nFalse = 0;
+    for (unsigned int i = 10000; i < 20000; i++)
+        if (rb.contains(TestHash(i)))
+            nFalse++;
+    BOOST_CHECK(nFalse < 200);
+
+    vector<unsigned char> vKey = ParseHex("03a1b2c3");
+    rb.insert(vKey);
+    BOOST_CHECK(rb.contains(vKey));
+
+    rb.reset();
+    unsigned int nAfterReset = 0;
+    for (unsigned int i = 900; i < 1000; i++)
+        if (rb.contains(TestHash(i)))
+            nAfterReset++;
+    BOOST_CHECK(nAfterReset < 10);
+
+    // The memory footprint is fixed up front
+    size_t nMemory = rb.DynamicMemoryUsage();
+    for (unsigned int i = 0; i < 10000; i++)
+        rb.insert(TestHash(i));
+    BOOST_CHECK_EQUAL(rb.DynamicMemoryUsage(), nMemory);
+}
+
+// The filters CNode keeps to avoid announcing inventory and addresses twice,
+// at their real sizes: everything recent is remembered, and new items are
+// only held back by the rare false positive.
+BOOST_AUTO_TEST_CASE(rolling_bloom_known_inventory)
+{
+    const unsigned int nInventoryKnown = SendBufferSize() / 1000;
+    const unsigned int nRelay = 2000;
+
+    CRollingBloomFilter filterInventoryKnown(nInventoryKnown, INVENTORY_KNOWN_FP_RATE);
+    for (unsigned int i = 0; i < nInventoryKnown; i++)
+        filterInventoryKnown.insert(TestHash(i));
+    bool fAllKnown = true;
+    for (unsigned int i = 0; i < nInventoryKnown; i++)
+        fAllKnown &= filterInventoryKnown.contains(TestHash(i));
+    BOOST_CHECK(fAllKnown);
+
+    // Relay new inventory the way PushInventory does
+    unsigned int nSent = 0;
+    for (unsigned int i = nInventoryKnown; i < nInventoryKnown + nRelay; i++)
+        if (!filterInventoryKnown.contains(TestHash(i))) {
+            filterInventoryKnown.insert(TestHash(i));
+            nSent++;
+        }
+    BOOST_CHECK(nSent > nRelay - 2);
+    BOOST_CHECK(filterInventoryKnown.contains(TestHash(nInventoryKnown + nRelay - 1)));
+
+    CRollingBloomFilter filterAddrKnown(ADDR_KNOWN_SIZE, ADDR_KNOWN_FP_RATE);
+    vector<CAddress> vAddr;
+    for (unsigned int i = 0; i < ADDR_KNOWN_SIZE; i++) {
+        vAddr.push_back(CAddress(CService(CNetAddr(strprintf("10.%u.%u.%u", i >> 16, (i >> 8) & 0xff, i & 0xff).c_str()), 9265)));
+        filterAddrKnown.insert(vAddr.back().GetKey());
+    }
+    bool fAllAddrKnown = true;
+    for (unsigned int i = 0; i < vAddr.size(); i++)
+        fAllAddrKnown &= filterAddrKnown.contains(vAddr[i].GetKey());
+    BOOST_CHECK(fAllAddrKnown);
+    unsigned int nAddrFalse = 0;
+    for (unsigned int i = 0; i < 1000; i++)
+        if (filterAddrKnown.contains(CService(CNetAddr(strprintf("10.200.%u.%u", i >> 8, i & 0xff).c_str()), 9265).GetKey()))
+            nAddrFalse++;
+    BOOST_CHECK(nAddrFalse < 10);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,127 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include "util.h"
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+struct CCountingCheck
+{
+    std::atomic<unsigned int> *pnCount;
+    bool fOk;
+    int nSleepMillis;
+
+    CCountingCheck() : pnCount(NULL), fOk(true), nSleepMillis(0) {}
+    CCountingCheck(std::atomic<unsigned int> *pnCountIn, bool fOkIn = true, int nSleepMillisIn = 0) :
+        pnCount(pnCountIn), fOk(fOkIn), nSleepMillis(nSleepMillisIn) {}
+
+    bool operator()() {
+        if (nSleepMillis)
+            MilliSleep(nSleepMillis);
+        (*pnCount)++;
+        return fOk;
+    }
+
+    void swap(CCountingCheck &check) {
+        std::swap(pnCount, check.pnCount);
+        std::swap(fOk, check.fOk);
+        std::swap(nSleepMillis, check.nSleepMillis);
+    }
+};
+
+static void StartWorkers(CCheckQueue<CCountingCheck> &queue, boost::thread_group &threads, int nThreads)
+{
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, &queue));
+}
+
+static void StopWorkers(CCheckQueue<CCountingCheck> &queue, boost::thread_group &threads)
+{
+    queue.Quit();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_runs_all)
+{
+    CCheckQueue<CCountingCheck> queue(16, 4);
+    boost::thread_group threads;
+    StartWorkers(queue, threads, 3);
+
+    std::atomic<unsigned int> nCount(0);
+    for (unsigned int nRound = 0; nRound < 50; nRound++) {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        unsigned int nChecks = GetRand(300);
+        for (unsigned int nAdded = 0; nAdded < nChecks; ) {
+            vector<CCountingCheck> vChecks(std::min(nChecks - nAdded, 1 + (unsigned int)GetRand(40)), CCountingCheck(&nCount));
+            nAdded += vChecks.size();
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nCount, nChecks);
+        BOOST_CHECK(queue.IsIdle());
+        nCount = 0;
+    }
+    StopWorkers(queue, threads);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    CCheckQueue<CCountingCheck> queue(16, 4);
+    boost::thread_group threads;
+    StartWorkers(queue, threads, 3);
+
+    std::atomic<unsigned int> nCount(0);
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        vector<CCountingCheck> vChecks(1000, CCountingCheck(&nCount));
+        vChecks[500].fOk = false;
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+        BOOST_CHECK(nCount <= 1000U);
+    }
+
+    // The failure doesn't leak into the next round, which may be waited for more than once
+    nCount = 0;
+    CCheckQueueControl<CCountingCheck> control(&queue);
+    vector<CCountingCheck> vChecks(100, CCountingCheck(&nCount));
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+    vChecks.assign(100, CCountingCheck(&nCount));
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+    BOOST_CHECK_EQUAL(nCount, 200U);
+    StopWorkers(queue, threads);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_steals)
+{
+    CCheckQueue<CCountingCheck> queue(16, 4);
+    boost::thread_group threads;
+    std::atomic<unsigned int> nCount(0);
+    CCheckQueueStats statsStart = queue.GetStats();
+
+    // Everything lands in the master's deque; workers started afterwards have to steal it
+    CCheckQueueControl<CCountingCheck> control(&queue);
+    vector<CCountingCheck> vChecks(200, CCountingCheck(&nCount, true, 1));
+    control.Add(vChecks);
+    StartWorkers(queue, threads, 3);
+    BOOST_CHECK(control.Wait());
+    BOOST_CHECK_EQUAL(nCount, 200U);
+
+    CCheckQueueStats stats = queue.GetStats() - statsStart;
+    BOOST_CHECK_EQUAL(stats.nChecks, 200U);
+    BOOST_CHECK(stats.nSteals > 0);
+    BOOST_TEST_MESSAGE("checkqueue: " << stats.nSteals << " steals taking " << 0.001 * stats.nStealMicros << "ms, " << 0.001 * stats.nIdleMicros << "ms idle");
+    StopWorkers(queue, threads);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
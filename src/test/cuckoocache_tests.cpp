@@ -0,0 +1,112 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+static vector<uint256> RandomKeys(unsigned int n)
+{
+    vector<uint256> vKeys;
+    for (unsigned int i = 0; i < n; i++)
+        vKeys.push_back(GetRandHash());
+    return vKeys;
+}
+
+static unsigned int CountContained(CCuckooCache &cache, const vector<uint256> &vKeys, bool fErase = false)
+{
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        if (cache.Contains(vKeys[i], fErase))
+            n++;
+    return n;
+}
+
+BOOST_AUTO_TEST_SUITE(cuckoocache_tests)
+
+BOOST_AUTO_TEST_CASE(cuckoocache_insert_contains)
+{
+    CCuckooCache cache;
+    uint32_t nSlots = cache.Setup(1 << 16);
+    BOOST_CHECK(nSlots > 1900 && nSlots < 2000);
+
+    // At half load every key finds a place
+    vector<uint256> vKeys = RandomKeys(nSlots / 2);
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        cache.Insert(vKeys[i]);
+    BOOST_CHECK_EQUAL(CountContained(cache, vKeys), vKeys.size());
+    BOOST_CHECK_EQUAL(CountContained(cache, RandomKeys(1000)), 0U);
+
+    // Overfilling evicts, but never stores more keys than slots
+    vector<uint256> vMore = RandomKeys(nSlots * 2);
+    for (unsigned int i = 0; i < vMore.size(); i++)
+        cache.Insert(vMore[i]);
+    unsigned int nContained = CountContained(cache, vKeys) + CountContained(cache, vMore);
+    BOOST_CHECK(nContained <= nSlots);
+    BOOST_CHECK(nContained > nSlots / 2);
+
+    // A zero sized cache holds nothing
+    BOOST_CHECK_EQUAL(cache.Setup(0), 0U);
+    cache.Insert(vKeys[0]);
+    BOOST_CHECK(!cache.Contains(vKeys[0], false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_erase_reuses_slots)
+{
+    CCuckooCache cache;
+    uint32_t nSlots = cache.Setup(1 << 16);
+    vector<uint256> vOld = RandomKeys(nSlots / 2);
+    for (unsigned int i = 0; i < vOld.size(); i++)
+        cache.Insert(vOld[i]);
+
+    // Erased keys stay findable until their slots are needed
+    BOOST_CHECK_EQUAL(CountContained(cache, vOld, true), vOld.size());
+    BOOST_CHECK_EQUAL(CountContained(cache, vOld), vOld.size());
+
+    // New keys take the erased slots instead of displacing each other
+    vector<uint256> vNew = RandomKeys(nSlots / 2);
+    for (unsigned int i = 0; i < vNew.size(); i++)
+        cache.Insert(vNew[i]);
+    BOOST_CHECK_EQUAL(CountContained(cache, vNew), vNew.size());
+}
+
+static void LookupKeys(CCuckooCache *pcache, const vector<uint256> *pvPresent, const vector<uint256> *pvAbsent, unsigned int *pnFound, unsigned int *pnFalse)
+{
+    for (int nRound = 0; nRound < 20; nRound++) {
+        *pnFound += CountContained(*pcache, *pvPresent);
+        *pnFalse += CountContained(*pcache, *pvAbsent);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_concurrent_readers)
+{
+    CCuckooCache cache;
+    uint32_t nSlots = cache.Setup(1 << 20);
+    vector<uint256> vPresent = RandomKeys(nSlots / 4), vAbsent = RandomKeys(1000), vWrites = RandomKeys(nSlots / 4);
+    for (unsigned int i = 0; i < vPresent.size(); i++)
+        cache.Insert(vPresent[i]);
+
+    // Readers run while the table is rearranged underneath them
+    boost::thread_group threads;
+    unsigned int vFound[4] = {}, vFalse[4] = {};
+    for (int i = 0; i < 4; i++)
+        threads.create_thread(boost::bind(&LookupKeys, &cache, &vPresent, &vAbsent, &vFound[i], &vFalse[i]));
+    for (unsigned int i = 0; i < vWrites.size(); i++)
+        cache.Insert(vWrites[i]);
+    threads.join_all();
+
+    for (int i = 0; i < 4; i++) {
+        BOOST_CHECK_EQUAL(vFalse[i], 0U);
+        BOOST_CHECK(vFound[i] > 0);
+    }
+    BOOST_CHECK_EQUAL(CountContained(cache, vPresent), vPresent.size());
+    BOOST_CHECK_EQUAL(CountContained(cache, vWrites), vWrites.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -47,4 +47,34 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(murmurhash3_batch)
+{
+    // Any number of seeds and any tail length give the same as one at a time
+    vector<unsigned char> vData(41);
+    for (unsigned int i = 0; i < vData.size(); i++)
+        vData[i] = i * 37 + 11;
+    unsigned int vSeeds[13], vHashes[13];
+    for (unsigned int i = 0; i < 13; i++)
+        vSeeds[i] = i * 0xFBA4C795 + 0x12345;
+
+    for (unsigned int nLen = 0; nLen <= vData.size(); nLen++)
+    {
+        for (unsigned int nSeeds = 1; nSeeds <= 13; nSeeds++)
+        {
+            MurmurHash3Batch(vSeeds, nSeeds, &vData[0], nLen, vHashes);
+            for (unsigned int i = 0; i < nSeeds; i++)
+                BOOST_CHECK_EQUAL(vHashes[i], MurmurHash3(vSeeds[i], &vData[0], nLen));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Reference output for key 00..0f and the message 00..1f
+    uint256 val;
+    for (int i = 0; i < 32; i++)
+        val.begin()[i] = i;
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
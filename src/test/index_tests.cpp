@@ -0,0 +1,140 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txdb.h"
+
+#include "core.h"
+#include "util.h"
+#include "test/test_bitmark.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(index_tests)
+
+BOOST_AUTO_TEST_CASE(addressindex_connect_rewind)
+{
+    CAddressIndexDB db(1 << 20, true);
+    uint160 hashA("0x1111111111111111111111111111111111111111"), hashB("0x2222222222222222222222222222222222222222");
+    CScript scriptA, scriptB;
+    scriptA.SetDestination(CKeyID(hashA));
+    scriptB.SetDestination(CScriptID(hashB));
+
+    // Block 1: coinbase pays A
+    CBlock block1;
+    block1.vtx.push_back(MakeTx(COutPoint(), 1, 50 * COIN, scriptA));
+    block1.BuildMerkleTree();
+    uint256 hash1 = block1.GetHash();
+    CBlockIndex index1;
+    index1.phashBlock = &hash1;
+    index1.nHeight = 1;
+    CBlockUndo undo1;
+    BOOST_CHECK(db.IndexBlock(block1, undo1, &index1));
+
+    // Block 256: A pays B, which is spent back to A in the same block
+    CBlock block2;
+    block2.vtx.push_back(MakeTx(COutPoint(), 1, 50 * COIN));
+    block2.vtx.push_back(MakeTx(COutPoint(block1.vtx[0].GetHash(), 0), 1, 40 * COIN, scriptB));
+    block2.vtx.push_back(MakeTx(COutPoint(block2.vtx[1].GetHash(), 0), 1, 30 * COIN, scriptA));
+    block2.BuildMerkleTree();
+    uint256 hash2 = block2.GetHash();
+    CBlockIndex index2;
+    index2.phashBlock = &hash2;
+    index2.pprev = &index1;
+    index2.nHeight = 256;
+    CBlockUndo undo2;
+    undo2.vtxundo.resize(2);
+    undo2.vtxundo[0].vprevout.push_back(CTxInUndo(block1.vtx[0].vout[0], true, 1));
+    undo2.vtxundo[1].vprevout.push_back(CTxInUndo(block2.vtx[1].vout[0]));
+    BOOST_CHECK(db.IndexBlock(block2, undo2, &index2));
+    BOOST_CHECK(db.GetBestBlock() == hash2);
+
+    // History is ordered by height, even across byte boundaries
+    vector<pair<CAddressIndexKey, CAddressIndexValue> > vEntries;
+    BOOST_CHECK(db.ReadAddressIndex(1, hashA, vEntries));
+    BOOST_REQUIRE_EQUAL(vEntries.size(), 3U);
+    BOOST_CHECK_EQUAL(vEntries[0].first.nHeight, 1U);
+    BOOST_CHECK_EQUAL(vEntries[0].second.nValue, 50 * COIN);
+    BOOST_CHECK_EQUAL(vEntries[1].first.nHeight, 256U);
+    BOOST_CHECK_EQUAL(vEntries[2].first.nHeight, 256U);
+    for (unsigned int i = 1; i < 3; i++) {
+        if (vEntries[i].first.fSpending) {
+            BOOST_CHECK_EQUAL(vEntries[i].second.nValue, -50 * COIN);
+            BOOST_CHECK_EQUAL(vEntries[i].second.nPrevHeight, 1U);
+        } else
+            BOOST_CHECK_EQUAL(vEntries[i].second.nValue, 30 * COIN);
+    }
+
+    vEntries.clear();
+    BOOST_CHECK(db.ReadAddressIndex(1, hashA, vEntries, 2, 300));
+    BOOST_CHECK_EQUAL(vEntries.size(), 2U);
+    vEntries.clear();
+    BOOST_CHECK(db.ReadAddressIndex(1, hashA, vEntries, 0, 255));
+    BOOST_CHECK_EQUAL(vEntries.size(), 1U);
+    vEntries.clear();
+    BOOST_CHECK(db.ReadAddressIndex(2, hashB, vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 2U);
+
+    vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    BOOST_CHECK(db.ReadAddressUnspent(1, hashA, vUnspent));
+    BOOST_REQUIRE_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent[0].first.txid == block2.vtx[2].GetHash());
+    BOOST_CHECK_EQUAL(vUnspent[0].second.nHeight, 256U);
+    vUnspent.clear();
+    BOOST_CHECK(db.ReadAddressUnspent(2, hashB, vUnspent));
+    BOOST_CHECK(vUnspent.empty());
+
+    // Rewinding restores the state after block 1
+    BOOST_CHECK(db.RewindBlock(block2, undo2, &index2));
+    BOOST_CHECK(db.GetBestBlock() == hash1);
+    vEntries.clear();
+    BOOST_CHECK(db.ReadAddressIndex(1, hashA, vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 1U);
+    vEntries.clear();
+    BOOST_CHECK(db.ReadAddressIndex(2, hashB, vEntries));
+    BOOST_CHECK(vEntries.empty());
+    vUnspent.clear();
+    BOOST_CHECK(db.ReadAddressUnspent(1, hashA, vUnspent));
+    BOOST_REQUIRE_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent[0].first.txid == block1.vtx[0].GetHash());
+    BOOST_CHECK_EQUAL(vUnspent[0].second.nHeight, 1U);
+    BOOST_CHECK(vUnspent[0].second.txout == block1.vtx[0].vout[0]);
+}
+
+BOOST_AUTO_TEST_CASE(txindex_connect_rewind)
+{
+    CTxIndexDB db(1 << 20, true);
+    CBlock block;
+    for (int i = 0; i < 3; i++)
+        block.vtx.push_back(MakeTx(COutPoint(GetRandHash(), i), 1, i * COIN));
+    block.BuildMerkleTree();
+    uint256 hash = block.GetHash(), hashPrev = GetRandHash();
+    CBlockIndex indexPrev, index;
+    indexPrev.phashBlock = &hashPrev;
+    index.phashBlock = &hash;
+    index.pprev = &indexPrev;
+    index.nHeight = 1;
+    index.nFile = 2;
+    index.nDataPos = 1000;
+    index.nStatus = BLOCK_HAVE_DATA;
+
+    BOOST_CHECK(db.IndexBlock(block, CBlockUndo(), &index));
+    unsigned int nTxOffset = GetSizeOfCompactSize(block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        CDiskTxPos pos;
+        BOOST_CHECK(db.ReadTxPos(block.vtx[i].GetHash(), pos));
+        BOOST_CHECK_EQUAL(pos.nFile, 2);
+        BOOST_CHECK_EQUAL(pos.nPos, 1000U);
+        BOOST_CHECK_EQUAL(pos.nTxOffset, nTxOffset);
+        nTxOffset += ::GetSerializeSize(block.vtx[i], SER_DISK, CLIENT_VERSION);
+    }
+
+    BOOST_CHECK(db.RewindBlock(block, CBlockUndo(), &index));
+    BOOST_CHECK(db.GetBestBlock() == hashPrev);
+    CDiskTxPos pos;
+    BOOST_CHECK(!db.ReadTxPos(block.vtx[0].GetHash(), pos));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
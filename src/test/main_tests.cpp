@@ -8,6 +8,8 @@
 
 #include <boost/test/unit_test.hpp>
 
+extern void SelectFilesToPrune(const std::vector<CBlockFileInfo>& vinfoBlockFile, int nTipHeight, int nSnapshotHeight, uint64_t nTarget, std::set<int>& setFilesToPrune);
+
 BOOST_AUTO_TEST_SUITE(main_tests)
 
 BOOST_AUTO_TEST_CASE(subsidy_limit_test)
@@ -25,4 +27,94 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
   */
 }
 
+BOOST_AUTO_TEST_CASE(assumevalid_ancestors)
+{
+    LOCK(cs_main);
+    uint256 hashAssumeValidOld = hashAssumeValid;
+
+    // A 20 block chain, with a 10 block fork off it after height 10
+    std::vector<CBlockIndex> vIndex(30);
+    for (unsigned int i = 0; i < vIndex.size(); i++) {
+        vIndex[i].nHeight = i < 20 ? i : i - 9;
+        vIndex[i].pprev = i == 0 ? NULL : i == 20 ? &vIndex[10] : &vIndex[i - 1];
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(std::make_pair(uint256(0xa55a0000 + i), &vIndex[i])).first;
+        vIndex[i].phashBlock = &mi->first;
+    }
+
+    hashAssumeValid = vIndex[15].GetBlockHash();
+    BOOST_CHECK(IsAssumedValid(&vIndex[0]));
+    BOOST_CHECK(IsAssumedValid(&vIndex[10]));
+    BOOST_CHECK(IsAssumedValid(&vIndex[15]));
+    BOOST_CHECK(!IsAssumedValid(&vIndex[16]));
+    BOOST_CHECK(!IsAssumedValid(&vIndex[20]));
+
+    // Switching blocks rebuilds the ancestry
+    hashAssumeValid = vIndex[25].GetBlockHash();
+    BOOST_CHECK(IsAssumedValid(&vIndex[10]));
+    BOOST_CHECK(IsAssumedValid(&vIndex[25]));
+    BOOST_CHECK(!IsAssumedValid(&vIndex[11]));
+    BOOST_CHECK(!IsAssumedValid(&vIndex[26]));
+
+    // Nothing is assumed valid below a block found to be invalid
+    vIndex[25].nStatus |= BLOCK_FAILED_VALID;
+    BOOST_CHECK(!IsAssumedValid(&vIndex[10]));
+
+    // Or when the block isn't known, or the option is off
+    hashAssumeValid = uint256(0xa55b0000);
+    BOOST_CHECK(!IsAssumedValid(&vIndex[0]));
+    hashAssumeValid = 0;
+    BOOST_CHECK(!IsAssumedValid(&vIndex[0]));
+
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+        mapBlockIndex.erase(vIndex[i].GetBlockHash());
+    hashAssumeValid = hashAssumeValidOld;
+}
+
+static std::set<int> PruneFiles(const std::vector<CBlockFileInfo>& vinfo, int nTipHeight, uint64_t nTargetMiB, int nSnapshotHeight = -1)
+{
+    std::set<int> setFiles;
+    SelectFilesToPrune(vinfo, nTipHeight, nSnapshotHeight, nTargetMiB << 20, setFiles);
+    return setFiles;
+}
+
+BOOST_AUTO_TEST_CASE(prune_file_selection)
+{
+    // Five files of 100 MiB blocks and 10 MiB undo data; the last one is being written to
+    std::vector<CBlockFileInfo> vinfo(5);
+    unsigned int nHeightLast[5] = {2000, 4000, 6000, 9000, 9500};
+    for (unsigned int i = 0; i < vinfo.size(); i++) {
+        vinfo[i].nSize = 100 << 20;
+        vinfo[i].nUndoSize = 10 << 20;
+        vinfo[i].nHeightLast = nHeightLast[i];
+    }
+    int aOld[] = {0, 1, 2}, aAllButLast[] = {0, 1, 2, 3};
+    std::set<int> setOld(aOld, aOld + 3), setAllButLast(aAllButLast, aAllButLast + 4);
+
+    // Pruning is off, or the chain is too short for anything to be prunable
+    BOOST_CHECK(PruneFiles(vinfo, 10000, 0).empty());
+    BOOST_CHECK(PruneFiles(vinfo, MIN_BLOCKS_TO_KEEP, 1).empty());
+
+    // 550 MiB are in use; the target must also leave room for the next chunk of each file
+    unsigned int nBufferMiB = (BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE) >> 20;
+    BOOST_CHECK(PruneFiles(vinfo, 10000, 550 + nBufferMiB + 1).empty());
+    BOOST_CHECK(PruneFiles(vinfo, 10000, 550 + nBufferMiB) == std::set<int>(aOld, aOld + 1));
+    BOOST_CHECK(PruneFiles(vinfo, 10000, 300) == setOld);
+
+    // Files with blocks within MIN_BLOCKS_TO_KEEP of the tip stay
+    BOOST_CHECK(PruneFiles(vinfo, 10000, 1) == setOld);
+    BOOST_CHECK(PruneFiles(vinfo, 9000 + MIN_BLOCKS_TO_KEEP, 1) == setAllButLast);
+
+    // The file being written to is never pruned, however old its blocks are
+    BOOST_CHECK(PruneFiles(vinfo, 20000, 1) == setAllButLast);
+
+    // Nor is history an imported snapshot still has to be validated against
+    BOOST_CHECK(PruneFiles(vinfo, 20000, 1, 3999) == std::set<int>(aOld, aOld + 1));
+    BOOST_CHECK(PruneFiles(vinfo, 20000, 1, 4000) == std::set<int>(aOld, aOld + 2));
+    BOOST_CHECK(PruneFiles(vinfo, 20000, 1, 0).empty());
+
+    // Already pruned files are skipped
+    vinfo[0].SetNull();
+    BOOST_CHECK(PruneFiles(vinfo, 20000, 300) == std::set<int>(aAllButLast + 1, aAllButLast + 3));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
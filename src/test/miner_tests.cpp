@@ -7,6 +7,7 @@
 #include "miner.h"
 #include "uint256.h"
 #include "util.h"
+#include "test/test_bitmark.h"
 
 #include <boost/test/unit_test.hpp>
 
@@ -292,6 +293,223 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 
 }
 
+BOOST_AUTO_TEST_CASE(mutated_block_body)
+{
+    SelectParams(CChainParams::REGTEST);
+
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    unsigned int nExtraNonce = 0;
+
+    LOCK(cs_main);
+
+    CBlockTemplate *pblocktemplate = CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE(pblocktemplate);
+    CBlock block = pblocktemplate->block;
+    delete pblocktemplate;
+    IncrementExtraNonce(&block, chainActive.Tip(), nExtraNonce);
+    CBigNum bnTarget;
+    bnTarget.SetCompact(block.nBits);
+    while (block.GetPoWHash() > bnTarget.getuint256())
+        block.nNonce++;
+
+    // The header arrives first, as in headers-first sync
+    CValidationState state;
+    CBlockIndex *pindex = NULL;
+    BOOST_CHECK(AcceptBlockHeader(block, state, &pindex));
+    BOOST_REQUIRE(pindex);
+
+    // A body with a second coinbase under the same header is the sender's fault
+    CBlock blockMutated = block;
+    blockMutated.vtx.push_back(block.vtx[0]);
+    blockMutated.vtx.back().vin[0].scriptSig << OP_1;
+    BOOST_CHECK(blockMutated.GetHash() == block.GetHash());
+    BOOST_CHECK(!ProcessBlock(state, NULL, &blockMutated));
+    BOOST_CHECK(state.CorruptionPossible());
+    BOOST_CHECK(!(pindex->nStatus & BLOCK_FAILED_MASK));
+    BOOST_CHECK(!(pindex->nStatus & BLOCK_HAVE_DATA));
+
+    // and the real block is still accepted
+    CValidationState stateReal;
+    BOOST_CHECK(ProcessBlock(stateReal, NULL, &block));
+    BOOST_CHECK(stateReal.IsValid());
+    BOOST_CHECK(chainActive.Tip() == pindex);
+}
+
+BOOST_AUTO_TEST_CASE(template_manager)
+{
+    SelectParams(CChainParams::REGTEST);
+
+    CScript scriptA = CScript() << OP_TRUE;
+    CScript scriptB = CScript() << OP_2;
+    CBlockIndex* pindexPrev = NULL;
+    unsigned int nIdA, nIdB, nIdOther;
+
+    // Copies of one template only differ in their coinbase
+    CBlockTemplate* pblocktemplateA = templateManager.Get(ALGO_SCRYPT, scriptA, pindexPrev, nIdA);
+    CBlockTemplate* pblocktemplateB = templateManager.Get(ALGO_SCRYPT, scriptB, pindexPrev, nIdB);
+    BOOST_REQUIRE(pblocktemplateA && pblocktemplateB);
+    BOOST_CHECK(pindexPrev == chainActive.Tip());
+    BOOST_CHECK_EQUAL(nIdA, nIdB);
+    BOOST_CHECK_EQUAL(templateManager.Update(ALGO_SCRYPT), nIdA);
+    const CBlock& blockA = pblocktemplateA->block;
+    const CBlock& blockB = pblocktemplateB->block;
+    BOOST_CHECK(blockA.vtx[0].vout[0].scriptPubKey == scriptA);
+    BOOST_CHECK(blockB.vtx[0].vout[0].scriptPubKey == scriptB);
+    BOOST_CHECK(blockA.vtx[0].vin[0].scriptSig != blockB.vtx[0].vin[0].scriptSig);
+    BOOST_CHECK(blockA.hashMerkleRoot == blockA.BuildMerkleTree());
+    BOOST_CHECK(blockA.hashMerkleRoot != blockB.hashMerkleRoot);
+    BOOST_CHECK(blockA.hashPrevBlock == blockB.hashPrevBlock);
+
+    // Re-rolling the extranonce of a copy doesn't collide with the next copy
+    CScript scriptSigA = blockA.vtx[0].vin[0].scriptSig;
+    templateManager.IncrementExtraNonce(&pblocktemplateA->block, pindexPrev);
+    BOOST_CHECK(blockA.vtx[0].vin[0].scriptSig != scriptSigA);
+    delete pblocktemplateB;
+    pblocktemplateB = templateManager.Get(ALGO_SCRYPT, scriptA, pindexPrev, nIdB);
+    BOOST_REQUIRE(pblocktemplateB);
+    BOOST_CHECK(pblocktemplateB->block.vtx[0].vin[0].scriptSig != blockA.vtx[0].vin[0].scriptSig);
+    BOOST_CHECK(pblocktemplateB->block.vtx[0].vin[0].scriptSig != scriptSigA);
+
+    // Every algo has its own template
+    CBlockTemplate* pblocktemplateOther = templateManager.Get(ALGO_SHA256D, scriptA, pindexPrev, nIdOther);
+    BOOST_REQUIRE(pblocktemplateOther);
+    BOOST_CHECK(nIdOther != nIdA);
+    BOOST_CHECK_EQUAL(templateManager.Update(ALGO_SCRYPT), nIdA);
+
+    BOOST_CHECK(!templateManager.Get(NUM_ALGOS, scriptA, pindexPrev, nIdB));
+    BOOST_CHECK_EQUAL(templateManager.Update(-1), 0U);
+
+    // Templates are rebuilt once dropped
+    templateManager.Clear();
+    BOOST_CHECK(templateManager.Update(ALGO_SCRYPT) > nIdOther);
+
+    delete pblocktemplateA;
+    delete pblocktemplateB;
+    delete pblocktemplateOther;
+    templateManager.Clear();
+}
+
+BOOST_AUTO_TEST_CASE(mempool_ancestor_index)
+{
+    CTxMemPool pool;
+    CTransaction txParent = MakeTx(COutPoint(uint256(1), 0), 2);
+    CTransaction txChild = MakeTx(COutPoint(txParent.GetHash(), 0), 2);
+    CTransaction txGrandChild = MakeTx(COutPoint(txChild.GetHash(), 1), 2);
+    CTransaction txOther = MakeTx(COutPoint(uint256(2), 0), 2);
+    size_t nSize = ::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION);
+
+    // A free parent with a well paying child goes ahead of a transaction paying a bit less than the pair
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 10000, 0, 0.0, 1));
+    pool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 4000, 0, 0.0, 1));
+    const CTxMemPoolEntry& child = pool.mapTx[txChild.GetHash()];
+    BOOST_CHECK_EQUAL(child.GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(child.GetSizeWithAncestors(), 2 * nSize);
+    BOOST_CHECK_EQUAL(child.GetFeesWithAncestors(), 10000);
+    BOOST_CHECK_EQUAL(pool.setByAncestorFee.size(), 3U);
+    BOOST_CHECK((*pool.setByAncestorFee.begin())->first == txChild.GetHash());
+    BOOST_CHECK((*pool.setByAncestorFee.rbegin())->first == txParent.GetHash());
+
+    // Entries already in the pool pick up parents added after them, as after a reorg
+    pool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 2000, 0, 0.0, 1));
+    const CTxMemPoolEntry& grandChild = pool.mapTx[txGrandChild.GetHash()];
+    BOOST_CHECK_EQUAL(grandChild.GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(grandChild.GetFeesWithAncestors(), 12000);
+
+    std::list<CTransaction> removed;
+    pool.remove(txParent, removed);
+    BOOST_CHECK_EQUAL(child.GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(child.GetSizeWithAncestors(), nSize);
+    BOOST_CHECK_EQUAL(grandChild.GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(grandChild.GetFeesWithAncestors(), 12000);
+    BOOST_CHECK((*pool.setByAncestorFee.begin())->first == txChild.GetHash());
+
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(child.GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(grandChild.GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(grandChild.GetSizeWithAncestors(), 3 * nSize);
+    BOOST_CHECK_EQUAL(pool.setByAncestorFee.size(), pool.mapTx.size());
+
+    pool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(pool.mapTx.size(), 1U);
+    BOOST_CHECK_EQUAL(pool.setByAncestorFee.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_chain_limits)
+{
+    CTxMemPool pool;
+    CTransaction txA = MakeTx(COutPoint(uint256(1), 0), 2);
+    CTransaction txB = MakeTx(COutPoint(txA.GetHash(), 0), 2);
+    CTransaction txC = MakeTx(COutPoint(txB.GetHash(), 0), 2);
+    CTransaction txD = MakeTx(COutPoint(txA.GetHash(), 1), 2);
+    size_t nSize = ::GetSerializeSize(txA, SER_NETWORK, PROTOCOL_VERSION);
+    std::string errString;
+
+    pool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 0, 0, 0.0, 1));
+    pool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 0, 0, 0.0, 1));
+
+    // C would be the third in a chain
+    CTxMemPoolEntry entryC(txC, 0, 0, 0.0, 1);
+    BOOST_CHECK(pool.CheckAncestorLimits(entryC, 3, 3 * nSize, 3, 3 * nSize, errString));
+    BOOST_CHECK(!pool.CheckAncestorLimits(entryC, 2, 3 * nSize, 3, 3 * nSize, errString));
+    BOOST_CHECK(!pool.CheckAncestorLimits(entryC, 3, 2 * nSize, 3, 3 * nSize, errString));
+    BOOST_CHECK(!pool.CheckAncestorLimits(entryC, 3, 3 * nSize, 2, 3 * nSize, errString));
+    BOOST_CHECK(!pool.CheckAncestorLimits(entryC, 3, 3 * nSize, 3, 2 * nSize, errString));
+    pool.addUnchecked(txC.GetHash(), CTxMemPoolEntry(txC, 0, 0, 0.0, 1));
+
+    // D only has A as an ancestor, but would be A's fourth transaction
+    CTxMemPoolEntry entryD(txD, 0, 0, 0.0, 1);
+    BOOST_CHECK(!pool.CheckAncestorLimits(entryD, 2, 2 * nSize, 3, 4 * nSize, errString));
+    BOOST_CHECK(pool.CheckAncestorLimits(entryD, 2, 2 * nSize, 4, 4 * nSize, errString));
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_packages)
+{
+    SelectParams(CChainParams::REGTEST);
+
+    CScript scriptPubKey = CScript() << OP_TRUE;
+
+    LOCK(cs_main);
+
+    // Confirmed outputs to spend, put straight into the coins view
+    CTransaction txFunding;
+    txFunding.vout.resize(2);
+    txFunding.vout[0].nValue = 2 * COIN;
+    txFunding.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    txFunding.vout[1].nValue = 3 * COIN;
+    txFunding.vout[1].scriptPubKey = CScript() << OP_FALSE;
+    uint256 hashFunding = txFunding.GetHash();
+    pcoinsTip->SetCoins(hashFunding, CCoins(txFunding, chainActive.Height()));
+
+    // A free parent, a child paying well, and a transaction paying even
+    // better whose script fails
+    CTransaction txParent = MakeTx(COutPoint(hashFunding, 0), 2);
+    CTransaction txChild = MakeTx(COutPoint(txParent.GetHash(), 0), 2);
+    txChild.vout[0].nValue = COIN / 2;
+    txChild.vout[1].nValue = COIN / 4;
+    CTransaction txBad = MakeTx(COutPoint(hashFunding, 1), 2);
+    unsigned int nHeight = chainActive.Height();
+    mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, GetTime(), 0.0, nHeight));
+    mempool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, COIN / 4, GetTime(), 0.0, nHeight));
+    mempool.addUnchecked(txBad.GetHash(), CTxMemPoolEntry(txBad, COIN, GetTime(), 0.0, nHeight));
+
+    // The child brings its parent along, which wouldn't get in on its own
+    CBlockTemplate *pblocktemplate = CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE(pblocktemplate);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 3U);
+    BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == txParent.GetHash());
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == txChild.GetHash());
+    delete pblocktemplate;
+
+    // Scripts that passed for the last template aren't run again. Only the
+    // template's own ConnectBlock check notices the parent's input now fails.
+    pcoinsTip->GetCoins(hashFunding).vout[0].scriptPubKey = CScript() << OP_FALSE;
+    BOOST_CHECK_THROW(CreateNewBlock(scriptPubKey), std::runtime_error);
+
+    mempool.clear();
+    pcoinsTip->SetCoins(hashFunding, CCoins());
+}
+
 BOOST_AUTO_TEST_CASE(sha256transform_equality)
 {
     unsigned int pSHA256InitState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
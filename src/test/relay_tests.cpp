@@ -0,0 +1,97 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for relaying transactions from shared serialized buffers
+//
+
+#include "core.h"
+#include "net.h"
+#include "serialize.h"
+#include "txmempool.h"
+#include "test/test_bitmark.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/weak_ptr.hpp>
+
+using namespace std;
+
+static CSerializeData QueuedBytes(const CNode& node)
+{
+    CSerializeData vch;
+    for (unsigned int i = 0; i < node.vSendMsg.size(); i++)
+        vch.insert(vch.end(), node.vSendMsg[i]->begin(), node.vSendMsg[i]->end());
+    return vch;
+}
+
+BOOST_AUTO_TEST_SUITE(relay_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_serialized)
+{
+    CTransaction tx = MakeTx(1);
+    uint256 hash = tx.GetHash();
+    CTxMemPool pool;
+    pool.addUnchecked(hash, CTxMemPoolEntry(tx, 0, 0, 0.0, 1));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    CSharedSerializeData data;
+    BOOST_CHECK(pool.lookupSerialized(hash, data));
+    BOOST_CHECK(CSerializeData(ss.begin(), ss.end()) == *data);
+
+    // Every lookup hands out the same buffer while one is held
+    CSharedSerializeData data2;
+    BOOST_CHECK(pool.lookupSerialized(hash, data2));
+    BOOST_CHECK(data.get() == data2.get());
+
+    BOOST_CHECK(!pool.lookupSerialized(MakeTx(2).GetHash(), data2));
+
+    // The entry doesn't keep the buffer alive by itself, a later lookup serializes again
+    boost::weak_ptr<const CSerializeData> weak(data);
+    data.reset();
+    data2.reset();
+    BOOST_CHECK(weak.expired());
+    BOOST_CHECK(pool.lookupSerialized(hash, data));
+    BOOST_CHECK(CSerializeData(ss.begin(), ss.end()) == *data);
+
+    // The buffer outlives the entry for as long as something still holds it
+    std::list<CTransaction> removed;
+    pool.remove(tx, removed);
+    BOOST_CHECK(!pool.lookupSerialized(hash, data2));
+    BOOST_CHECK(CSerializeData(ss.begin(), ss.end()) == *data);
+}
+
+BOOST_AUTO_TEST_CASE(pushmessage_shared)
+{
+    CTransaction tx = MakeTx(3);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    CSharedSerializeData data(new CSerializeData(ss.begin(), ss.end()));
+
+    // Nodes without a socket keep everything queued
+    CAddress addr(CService("127.0.0.1", 0));
+    CNode nodeCopy(INVALID_SOCKET, addr, "", true);
+    nodeCopy.PushMessage("tx", tx);
+
+    std::vector<CNode*> vNodes;
+    for (int i = 0; i < 10; i++) {
+        vNodes.push_back(new CNode(INVALID_SOCKET, addr, "", true));
+        vNodes.back()->PushMessage("tx", data, tx.GetHash());
+    }
+
+    // Same bytes on the wire, checksum included, but only one copy of the payload
+    for (unsigned int i = 0; i < vNodes.size(); i++) {
+        BOOST_CHECK_EQUAL(vNodes[i]->vSendMsg.size(), 2U);
+        BOOST_CHECK(vNodes[i]->vSendMsg[1].get() == data.get());
+        BOOST_CHECK(QueuedBytes(*vNodes[i]) == QueuedBytes(nodeCopy));
+        BOOST_CHECK_EQUAL(vNodes[i]->nSendSize, nodeCopy.nSendSize);
+    }
+    BOOST_CHECK_EQUAL(data.use_count(), 11);
+
+    for (unsigned int i = 0; i < vNodes.size(); i++)
+        delete vNodes[i];
+    BOOST_CHECK(data.unique());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -154,6 +154,8 @@ BOOST_AUTO_TEST_CASE(script_valid)
     // ... where scriptSig and scriptPubKey are stringified
     // scripts.
     Array tests = read_json(std::string(json_tests::script_valid, json_tests::script_valid + sizeof(json_tests::script_valid)));
+    // Also run them all on one arena, as a script check thread does
+    CScriptArena arena;
 
     BOOST_FOREACH(Value& tv, tests)
     {
@@ -175,6 +177,7 @@ BOOST_AUTO_TEST_CASE(script_valid)
 	}
         CTransaction tx;
         BOOST_CHECK_MESSAGE(VerifyScript(scriptSig, scriptPubKey, tx, 0, scriptflags, 0), strTest);
+        BOOST_CHECK_MESSAGE(VerifyScript(scriptSig, scriptPubKey, tx, 0, scriptflags, 0, NULL, &arena), strTest);
     }
 }
 
@@ -182,6 +185,7 @@ BOOST_AUTO_TEST_CASE(script_invalid)
 {
     // Scripts that should evaluate as invalid
     Array tests = read_json(std::string(json_tests::script_invalid, json_tests::script_invalid + sizeof(json_tests::script_invalid)));
+    CScriptArena arena;
 
     BOOST_FOREACH(Value& tv, tests)
     {
@@ -203,6 +207,7 @@ BOOST_AUTO_TEST_CASE(script_invalid)
 	}
         CTransaction tx;
         BOOST_CHECK_MESSAGE(!VerifyScript(scriptSig, scriptPubKey, tx, 0, scriptflags, 0), strTest);
+        BOOST_CHECK_MESSAGE(!VerifyScript(scriptSig, scriptPubKey, tx, 0, scriptflags, 0, NULL, &arena), strTest);
     }
 }
 
@@ -497,4 +502,58 @@ BOOST_AUTO_TEST_CASE(script_standard_push)
     }
 }
 
+// Signed P2PKH and P2SH multisig checks, failing and passing in turn on one
+// arena: nothing a failed evaluation leaves behind may change the next one
+BOOST_AUTO_TEST_CASE(script_verify_arena)
+{
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+        key[i].MakeNewKey(true);
+
+    CTransaction txFrom;
+    txFrom.vout.resize(2);
+    txFrom.vout[0].scriptPubKey.SetDestination(key[0].GetPubKey().GetID());
+    CScript redeemScript;
+    redeemScript << OP_2 << key[0].GetPubKey() << key[1].GetPubKey() << key[2].GetPubKey() << OP_3 << OP_CHECKMULTISIG;
+    txFrom.vout[1].scriptPubKey.SetDestination(redeemScript.GetID());
+
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vin[0].prevout.hash = txFrom.GetHash();
+    txTo.vout[0].nValue = 1;
+
+    // Signature cache writes are off, so every run checks the signatures
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_NOCACHE;
+
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key[0].Sign(SignatureHash(txFrom.vout[0].scriptPubKey, txTo, 0, SIGHASH_ALL), vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    CScript scriptSigP2PKH;
+    scriptSigP2PKH << vchSig << key[0].GetPubKey();
+    vchSig[10] ^= 1;
+    CScript scriptSigP2PKHBad;
+    scriptSigP2PKHBad << vchSig << key[0].GetPubKey();
+
+    vector<CKey> vSigners;
+    vSigners.push_back(key[0]);
+    vSigners.push_back(key[2]);
+    CScript scriptSigP2SH = sign_multisig(redeemScript, vSigners, txTo);
+    scriptSigP2SH << static_cast<vector<unsigned char> >(redeemScript);
+    // Signatures out of key order fail
+    std::reverse(vSigners.begin(), vSigners.end());
+    CScript scriptSigP2SHBad = sign_multisig(redeemScript, vSigners, txTo);
+    scriptSigP2SHBad << static_cast<vector<unsigned char> >(redeemScript);
+
+    CScriptArena arena;
+    for (int i = 0; i < 3; i++) {
+        BOOST_CHECK(!VerifyScript(scriptSigP2PKHBad, txFrom.vout[0].scriptPubKey, txTo, 0, flags, 0, NULL, &arena));
+        BOOST_CHECK(VerifyScript(scriptSigP2PKH, txFrom.vout[0].scriptPubKey, txTo, 0, flags, 0, NULL, &arena));
+        BOOST_CHECK(!VerifyScript(scriptSigP2SHBad, txFrom.vout[1].scriptPubKey, txTo, 0, flags, 0, NULL, &arena));
+        BOOST_CHECK(VerifyScript(scriptSigP2SH, txFrom.vout[1].scriptPubKey, txTo, 0, flags, 0, NULL, &arena));
+        // A P2SH scriptSig can't stand in for the P2PKH one
+        BOOST_CHECK(!VerifyScript(scriptSigP2SH, txFrom.vout[0].scriptPubKey, txTo, 0, flags, 0, NULL, &arena));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,77 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "core.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#define SKIPLIST_LENGTH 300000
+
+BOOST_AUTO_TEST_SUITE(skiplist_tests)
+
+BOOST_AUTO_TEST_CASE(skiplist_test)
+{
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        if (i > 0) {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < i);
+        } else {
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+        }
+    }
+
+    for (int i=0; i < 1000; i++) {
+        int from = GetRand(SKIPLIST_LENGTH - 1);
+        int to = GetRand(from + 1);
+
+        BOOST_CHECK(vIndex[SKIPLIST_LENGTH - 1].GetAncestor(from) == &vIndex[from]);
+        BOOST_CHECK(vIndex[from].GetAncestor(to) == &vIndex[to]);
+        BOOST_CHECK(vIndex[from].GetAncestor(0) == &vIndex[0]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(getancestor_forks)
+{
+    // Two branches off a common trunk; walking back from either must land on the trunk
+    std::vector<CBlockIndex> vTrunk(5000), vBranchA(3000), vBranchB(2000);
+    for (unsigned int i = 0; i < vTrunk.size(); i++) {
+        vTrunk[i].nHeight = i;
+        vTrunk[i].pprev = i == 0 ? NULL : &vTrunk[i - 1];
+        vTrunk[i].BuildSkip();
+    }
+    for (unsigned int i = 0; i < vBranchA.size(); i++) {
+        vBranchA[i].nHeight = vTrunk.size() + i;
+        vBranchA[i].pprev = i == 0 ? &vTrunk.back() : &vBranchA[i - 1];
+        vBranchA[i].BuildSkip();
+    }
+    for (unsigned int i = 0; i < vBranchB.size(); i++) {
+        vBranchB[i].nHeight = vTrunk.size() + i;
+        vBranchB[i].pprev = i == 0 ? &vTrunk.back() : &vBranchB[i - 1];
+        vBranchB[i].BuildSkip();
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        int nTrunk = GetRand(vTrunk.size());
+        BOOST_CHECK(vBranchA.back().GetAncestor(nTrunk) == &vTrunk[nTrunk]);
+        BOOST_CHECK(vBranchB.back().GetAncestor(nTrunk) == &vTrunk[nTrunk]);
+        int nBranch = vTrunk.size() + GetRand(vBranchB.size());
+        BOOST_CHECK(vBranchA.back().GetAncestor(nBranch) == &vBranchA[nBranch - vTrunk.size()]);
+        BOOST_CHECK(vBranchB.back().GetAncestor(nBranch) == &vBranchB[nBranch - vTrunk.size()]);
+    }
+    BOOST_CHECK(vBranchB.back().GetAncestor(vTrunk.size() + vBranchB.size()) == NULL);
+    BOOST_CHECK(vBranchB.back().GetAncestor(-1) == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,115 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "smallvector.h"
+
+#include "util.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+typedef smallvector<8, unsigned char> smallvec;
+
+static bool Equals(const smallvec &sv, const vector<unsigned char> &v)
+{
+    return sv.size() == v.size() && std::equal(v.begin(), v.end(), sv.begin());
+}
+
+BOOST_AUTO_TEST_SUITE(smallvector_tests)
+
+BOOST_AUTO_TEST_CASE(smallvector_random)
+{
+    // Mirror random operations on a std::vector, across the inline/heap boundary
+    smallvec sv;
+    vector<unsigned char> v;
+    for (int i = 0; i < 10000; i++) {
+        int nOp = GetRand(6);
+        if (nOp == 0 && !v.empty()) {
+            sv.pop_back();
+            v.pop_back();
+        } else if (nOp == 1) {
+            unsigned int n = GetRand(20);
+            sv.resize(n);
+            v.resize(n);
+            for (unsigned int j = 0; j < n; j++)
+                sv[j] = v[j] = GetRand(256);
+        } else if (nOp == 2 && GetRand(8) == 0) {
+            sv.clear();
+            v.clear();
+        } else {
+            unsigned char ch = GetRand(256);
+            sv.push_back(ch);
+            v.push_back(ch);
+        }
+        BOOST_CHECK(Equals(sv, v));
+        BOOST_CHECK(sv.capacity() >= sv.size());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(smallvector_inline)
+{
+    smallvec sv(8, 0x55);
+    BOOST_CHECK_EQUAL(sv.capacity(), 8U);
+    sv.push_back(0xaa);
+    BOOST_CHECK(sv.capacity() > 8U);
+    BOOST_CHECK_EQUAL(sv.size(), 9U);
+    BOOST_CHECK_EQUAL(sv.back(), 0xaa);
+
+    // Once on the heap the buffer is kept for reuse
+    unsigned int nCapacity = sv.capacity();
+    sv.clear();
+    sv.assign(3, 0x11);
+    BOOST_CHECK_EQUAL(sv.capacity(), nCapacity);
+    BOOST_CHECK(Equals(sv, vector<unsigned char>(3, 0x11)));
+}
+
+BOOST_AUTO_TEST_CASE(smallvector_copy_move_swap)
+{
+    vector<unsigned char> vShort(5, 1), vLong(40, 2);
+    smallvec a(vShort), b(vLong);
+
+    smallvec c(a), d(b);
+    BOOST_CHECK(c == a && d == b);
+    BOOST_CHECK(c != d);
+
+    // Moving a heap buffer hands it over
+    const unsigned char *pHeap = d.data();
+    smallvec e(static_cast<smallvec&&>(d));
+    BOOST_CHECK(e.data() == pHeap);
+    BOOST_CHECK(d.empty());
+    BOOST_CHECK(Equals(e, vLong));
+
+    smallvec f(static_cast<smallvec&&>(c));
+    BOOST_CHECK(Equals(f, vShort));
+
+    swap(e, f);
+    BOOST_CHECK(Equals(e, vShort));
+    BOOST_CHECK(Equals(f, vLong));
+
+    a = b;
+    BOOST_CHECK(Equals(a, vLong));
+    const smallvec &aSelf = a;
+    a = aSelf;
+    BOOST_CHECK(Equals(a, vLong));
+
+    BOOST_CHECK(smallvec(vShort) < smallvec(vLong));
+    BOOST_CHECK(!(smallvec(vLong) < smallvec(vShort)));
+}
+
+BOOST_AUTO_TEST_CASE(smallvector_self_push)
+{
+    // Pushing one of our own elements while growing must not read freed memory
+    smallvec sv;
+    for (unsigned int i = 0; i < 8; i++)
+        sv.push_back(i);
+    for (unsigned int i = 0; i < 100; i++)
+        sv.push_back(sv[i]);
+    for (unsigned int i = 0; i < sv.size(); i++)
+        BOOST_CHECK_EQUAL(sv[i], i % 8);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,98 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txdb.h"
+
+#include "core.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static CCoins MakeCoins(int nHeight, int64_t nValue)
+{
+    CTransaction tx;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    tx.vout[1].nValue = nValue / 2;
+    tx.vout[1].scriptPubKey << OP_TRUE;
+    return CCoins(tx, nHeight);
+}
+
+// Write the coin records of db after a header, the way dumptxoutset lays out the file
+static bool WriteTestSnapshot(CCoinsViewDB &db, const boost::filesystem::path &path, CCoinsSnapshotHeader &header)
+{
+    CAutoFile fileout = CAutoFile(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    fileout << header;
+    CHashedAutoFile file(fileout);
+    if (!db.WriteSnapshot(file, header))
+        return false;
+    header.hashChecksum = file.GetHash();
+    fseek(fileout, 0, SEEK_SET);
+    fileout << header;
+    return true;
+}
+
+static bool LoadTestSnapshot(CCoinsViewDB &db, const boost::filesystem::path &path, const CCoinsSnapshotHeader &header, bool fWrite)
+{
+    CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    CCoinsSnapshotHeader headerRead;
+    filein >> headerRead;
+    CHashedAutoFile file(filein);
+    return db.LoadSnapshot(file, header, fWrite) && file.GetHash() == header.hashChecksum;
+}
+
+BOOST_AUTO_TEST_SUITE(snapshot_tests)
+
+BOOST_AUTO_TEST_CASE(snapshot_roundtrip)
+{
+    boost::filesystem::path path = GetDataDir() / "snapshot_test.dat";
+    CCoinsViewDB dbFrom(GetDataDir() / "snapshot_from", 1 << 20, true);
+    map<uint256, CCoins> mapCoins;
+    for (int i = 0; i < 50; i++)
+        mapCoins[GetRandHash()] = MakeCoins(i, (i + 1) * COIN);
+    uint256 hashBlock = GetRandHash();
+    BOOST_CHECK(dbFrom.BatchWrite(mapCoins, hashBlock));
+
+    CCoinsSnapshotHeader header;
+    BOOST_CHECK(WriteTestSnapshot(dbFrom, path, header));
+    BOOST_CHECK(header.hashBlock == hashBlock);
+    BOOST_CHECK_EQUAL(header.nTransactions, 50U);
+    BOOST_CHECK_EQUAL(header.nTransactionOutputs, 100U);
+
+    CCoinsSnapshotHeader headerRead;
+    {
+        CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        filein >> headerRead;
+    }
+    BOOST_CHECK(headerRead.IsValid());
+    BOOST_CHECK(headerRead.hashSerialized == header.hashSerialized);
+    BOOST_CHECK(headerRead.hashChecksum == header.hashChecksum);
+
+    // Checking alone leaves the target untouched, loading copies every coin and the best block
+    CCoinsViewDB dbTo(GetDataDir() / "snapshot_to", 1 << 20, true);
+    BOOST_CHECK(LoadTestSnapshot(dbTo, path, headerRead, false));
+    BOOST_CHECK(dbTo.GetBestBlock() == 0);
+    BOOST_CHECK(LoadTestSnapshot(dbTo, path, headerRead, true));
+    BOOST_CHECK(dbTo.GetBestBlock() == hashBlock);
+    for (map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK(dbTo.GetCoins(it->first, coins));
+        BOOST_CHECK(coins == it->second);
+    }
+
+    // A header that doesn't describe the coins is refused
+    CCoinsSnapshotHeader headerBad = headerRead;
+    headerBad.hashSerialized = GetRandHash();
+    CCoinsViewDB dbBad(GetDataDir() / "snapshot_bad", 1 << 20, true);
+    BOOST_CHECK(!LoadTestSnapshot(dbBad, path, headerBad, true));
+    BOOST_CHECK(dbBad.GetBestBlock() == 0);
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
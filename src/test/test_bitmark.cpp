@@ -7,6 +7,8 @@
 
 
 
+#include "test/test_bitmark.h"
+
 #include "main.h"
 #include "txdb.h"
 #include "ui_interface.h"
@@ -26,7 +28,6 @@ extern bool fPrintToConsole;
 extern void noui_connect();
 
 struct TestingSetup {
-    CCoinsViewDB *pcoinsdbview;
     boost::filesystem::path pathTemp;
     boost::thread_group threadGroup;
 
@@ -76,6 +77,31 @@ struct TestingSetup {
 
 BOOST_GLOBAL_FIXTURE(TestingSetup);
 
+CTransaction MakeTx(unsigned int n)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = uint256(n + 1);
+    tx.vin[0].prevout.n = n;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = n * COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+CTransaction MakeTx(const COutPoint& prevout, unsigned int nOut, int64_t nValue, const CScript& scriptPubKey)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(nOut);
+    for (unsigned int i = 0; i < nOut; i++) {
+        tx.vout[i].nValue = nValue;
+        tx.vout[i].scriptPubKey = scriptPubKey;
+    }
+    return tx;
+}
+
 void Shutdown(void* parg)
 {
   exit(0);
@@ -91,3 +117,19 @@ bool ShutdownRequested()
   return false;
 }
 
+CBlock MakeBlock(unsigned int nTx, unsigned int nNonce)
+{
+    CBlock block;
+    block.nVersion = 2;
+    block.nBits = 0x207fffff;
+    block.nNonce = nNonce;
+
+    CTransaction coinbase = MakeTx(COutPoint(), 1, 20 * COIN);
+    coinbase.vin[0].scriptSig = CScript() << OP_1 << OP_1;
+    block.vtx.push_back(coinbase);
+
+    for (unsigned int i = 0; i < nTx; i++)
+        block.vtx.push_back(MakeTx(i));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
@@ -0,0 +1,23 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_TEST_TEST_BITMARK_H
+#define BITMARK_TEST_TEST_BITMARK_H
+
+#include "core.h"
+
+/** A transaction paying n coins to OP_TRUE from a made-up output; a
+ *  different n gives a different txid. Not valid against any chain. */
+CTransaction MakeTx(unsigned int n);
+
+/** A transaction spending prevout into nOut outputs of nValue each, paid to
+ *  scriptPubKey. The input carries no signature. */
+CTransaction MakeTx(const COutPoint& prevout, unsigned int nOut = 1, int64_t nValue = COIN, const CScript& scriptPubKey = CScript() << OP_TRUE);
+
+/** A block of a coinbase and MakeTx(0) .. MakeTx(nTx - 1), with a
+ *  consistent merkle root but no valid proof of work. Blocks with a
+ *  different nNonce have different hashes and the same size. */
+CBlock MakeBlock(unsigned int nTx, unsigned int nNonce = 42);
+
+#endif // BITMARK_TEST_TEST_BITMARK_H
@@ -220,6 +220,34 @@ BOOST_AUTO_TEST_CASE(basic_transaction_tests)
     BOOST_CHECK_MESSAGE(!CheckTransaction(tx, state) || !state.IsValid(), "Transaction with duplicate txins should be invalid.");
 }
 
+BOOST_AUTO_TEST_CASE(transaction_cached_hash)
+{
+    CTransaction txFresh;
+    txFresh.vin.resize(1);
+    txFresh.vout.resize(1);
+    txFresh.vout[0].nValue = 1;
+    uint256 hashFresh = txFresh.GetHash();
+
+    // Transactions built in memory are hashed on demand
+    txFresh.vout[0].nValue = 2;
+    BOOST_CHECK(txFresh.GetHash() != hashFresh);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << txFresh;
+    CTransaction tx;
+    stream >> tx;
+    BOOST_CHECK(tx.GetHash() == txFresh.GetHash());
+    CTransaction txCopy(tx);
+    BOOST_CHECK(txCopy.GetHash() == txFresh.GetHash());
+
+    // Deserialized ones keep their txid until it is dropped explicitly
+    tx.vout[0].nValue = 3;
+    BOOST_CHECK(tx.GetHash() == txFresh.GetHash());
+    tx.InvalidateHash();
+    BOOST_CHECK(tx.GetHash() == SerializeHash(tx));
+    BOOST_CHECK(tx.GetHash() != txFresh.GetHash());
+}
+
 //
 // Helper: create two dummy transactions, each with
 // two outputs.  The first has 11 and 50 CENT outputs
@@ -0,0 +1,162 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+
+#include "coins.h"
+#include "core.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// A block spending a P2PKH, a P2SH, a mismatched P2PKH and a bare script output
+static void MakeSpends(CBlock &block, CBlockUndo &blockundo)
+{
+    vector<unsigned char> vchSig(71, 0x30), vchPubKey(33, 0x02), vchRedeem(71, 0x52);
+    vchPubKey[32] = 0x01;
+
+    CTransaction tx;
+    tx.vin.resize(4);
+    tx.vin[0].scriptSig << vchSig << vchPubKey;
+    tx.vin[1].scriptSig << OP_0 << vchSig << vchRedeem;
+    tx.vin[2].scriptSig << vchSig << vchPubKey;
+    tx.vin[3].scriptSig << OP_TRUE;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey << OP_TRUE;
+
+    block.vtx.resize(1);
+    block.vtx[0].vin.resize(1);
+    block.vtx.push_back(tx);
+
+    CTxUndo txundo;
+    CScript script;
+    script.SetDestination(CKeyID(Hash160(vchPubKey)));
+    txundo.vprevout.push_back(CTxInUndo(CTxOut(12 * COIN, script), false, 1000, 1));
+    script.SetDestination(CScriptID(Hash160(vchRedeem)));
+    txundo.vprevout.push_back(CTxInUndo(CTxOut(COIN / 3, script)));
+    script.SetDestination(CKeyID(Hash160(vchRedeem)));
+    txundo.vprevout.push_back(CTxInUndo(CTxOut(5 * COIN, script), true, 2, 1));
+    script = CScript() << OP_TRUE;
+    txundo.vprevout.push_back(CTxInUndo(CTxOut(0, script)));
+    blockundo.vtxundo.push_back(txundo);
+}
+
+static uint64_t GetTableBytes(const boost::filesystem::path &path)
+{
+    uint64_t nBytes = 0;
+    for (boost::filesystem::directory_iterator it(path); it != boost::filesystem::directory_iterator(); ++it) {
+        string strExt = it->path().extension().string();
+        if (strExt == ".ldb" || strExt == ".sst")
+            nBytes += boost::filesystem::file_size(it->path());
+    }
+    return nBytes;
+}
+
+BOOST_AUTO_TEST_SUITE(undo_tests)
+
+BOOST_AUTO_TEST_CASE(undo_compact_roundtrip)
+{
+    CBlock block;
+    CBlockUndo blockundo;
+    MakeSpends(block, blockundo);
+
+    CDataStream ssLegacy(SER_DISK, CLIENT_VERSION), ssCompact(SER_DISK, CLIENT_VERSION);
+    ssLegacy << blockundo;
+    ssCompact << CBlockUndoCompressor(blockundo, block);
+    BOOST_CHECK_EQUAL(ssCompact.size(), ::GetSerializeSize(CBlockUndoCompressor(blockundo, block), SER_DISK, CLIENT_VERSION));
+    // The P2PKH and P2SH scripts (21 bytes each when compressed) are derived from the scriptSigs
+    BOOST_CHECK_EQUAL(ssCompact.size() + 2 * 21, ssLegacy.size());
+    BOOST_TEST_MESSAGE("undo data: " << ssLegacy.size() << " bytes legacy, " << ssCompact.size() << " bytes compact");
+
+    CBlockUndo blockundo2;
+    CBlockUndoCompressor compressor(blockundo2, block);
+    ssCompact >> compressor;
+    BOOST_REQUIRE_EQUAL(blockundo2.vtxundo.size(), 1U);
+    const vector<CTxInUndo> &vExpected = blockundo.vtxundo[0].vprevout, &vActual = blockundo2.vtxundo[0].vprevout;
+    BOOST_REQUIRE_EQUAL(vActual.size(), vExpected.size());
+    for (unsigned int i = 0; i < vExpected.size(); i++) {
+        BOOST_CHECK(vActual[i].txout == vExpected[i].txout);
+        BOOST_CHECK_EQUAL(vActual[i].fCoinBase, vExpected[i].fCoinBase);
+        BOOST_CHECK_EQUAL(vActual[i].nHeight, vExpected[i].nHeight);
+        BOOST_CHECK_EQUAL(vActual[i].nVersion, vExpected[i].nVersion);
+    }
+
+    // Compact undo data only decodes against the block it was written for
+    CBlock blockOther = block;
+    blockOther.vtx[1].vin.pop_back();
+    ssCompact.clear();
+    ssCompact << CBlockUndoCompressor(blockundo, block);
+    CBlockUndoCompressor compressorOther(blockundo2, blockOther);
+    BOOST_CHECK_THROW(ssCompact >> compressorOther, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(undo_disk_formats)
+{
+    CBlock block;
+    CBlockUndo blockundo;
+    MakeSpends(block, blockundo);
+    uint256 hashPrev = GetRandHash();
+
+    // Legacy undo data stays readable next to the compact format
+    CDiskBlockPos posLegacy(900, 0), posCompact(901, 0);
+    BOOST_CHECK(blockundo.WriteToDisk(posLegacy, hashPrev));
+    BOOST_CHECK(blockundo.WriteToDisk(posCompact, hashPrev, &block));
+
+    CBlockUndo undoLegacy, undoCompact;
+    BOOST_CHECK(undoLegacy.ReadFromDisk(posLegacy, hashPrev));
+    BOOST_CHECK(undoCompact.ReadFromDisk(posCompact, hashPrev, &block));
+    BOOST_CHECK(::SerializeHash(undoLegacy) == ::SerializeHash(blockundo));
+    BOOST_CHECK(::SerializeHash(undoCompact) == ::SerializeHash(blockundo));
+
+    // The checksum commits to the previous block hash
+    BOOST_CHECK(!undoCompact.ReadFromDisk(posCompact, GetRandHash(), &block));
+}
+
+BOOST_AUTO_TEST_CASE(coinsdb_compression)
+{
+    // Flushed in several batches so LevelDB moves them from its log into tables
+    vector<map<uint256, CCoins> > vBatches(20);
+    for (unsigned int i = 0; i < 20000; i++) {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vout.resize(2);
+        tx.vout[0].nValue = (i % 100 + 1) * COIN;
+        tx.vout[0].scriptPubKey.SetDestination(CKeyID(Hash160(BEGIN(i), END(i))));
+        tx.vout[1].nValue = i * 1000;
+        tx.vout[1].scriptPubKey << OP_RETURN << vector<unsigned char>(40, i % 7);
+        vBatches[i % vBatches.size()][tx.GetHash()] = CCoins(tx, 1000 + i / 10);
+    }
+
+    uint64_t nBytes[2];
+    for (int fCompression = 0; fCompression < 2; fCompression++) {
+        boost::filesystem::path path = GetDataDir() / strprintf("coins_compression_%d", fCompression);
+        {
+            CCoinsViewDB db(path, 1 << 20, false, true, fCompression);
+            for (unsigned int i = 0; i < vBatches.size(); i++)
+                BOOST_CHECK(db.BatchWrite(vBatches[i], GetRandHash()));
+        }
+        nBytes[fCompression] = GetTableBytes(path);
+        BOOST_CHECK(nBytes[fCompression] > 0);
+
+        // Everything reads back the same after reopening
+        CCoinsViewDB db(path, 1 << 20, false, false, fCompression);
+        bool fSame = true;
+        for (unsigned int i = 0; i < vBatches.size(); i++)
+            for (map<uint256, CCoins>::const_iterator it = vBatches[i].begin(); it != vBatches[i].end(); ++it) {
+                CCoins coins;
+                fSame &= db.GetCoins(it->first, coins) && coins == it->second;
+            }
+        BOOST_CHECK(fSame);
+    }
+#ifdef USE_SNAPPY
+    // LevelDB keeps a block uncompressed unless that saves space
+    BOOST_CHECK(nBytes[1] <= nBytes[0]);
+#endif
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -14,6 +14,11 @@
 
 using namespace std;
 
+static const unsigned char pchSnapshotMagic[4] = { 'u', 't', 'x', 'o' };
+
+// Amount of coin data written to the chainstate per batch when loading a snapshot
+static const size_t nSnapshotBatchSize = 16 << 20;
+
 void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
     if (coins.IsPruned())
         batch.Erase(make_pair('c', hash));
@@ -25,7 +30,10 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, bool fCompression) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, fCompression) {
+}
+
+CCoinsViewDB::CCoinsViewDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory, bool fWipe, bool fCompression) : db(path, nCacheSize, fMemory, fWipe, fCompression) {
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) {
@@ -67,7 +75,7 @@ bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const u
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, bool fCompression) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, fCompression) {
 }
 
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
@@ -75,6 +83,14 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::WriteBlockIndexBatch(const std::vector<CDiskBlockIndex>& vblockindex)
+{
+    CLevelDBBatch batch;
+    for (std::vector<CDiskBlockIndex>::const_iterator it = vblockindex.begin(); it != vblockindex.end(); it++)
+        batch.Write(make_pair('b', it->GetBlockHash()), *it);
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::WriteBestInvalidWork(const CBigNum& bnBestInvalidWork)
 {
     // Obsolete; only written for backward compatibility.
@@ -109,6 +125,26 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
+// Add one transaction's unspent outputs to the gettxoutsetinfo statistics and serialized hash
+void static ApplyStats(CCoinsStats &stats, CHashWriter &ss, const uint256 &txhash, const CCoins &coins, size_t nValueSize) {
+    ss << txhash;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i=0; i<coins.vout.size(); i++) {
+        const CTxOut &out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i+1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    stats.nSerializedSize += 32 + nValueSize;
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
     leveldb::Iterator *pcursor = db.NewIterator();
     pcursor->SeekToFirst();
@@ -116,7 +152,6 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    int64_t nTotalAmount = 0;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -131,22 +166,7 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
                 ssValue >> coins;
                 uint256 txhash;
                 ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                ApplyStats(stats, ss, txhash, coins, slValue.size());
             }
             pcursor->Next();
         } catch (std::exception &e) {
@@ -156,19 +176,109 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
     delete pcursor;
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
-bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
-    return Read(make_pair('t', txid), pos);
+bool CCoinsViewDB::WriteSnapshot(CHashedAutoFile &file, CCoinsSnapshotHeader &header) {
+    leveldb::Iterator *pcursor = db.NewIterator();
+    pcursor->SeekToFirst();
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    CCoinsStats stats;
+    stats.hashBlock = GetBestBlock();
+    ss << stats.hashBlock;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType == 'c') {
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CCoins coins;
+                ssValue >> coins;
+                uint256 txhash;
+                ssKey >> txhash;
+                file << txhash << coins;
+                ApplyStats(stats, ss, txhash, coins, slValue.size());
+            }
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    delete pcursor;
+    header.hashBlock = stats.hashBlock;
+    header.nTransactions = stats.nTransactions;
+    header.nTransactionOutputs = stats.nTransactionOutputs;
+    header.nTotalAmount = stats.nTotalAmount;
+    header.hashSerialized = ss.GetHash();
+    return true;
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
+bool CCoinsViewDB::LoadSnapshot(CHashedAutoFile &file, const CCoinsSnapshotHeader &header, bool fWrite) {
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    CCoinsStats stats;
+    ss << header.hashBlock;
     CLevelDBBatch batch;
-    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(make_pair('t', it->first), it->second);
-    return WriteBatch(batch);
+    size_t nBatchBytes = 0;
+    try {
+        for (uint64_t n = 0; n < header.nTransactions; n++) {
+            boost::this_thread::interruption_point();
+            uint256 txhash;
+            CCoins coins;
+            file >> txhash >> coins;
+            if (coins.IsPruned())
+                return error("%s : snapshot contains spent transaction %s", __func__, txhash.ToString());
+            size_t nValueSize = ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+            ApplyStats(stats, ss, txhash, coins, nValueSize);
+            if (fWrite) {
+                BatchWriteCoins(batch, txhash, coins);
+                nBatchBytes += 32 + nValueSize;
+                if (nBatchBytes >= nSnapshotBatchSize) {
+                    LogPrint("coindb", "Committing %u bytes of snapshot coins to coin database...\n", (unsigned int)nBatchBytes);
+                    if (!db.WriteBatch(batch))
+                        return false;
+                    batch.Clear();
+                    nBatchBytes = 0;
+                }
+            }
+        }
+    } catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    if (ss.GetHash() != header.hashSerialized || stats.nTransactionOutputs != header.nTransactionOutputs || stats.nTotalAmount != header.nTotalAmount)
+        return error("%s : coins do not match the snapshot header", __func__);
+
+    if (fWrite) {
+        // Only now the coins become the chain state
+        BatchWriteHashBestChain(batch, header.hashBlock);
+        if (!db.WriteBatch(batch, true))
+            return false;
+    }
+    return true;
+}
+
+void CCoinsSnapshotHeader::SetNull() {
+    memcpy(pchMagic, pchSnapshotMagic, sizeof(pchMagic));
+    nVersion = CURRENT_VERSION;
+    memcpy(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE);
+    hashBlock = 0;
+    nHeight = 0;
+    nBlocks = 0;
+    nTransactions = 0;
+    nTransactionOutputs = 0;
+    nTotalAmount = 0;
+    hashSerialized = 0;
+    hashChecksum = 0;
+}
+
+bool CCoinsSnapshotHeader::IsValid() const {
+    return memcmp(pchMagic, pchSnapshotMagic, sizeof(pchMagic)) == 0 && nVersion == CURRENT_VERSION;
 }
 
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
@@ -183,6 +293,18 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::WriteSnapshotValidation(const CCoinsSnapshotHeader &header) {
+    return Write('S', header, true);
+}
+
+bool CBlockTreeDB::ReadSnapshotValidation(CCoinsSnapshotHeader &header) {
+    return Read('S', header);
+}
+
+bool CBlockTreeDB::EraseSnapshotValidation() {
+    return Erase('S', true);
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     leveldb::Iterator *pcursor = NewIterator();
@@ -240,3 +362,229 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
 
     return true;
 }
+
+static boost::filesystem::path GetIndexDir(const std::string &strName) {
+    boost::filesystem::path path = GetDataDir() / "indexes";
+    TryCreateDirectory(path);
+    return path / strName;
+}
+
+CChainIndexDB::CChainIndexDB(const std::string &strNameIn, size_t nCacheSize, bool fMemory, bool fWipe) :
+    CLevelDBWrapper(GetIndexDir(strNameIn), nCacheSize, fMemory, fWipe), strName(strNameIn) {
+}
+
+void CChainIndexDB::WriteBestBlock(CLevelDBBatch &batch, const uint256 &hashBlock) {
+    batch.Write('B', hashBlock);
+}
+
+uint256 CChainIndexDB::GetBestBlock() {
+    uint256 hashBest;
+    if (!Read('B', hashBest))
+        return uint256(0);
+    return hashBest;
+}
+
+bool CChainIndexDB::SetBestBlock(const uint256 &hashBlock) {
+    CLevelDBBatch batch;
+    WriteBestBlock(batch, hashBlock);
+    return WriteBatch(batch);
+}
+
+CTxIndexDB::CTxIndexDB(size_t nCacheSize, bool fMemory, bool fWipe) : CChainIndexDB("txindex", nCacheSize, fMemory, fWipe) {
+}
+
+bool CTxIndexDB::ReadTxPos(const uint256 &txid, CDiskTxPos &pos) {
+    return Read(make_pair('t', txid), pos);
+}
+
+bool CTxIndexDB::IndexBlock(const CBlock &block, const CBlockUndo &blockundo, const CBlockIndex *pindex) {
+    CLevelDBBatch batch;
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        batch.Write(make_pair('t', block.GetTxHash(i)), pos);
+        pos.nTxOffset += ::GetSerializeSize(block.vtx[i], SER_DISK, CLIENT_VERSION);
+    }
+    WriteBestBlock(batch, pindex->GetBlockHash());
+    return WriteBatch(batch);
+}
+
+bool CTxIndexDB::RewindBlock(const CBlock &block, const CBlockUndo &blockundo, const CBlockIndex *pindex) {
+    CLevelDBBatch batch;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        batch.Erase(make_pair('t', block.GetTxHash(i)));
+    WriteBestBlock(batch, pindex->pprev->GetBlockHash());
+    return WriteBatch(batch);
+}
+
+bool GetAddressIndexKey(const CScript &scriptPubKey, unsigned char &type, uint160 &hashBytes) {
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+    if (const CKeyID *keyID = boost::get<CKeyID>(&dest)) {
+        type = 1;
+        hashBytes = *keyID;
+        return true;
+    }
+    if (const CScriptID *scriptID = boost::get<CScriptID>(&dest)) {
+        type = 2;
+        hashBytes = *scriptID;
+        return true;
+    }
+    return false;
+}
+
+CAddressIndexDB::CAddressIndexDB(size_t nCacheSize, bool fMemory, bool fWipe) : CChainIndexDB("addressindex", nCacheSize, fMemory, fWipe) {
+}
+
+bool CAddressIndexDB::ReadAddressIndex(unsigned char type, const uint160 &hashBytes, std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > &vEntries,
+                                       unsigned int nStart, unsigned int nEnd) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('a', CAddressIndexKey(type, hashBytes, nStart, uint256(0), 0, false));
+    pcursor->Seek(ssKeySet.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType;
+            if (chType != 'a')
+                break;
+            ssKey >> key;
+            if (key.type != type || key.hashBytes != hashBytes || key.nHeight > nEnd)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressIndexValue value;
+            ssValue >> value;
+            vEntries.push_back(make_pair(key, value));
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CAddressIndexDB::ReadAddressUnspent(unsigned char type, const uint160 &hashBytes, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('u', CAddressUnspentKey(type, hashBytes, uint256(0), 0));
+    pcursor->Seek(ssKeySet.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            ssKey >> chType;
+            if (chType != 'u')
+                break;
+            ssKey >> key;
+            if (key.type != type || key.hashBytes != hashBytes)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vUnspent.push_back(make_pair(key, value));
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CAddressIndexDB::IndexBlock(const CBlock &block, const CBlockUndo &blockundo, const CBlockIndex *pindex) {
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+        return error("CAddressIndexDB::IndexBlock() : block and undo data inconsistent");
+
+    CLevelDBBatch batch;
+    unsigned int nHeight = pindex->nHeight;
+    unsigned char type;
+    uint160 hashBytes;
+    std::set<COutPoint> setCreated;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = block.vtx[i];
+        const uint256 &txid = block.GetTxHash(i);
+        if (i > 0) {
+            const CTxUndo &txundo = blockundo.vtxundo[i-1];
+            if (txundo.vprevout.size() != tx.vin.size())
+                return error("CAddressIndexDB::IndexBlock() : transaction and undo data inconsistent");
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const COutPoint &prevout = tx.vin[j].prevout;
+                const CTxOut &txoutPrev = txundo.vprevout[j].txout;
+                if (!GetAddressIndexKey(txoutPrev.scriptPubKey, type, hashBytes))
+                    continue;
+                // Outputs created earlier in this block are still only in the batch
+                CAddressUnspentKey keyUnspent(type, hashBytes, prevout.hash, prevout.n);
+                CAddressUnspentValue valueUnspent(txoutPrev, nHeight);
+                if (!setCreated.count(prevout) && !Read(make_pair('u', keyUnspent), valueUnspent))
+                    return error("CAddressIndexDB::IndexBlock() : spent output %s:%u not indexed", prevout.hash.ToString(), prevout.n);
+                batch.Write(make_pair('a', CAddressIndexKey(type, hashBytes, nHeight, txid, j, true)),
+                            CAddressIndexValue(-txoutPrev.nValue, valueUnspent.nHeight));
+                batch.Erase(make_pair('u', keyUnspent));
+            }
+        }
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            const CTxOut &txout = tx.vout[j];
+            if (!GetAddressIndexKey(txout.scriptPubKey, type, hashBytes))
+                continue;
+            batch.Write(make_pair('a', CAddressIndexKey(type, hashBytes, nHeight, txid, j, false)), CAddressIndexValue(txout.nValue, 0));
+            batch.Write(make_pair('u', CAddressUnspentKey(type, hashBytes, txid, j)), CAddressUnspentValue(txout, nHeight));
+            setCreated.insert(COutPoint(txid, j));
+        }
+    }
+    WriteBestBlock(batch, pindex->GetBlockHash());
+    return WriteBatch(batch);
+}
+
+bool CAddressIndexDB::RewindBlock(const CBlock &block, const CBlockUndo &blockundo, const CBlockIndex *pindex) {
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+        return error("CAddressIndexDB::RewindBlock() : block and undo data inconsistent");
+
+    CLevelDBBatch batch;
+    unsigned int nHeight = pindex->nHeight;
+    unsigned char type;
+    uint160 hashBytes;
+    for (int i = block.vtx.size() - 1; i >= 0; i--) {
+        const CTransaction &tx = block.vtx[i];
+        const uint256 &txid = block.GetTxHash(i);
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            if (!GetAddressIndexKey(tx.vout[j].scriptPubKey, type, hashBytes))
+                continue;
+            batch.Erase(make_pair('a', CAddressIndexKey(type, hashBytes, nHeight, txid, j, false)));
+            batch.Erase(make_pair('u', CAddressUnspentKey(type, hashBytes, txid, j)));
+        }
+        if (i > 0) {
+            const CTxUndo &txundo = blockundo.vtxundo[i-1];
+            if (txundo.vprevout.size() != tx.vin.size())
+                return error("CAddressIndexDB::RewindBlock() : transaction and undo data inconsistent");
+            for (unsigned int j = tx.vin.size(); j-- > 0;) {
+                const COutPoint &prevout = tx.vin[j].prevout;
+                const CTxOut &txoutPrev = txundo.vprevout[j].txout;
+                if (!GetAddressIndexKey(txoutPrev.scriptPubKey, type, hashBytes))
+                    continue;
+                CAddressIndexKey keySpend(type, hashBytes, nHeight, txid, j, true);
+                CAddressIndexValue valueSpend;
+                if (!Read(make_pair('a', keySpend), valueSpend))
+                    return error("CAddressIndexDB::RewindBlock() : spend of %s:%u not indexed", prevout.hash.ToString(), prevout.n);
+                batch.Erase(make_pair('a', keySpend));
+                batch.Write(make_pair('u', CAddressUnspentKey(type, hashBytes, prevout.hash, prevout.n)),
+                            CAddressUnspentValue(txoutPrev, valueSpend.nPrevHeight));
+            }
+        }
+    }
+    WriteBestBlock(batch, pindex->pprev->GetBlockHash());
+    return WriteBatch(batch);
+}
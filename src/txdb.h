@@ -7,9 +7,14 @@
 #ifndef BITMARK_TXDB_LEVELDB_H
 #define BITMARK_TXDB_LEVELDB_H
 
+#include "chainparams.h"
+#include "hash.h"
 #include "leveldbwrapper.h"
 #include "main.h"
 
+#include <boost/filesystem/path.hpp>
+
+#include <limits>
 #include <map>
 #include <string>
 #include <utility>
@@ -25,6 +30,99 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 // min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+// -dbcompression default
+static const bool DEFAULT_DB_COMPRESSION = false;
+
+/** Header of a UTXO set snapshot file (dumptxoutset, -loadutxosnapshot).
+ *
+ * The header is followed by nBlocks block index entries (heights 1 up to
+ * hashBlock, without block file positions) and then nTransactions
+ * (txid, CCoins) records in chainstate order. hashSerialized is the
+ * gettxoutsetinfo hash of those coins and hashChecksum a double-SHA256 of
+ * everything after the header.
+ */
+class CCoinsSnapshotHeader
+{
+public:
+    static const int CURRENT_VERSION = 1;
+
+    unsigned char pchMagic[4];
+    int nVersion;
+    unsigned char pchMessageStart[MESSAGE_START_SIZE];
+    uint256 hashBlock;
+    int nHeight;
+    unsigned int nBlocks;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    int64_t nTotalAmount;
+    uint256 hashSerialized;
+    uint256 hashChecksum;
+
+    CCoinsSnapshotHeader() {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(FLATDATA(pchMagic));
+        READWRITE(this->nVersion);
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nBlocks);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nTotalAmount);
+        READWRITE(hashSerialized);
+        READWRITE(hashChecksum);
+    )
+
+    void SetNull();
+    bool IsValid() const;
+};
+
+/** Reads or writes the body of a snapshot file, hashing every byte that passes through */
+class CHashedAutoFile
+{
+private:
+    CAutoFile &file;
+    CHashWriter hasher;
+
+public:
+    int nType;
+    int nVersion;
+
+    CHashedAutoFile(CAutoFile &fileIn) : file(fileIn), hasher(SER_GETHASH, 0), nType(fileIn.nType), nVersion(fileIn.nVersion) {}
+
+    CHashedAutoFile& read(char *pch, size_t nSize) {
+        file.read(pch, nSize);
+        hasher.write(pch, nSize);
+        return (*this);
+    }
+
+    CHashedAutoFile& write(const char *pch, size_t nSize) {
+        file.write(pch, nSize);
+        hasher.write(pch, nSize);
+        return (*this);
+    }
+
+    template<typename T>
+    CHashedAutoFile& operator<<(const T& obj) {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    template<typename T>
+    CHashedAutoFile& operator>>(T& obj) {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    // invalidates the object
+    uint256 GetHash() {
+        return hasher.GetHash();
+    }
+};
 
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -32,7 +130,8 @@ class CCoinsViewDB : public CCoinsView
 protected:
     CLevelDBWrapper db;
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool fCompression = false);
+    CCoinsViewDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool fCompression = false);
 
     bool GetCoins(const uint256 &txid, CCoins &coins);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
@@ -41,18 +140,185 @@ public:
     bool SetBestBlock(const uint256 &hashBlock);
     bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats);
+
+    /** Append every coin record to a snapshot and fill in the coin fields of header */
+    bool WriteSnapshot(CHashedAutoFile &file, CCoinsSnapshotHeader &header);
+    /** Read the coin records of a snapshot, checking them against header. With fWrite
+     *  they are stored in large batches and the best block is set once all are in. */
+    bool LoadSnapshot(CHashedAutoFile &file, const CCoinsSnapshotHeader &header, bool fWrite);
+};
+
+/** Serializes a 32-bit integer big-endian, so LevelDB orders the keys numerically */
+class CBigEndian32
+{
+protected:
+    unsigned int &n;
+public:
+    CBigEndian32(unsigned int &nIn) : n(nIn) { }
+
+    unsigned int GetSerializeSize(int, int) const {
+        return 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int, int) const {
+        unsigned char buf[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+        s.write((const char*)buf, 4);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int, int) {
+        unsigned char buf[4];
+        s.read((char*)buf, 4);
+        n = ((unsigned int)buf[0] << 24) | ((unsigned int)buf[1] << 16) | ((unsigned int)buf[2] << 8) | buf[3];
+    }
+};
+
+/** Address index entry: one output paid to, or one input spending from, an address */
+struct CAddressIndexKey
+{
+    unsigned char type; // 1: pay-to-pubkey(-hash), 2: pay-to-script-hash
+    uint160 hashBytes;
+    unsigned int nHeight;
+    uint256 txid;
+    unsigned int nIndex;
+    bool fSpending;
+
+    CAddressIndexKey() : type(0), nHeight(0), nIndex(0), fSpending(false) {}
+    CAddressIndexKey(unsigned char typeIn, const uint160 &hashIn, unsigned int nHeightIn, const uint256 &txidIn, unsigned int nIndexIn, bool fSpendingIn) :
+        type(typeIn), hashBytes(hashIn), nHeight(nHeightIn), txid(txidIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(type);
+        READWRITE(hashBytes);
+        READWRITE(REF(CBigEndian32(REF(nHeight))));
+        READWRITE(txid);
+        READWRITE(nIndex);
+        READWRITE(fSpending);
+    )
+};
+
+struct CAddressIndexValue
+{
+    int64_t nValue;           // negative for spends
+    unsigned int nPrevHeight; // spends: height of the output being spent
+
+    CAddressIndexValue() : nValue(0), nPrevHeight(0) {}
+    CAddressIndexValue(int64_t nValueIn, unsigned int nPrevHeightIn) : nValue(nValueIn), nPrevHeight(nPrevHeightIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(VARINT(nPrevHeight));
+    )
+};
+
+/** Unspent output paid to an address */
+struct CAddressUnspentKey
+{
+    unsigned char type;
+    uint160 hashBytes;
+    uint256 txid;
+    unsigned int n;
+
+    CAddressUnspentKey() : type(0), n(0) {}
+    CAddressUnspentKey(unsigned char typeIn, const uint160 &hashIn, const uint256 &txidIn, unsigned int nIn) :
+        type(typeIn), hashBytes(hashIn), txid(txidIn), n(nIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(type);
+        READWRITE(hashBytes);
+        READWRITE(txid);
+        READWRITE(n);
+    )
+};
+
+struct CAddressUnspentValue
+{
+    CTxOut txout;
+    unsigned int nHeight;
+
+    CAddressUnspentValue() : nHeight(0) {}
+    CAddressUnspentValue(const CTxOut &txoutIn, unsigned int nHeightIn) : txout(txoutIn), nHeight(nHeightIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(REF(CTxOutCompressor(REF(txout))));
+        READWRITE(VARINT(nHeight));
+    )
+};
+
+/** Map a scriptPubKey to the address index key type and hash; false for scripts that are not indexed */
+bool GetAddressIndexKey(const CScript &scriptPubKey, unsigned char &type, uint160 &hashBytes);
+
+/** An optional index with its own database under indexes/, built by ThreadSyncIndex.
+ *  The hash of the last block processed is written in the same batch as that
+ *  block's entries, so after a restart or a reorg the index resumes or rewinds
+ *  from a consistent state. */
+class CChainIndexDB : public CLevelDBWrapper
+{
+private:
+    CChainIndexDB(const CChainIndexDB&);
+    void operator=(const CChainIndexDB&);
+protected:
+    void WriteBestBlock(CLevelDBBatch &batch, const uint256 &hashBlock);
+public:
+    const std::string strName;
+
+    CChainIndexDB(const std::string &strNameIn, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    virtual ~CChainIndexDB() {}
+
+    uint256 GetBestBlock();
+    bool SetBestBlock(const uint256 &hashBlock);
+
+    /** Whether IndexBlock and RewindBlock need the block's undo data */
+    virtual bool NeedsUndo() const { return false; }
+    /** Add the entries of a block whose parent is the current best block */
+    virtual bool IndexBlock(const CBlock &block, const CBlockUndo &blockundo, const CBlockIndex *pindex) = 0;
+    /** Remove the entries of the current best block, making its parent the best block */
+    virtual bool RewindBlock(const CBlock &block, const CBlockUndo &blockundo, const CBlockIndex *pindex) = 0;
+};
+
+/** Transaction index (indexes/txindex/): txid to position on disk */
+class CTxIndexDB : public CChainIndexDB
+{
+public:
+    CTxIndexDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    bool ReadTxPos(const uint256 &txid, CDiskTxPos &pos);
+    bool IndexBlock(const CBlock &block, const CBlockUndo &blockundo, const CBlockIndex *pindex);
+    bool RewindBlock(const CBlock &block, const CBlockUndo &blockundo, const CBlockIndex *pindex);
+};
+
+/** Address index (indexes/addressindex/): per address history sorted by height, and unspent outputs */
+class CAddressIndexDB : public CChainIndexDB
+{
+public:
+    CAddressIndexDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    /** Entries of an address with nStart <= height <= nEnd */
+    bool ReadAddressIndex(unsigned char type, const uint160 &hashBytes, std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > &vEntries,
+                          unsigned int nStart = 0, unsigned int nEnd = std::numeric_limits<unsigned int>::max());
+    bool ReadAddressUnspent(unsigned char type, const uint160 &hashBytes, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent);
+
+    bool NeedsUndo() const { return true; }
+    bool IndexBlock(const CBlock &block, const CBlockUndo &blockundo, const CBlockIndex *pindex);
+    bool RewindBlock(const CBlock &block, const CBlockUndo &blockundo, const CBlockIndex *pindex);
 };
 
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool fCompression = false);
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool WriteBlockIndexBatch(const std::vector<CDiskBlockIndex>& vblockindex);
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool WriteBlockFileInfo(int nFile, const CBlockFileInfo &fileinfo);
@@ -60,10 +326,11 @@ public:
     bool WriteLastBlockFile(int nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
-    bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    bool WriteSnapshotValidation(const CCoinsSnapshotHeader &header);
+    bool ReadSnapshotValidation(CCoinsSnapshotHeader &header);
+    bool EraseSnapshotValidation();
     bool LoadBlockIndexGuts();
 };
 
@@ -12,6 +12,9 @@ using namespace std;
 CTxMemPoolEntry::CTxMemPoolEntry()
 {
     nHeight = MEMPOOL_HEIGHT;
+    nCountWithAncestors = 0;
+    nSizeWithAncestors = 0;
+    nFeesWithAncestors = 0;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
@@ -20,6 +23,10 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nFeesWithAncestors = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -70,6 +77,118 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+void CTxMemPool::CalculateAncestors(const CTransaction& tx, setTxIter& setAncestors) const
+{
+    std::vector<txiter> vToVisit;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        txiter it = mapTx.find(txin.prevout.hash);
+        if (it != mapTx.end() && setAncestors.insert(it).second)
+            vToVisit.push_back(it);
+    }
+    while (!vToVisit.empty()) {
+        const CTransaction& txParent = vToVisit.back()->second.GetTx();
+        vToVisit.pop_back();
+        BOOST_FOREACH(const CTxIn& txin, txParent.vin) {
+            txiter it = mapTx.find(txin.prevout.hash);
+            if (it != mapTx.end() && setAncestors.insert(it).second)
+                vToVisit.push_back(it);
+        }
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter itTx, setTxIter& setDescendants) const
+{
+    std::vector<txiter> vToVisit(1, itTx);
+    while (!vToVisit.empty()) {
+        uint256 hash = vToVisit.back()->first;
+        vToVisit.pop_back();
+        std::map<COutPoint, CInPoint>::const_iterator itNext = mapNextTx.lower_bound(COutPoint(hash, 0));
+        for (; itNext != mapNextTx.end() && itNext->first.hash == hash; ++itNext) {
+            txiter it = mapTx.find(itNext->second.ptx->GetHash());
+            if (it != mapTx.end() && setDescendants.insert(it).second)
+                vToVisit.push_back(it);
+        }
+    }
+}
+
+bool CTxMemPool::CheckAncestorLimits(const CTxMemPoolEntry& entry,
+                                     uint64_t nLimitAncestorCount, uint64_t nLimitAncestorSize,
+                                     uint64_t nLimitDescendantCount, uint64_t nLimitDescendantSize,
+                                     std::string& errString) const
+{
+    setTxIter setAncestors;
+    uint64_t nSizeWithAncestors = entry.GetTxSize();
+    std::vector<const CTransaction*> vToVisit(1, &entry.GetTx());
+    while (!vToVisit.empty()) {
+        const CTransaction& tx = *vToVisit.back();
+        vToVisit.pop_back();
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            txiter it = mapTx.find(txin.prevout.hash);
+            if (it == mapTx.end() || !setAncestors.insert(it).second)
+                continue;
+            nSizeWithAncestors += it->second.GetTxSize();
+            if (setAncestors.size() + 1 > nLimitAncestorCount) {
+                errString = strprintf("too many unconfirmed ancestors [limit: %u]", nLimitAncestorCount);
+                return false;
+            }
+            if (nSizeWithAncestors > nLimitAncestorSize) {
+                errString = strprintf("exceeds ancestor size limit [limit: %u]", nLimitAncestorSize);
+                return false;
+            }
+            vToVisit.push_back(&it->second.GetTx());
+        }
+    }
+
+    // Each ancestor would get it as one more descendant
+    BOOST_FOREACH(const txiter& itAncestor, setAncestors) {
+        setTxIter setDescendants;
+        setDescendants.insert(itAncestor);
+        uint64_t nSizeWithDescendants = entry.GetTxSize() + itAncestor->second.GetTxSize();
+        std::vector<txiter> vDescendantsToVisit(1, itAncestor);
+        while (!vDescendantsToVisit.empty()) {
+            if (setDescendants.size() + 1 > nLimitDescendantCount) {
+                errString = strprintf("too many descendants for tx %s [limit: %u]", itAncestor->first.ToString(), nLimitDescendantCount);
+                return false;
+            }
+            if (nSizeWithDescendants > nLimitDescendantSize) {
+                errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", itAncestor->first.ToString(), nLimitDescendantSize);
+                return false;
+            }
+            uint256 hash = vDescendantsToVisit.back()->first;
+            vDescendantsToVisit.pop_back();
+            std::map<COutPoint, CInPoint>::const_iterator itNext = mapNextTx.lower_bound(COutPoint(hash, 0));
+            for (; itNext != mapNextTx.end() && itNext->first.hash == hash; ++itNext) {
+                txiter it = mapTx.find(itNext->second.ptx->GetHash());
+                if (it != mapTx.end() && setDescendants.insert(it).second) {
+                    nSizeWithDescendants += it->second.GetTxSize();
+                    vDescendantsToVisit.push_back(it);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void CTxMemPool::UpdateAncestorState(txiter it)
+{
+    setByAncestorFee.erase(it);
+
+    // The index orders by these, so they only change while it is out of it
+    CTxMemPoolEntry& entry = const_cast<CTxMemPoolEntry&>(it->second);
+    setTxIter setAncestors;
+    CalculateAncestors(entry.GetTx(), setAncestors);
+    entry.nCountWithAncestors = 1;
+    entry.nSizeWithAncestors = entry.GetTxSize();
+    entry.nFeesWithAncestors = entry.GetFee();
+    BOOST_FOREACH(const txiter& itAncestor, setAncestors) {
+        entry.nCountWithAncestors++;
+        entry.nSizeWithAncestors += itAncestor->second.GetTxSize();
+        entry.nFeesWithAncestors += itAncestor->second.GetFee();
+    }
+
+    setByAncestorFee.insert(it);
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
     // Add to memory pool without checking anything.
@@ -77,10 +196,24 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
     // all the appropriate checks.
     LOCK(cs);
     {
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end())
+            setByAncestorFee.erase(it);
         mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
+        it = mapTx.find(hash);
+        const CTransaction& tx = it->second.GetTx();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        UpdateAncestorState(it);
+
+        // Transactions coming back from a disconnected block can already
+        // have children in the pool; they have a new ancestor now
+        setTxIter setDescendants;
+        CalculateDescendants(it, setDescendants);
+        setDescendants.erase(it);
+        BOOST_FOREACH(const txiter& itDescendant, setDescendants)
+            UpdateAncestorState(itDescendant);
+
         nTransactionsUpdated++;
     }
     return true;
@@ -101,12 +234,28 @@ void CTxMemPool::remove(const CTransaction &tx, std::list<CTransaction>& removed
                 remove(*it->second.ptx, removed, true);
             }
         }
-        if (mapTx.count(hash))
+        std::map<uint256, CTxMemPoolEntry>::iterator itTx = mapTx.find(hash);
+        if (itTx != mapTx.end())
         {
+            // Whatever still spends from it (it was mined) no longer has to
+            // bring it along into a block
+            setTxIter setDescendants;
+            CalculateDescendants(itTx, setDescendants);
+            setDescendants.erase(itTx);
+            BOOST_FOREACH(const txiter& it, setDescendants) {
+                setByAncestorFee.erase(it);
+                CTxMemPoolEntry& entry = const_cast<CTxMemPoolEntry&>(it->second);
+                entry.nCountWithAncestors--;
+                entry.nSizeWithAncestors -= itTx->second.GetTxSize();
+                entry.nFeesWithAncestors -= itTx->second.GetFee();
+                setByAncestorFee.insert(it);
+            }
+
             removed.push_front(tx);
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            setByAncestorFee.erase(itTx);
+            mapTx.erase(itTx);
             nTransactionsUpdated++;
         }
     }
@@ -132,6 +281,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    setByAncestorFee.clear();
     mapTx.clear();
     mapNextTx.clear();
     ++nTransactionsUpdated;
@@ -165,7 +315,22 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+
+        // Check the ancestor totals and that it is indexed by them
+        setTxIter setAncestors;
+        CalculateAncestors(tx, setAncestors);
+        size_t nSizeWithAncestors = it->second.GetTxSize();
+        int64_t nFeesWithAncestors = it->second.GetFee();
+        BOOST_FOREACH(const txiter& itAncestor, setAncestors) {
+            nSizeWithAncestors += itAncestor->second.GetTxSize();
+            nFeesWithAncestors += itAncestor->second.GetFee();
+        }
+        assert(it->second.GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->second.GetSizeWithAncestors() == nSizeWithAncestors);
+        assert(it->second.GetFeesWithAncestors() == nFeesWithAncestors);
+        assert(setByAncestorFee.count(it));
     }
+    assert(setByAncestorFee.size() == mapTx.size());
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
         map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
@@ -196,6 +361,24 @@ bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
     return true;
 }
 
+bool CTxMemPool::lookupSerialized(const uint256& hash, CSharedSerializeData& result) const
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end()) return false;
+    result = i->second.serialized.lock();
+    if (!result) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss.reserve(i->second.GetTxSize());
+        ss << i->second.GetTx();
+        boost::shared_ptr<CSerializeData> data(new CSerializeData());
+        ss.GetAndClear(*data);
+        result = data;
+        i->second.serialized = result;
+    }
+    return true;
+}
+
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
 
 bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) {
@@ -7,6 +7,9 @@
 #define BITMARK_TXMEMPOOL_H
 
 #include <list>
+#include <set>
+
+#include <boost/weak_ptr.hpp>
 
 #include "coins.h"
 #include "core.h"
@@ -27,6 +30,17 @@ private:
     int64_t nTime; // Local time when entering the mempool
     double dPriority; // Priority when entering the mempool
     unsigned int nHeight; // Chain height when entering the mempool
+    // What relay and getdata send, serialized on first use and shared with
+    // mapRelay and send queues; freed once none of them holds it any more
+    mutable boost::weak_ptr<const CSerializeData> serialized;
+
+    // This transaction together with its unconfirmed ancestors in the pool,
+    // which would all have to go into a block with it. Kept by CTxMemPool.
+    unsigned int nCountWithAncestors;
+    size_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+
+    friend class CTxMemPool;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
@@ -40,6 +54,35 @@ public:
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+
+    unsigned int GetCountWithAncestors() const { return nCountWithAncestors; }
+    size_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+};
+
+typedef std::map<uint256, CTxMemPoolEntry>::const_iterator txiter;
+
+struct CompareTxIterByHash
+{
+    bool operator()(const txiter& a, const txiter& b) const
+    {
+        return a->first < b->first;
+    }
+};
+
+typedef std::set<txiter, CompareTxIterByHash> setTxIter;
+
+/** Best fee per byte of a transaction and its ancestors first */
+struct CompareTxIterByAncestorFee
+{
+    bool operator()(const txiter& a, const txiter& b) const
+    {
+        double f1 = (double)a->second.GetFeesWithAncestors() * b->second.GetSizeWithAncestors();
+        double f2 = (double)b->second.GetFeesWithAncestors() * a->second.GetSizeWithAncestors();
+        if (f1 == f2)
+            return a->first < b->first;
+        return f1 > f2;
+    }
 };
 
 /*
@@ -58,10 +101,15 @@ private:
     bool fSanityCheck; // Normally false, true if -checkmempool or -regtest
     unsigned int nTransactionsUpdated;
 
+    // Work out the ancestor totals of it from scratch and (re)index it
+    void UpdateAncestorState(txiter it);
+
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    // All of mapTx, in the order a block template wants them
+    std::set<txiter, CompareTxIterByAncestorFee> setByAncestorFee;
 
     CTxMemPool();
 
@@ -95,7 +143,21 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
+    // The unconfirmed transactions tx spends from, directly or not
+    void CalculateAncestors(const CTransaction& tx, setTxIter& setAncestors) const;
+    // The transactions in the pool that spend from it, directly or not
+    void CalculateDescendants(txiter it, setTxIter& setDescendants) const;
+    // Whether entry can join the pool without getting more than nLimitAncestorCount
+    // ancestors or nLimitAncestorSize bytes of them (itself included), or
+    // making any of its ancestors exceed the descendant limits the same way.
+    // The walks stop at the limits. errString says which one was hit.
+    bool CheckAncestorLimits(const CTxMemPoolEntry& entry,
+                             uint64_t nLimitAncestorCount, uint64_t nLimitAncestorSize,
+                             uint64_t nLimitDescendantCount, uint64_t nLimitDescendantSize,
+                             std::string& errString) const;
+
     bool lookup(uint256 hash, CTransaction& result) const;
+    bool lookupSerialized(const uint256& hash, CSharedSerializeData& result) const;
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -30,7 +30,7 @@ extern const std::string CLIENT_DATE;
 //
 
 // Bump up to 70003 to easily discriminate earlier versions via DNS Seeder
-static const int PROTOCOL_VERSION = 70003;
+static const int PROTOCOL_VERSION = 70004;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -49,4 +49,7 @@ static const int NOBLKS_VERSION_END = 32400;
 // "mempool" command, enhanced "getdata" behavior starts with this version:
 static const int MEMPOOL_GD_VERSION = 60002;
 
+// "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" start with this version
+static const int COMPACT_BLOCKS_VERSION = 70004;
+
 #endif